@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <core/math/audio_frame.h>
+#include <cstring>
+#include <vector>
+
+// A lock-free ring of stereo audio frames, for one producer (the audio decoding thread)
+// and one consumer (the audio mixing thread).
+class AudioFrameRing {
+public:
+    AudioFrameRing() = default;
+
+    AudioFrameRing(const AudioFrameRing&)            = delete;
+    AudioFrameRing& operator=(const AudioFrameRing&) = delete;
+
+    // Neither the producer nor the consumer may be running when calling this
+    void reset(size_t capacity)
+    {
+        frames_.clear();
+        frames_.resize(std::max<size_t>(capacity, 1));
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        discardUntil_.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return frames_.size(); }
+
+    // Producer side
+    size_t write_space() const { return frames_.size() - (tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire)); }
+
+    // Producer side, returns the count of frames written
+    size_t write(const AudioFrame* src, size_t count)
+    {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        count     = std::min(count, write_space());
+        for (size_t done = 0; done < count;) {
+            auto index = (size_t)(tail % frames_.size());
+            auto n     = std::min(count - done, frames_.size() - index);
+            memcpy(&frames_[index], src + done, n * sizeof(AudioFrame));
+            done += n;
+            tail += n;
+        }
+        tail_.store(tail, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side
+    size_t read_available() const
+    {
+        auto head = std::max(head_.load(std::memory_order_relaxed), discardUntil_.load(std::memory_order_acquire));
+        return tail_.load(std::memory_order_acquire) - head;
+    }
+
+    // Consumer side, returns the count of frames read
+    size_t read(AudioFrame* dst, size_t count)
+    {
+        auto head         = head_.load(std::memory_order_relaxed);
+        auto discardUntil = discardUntil_.load(std::memory_order_acquire);
+        if (head < discardUntil) {
+            head = discardUntil;
+            head_.store(head, std::memory_order_release);
+        }
+        count = std::min(count, read_available());
+        for (size_t done = 0; done < count;) {
+            auto index = (size_t)(head % frames_.size());
+            auto n     = std::min(count - done, frames_.size() - index);
+            memcpy(dst + done, &frames_[index], n * sizeof(AudioFrame));
+            done += n;
+            head += n;
+        }
+        head_.store(head, std::memory_order_release);
+        return count;
+    }
+
+    // Any thread, the consumer drops everything written so far on its next read
+    void discard_written()
+    {
+        auto tail    = tail_.load(std::memory_order_acquire);
+        auto current = discardUntil_.load(std::memory_order_relaxed);
+        while (current < tail && !discardUntil_.compare_exchange_weak(current, tail, std::memory_order_acq_rel)) {
+        }
+    }
+
+    // Count of frames ever written, the index of the next frame to write
+    uint64_t total_written() const { return tail_.load(std::memory_order_acquire); }
+
+    // Count of frames ever read or discarded, the index of the next frame to read
+    uint64_t total_read() const { return head_.load(std::memory_order_acquire); }
+
+private:
+    std::vector<AudioFrame> frames_ {};
+    alignas(64) std::atomic<uint64_t> head_ { 0 }; // written by the consumer
+    alignas(64) std::atomic<uint64_t> tail_ { 0 }; // written by the producer
+    std::atomic<uint64_t> discardUntil_ { 0 };
+};
@@ -0,0 +1,645 @@
+#ifdef TOOLS_ENABLED
+
+#include "benchmarks.h"
+#include "codec_context_pool.h"
+#include "ffmpeg_media_stream.h"
+#include "hw_device_cache.h"
+#include "spsc_ring.h"
+#include "yuv_to_rgba.h"
+#include <algorithm>
+#include <core/config/project_settings.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <thirdparty/misc/yuv2rgb.h>
+#include <thread>
+#include <vector>
+
+using BenchmarkClock = std::chrono::steady_clock;
+
+static int64_t elapsed_ns(BenchmarkClock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(BenchmarkClock::now() - since).count();
+}
+
+static void busy_wait_us(int us)
+{
+    auto begin = BenchmarkClock::now();
+    while (elapsed_ns(begin) < us * 1000LL) {
+    }
+}
+
+static Dictionary summarize_polls(std::vector<int64_t>& pollNs, int64_t totalNs, int frames)
+{
+    Dictionary result;
+    result["frames"]       = frames;
+    result["total_ms"]     = totalNs / 1e6;
+    result["polls"]        = (int64_t)pollNs.size();
+    result["poll_mean_ns"] = 0.0;
+    result["poll_p99_ns"]  = (int64_t)0;
+    result["poll_max_ns"]  = (int64_t)0;
+    if (pollNs.empty()) {
+        return result;
+    }
+
+    int64_t sum = 0;
+    for (auto ns : pollNs) {
+        sum += ns;
+    }
+    std::sort(pollNs.begin(), pollNs.end());
+    result["poll_mean_ns"] = sum / (double)pollNs.size();
+    result["poll_p99_ns"]  = pollNs[std::min(pollNs.size() - 1, pollNs.size() * 99 / 100)];
+    result["poll_max_ns"]  = pollNs.back();
+    return result;
+}
+
+static Ref<FfmpegCodecHwConfig> find_hw_config(const Ref<FfmpegCodec>& codec, const String& hwName)
+{
+    TypedArray<FfmpegCodecHwConfig> configs = codec->available_hw_configs();
+    for (int i = 0; i < configs.size(); ++i) {
+        Ref<FfmpegCodecHwConfig> config = configs[i];
+        if (config->get_name() == hwName) {
+            return config;
+        }
+    }
+    return Ref<FfmpegCodecHwConfig>();
+}
+
+// Opens the file with its first video decoder, empty hwName for software. Returns null with the reason in error.
+static Ref<FfmpegMediaStream> open_stream(const String& path, const String& hwName, double& createDecodersMs, String& error)
+{
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    if (!stream->set_file(path)) {
+        error = "open failed";
+        return Ref<FfmpegMediaStream>();
+    }
+    TypedArray<FfmpegCodec> decoders = stream->available_video_decoders();
+    if (decoders.is_empty()) {
+        error = "no decoder";
+        return Ref<FfmpegMediaStream>();
+    }
+    Ref<FfmpegCodec> codec = decoders[0];
+    Ref<FfmpegCodecHwConfig> hwConfig;
+    if (!hwName.is_empty()) {
+        hwConfig = find_hw_config(codec, hwName);
+        if (hwConfig.is_null()) {
+            error = "hw decoder not available";
+            return Ref<FfmpegMediaStream>();
+        }
+    }
+    auto begin = BenchmarkClock::now();
+    if (!stream->create_decoders(codec.ptr(), hwConfig.ptr())) {
+        error = "create_decoders failed";
+        return Ref<FfmpegMediaStream>();
+    }
+    createDecodersMs = elapsed_ns(begin) / 1e6;
+    return stream;
+}
+
+static Dictionary run_mailbox(int frames, int depth, int producerWorkUs)
+{
+    using FrameInfo = FfmpegMediaStream::FrameInfo;
+    SpscRing<FrameInfo> ring(depth);
+    std::mutex spaceMutex;
+    std::condition_variable spaceCv;
+
+    std::vector<int64_t> pollNs;
+    pollNs.reserve(frames * 4);
+
+    auto begin = BenchmarkClock::now();
+    std::thread producer([&]() {
+        for (int i = 0; i < frames; ++i) {
+            busy_wait_us(producerWorkUs);
+            FrameInfo frameInfo {};
+            frameInfo.frameTime = i;
+            while (!ring.tryPush(std::move(frameInfo))) {
+                std::unique_lock<std::mutex> lck(spaceMutex);
+                spaceCv.wait_for(lck, std::chrono::milliseconds(5), [&]() { return !ring.isFull(); });
+            }
+        }
+    });
+
+    int received = 0;
+    while (received < frames) {
+        auto pollBegin = BenchmarkClock::now();
+        FrameInfo frameInfo {};
+        bool got = ring.tryPop(frameInfo);
+        if (got) {
+            spaceCv.notify_one();
+        }
+        pollNs.push_back(elapsed_ns(pollBegin));
+        if (got) {
+            ++received;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    return summarize_polls(pollNs, elapsed_ns(begin), frames);
+}
+
+static Dictionary run_list_mutex(int frames, int depth, int producerWorkUs)
+{
+    using FrameInfo = FfmpegMediaStream::FrameInfo;
+    std::list<FrameInfo> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<int64_t> pollNs;
+    pollNs.reserve(frames * 4);
+
+    auto begin = BenchmarkClock::now();
+    std::thread producer([&]() {
+        for (int i = 0; i < frames; ++i) {
+            busy_wait_us(producerWorkUs);
+            FrameInfo frameInfo {};
+            frameInfo.frameTime = i;
+            std::unique_lock<std::mutex> lck(mutex);
+            cv.wait(lck, [&]() { return queue.size() < (size_t)depth; });
+            queue.push_back(std::move(frameInfo));
+        }
+    });
+
+    int received = 0;
+    while (received < frames) {
+        auto pollBegin = BenchmarkClock::now();
+        FrameInfo frameInfo {};
+        bool got = false;
+        {
+            std::unique_lock<std::mutex> lck(mutex);
+            if (!queue.empty()) {
+                frameInfo = std::move(queue.front());
+                queue.pop_front();
+                got = true;
+            }
+        }
+        if (got) {
+            cv.notify_one();
+        }
+        pollNs.push_back(elapsed_ns(pollBegin));
+        if (got) {
+            ++received;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    return summarize_polls(pollNs, elapsed_ns(begin), frames);
+}
+
+static void fill_test_pattern(AVFrame* frame, int index)
+{
+    if (frame->format == AV_PIX_FMT_YUV420P10) {
+        // The same pattern with 10-bit samples, the two low bits keep it from being an 8-bit clip in disguise
+        for (int y = 0; y < frame->height; ++y) {
+            auto* row = reinterpret_cast<uint16_t*>(frame->data[0] + (ptrdiff_t)y * frame->linesize[0]);
+            for (int x = 0; x < frame->width; ++x) {
+                row[x] = (uint16_t)((x + y + index * 8) & 0x3FF);
+            }
+        }
+        for (int y = 0; y < frame->height / 2; ++y) {
+            auto* u = reinterpret_cast<uint16_t*>(frame->data[1] + (ptrdiff_t)y * frame->linesize[1]);
+            auto* v = reinterpret_cast<uint16_t*>(frame->data[2] + (ptrdiff_t)y * frame->linesize[2]);
+            for (int x = 0; x < frame->width / 2; ++x) {
+                u[x] = (uint16_t)((512 + y + index * 2) & 0x3FF);
+                v[x] = (uint16_t)((256 + index * 3) & 0x3FF);
+            }
+        }
+        return;
+    }
+
+    // Diagonal luma bands scrolling to the right, chroma slowly cycling
+    for (int y = 0; y < frame->height; ++y) {
+        auto* row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        for (int x = 0; x < frame->width; ++x) {
+            row[x] = (uint8_t)(x + y + index * 8);
+        }
+    }
+    for (int y = 0; y < frame->height / 2; ++y) {
+        memset(frame->data[1] + (ptrdiff_t)y * frame->linesize[1], (uint8_t)(128 + y + index * 2), frame->width / 2);
+        memset(frame->data[2] + (ptrdiff_t)y * frame->linesize[2], (uint8_t)(64 + index * 3), frame->width / 2);
+    }
+}
+
+// The first encoder accepting pixelFormat: H.264, HEVC when the x264 build has no 10-bit support, MPEG-4 part 2
+static const AVCodec* find_clip_encoder(AVPixelFormat pixelFormat)
+{
+    for (const AVCodec* codec : { avcodec_find_encoder_by_name("libx264"), avcodec_find_encoder_by_name("libx265"), avcodec_find_encoder(AV_CODEC_ID_MPEG4) }) {
+        if (codec == nullptr) {
+            continue;
+        }
+        for (auto* format = codec->pix_fmts; format != nullptr && *format != AV_PIX_FMT_NONE; ++format) {
+            if (*format == pixelFormat) {
+                return codec;
+            }
+        }
+    }
+    return nullptr;
+}
+
+static void fill_test_tone(AVFrame* frame, int64_t firstSample)
+{
+    // 440 Hz on the left, 660 Hz on the right
+    for (int c = 0; c < frame->ch_layout.nb_channels; ++c) {
+        auto* samples = reinterpret_cast<float*>(frame->extended_data[c]);
+        auto hz       = c == 0 ? 440.0 : 660.0;
+        for (int i = 0; i < frame->nb_samples; ++i) {
+            samples[i] = (float)(0.2 * Math::sin(Math_TAU * hz * (double)(firstSample + i) / frame->sample_rate));
+        }
+    }
+}
+
+static bool write_encoded_packets(AVFormatContext* formatContext, AVCodecContext* codecContext, AVStream* stream, AVPacket* packet)
+{
+    while (true) {
+        int ret = avcodec_receive_packet(codecContext, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return true;
+        }
+        if (ret < 0) {
+            return false;
+        }
+        av_packet_rescale_ts(packet, codecContext->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        if (av_interleaved_write_frame(formatContext, packet) < 0) {
+            return false;
+        }
+    }
+}
+
+void FfmpegBenchmark::_bind_methods()
+{
+    ClassDB::bind_static_method("FfmpegBenchmark", D_METHOD("frame_mailbox_contention", "frames", "depth", "producer_work_us"), &FfmpegBenchmark::frame_mailbox_contention);
+    ClassDB::bind_static_method("FfmpegBenchmark", D_METHOD("generate_clip", "path", "width", "height", "seconds", "fps", "options"), &FfmpegBenchmark::generate_clip, DEFVAL(Dictionary()));
+    ClassDB::bind_static_method("FfmpegBenchmark", D_METHOD("playback", "path", "options"), &FfmpegBenchmark::playback, DEFVAL(Dictionary()));
+    ClassDB::bind_static_method("FfmpegBenchmark", D_METHOD("open_decoders", "path", "options"), &FfmpegBenchmark::open_decoders, DEFVAL(Dictionary()));
+    ClassDB::bind_static_method("FfmpegBenchmark", D_METHOD("yuv_to_rgba", "width", "height", "iterations"), &FfmpegBenchmark::yuv_to_rgba);
+}
+
+bool FfmpegBenchmark::generate_clip(const String& path, int width, int height, double seconds, int fps, const Dictionary& options)
+{
+    if (width <= 0 || height <= 0 || (width & 1) || (height & 1) || fps <= 0) {
+        ERR_PRINT("Invalid clip size or frame rate");
+        return false;
+    }
+    auto utf8Path = ProjectSettings::get_singleton()->globalize_path(path).utf8();
+
+    AVFormatContext* formatContext = nullptr;
+    if (avformat_alloc_output_context2(&formatContext, nullptr, "mp4", utf8Path.get_data()) < 0) {
+        ERR_PRINT("Failed to create the output context");
+        return false;
+    }
+    std::unique_ptr<AVFormatContext, AVFormatContextDeleter> formatContext_(formatContext);
+
+    String pixelFormatName = options.get("pix_fmt", "yuv420p");
+    auto pixelFormat       = pixelFormatName == "yuv420p10" ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+    if (pixelFormat == AV_PIX_FMT_YUV420P && pixelFormatName != "yuv420p") {
+        ERR_PRINT("Unsupported clip pixel format " + pixelFormatName);
+        return false;
+    }
+    const AVCodec* codec = find_clip_encoder(pixelFormat);
+    if (codec == nullptr) {
+        ERR_PRINT("No video encoder available for " + pixelFormatName);
+        return false;
+    }
+    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> codecContext_(avcodec_alloc_context3(codec));
+    auto* codecContext      = codecContext_.get();
+    codecContext->width     = width;
+    codecContext->height    = height;
+    codecContext->pix_fmt   = pixelFormat;
+    codecContext->time_base = AVRational { 1, fps };
+    codecContext->framerate = AVRational { fps, 1 };
+    codecContext->gop_size  = fps; // a keyframe every second, like typical VR footage
+    codecContext->bit_rate  = options.get("bit_rate", (int64_t)width * height * fps / 10);
+    if (options.has("b_frames")) {
+        codecContext->max_b_frames = options["b_frames"];
+    }
+    if (formatContext->oformat->flags & AVFMT_GLOBALHEADER) {
+        codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
+        ERR_PRINT(String("Failed to open encoder {0} for {1}x{2}").format(varray(codec->name, width, height)));
+        return false;
+    }
+
+    auto* stream      = avformat_new_stream(formatContext, nullptr);
+    stream->time_base = codecContext->time_base;
+    avcodec_parameters_from_context(stream->codecpar, codecContext);
+
+    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> audioContext_;
+    AVStream* audioStream = nullptr;
+    if (options.get("audio", false)) {
+        const AVCodec* audioCodec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+        if (audioCodec == nullptr) {
+            ERR_PRINT("No audio encoder available");
+            return false;
+        }
+        audioContext_.reset(avcodec_alloc_context3(audioCodec));
+        auto* audioContext        = audioContext_.get();
+        AVChannelLayout stereo    = AV_CHANNEL_LAYOUT_STEREO;
+        audioContext->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+        audioContext->sample_rate = 48000;
+        audioContext->time_base   = AVRational { 1, 48000 };
+        audioContext->bit_rate    = 128000;
+        av_channel_layout_copy(&audioContext->ch_layout, &stereo);
+        if (formatContext->oformat->flags & AVFMT_GLOBALHEADER) {
+            audioContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        if (avcodec_open2(audioContext, audioCodec, nullptr) < 0) {
+            ERR_PRINT(String("Failed to open encoder {0}").format(varray(audioCodec->name)));
+            return false;
+        }
+        audioStream            = avformat_new_stream(formatContext, nullptr);
+        audioStream->time_base = audioContext->time_base;
+        avcodec_parameters_from_context(audioStream->codecpar, audioContext);
+    }
+
+    if (avio_open(&formatContext->pb, utf8Path.get_data(), AVIO_FLAG_WRITE) < 0) {
+        ERR_PRINT("Failed to open '" + path + "' for writing");
+        return false;
+    }
+    bool ok = avformat_write_header(formatContext, nullptr) >= 0;
+
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> frame(av_frame_alloc());
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet(av_packet_alloc());
+    frame->width  = width;
+    frame->height = height;
+    frame->format = pixelFormat;
+    ok            = ok && av_frame_get_buffer(frame.get(), 0) >= 0;
+
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> audioFrame(av_frame_alloc());
+    auto* audioContext = audioContext_.get();
+    if (audioContext != nullptr) {
+        audioFrame->format      = audioContext->sample_fmt;
+        audioFrame->sample_rate = audioContext->sample_rate;
+        audioFrame->nb_samples  = audioContext->frame_size > 0 ? audioContext->frame_size : 1024;
+        av_channel_layout_copy(&audioFrame->ch_layout, &audioContext->ch_layout);
+        ok = ok && av_frame_get_buffer(audioFrame.get(), 0) >= 0;
+    }
+
+    int64_t audioSamples = 0;
+    auto frameCount      = (int)(seconds * fps);
+    for (int i = 0; ok && i < frameCount; ++i) {
+        ok = av_frame_make_writable(frame.get()) >= 0;
+        if (!ok) {
+            break;
+        }
+        fill_test_pattern(frame.get(), i);
+        frame->pts = i;
+        ok         = avcodec_send_frame(codecContext, frame.get()) >= 0 && write_encoded_packets(formatContext, codecContext, stream, packet.get());
+
+        // The tone up to the end of this video frame, the muxer interleaves both streams
+        while (ok && audioContext != nullptr && audioSamples < (int64_t)(i + 1) * audioContext->sample_rate / fps) {
+            ok = av_frame_make_writable(audioFrame.get()) >= 0;
+            if (!ok) {
+                break;
+            }
+            fill_test_tone(audioFrame.get(), audioSamples);
+            audioFrame->pts = audioSamples;
+            audioSamples += audioFrame->nb_samples;
+            ok = avcodec_send_frame(audioContext, audioFrame.get()) >= 0 && write_encoded_packets(formatContext, audioContext, audioStream, packet.get());
+        }
+    }
+    if (ok) {
+        avcodec_send_frame(codecContext, nullptr);
+        ok = write_encoded_packets(formatContext, codecContext, stream, packet.get());
+        if (audioContext != nullptr) {
+            avcodec_send_frame(audioContext, nullptr);
+            ok = write_encoded_packets(formatContext, audioContext, audioStream, packet.get()) && ok;
+        }
+        ok = av_write_trailer(formatContext) >= 0 && ok;
+    }
+    avio_closep(&formatContext->pb);
+    if (!ok) {
+        ERR_PRINT("Failed to encode '" + path + "'");
+    }
+    return ok;
+}
+
+Dictionary FfmpegBenchmark::playback(const String& path, const Dictionary& options)
+{
+    Dictionary result;
+    String hwName    = options.get("hw", "");
+    double displayHz = options.get("display_hz", 90.0);
+    double maxTime   = options.get("max_seconds", 10.0);
+    int seeks        = options.get("seeks", 5);
+    bool zeroCopy    = options.get("zero_copy", false);
+    bool packed      = options.get("packed_planes", false);
+    bool mapped      = options.get("memory_mapped", false);
+    int readAhead    = options.get("read_ahead_size", mapped ? 0 : 16 * 1024 * 1024);
+    bool probeCache  = options.get("probe_cache", true);
+
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    stream->set_read_ahead_size(readAhead);
+    stream->set_memory_mapped(mapped);
+    stream->set_probe_cache_enabled(probeCache);
+    if (!stream->set_file(path)) {
+        result["error"] = "open failed";
+        return result;
+    }
+    TypedArray<FfmpegCodec> decoders = stream->available_video_decoders();
+    if (decoders.is_empty()) {
+        result["error"] = "no decoder";
+        return result;
+    }
+    Ref<FfmpegCodec> codec = decoders[0];
+    Ref<FfmpegCodecHwConfig> hwConfig;
+    if (!hwName.is_empty()) {
+        hwConfig = find_hw_config(codec, hwName);
+        if (hwConfig.is_null()) {
+            result["error"] = "hw decoder not available";
+            return result;
+        }
+    }
+    if (!stream->create_decoders(codec.ptr(), hwConfig.ptr())) {
+        result["error"] = "create_decoders failed";
+        return result;
+    }
+    result["path"]    = path;
+    result["decoder"] = codec->get_name();
+    result["hw"]      = hwName;
+
+    auto delta = 1.0 / MAX(displayHz, 1.0);
+    stream->set_zero_copy(zeroCopy);
+    stream->set_packed_planes(packed);
+    stream->set_external_clock(true);
+    stream->play();
+
+    // Playback, the clock advances with every update() so the pipeline runs as fast as it can
+    auto begin = BenchmarkClock::now();
+    while (!stream->is_stopped() && elapsed_ns(begin) < maxTime * 1e9) {
+        stream->update(delta);
+        std::this_thread::yield();
+    }
+    auto wallSeconds         = elapsed_ns(begin) / 1e9;
+    Dictionary playback      = stream->get_stats();
+    int64_t decodedFrames    = playback["decoded_frames"];
+    playback["wall_s"]       = wallSeconds;
+    playback["decode_fps"]   = decodedFrames / MAX(wallSeconds, 1e-6);
+    static const char* kPixelFormatNames[] = { "yuv420p", "nv12", "packed_i420", "rgba8", "yuv420p10", "p010", "yuv420p_tiles", "nv12_tiles" };
+    auto pixelFormat         = stream->get_pixel_format();
+    playback["pixel_format"] = pixelFormat == FfmpegMediaStream::kPixelFormatNone ? "none" : kPixelFormatNames[pixelFormat];
+    result["playback"]       = playback;
+
+    // Seeks spread over the file, each one is done when its first frame is presented
+    if (stream->is_stopped()) {
+        stream->play();
+    }
+    stream->reset_stats();
+    auto length = stream->get_length();
+    for (int i = 0; i < seeks && length > 0; ++i) {
+        stream->seek(length * (i + 0.5) / seeks);
+        auto seekBegin = BenchmarkClock::now();
+        while (stream->is_seeking() && !stream->is_stopped() && elapsed_ns(seekBegin) < 5e9) {
+            stream->update(0.0);
+            std::this_thread::yield();
+        }
+    }
+    Dictionary seekStats = stream->get_stats();
+    Dictionary seek;
+    seek["count"]          = seekStats["seeks"];
+    seek["latency_ms"]     = seekStats["seek_latency_ms"];
+    seek["latency_p99_ms"] = seekStats["seek_latency_p99_ms"];
+    seek["window_seeks"]   = seekStats["read_ahead_window_seeks"];
+    seek["refill_seeks"]   = seekStats["read_ahead_refill_seeks"];
+    result["seek"]         = seek;
+
+    stream->stop();
+    return result;
+}
+
+Dictionary FfmpegBenchmark::open_decoders(const String& path, const Dictionary& options)
+{
+    Dictionary result;
+    String hwName = options.get("hw", "");
+    int count     = MAX((int)options.get("count", 5), 1);
+
+    auto& devices = HwDeviceCache::get_singleton();
+    auto& pool    = CodecContextPool::get_singleton();
+    auto poolSize = pool.get_capacity();
+    pool.clear();
+
+    // together: every stream stays open until the last one is, as the items of a playlist, the pool is disabled.
+    // Otherwise each stream is freed before the next one is opened and gives its decoders back to the pool.
+    auto run = [&](bool together) {
+        Dictionary phase;
+        pool.set_capacity(together ? 0 : MAX(poolSize, 1));
+        auto devicesBefore = devices.get_stats();
+        auto poolBefore    = pool.get_stats();
+
+        Vector<Ref<FfmpegMediaStream>> streams;
+        double firstMs = 0.0;
+        double restMs  = 0.0;
+        int reused     = 0;
+        for (int i = 0; i < count; ++i) {
+            double createDecodersMs = 0.0;
+            String error;
+            auto stream = open_stream(path, hwName, createDecodersMs, error);
+            if (stream.is_null()) {
+                phase["error"] = error;
+                return phase;
+            }
+            (i == 0 ? firstMs : restMs) += createDecodersMs;
+            reused += stream->is_decoder_reused() ? 1 : 0;
+            if (together) {
+                streams.push_back(stream);
+            }
+        }
+        streams.clear();
+
+        auto devicesAfter           = devices.get_stats();
+        auto poolAfter              = pool.get_stats();
+        phase["first_ms"]           = firstMs;
+        phase["next_mean_ms"]       = count > 1 ? restMs / (count - 1) : 0.0;
+        phase["decoders_reused"]    = reused;
+        phase["decoders_opened"]    = poolAfter.opened - poolBefore.opened;
+        phase["hw_devices_created"] = devicesAfter.created - devicesBefore.created;
+        phase["hw_devices_reused"]  = devicesAfter.reused - devicesBefore.reused;
+        return phase;
+    };
+
+    result["path"]       = path;
+    result["hw"]         = hwName;
+    result["count"]      = count;
+    result["concurrent"] = run(true);
+    result["pooled"]     = run(false);
+
+    pool.set_capacity(poolSize);
+    return result;
+}
+
+Dictionary FfmpegBenchmark::frame_mailbox_contention(int frames, int depth, int producerWorkUs)
+{
+    Dictionary result;
+    if (frames <= 0 || depth <= 0) {
+        ERR_PRINT("frames and depth must be positive");
+        return result;
+    }
+    result["mailbox"]    = run_mailbox(frames, depth, producerWorkUs);
+    result["list_mutex"] = run_list_mutex(frames, depth, producerWorkUs);
+    return result;
+}
+
+Dictionary FfmpegBenchmark::yuv_to_rgba(int width, int height, int iterations)
+{
+    Dictionary result;
+    if (width <= 0 || height <= 0 || iterations <= 0) {
+        ERR_PRINT("width, height and iterations must be positive");
+        return result;
+    }
+
+    // Large enough for every layout, a gradient so that the kernels do not only see one value
+    std::vector<uint8_t> planes[3];
+    for (auto& plane : planes) {
+        plane.resize((size_t)width * height * 2);
+        for (size_t i = 0; i < plane.size(); ++i) {
+            plane[i] = (uint8_t)(i * 7 + (i >> 8));
+        }
+    }
+    std::vector<uint8_t> rgba((size_t)width * height * 4);
+
+    struct Case {
+        const char* name;
+        YuvLayout layout;
+        int chromaStride;
+    };
+    const Case cases[] = {
+        { "yuv420p_ms", kYuvLayout420P, (width + 1) / 2 },
+        { "nv12_ms", kYuvLayoutNv12, (width + 1) / 2 * 2 },
+        { "yuv422p_ms", kYuvLayout422P, (width + 1) / 2 },
+        { "yuv444p_ms", kYuvLayout444P, width },
+    };
+    for (const auto& c : cases) {
+        YuvImage image;
+        image.layout = c.layout;
+        image.matrix = kYuvMatrixBt709;
+        image.width  = width;
+        image.height = height;
+        for (int i = 0; i < 3; ++i) {
+            image.planes[i]  = planes[i].data();
+            image.strides[i] = i == 0 ? width : c.chromaStride;
+        }
+        auto begin = BenchmarkClock::now();
+        for (int i = 0; i < iterations; ++i) {
+            yuv_to_rgba8(image, rgba.data(), width * 4);
+        }
+        result[c.name] = elapsed_ns(begin) / 1e6 / iterations;
+    }
+
+    // The scalar converter VideoStreamPlaybackFfmpeg used before, for comparison
+    auto begin = BenchmarkClock::now();
+    for (int i = 0; i < iterations; ++i) {
+        yuv420_2_rgb8888(rgba.data(), planes[0].data(), planes[1].data(), planes[2].data(), width, height, width, (width + 1) / 2, width * 4);
+    }
+    result["reference_yuv420p_ms"] = elapsed_ns(begin) / 1e6 / iterations;
+    result["backend"]              = yuv_to_rgba8_backend();
+    return result;
+}
+
+#endif // TOOLS_ENABLED
@@ -0,0 +1,56 @@
+#pragma once
+
+#ifdef TOOLS_ENABLED
+
+#include <core/object/ref_counted.h>
+#include <core/string/ustring.h>
+#include <core/variant/dictionary.h>
+
+// Micro benchmarks of the playback pipeline, results are returned as dictionaries
+// so that they can be printed as json by the benchmark scenes.
+class FfmpegBenchmark : public RefCounted {
+    GDCLASS(FfmpegBenchmark, RefCounted);
+
+public:
+    static void _bind_methods();
+
+    // Hands `frames` frames from a producer thread to the calling thread, once through the
+    // lock-free frame mailbox and once through a std::list guarded by a mutex and a condition
+    // variable. The producer spends `producerWorkUs` microseconds on every frame before pushing it.
+    // Returns the time the consumer spends polling, per poll, for both variants.
+    static Dictionary frame_mailbox_contention(int frames, int depth, int producerWorkUs);
+
+    // Encodes a synthetic moving pattern with libavcodec into an mp4 file, H.264 if libx264 is available,
+    // HEVC with libx265 for 10-bit if x264 cannot, MPEG-4 part 2 otherwise. Used to benchmark resolutions the sample data does not cover. Options:
+    //   bit_rate: video bit rate in bit/s (default width * height * fps / 10)
+    //   audio: adds a 48 kHz stereo AAC tone (default false)
+    //   pix_fmt: "yuv420p" or "yuv420p10", which hw decoders output as p010 (default "yuv420p")
+    //   b_frames: B-frames between reference frames at most (default the encoder's)
+    static bool generate_clip(const String& path, int width, int height, double seconds, int fps, const Dictionary& options);
+
+    // Plays the file through FfmpegMediaStream with an external clock advanced by 1 / display_hz per update(),
+    // as fast as the pipeline allows, then seeks `seeks` times. Options:
+    //   hw: name of the hardware decoder to use, empty for software (default "")
+    //   display_hz: update() rate the clock simulates (default 90)
+    //   max_seconds: wall time limit of the playback phase (default 10)
+    //   seeks: count of seeks to measure (default 5)
+    //   zero_copy: see FfmpegMediaStream::set_zero_copy (default false)
+    //   packed_planes: see FfmpegMediaStream::set_packed_planes (default false)
+    //   read_ahead_size: see FfmpegMediaStream::set_read_ahead_size (default 16 MB, 0 when memory_mapped)
+    //   memory_mapped: see FfmpegMediaStream::set_memory_mapped, needs read_ahead_size 0 (default false)
+    //   probe_cache: see FfmpegMediaStream::set_probe_cache_enabled (default true)
+    static Dictionary playback(const String& path, const Dictionary& options);
+
+    // Times create_decoders() for count streams of the file, first kept open together with the decoder pool disabled,
+    // so that only the hardware device is shared, then opened one after the other, each freed before the next one
+    // reuses its pooled decoders. Runs with the software decoder too, no GPU needed. Options:
+    //   hw: name of the hardware decoder to use, empty for software (default "")
+    //   count: streams opened by each phase (default 5)
+    static Dictionary open_decoders(const String& path, const Dictionary& options);
+
+    // Time per frame of the YUV to RGBA8 kernels VideoStreamPlaybackFfmpeg uses, for each layout,
+    // next to the scalar yuv420_2_rgb8888() from thirdparty.
+    static Dictionary yuv_to_rgba(int width, int height, int iterations);
+};
+
+#endif // TOOLS_ENABLED
@@ -0,0 +1,137 @@
+#include "codec_context_pool.h"
+#include "hw_device_cache.h"
+
+extern "C" {
+#include <libavutil/md5.h>
+}
+
+CodecContextPool& CodecContextPool::get_singleton()
+{
+    static CodecContextPool pool;
+    return pool;
+}
+
+String CodecContextPool::make_key(const AVCodec* codec, const AVCodecParameters* par, AVHWDeviceType hwType, int threadCount)
+{
+    uint8_t extradataMd5[16] {};
+    if (par->extradata_size > 0) {
+        av_md5_sum(extradataMd5, par->extradata, par->extradata_size);
+    }
+    const int64_t fields[] = {
+        hwType, threadCount, par->codec_id, par->codec_tag, par->format, par->profile, par->level, par->width,
+        par->height, par->bits_per_coded_sample, par->bits_per_raw_sample, par->sample_aspect_ratio.num,
+        par->sample_aspect_ratio.den, par->field_order, par->color_range, par->color_primaries, par->color_trc,
+        par->color_space, par->chroma_location, par->ch_layout.nb_channels, par->sample_rate, par->block_align,
+        par->frame_size
+    };
+
+    String key = String(codec->name) + "|" + String::hex_encode_buffer(extradataMd5, sizeof(extradataMd5));
+    for (auto field : fields) {
+        key += "|" + itos(field);
+    }
+    return key;
+}
+
+AVCodecContext* CodecContextPool::acquire(const String& key)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    // Most recently released first, its buffers are the most likely to be still warm
+    for (auto it = idle_.rbegin(); it != idle_.rend(); ++it) {
+        if (it->key != key) {
+            continue;
+        }
+        auto* ctx = it->ctx;
+        idle_.erase(std::next(it).base());
+        tracked_[ctx] = key;
+        ++reused_;
+        return ctx;
+    }
+    return nullptr;
+}
+
+void CodecContextPool::track(AVCodecContext* ctx, const String& key)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    tracked_[ctx] = key;
+    ++opened_;
+}
+
+void CodecContextPool::release(AVCodecContext* ctx)
+{
+    std::list<Idle> evicted;
+    String key;
+    bool keep = false;
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        auto it = tracked_.find(ctx);
+        if (it != tracked_.end()) {
+            keep = capacity_ > 0;
+            key  = it->second;
+            tracked_.erase(it);
+        }
+    }
+    if (!keep) {
+        evicted.push_back(Idle { String(), ctx }); // possibly never opened
+        free_contexts(evicted);
+        return;
+    }
+
+    // Flushing waits for the frame threads of the decoder, so it runs unlocked: nothing else holds the context yet
+    avcodec_flush_buffers(ctx);
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        idle_.push_back(Idle { key, ctx });
+        while ((int)idle_.size() > capacity_) {
+            evicted.splice(evicted.end(), idle_, idle_.begin());
+        }
+    }
+    free_contexts(evicted);
+}
+
+void CodecContextPool::set_capacity(int contexts)
+{
+    std::list<Idle> evicted;
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        capacity_ = MAX(contexts, 0);
+        while ((int)idle_.size() > capacity_) {
+            evicted.splice(evicted.end(), idle_, idle_.begin());
+        }
+    }
+    free_contexts(evicted);
+}
+
+int CodecContextPool::get_capacity() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return capacity_;
+}
+
+void CodecContextPool::clear()
+{
+    std::list<Idle> evicted;
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        evicted.swap(idle_);
+    }
+    free_contexts(evicted);
+}
+
+CodecContextPool::Stats CodecContextPool::get_stats() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return Stats { opened_, reused_, (uint32_t)idle_.size() };
+}
+
+void CodecContextPool::free_contexts(std::list<Idle>& contexts)
+{
+    if (contexts.empty()) {
+        return;
+    }
+    for (auto& idle : contexts) {
+        avcodec_free_context(&idle.ctx);
+    }
+    contexts.clear();
+    // The freed hw decoders may have held the last references to their devices
+    HwDeviceCache::get_singleton().trim();
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <core/string/ustring.h>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Opened decoders kept for the next stream decoding the same codec with the same parameters, which then skips
+// avcodec_open2(): the frame threads, the hw frames setup and the extradata parsing. A released context is flushed
+// with avcodec_flush_buffers(), back to the state it had right after opening, and kept idle. The least recently
+// released ones beyond the capacity are freed. Any thread may use it.
+class CodecContextPool {
+public:
+    struct Stats {
+        uint64_t opened { 0 }; // contexts tracked
+        uint64_t reused { 0 }; // acquire() calls served from the pool
+        uint32_t idle { 0 };   // kept now
+    };
+
+    static CodecContextPool& get_singleton();
+
+    CodecContextPool(const CodecContextPool&)            = delete;
+    CodecContextPool& operator=(const CodecContextPool&) = delete;
+
+    // Everything an opened decoder depends on: the decoder, the codec parameters, the hw device type and the thread
+    // count. Contexts only come back for an identical key.
+    static String make_key(const AVCodec* codec, const AVCodecParameters* par, AVHWDeviceType hwType, int threadCount);
+
+    // An idle context opened with key, null if there is none
+    AVCodecContext* acquire(const String& key);
+
+    // Makes release() keep the opened context ctx for key
+    void track(AVCodecContext* ctx, const String& key);
+
+    // Flushes and keeps a tracked context, frees the others
+    void release(AVCodecContext* ctx);
+
+    // Idle contexts kept at most (4 by default), 0 disables the pool
+    void set_capacity(int contexts);
+    int get_capacity() const;
+
+    // Frees the idle contexts
+    void clear();
+
+    Stats get_stats() const;
+
+private:
+    CodecContextPool() = default;
+
+    struct Idle {
+        String key {};
+        AVCodecContext* ctx { nullptr };
+    };
+
+    // Called without the lock, closing a decoder joins its threads
+    static void free_contexts(std::list<Idle>& contexts);
+
+private:
+    mutable std::mutex mutex_ {};
+    std::list<Idle> idle_ {}; // least recently released first
+    std::unordered_map<AVCodecContext*, String> tracked_ {};
+    int capacity_ { 4 };
+    uint64_t opened_ { 0 };
+    uint64_t reused_ { 0 };
+};
+
+// Gives the context back to CodecContextPool instead of freeing it
+struct PooledCodecContextDeleter {
+    void operator()(AVCodecContext* c)
+    {
+        if (c) {
+            CodecContextPool::get_singleton().release(c);
+        }
+    }
+};
@@ -1,9 +1,22 @@
 #include "ffmpeg_media_stream.h"
+#include "http_chunk_cache.h"
+#include "probe_cache.h"
+#include "yuv_to_rgba.h"
+#include <algorithm>
+#include <array>
+#include <core/config/engine.h>
+#include <core/io/file_access.h>
+#include <core/os/os.h>
+#include <main/performance.h>
+#include <servers/rendering_server.h>
 #include <scene/audio/audio_stream_player.h>
 #include <string>
 
 extern "C" {
 #include "libavutil/avutil.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
 }
 
 #ifdef __ANDROID__
@@ -38,6 +51,23 @@ static double get_stream_duration(AVStream* stream)
     return get_stream_time_seconds(stream, stream->duration);
 }
 
+// The duration of a packet in microseconds, estimated from the frame rate or the frame size when the demuxer leaves it
+// unset
+static int64_t get_packet_duration_usec(AVStream* stream, const AVPacket* packet)
+{
+    if (packet->duration > 0) {
+        return av_rescale_q(packet->duration, stream->time_base, AVRational { 1, 1000000 });
+    }
+    auto* par = stream->codecpar;
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO && stream->avg_frame_rate.num > 0) {
+        return av_rescale_q(1, av_inv_q(stream->avg_frame_rate), AVRational { 1, 1000000 });
+    }
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO && par->frame_size > 0 && par->sample_rate > 0) {
+        return (int64_t)par->frame_size * 1000000 / par->sample_rate;
+    }
+    return 0;
+}
+
 static double get_context_duration(AVFormatContext* ctx)
 {
     return ctx->duration / AV_TIME_BASE;
@@ -47,8 +77,14 @@ inline uint32_t get_textures_count_by_pixel_format(FfmpegMediaStream::PixelForma
 {
     // clang-format off
     switch (fmt) {
-    case FfmpegMediaStream::kPixelFormatYuv420P: return 3;
-    case FfmpegMediaStream::kPixelFormatNv12:    return 2;
+    case FfmpegMediaStream::kPixelFormatYuv420P:      return 3;
+    case FfmpegMediaStream::kPixelFormatNv12:         return 2;
+    case FfmpegMediaStream::kPixelFormatPackedI420:   return 1;
+    case FfmpegMediaStream::kPixelFormatRgba8:        return 1;
+    case FfmpegMediaStream::kPixelFormatYuv420P10:    return 3;
+    case FfmpegMediaStream::kPixelFormatP010:         return 2;
+    case FfmpegMediaStream::kPixelFormatYuv420PTiles: return 3;
+    case FfmpegMediaStream::kPixelFormatNv12Tiles:    return 2;
     case FfmpegMediaStream::kPixelFormatNone:
     default:
         ERR_PRINT("Invalid format");
@@ -71,8 +107,28 @@ static String get_hw_type_name(const AVCodecHWConfig* cfg)
     return result;
 }
 
+// Wakes the threads waiting on cv for a condition changed without holding mutex. Taking mutex in between makes sure
+// a waiter is either before its predicate check or already waiting, so no wakeup is lost and no wait needs a timeout.
+static void notify_after_lock(std::mutex& mutex, std::condition_variable& cv)
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+    }
+    cv.notify_all();
+}
+
+// Whether the decoder cannot go on after avcodec_receive_frame() returned error, the other errors come from corrupt data
+static bool is_fatal_decode_error(int error)
+{
+    return error == AVERROR(ENOMEM) || error == AVERROR(EINVAL) || error == AVERROR_BUG || error == AVERROR_BUG2 || error == AVERROR_EXTERNAL;
+}
+
 static const String kPixelFormatChangedSignalName { "pixel_format_changed" };
 static const String kPlayStateChangedSignalName { "play_state_changed" };
+static const String kSeekCompletedSignalName { "seek_completed" };
+static const String kOpenProgressSignalName { "open_progress" };
+static const String kOpenedSignalName { "opened" };
+static const String kOpenFailedSignalName { "open_failed" };
 
 void FfmpegCodecHwConfig::_bind_methods()
 {
@@ -107,8 +163,10 @@ void FfmpegMediaStream::_bind_methods()
 {
     ClassDB::bind_method(D_METHOD("get_texture", "index"), &FfmpegMediaStream::get_texture);
     ClassDB::bind_method(D_METHOD("get_textures_count"), &FfmpegMediaStream::get_textures_count);
+    ClassDB::bind_method(D_METHOD("get_pixel_format"), &FfmpegMediaStream::get_pixel_format);
     ClassDB::bind_method(D_METHOD("update", "delta"), &FfmpegMediaStream::update);
     ClassDB::bind_method(D_METHOD("play"), &FfmpegMediaStream::play);
+    ClassDB::bind_method(D_METHOD("prime"), &FfmpegMediaStream::prime);
     ClassDB::bind_method(D_METHOD("stop"), &FfmpegMediaStream::stop);
     ClassDB::bind_method(D_METHOD("pause"), &FfmpegMediaStream::pause);
     ClassDB::bind_method(D_METHOD("is_playing"), &FfmpegMediaStream::is_playing);
@@ -119,6 +177,8 @@ void FfmpegMediaStream::_bind_methods()
     ClassDB::bind_method(D_METHOD("get_position"), &FfmpegMediaStream::get_position);
     ClassDB::bind_method(D_METHOD("get_video_stream_count"), &FfmpegMediaStream::get_video_stream_count);
     ClassDB::bind_method(D_METHOD("get_audio_stream_count"), &FfmpegMediaStream::get_audio_stream_count);
+    ClassDB::bind_method(D_METHOD("set_audio_track", "track"), &FfmpegMediaStream::set_audio_track);
+    ClassDB::bind_method(D_METHOD("get_audio_track"), &FfmpegMediaStream::get_audio_track);
     ClassDB::bind_method(D_METHOD("get_subtitle_stream_count"), &FfmpegMediaStream::get_subtitle_stream_count);
     ClassDB::bind_method(D_METHOD("get_encapsulation_format"), &FfmpegMediaStream::get_encapsulation_format);
     ClassDB::bind_method(D_METHOD("get_video_encoding_format"), &FfmpegMediaStream::get_video_encoding_format);
@@ -126,17 +186,86 @@ void FfmpegMediaStream::_bind_methods()
     ClassDB::bind_method(D_METHOD("get_video_codec_name"), &FfmpegMediaStream::get_video_codec_name);
     ClassDB::bind_method(D_METHOD("get_audio_codec_name"), &FfmpegMediaStream::get_audio_codec_name);
     ClassDB::bind_method(D_METHOD("set_drop_every_n_frame"), &FfmpegMediaStream::set_drop_every_n_frame);
-
-    ClassDB::bind_method(D_METHOD("seek", "position"), &FfmpegMediaStream::seek);
+    ClassDB::bind_method(D_METHOD("get_frame_pool_stats"), &FfmpegMediaStream::get_frame_pool_stats);
+    ClassDB::bind_method(D_METHOD("get_stats"), &FfmpegMediaStream::get_stats);
+    ClassDB::bind_method(D_METHOD("reset_stats"), &FfmpegMediaStream::reset_stats);
+    ClassDB::bind_method(D_METHOD("set_external_clock", "enabled"), &FfmpegMediaStream::set_external_clock);
+    ClassDB::bind_method(D_METHOD("is_external_clock"), &FfmpegMediaStream::is_external_clock);
+    ClassDB::bind_method(D_METHOD("is_seeking"), &FfmpegMediaStream::is_seeking);
+    ClassDB::bind_method(D_METHOD("set_packed_planes", "enabled"), &FfmpegMediaStream::set_packed_planes);
+    ClassDB::bind_method(D_METHOD("is_packed_planes"), &FfmpegMediaStream::is_packed_planes);
+    ClassDB::bind_method(D_METHOD("set_rgba_output", "enabled"), &FfmpegMediaStream::set_rgba_output);
+    ClassDB::bind_method(D_METHOD("is_rgba_output"), &FfmpegMediaStream::is_rgba_output);
+    ClassDB::bind_method(D_METHOD("set_tiled_upload", "enabled"), &FfmpegMediaStream::set_tiled_upload);
+    ClassDB::bind_method(D_METHOD("is_tiled_upload"), &FfmpegMediaStream::is_tiled_upload);
+    ClassDB::bind_method(D_METHOD("set_tile_grid", "columns", "rows"), &FfmpegMediaStream::set_tile_grid);
+    ClassDB::bind_method(D_METHOD("get_tile_grid"), &FfmpegMediaStream::get_tile_grid);
+    ClassDB::bind_method(D_METHOD("set_view", "orientation", "fov_degrees", "aspect", "margin_degrees"), &FfmpegMediaStream::set_view, DEFVAL(10.0f));
+    ClassDB::bind_method(D_METHOD("get_tiled_texture", "index"), &FfmpegMediaStream::get_tiled_texture);
+    ClassDB::bind_method(D_METHOD("get_tiled_textures_count"), &FfmpegMediaStream::get_tiled_textures_count);
+    ClassDB::bind_method(D_METHOD("set_zero_copy", "enabled"), &FfmpegMediaStream::set_zero_copy);
+    ClassDB::bind_method(D_METHOD("is_zero_copy"), &FfmpegMediaStream::is_zero_copy);
+    ClassDB::bind_method(D_METHOD("set_frame_queue_depth", "depth"), &FfmpegMediaStream::set_frame_queue_depth);
+    ClassDB::bind_method(D_METHOD("get_frame_queue_depth"), &FfmpegMediaStream::get_frame_queue_depth);
+    ClassDB::bind_method(D_METHOD("set_latest_frame_wins", "enabled"), &FfmpegMediaStream::set_latest_frame_wins);
+    ClassDB::bind_method(D_METHOD("is_latest_frame_wins"), &FfmpegMediaStream::is_latest_frame_wins);
+    ClassDB::bind_method(D_METHOD("set_speed_scale", "scale"), &FfmpegMediaStream::set_speed_scale);
+    ClassDB::bind_method(D_METHOD("get_speed_scale"), &FfmpegMediaStream::get_speed_scale);
+    ClassDB::bind_method(D_METHOD("get_thumbnail", "position"), &FfmpegMediaStream::get_thumbnail);
+    ClassDB::bind_method(D_METHOD("set_thumbnail_width", "width"), &FfmpegMediaStream::set_thumbnail_width);
+    ClassDB::bind_method(D_METHOD("get_thumbnail_width"), &FfmpegMediaStream::get_thumbnail_width);
+    ClassDB::bind_method(D_METHOD("get_av_offset"), &FfmpegMediaStream::get_av_offset);
+    ClassDB::bind_method(D_METHOD("is_audio_clock_master"), &FfmpegMediaStream::is_audio_clock_master);
+
+    ClassDB::bind_method(D_METHOD("seek", "position", "keyframe_only"), &FfmpegMediaStream::seek, DEFVAL(false));
     ClassDB::bind_method(D_METHOD("set_file", "filePath"), &FfmpegMediaStream::set_file);
+    ClassDB::bind_method(D_METHOD("open_async", "filePath", "decoder", "hw"), &FfmpegMediaStream::open_async, DEFVAL(""), DEFVAL(""));
+    ClassDB::bind_method(D_METHOD("is_opening"), &FfmpegMediaStream::is_opening);
+    ClassDB::bind_method(D_METHOD("cancel_open"), &FfmpegMediaStream::cancel_open);
+    ClassDB::bind_method(D_METHOD("get_poster_texture"), &FfmpegMediaStream::get_poster_texture);
+    ClassDB::bind_method(D_METHOD("get_hw_decoder_name"), &FfmpegMediaStream::get_hw_decoder_name);
+    ClassDB::bind_method(D_METHOD("get_open_error"), &FfmpegMediaStream::get_open_error);
+    ClassDB::bind_method(D_METHOD("get_decode_error"), &FfmpegMediaStream::get_decode_error);
+    ClassDB::bind_method(D_METHOD("preroll"), &FfmpegMediaStream::preroll);
+    ClassDB::bind_method(D_METHOD("get_frame_size"), &FfmpegMediaStream::get_frame_size);
+    ClassDB::bind_method(D_METHOD("get_audio_buffer_size"), &FfmpegMediaStream::get_audio_buffer_size);
+    ClassDB::bind_method(D_METHOD("get_primed_buffer_size"), &FfmpegMediaStream::get_primed_buffer_size);
+    ClassDB::bind_method(D_METHOD("set_read_ahead_size", "bytes"), &FfmpegMediaStream::set_read_ahead_size);
+    ClassDB::bind_method(D_METHOD("get_read_ahead_size"), &FfmpegMediaStream::get_read_ahead_size);
+    ClassDB::bind_method(D_METHOD("set_memory_mapped", "enabled"), &FfmpegMediaStream::set_memory_mapped);
+    ClassDB::bind_method(D_METHOD("is_memory_mapped"), &FfmpegMediaStream::is_memory_mapped);
+    ClassDB::bind_method(D_METHOD("set_probe_cache_enabled", "enabled"), &FfmpegMediaStream::set_probe_cache_enabled);
+    ClassDB::bind_method(D_METHOD("is_probe_cache_enabled"), &FfmpegMediaStream::is_probe_cache_enabled);
+    ClassDB::bind_method(D_METHOD("is_probe_cache_hit"), &FfmpegMediaStream::is_probe_cache_hit);
+    ClassDB::bind_method(D_METHOD("set_probe_size", "bytes"), &FfmpegMediaStream::set_probe_size);
+    ClassDB::bind_method(D_METHOD("get_probe_size"), &FfmpegMediaStream::get_probe_size);
+    ClassDB::bind_method(D_METHOD("set_analyze_duration", "seconds"), &FfmpegMediaStream::set_analyze_duration);
+    ClassDB::bind_method(D_METHOD("get_analyze_duration"), &FfmpegMediaStream::get_analyze_duration);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("set_http_cache_size", "bytes"), &FfmpegMediaStream::set_http_cache_size);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("get_http_cache_size"), &FfmpegMediaStream::get_http_cache_size);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("clear_http_cache"), &FfmpegMediaStream::clear_http_cache);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("set_decoder_pool_size", "contexts"), &FfmpegMediaStream::set_decoder_pool_size);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("get_decoder_pool_size"), &FfmpegMediaStream::get_decoder_pool_size);
+    ClassDB::bind_static_method("FfmpegMediaStream", D_METHOD("clear_decoder_pool"), &FfmpegMediaStream::clear_decoder_pool);
+    ClassDB::bind_method(D_METHOD("is_decoder_reused"), &FfmpegMediaStream::is_decoder_reused);
     ClassDB::bind_method(D_METHOD("available_video_decoders"), &FfmpegMediaStream::available_video_decoders);
     ClassDB::bind_method(D_METHOD("create_decoders", "hw"), &FfmpegMediaStream::create_decoders);
 
     ADD_SIGNAL(MethodInfo(kPixelFormatChangedSignalName, PropertyInfo(Variant::INT, "format")));
     ADD_SIGNAL(MethodInfo(kPlayStateChangedSignalName, PropertyInfo(Variant::INT, "state")));
+    ADD_SIGNAL(MethodInfo(kSeekCompletedSignalName, PropertyInfo(Variant::FLOAT, "position")));
+    ADD_SIGNAL(MethodInfo(kOpenProgressSignalName, PropertyInfo(Variant::FLOAT, "progress")));
+    ADD_SIGNAL(MethodInfo(kOpenedSignalName));
+    ADD_SIGNAL(MethodInfo(kOpenFailedSignalName, PropertyInfo(Variant::STRING, "message")));
     BIND_ENUM_CONSTANT(kPixelFormatNone);
     BIND_ENUM_CONSTANT(kPixelFormatYuv420P);
     BIND_ENUM_CONSTANT(kPixelFormatNv12);
+    BIND_ENUM_CONSTANT(kPixelFormatPackedI420);
+    BIND_ENUM_CONSTANT(kPixelFormatRgba8);
+    BIND_ENUM_CONSTANT(kPixelFormatYuv420P10);
+    BIND_ENUM_CONSTANT(kPixelFormatP010);
+    BIND_ENUM_CONSTANT(kPixelFormatYuv420PTiles);
+    BIND_ENUM_CONSTANT(kPixelFormatNv12Tiles);
 
     BIND_ENUM_CONSTANT(kStateStopped);
     BIND_ENUM_CONSTANT(kStatePlaying);
@@ -147,56 +276,138 @@ void FfmpegMediaStream::_bind_methods()
 #endif
 }
 
+void FfmpegMediaStream::set_http_cache_size(int64_t bytes)
+{
+    HttpChunkCache::get_singleton().set_capacity((uint64_t)std::max<int64_t>(bytes, 0));
+}
+
+int64_t FfmpegMediaStream::get_http_cache_size()
+{
+    return (int64_t)HttpChunkCache::get_singleton().get_capacity();
+}
+
+void FfmpegMediaStream::clear_http_cache()
+{
+    HttpChunkCache::get_singleton().clear();
+}
+
+void FfmpegMediaStream::set_decoder_pool_size(int contexts)
+{
+    CodecContextPool::get_singleton().set_capacity(contexts);
+}
+
+int FfmpegMediaStream::get_decoder_pool_size()
+{
+    return CodecContextPool::get_singleton().get_capacity();
+}
+
+void FfmpegMediaStream::clear_decoder_pool()
+{
+    CodecContextPool::get_singleton().clear();
+}
+
 bool FfmpegMediaStream::set_file(const String& filePath)
 {
     if (!filePath_.is_empty()) {
         ERR_PRINT("You have set the file path before, try to create a new FfmpegMediaStream object!");
         return false;
     }
+    auto openBegin = OS::get_singleton()->get_ticks_usec();
     bool useAvio =
 #if defined(__ANDROID__)
-        filePath.begins_with("res://") || filePath.begins_with("user://");
+        filePath.begins_with("res://") || filePath.begins_with("user://") || HttpRangeSource::is_http_url(filePath);
 #else
         true;
 #endif
-    if (useAvio) {
-        avioContext_ = std::make_unique<AvIoContextWrapper>(filePath);
+    bool memoryMapped = memoryMapped_ && readAheadSize_ <= 0;
+    if (memoryMapped_ && !memoryMapped) {
+        WARN_PRINT("Memory mapping is ignored while the read ahead size is not 0");
+    }
+    if (useAvio || memoryMapped) {
+        avioContext_ = std::make_unique<AvIoContextWrapper>(filePath, (size_t)std::max(readAheadSize_, 0), memoryMapped);
         auto* avio   = avioContext_.get();
-        if (avio->file.is_null()) {
+        if (avio->mapped.is_open()) {
+            useAvio = true;
+        } else if (!useAvio) {
+            avioContext_.reset(); // opened by ffmpeg as before
+        } else if (!avio->is_open()) {
             ERR_PRINT("Cannot open file '" + filePath + "'.");
             return false;
         }
     }
     filePath_ = filePath;
 
-    int ret = 0;
-    if (useAvio) {
-        ret = av_probe_input_buffer(avioContext_.get()->context, &inputFormat_, "", nullptr, 0, 0);
-        if (ret < 0) {
-            ERR_PRINT("Failed to probe input format!");
-            return false;
+    // A file probed before skips probing and the stream analysis
+    String probeKey;
+    Dictionary probeEntry;
+    if (probeCacheEnabled_) {
+        int64_t fileSize = -1;
+        if (avioContext_ != nullptr) {
+            fileSize = avioContext_->get_length();
+        } else if (auto file = FileAccess::open(filePath, FileAccess::READ); file.is_valid()) {
+            fileSize = (int64_t)file->get_length();
+        }
+        probeKey = ProbeCache::make_key(filePath, fileSize);
+        if (!probeKey.is_empty()) {
+            probeEntry   = ProbeCache::load(probeKey);
+            inputFormat_ = probeEntry.is_empty() ? nullptr : av_find_input_format(String(probeEntry["format"]).utf8().get_data());
         }
     }
 
-    // open file
+    // open file, probing it for real if the format of the cache entry does not open it anymore
     auto utf8FilePath              = filePath.utf8();
-    const char* url                = utf8FilePath.get_data();
-    AVFormatContext* formatContext = avformat_alloc_context();
-    if (useAvio) {
-        formatContext->pb    = avioContext_->context;
-        formatContext->flags = AVFMT_FLAG_CUSTOM_IO;
-        url                  = "";
-    }
-    avFormatContext_.reset(formatContext);
-    ret = avformat_open_input(&formatContext, url, inputFormat_, nullptr);
-    if (ret != 0) {
-        char buf[AV_ERROR_MAX_STRING_SIZE];
-        av_make_error_string(buf, AV_ERROR_MAX_STRING_SIZE, ret);
-        ERR_PRINT(String("Failed to call avformat_open_input(): {0}, {1}").format(varray(buf, filePath)));
+    AVFormatContext* formatContext = nullptr;
+    keyframeIndex_.clear();
+    while (true) {
+        int ret = 0;
+        if (useAvio && inputFormat_ == nullptr) {
+            ret = av_probe_input_buffer(avioContext_.get()->context, &inputFormat_, "", nullptr, 0, (unsigned)std::max<int64_t>(probeSize_, 0));
+            if (ret < 0) {
+                ERR_PRINT("Failed to probe input format!");
+                return false;
+            }
+        }
 
-        return false;
+        const char* url                   = utf8FilePath.get_data();
+        formatContext                     = avformat_alloc_context();
+        formatContext->interrupt_callback = AVIOInterruptCB {
+            [](void* opaque) -> int { return reinterpret_cast<FfmpegMediaStream*>(opaque)->openCancelled_.load(std::memory_order_relaxed) ? 1 : 0; },
+            this
+        };
+        if (useAvio) {
+            formatContext->pb    = avioContext_->context;
+            formatContext->flags = AVFMT_FLAG_CUSTOM_IO;
+            url                  = "";
+        }
+        if (probeSize_ > 0) {
+            formatContext->probesize = probeSize_;
+        }
+        if (analyzeDuration_ > 0) {
+            formatContext->max_analyze_duration = (int64_t)(analyzeDuration_ * AV_TIME_BASE);
+        }
+        ret = avformat_open_input(&formatContext, url, inputFormat_, nullptr);
+        if (ret == 0) {
+            avFormatContext_.reset(formatContext);
+            break;
+        }
+        // avformat_open_input() freed the context
+        if (probeEntry.is_empty() || openCancelled_.load(std::memory_order_relaxed)) {
+            char buf[AV_ERROR_MAX_STRING_SIZE];
+            av_make_error_string(buf, AV_ERROR_MAX_STRING_SIZE, ret);
+            ERR_PRINT(String("Failed to call avformat_open_input(): {0}, {1}").format(varray(buf, filePath)));
+
+            return false;
+        }
+        WARN_PRINT(String("The cached format {0} does not open {1}, probing it again").format(varray(inputFormat_->name, filePath)));
+        ProbeCache::remove(probeKey);
+        probeEntry   = Dictionary();
+        inputFormat_ = nullptr;
+        if (useAvio) {
+            avio_seek(avioContext_->context, 0, SEEK_SET);
+        }
     }
-    inputFormat_ = avFormatContext_->iformat;
+    inputFormat_   = avFormatContext_->iformat;
+    probeCacheHit_ = !probeEntry.is_empty() && ProbeCache::apply(probeEntry, formatContext);
 
     for (int i = 0; i < formatContext->nb_streams; ++i) {
         auto* stream = formatContext->streams[i];
@@ -210,27 +421,36 @@ bool FfmpegMediaStream::set_file(const String& filePath)
     }
     if (!videoStreamIndices_.is_empty()) { // TODO: Multiple stream?
         const AVCodec* codec = nullptr;
-        videoStreamIndex_    = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        int cachedIndex      = probeCacheHit_ ? (int)probeEntry["video_stream"] : -1;
+        videoStreamIndex_    = videoStreamIndices_.has(cachedIndex) ? cachedIndex : av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
         assert(videoStreamIndex_ >= 0);
     }
     if (!audioStreamIndices_.is_empty()) {
         const AVCodec* codec = nullptr;
-        audioStreamIndex_    = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+        int cachedIndex      = probeCacheHit_ ? (int)probeEntry["audio_stream"] : -1;
+        audioStreamIndex_    = audioStreamIndices_.has(cachedIndex) ? cachedIndex : av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
         assert(audioStreamIndex_ >= 0);
     }
 
-    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
-        ERR_PRINT("Failed to find stream info");
-        return false;
+    if (!probeCacheHit_) {
+        if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+            ERR_PRINT("Failed to find stream info");
+            return false;
+        }
+        // Streams found only while reading packets would not match the header next time
+        if (!probeKey.is_empty() && !(formatContext->ctx_flags & AVFMTCTX_NOHEADER)) {
+            auto entry = ProbeCache::capture(formatContext, videoStreamIndex_, audioStreamIndex_);
+            if (!entry.is_empty()) {
+                ProbeCache::store(probeKey, entry);
+            }
+        }
     }
 
     if (videoStreamIndices_.is_empty() && audioStreamIndices_.is_empty()) {
         ERR_PRINT("Failed to find a video stream and audio stream.");
         return false;
     }
-    avPacket_.reset(av_packet_alloc());
-    avFrame_.reset(av_frame_alloc());
-
+    openUsec_ = OS::get_singleton()->get_ticks_usec() - openBegin;
     return true;
 }
 
@@ -263,62 +483,265 @@ bool FfmpegMediaStream::create_decoders(const FfmpegCodec* videoCodec, const Ffm
         auto codecId = videoCodec->avcodec()->id;
         auto* codec  = videoCodec->avcodec();
 
-        auto codecContext = avcodec_alloc_context3(codec);
-        videoCodecContext_.reset(codecContext);
-        avcodec_parameters_to_context(codecContext, stream->codecpar);
-
         bool isHwAccelerated = false;
         if (videoHwCfg != nullptr) {
-            isHwAccelerated = 0 == hw_decoder_init(codecContext, videoHwCfg->avcodec_hw_config()->device_type);
-            if (!isHwAccelerated) {
-                codecContext->thread_count = (int)std::thread::hardware_concurrency();
-            }
+            isHwAccelerated = 0 == hw_decoder_init(videoHwCfg->avcodec_hw_config()->device_type);
         }
 
         if (isHwAccelerated) {
-            String hw = get_hw_type_name(videoHwCfg->avcodec_hw_config());
+            String hw      = get_hw_type_name(videoHwCfg->avcodec_hw_config());
+            hwDecoderName_ = hw;
             ERR_PRINT(String("Using hw decoder {0}").format(varray(hw)));
         } else {
             ERR_PRINT(String("No hw decoder for {0} with name {1} found").format(varray(codec->name)));
         }
 
-        auto ret = avcodec_open2(codecContext, codec, nullptr);
-        if (0 != ret) {
+        auto hwType      = isHwAccelerated ? videoHwCfg->avcodec_hw_config()->device_type : AV_HWDEVICE_TYPE_NONE;
+        auto threadCount = isHwAccelerated ? 0 : (int)std::thread::hardware_concurrency();
+        videoCodecContext_.reset(open_decoder(codec, stream->codecpar, hwType, threadCount, &decoderReused_));
+        if (videoCodecContext_ == nullptr) {
             ERR_PRINT(String("Open codec {0} failed").format(varray(avcodec_get_name(codecId))));
             return false;
         }
     }
-    if (audioStreamIndex_ > 0) {
+    if (audioStreamIndex_ >= 0) {
         auto* stream = avFormatContext_->streams[audioStreamIndex_];
         auto codecId = stream->codecpar->codec_id;
         auto* codec  = avcodec_find_decoder(codecId);
 
-        auto codecContext = avcodec_alloc_context3(codec);
-        audioCodecContext_.reset(codecContext);
-        avcodec_parameters_to_context(codecContext, stream->codecpar);
-        if (0 != avcodec_open2(codecContext, codec, nullptr)) {
+        bool audioReused = false;
+        audioCodecContext_.reset(open_decoder(codec, stream->codecpar, AV_HWDEVICE_TYPE_NONE, 0, &audioReused));
+        if (audioCodecContext_ == nullptr) {
             ERR_PRINT(String("Open codec {0} failed").format(avcodec_get_name(codecId)));
             return false;
         }
+        if (videoCodecContext_ == nullptr) {
+            decoderReused_ = audioReused;
+        }
 
-        auto channelCount = codecContext->ch_layout.nb_channels;
-        auto sampleRate   = codecContext->sample_rate;
-        audioResampler_.setup(channelCount, sampleRate, AudioServer::get_singleton()->get_mix_rate(), audioBufferingMs_, 0);
+        // Everything is converted straight to the mix rate by swresample
+        mixRate_ = (int)AudioServer::get_singleton()->get_mix_rate();
+        audioRing_.reset((size_t)mixRate_ * audioBufferingMs_ / 1000);
     } else {
-        audioResampler_.clear();
+        audioRing_.reset(1);
+    }
+    return true;
+}
+
+bool FfmpegMediaStream::set_audio_track(int track)
+{
+    ERR_FAIL_INDEX_V(track, audioStreamIndices_.size(), false);
+    if (state_ != State::kStateStopped) {
+        ERR_PRINT("The audio track can only be changed while stopped");
+        return false;
+    }
+    auto index = audioStreamIndices_[track];
+    if (index == audioStreamIndex_) {
+        return true;
+    }
+    if (audioCodecContext_ != nullptr) {
+        auto* stream = avFormatContext_->streams[index];
+        auto codecId = stream->codecpar->codec_id;
+
+        bool reused = false;
+        std::unique_ptr<AVCodecContext, PooledCodecContextDeleter> context { open_decoder(avcodec_find_decoder(codecId), stream->codecpar, AV_HWDEVICE_TYPE_NONE, 0, &reused) };
+        if (context == nullptr) {
+            ERR_PRINT(String("Open codec {0} failed").format(varray(avcodec_get_name(codecId))));
+            return false; // the previous track keeps playing
+        }
+        audioCodecContext_ = std::move(context);
+        swrContext_.reset(); // rebuilt for the layout of the new track
     }
+    audioStreamIndex_ = index;
     return true;
 }
 
+void FfmpegMediaStream::open_async(const String& filePath, const String& decoderName, const String& hwName)
+{
+    if (!filePath_.is_empty() || is_opening()) {
+        ERR_PRINT("You have set the file path before, try to create a new FfmpegMediaStream object!");
+        return;
+    }
+    // The worker hands its reference over to the deferred finish_open(), so the last one is dropped on the main
+    // thread, after the worker is joined. If the call never runs the message queue drops it, nothing keeps the
+    // stream alive.
+    Ref<FfmpegMediaStream> keepAlive { this };
+    openError_  = String();
+    openThread_ = std::thread([this, keepAlive, filePath, decoderName, hwName]() {
+        openError_ = open_thread_routine(filePath, decoderName, hwName);
+        callable_mp(this, &FfmpegMediaStream::finish_open).call_deferred(keepAlive);
+    });
+}
+
+String FfmpegMediaStream::open_thread_routine(const String& filePath, const String& decoderName, const String& hwName)
+{
+    auto report = [this](double progress) { call_deferred(SNAME("emit_signal"), kOpenProgressSignalName, progress); };
+
+    auto cancelled = [this]() { return openCancelled_.load(std::memory_order_relaxed); };
+
+    if (!set_file(filePath) || cancelled()) {
+        return cancelled() ? String("Cancelled") : "Cannot open '" + filePath + "'";
+    }
+    report(0.4);
+
+    // The named decoder, otherwise the first one with a hw config, otherwise the first one
+    Ref<FfmpegCodec> codec;
+    TypedArray<FfmpegCodec> decoders = available_video_decoders();
+    for (int i = 0; i < decoders.size() && codec.is_null(); ++i) {
+        Ref<FfmpegCodec> candidate = decoders[i];
+        if (decoderName.is_empty() ? !candidate->available_hw_configs().is_empty() : candidate->get_name() == decoderName) {
+            codec = candidate;
+        }
+    }
+    if (codec.is_null() && decoderName.is_empty() && !decoders.is_empty()) {
+        codec = decoders[0];
+    }
+    if (codec.is_null() && videoStreamIndex_ >= 0) {
+        return decoderName.is_empty() ? String("No video decoder found") : "No video decoder named '" + decoderName + "'";
+    }
+
+    Ref<FfmpegCodecHwConfig> hwConfig;
+    if (codec.is_valid() && hwName != "none") {
+        TypedArray<FfmpegCodecHwConfig> configs = codec->available_hw_configs();
+        for (int i = 0; i < configs.size() && hwConfig.is_null(); ++i) {
+            Ref<FfmpegCodecHwConfig> candidate = configs[i];
+            if (hwName.is_empty() || candidate->get_name() == hwName) {
+                hwConfig = candidate;
+            }
+        }
+        if (hwConfig.is_null() && !hwName.is_empty()) {
+            ERR_PRINT("No hw config named '" + hwName + "', decoding in software");
+        }
+    }
+    if (cancelled() || !create_decoders(codec.ptr(), hwConfig.ptr())) {
+        return cancelled() ? String("Cancelled") : "Cannot create the decoders of '" + filePath + "'";
+    }
+    report(0.7);
+
+    decode_poster();
+    return cancelled() ? String("Cancelled") : String();
+}
+
+void FfmpegMediaStream::cancel_open()
+{
+    if (is_opening()) {
+        openCancelled_ = true;
+    }
+}
+
+void FfmpegMediaStream::finish_open(const Ref<FfmpegMediaStream>& keepAlive)
+{
+    openThread_.join();
+
+    if (!openError_.is_empty()) {
+        emit_signal(kOpenFailedSignalName, openError_);
+        return;
+    }
+    if (posterImage_.is_valid()) {
+        posterTexture_ = ImageTexture::create_from_image(posterImage_);
+        posterImage_.unref();
+    }
+    emit_signal(kOpenProgressSignalName, 1.0);
+    emit_signal(kOpenedSignalName);
+}
+
+void FfmpegMediaStream::decode_poster()
+{
+    if (videoCodecContext_ == nullptr) {
+        return;
+    }
+    auto* formatContext = avFormatContext_.get();
+    auto* codecContext  = videoCodecContext_.get();
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet { av_packet_alloc() };
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> frame { av_frame_alloc() };
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> swFrame { av_frame_alloc() };
+
+    bool draining = false;
+    for (int i = 0; i < kMaxPosterPackets_ && posterImage_.is_null() && !openCancelled_; ++i) {
+        if (!draining) {
+            int ret = av_read_frame(formatContext, packet.get());
+            if (ret < 0) {
+                draining = true;
+                avcodec_send_packet(codecContext, nullptr);
+            } else {
+                std::unique_ptr<AVPacket, AvPacketDeleter> packetGuard { packet.get() };
+                if (packet->stream_index != videoStreamIndex_) {
+                    continue;
+                }
+                ret = avcodec_send_packet(codecContext, packet.get());
+                if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                    break;
+                }
+            }
+        }
+
+        int ret = avcodec_receive_frame(codecContext, frame.get());
+        if (ret == AVERROR(EAGAIN) && !draining) {
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+        std::unique_ptr<AVFrame, AvFrameDeleter> frameGuard { frame.get() };
+        const AVFrame* src = frame.get();
+        if (frame->hw_frames_ctx != nullptr) {
+            if (av_hwframe_transfer_data(swFrame.get(), frame.get(), 0) < 0) {
+                break;
+            }
+            src = swFrame.get();
+        }
+        posterImage_ = scale_poster(src);
+        av_frame_unref(swFrame.get());
+    }
+
+    // play() starts from the beginning with clean decoders
+    auto startTime = formatContext->start_time == AV_NOPTS_VALUE ? 0 : formatContext->start_time;
+    if (av_seek_frame(formatContext, -1, startTime, AVSEEK_FLAG_BACKWARD) < 0) {
+        ERR_PRINT("Cannot seek back after decoding the poster of '" + filePath_ + "'");
+    }
+    avcodec_flush_buffers(codecContext);
+}
+
+Ref<Image> FfmpegMediaStream::scale_poster(const AVFrame* frame)
+{
+    if (frame->width <= 0 || frame->height <= 0) {
+        return {};
+    }
+    int width  = MIN(kMaxPosterWidth_, frame->width);
+    int height = MAX(2, (int)((int64_t)frame->height * width / frame->width) & ~1);
+
+    auto* swsContext = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format,
+        width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (swsContext == nullptr) {
+        ERR_PRINT("Failed to create the poster scaler");
+        return {};
+    }
+    Vector<uint8_t> buffer;
+    buffer.resize(Image::get_image_data_size(width, height, Image::FORMAT_RGBA8, false));
+    uint8_t* dst[4]    = { buffer.ptrw(), nullptr, nullptr, nullptr };
+    int dstLinesize[4] = { width * 4, 0, 0, 0 };
+    sws_scale(swsContext, frame->data, frame->linesize, 0, frame->height, dst, dstLinesize);
+    sws_freeContext(swsContext);
+
+    return Ref<Image> { memnew(Image(width, height, false, Image::FORMAT_RGBA8, buffer)) };
+}
+
 FfmpegMediaStream::FfmpegMediaStream() = default;
 
 FfmpegMediaStream::~FfmpegMediaStream()
 {
+    if (openThread_.joinable()) {
+        openThread_.join(); // the deferred finish_open() never ran
+    }
     // First stop playing
     stop();
+    thumbnails_.stop();
+    textures_.clear();
+    free_texture_sets();
 
     // Then destroy ffmpeg related objects
     // TODO:
+    av_channel_layout_uninit(&swrInputLayout_);
 }
 
 void FfmpegMediaStream::static_mix(void* data)
@@ -331,40 +754,124 @@ void FfmpegMediaStream::play()
     if (state_ == State::kStatePlaying) {
         return;
     }
+    if (is_opening()) {
+        ERR_PRINT("Cannot play before the stream is opened");
+        return;
+    }
     State prevState = state_;
-    state_          = State::kStatePlaying; // set state now, it will be used in decoding thread
     if (prevState == State::kStateStopped) {
-        assert(!decodingThread_.joinable());
-        decodingThread_ = std::thread([this]() {
-            decode_thread_routine();
-        });
-        if (audioStreamIndex_ != -1) {
-            mixBuffer_.resize(AudioServer::get_singleton()->thread_get_mix_buffer_size()); // resize before register
-            AudioServer::get_singleton()->add_mix_callback(&FfmpegMediaStream::static_mix, this);
-        }
+        systemClockBase_ = 0.0;
+        audioEndSerial_  = -1;
+    }
+    systemClockUsec_ = OS::get_singleton()->get_ticks_usec(); // the system clock resumes from systemClockBase_
+    state_           = State::kStatePlaying; // set state now, it will be used in decoding thread
+    primed_          = false;
+    notify_after_lock(controlMutex_, controlCv_); // the demuxer reads further ahead than while primed
+
+    monitoredStream_ = get_instance_id();
+    register_performance_monitors();
+
+    if (prevState == State::kStateStopped) {
+        start_threads();
+    }
+    // A primed stream mixes from its first play()
+    if (audioCodecContext_ != nullptr && !externalAudio_ && !mixCallbackAdded_) {
+        mixBuffer_.resize(AudioServer::get_singleton()->thread_get_mix_buffer_size()); // resize before register
+        AudioServer::get_singleton()->add_mix_callback(&FfmpegMediaStream::static_mix, this);
+        mixCallbackAdded_ = true;
     }
 
     emit_signal(kPlayStateChangedSignalName, State::kStatePlaying);
 }
 
+void FfmpegMediaStream::prime()
+{
+    if (state_ != State::kStateStopped) {
+        ERR_PRINT("Only a stopped stream can be primed");
+        return;
+    }
+    if (is_opening()) {
+        ERR_PRINT("Cannot prime before the stream is opened");
+        return;
+    }
+    systemClockBase_ = 0.0;
+    audioEndSerial_  = -1;
+    primed_          = true;
+    state_           = State::kStatePaused;
+    start_threads();
+    emit_signal(kPlayStateChangedSignalName, State::kStatePaused);
+}
+
+void FfmpegMediaStream::start_threads()
+{
+    assert(!demuxThread_.joinable());
+    decodeError_.store(0, std::memory_order_relaxed);
+    videoPackets_.reopen();
+    audioPackets_.reopen();
+    demuxThread_ = std::thread([this]() {
+        demux_thread_routine();
+    });
+    if (videoCodecContext_ != nullptr) {
+        videoDecodeThread_ = std::thread([this]() {
+            video_decode_thread_routine();
+        });
+        uploadThread_ = std::thread([this]() {
+            upload_thread_routine();
+        });
+    }
+    if (audioCodecContext_ != nullptr) {
+        audioDecodeThread_ = std::thread([this]() {
+            audio_decode_thread_routine();
+        });
+    }
+}
+
 void FfmpegMediaStream::stop()
 {
     if (state_ == State::kStateStopped) {
         return;
     }
-    AudioServer::get_singleton()->remove_mix_callback(&FfmpegMediaStream::static_mix, this);
+    if (mixCallbackAdded_) {
+        AudioServer::get_singleton()->remove_mix_callback(&FfmpegMediaStream::static_mix, this);
+        mixCallbackAdded_ = false;
+    }
+    primed_ = false;
 
     {
-        std::unique_lock<std::mutex> lck(decodedImagesMutex_);
-        state_ = State::kStateStopped;
+        std::unique_lock<std::mutex> lck(controlMutex_);
+        state_          = State::kStateStopped;
+        seekTo_         = 0.0; // the next play() starts over, without reopening the file
+        seekDropBefore_ = -1.0;
+    }
+    controlCv_.notify_all();
+    notify_after_lock(frameSpaceMutex_, frameSpaceCv_);
+    notify_after_lock(audioSpaceMutex_, audioSpaceCv_);
+    videoPackets_.close();
+    audioPackets_.close();
+    notify_after_lock(uploadMutex_, uploadCv_);
+    for (auto* t : { &demuxThread_, &videoDecodeThread_, &audioDecodeThread_, &uploadThread_ }) {
+        if (t->joinable()) {
+            t->join();
+        }
     }
-    hasDecodedImageCv_.notify_all();
-    if (decodingThread_.joinable()) {
-        decodingThread_.join();
+    FrameInfo frameInfo {};
+    while (decodedFrames_.tryPop(frameInfo)) {
+        release_frame(frameInfo);
+    }
+    clear_latest_frame();
+    while (uploadFrames_.tryPop(frameInfo)) {
+        release_frame(frameInfo);
     }
-    time_          = 0;
-    lastFrameTime_ = 0;
-    totalTime_     = 0;
+    release_frame(nextUpload_);
+    nextUpload_ = FrameInfo {};
+    uploadsPending_.store(0, std::memory_order_relaxed);
+    endOfStream_  = false;
+    prerolled_    = false;
+    prerollTaken_ = false;
+    audioRing_.discard_written();
+    systemClockBase_ = 0;
+    lastFrameTime_   = 0;
+    totalTime_       = 0;
     emit_signal(kPlayStateChangedSignalName, State::kStateStopped);
 }
 
@@ -375,111 +882,53 @@ void FfmpegMediaStream::pause()
         return;
     }
 
-    state_ = State::kStatePaused;
+    systemClockBase_ = get_master_clock(0.0); // freeze the clock, the audio clock stops by itself
+    state_           = State::kStatePaused;
     emit_signal(kPlayStateChangedSignalName, State::kStatePaused);
 }
 
-static int64_t now()
-{
-    using namespace std::chrono;
-    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
-}
-
-bool FfmpegMediaStream::update(double delta)
+bool FfmpegMediaStream::preroll()
 {
-    if (state_ != State::kStatePlaying) {
+    if (state_ != State::kStatePaused) {
         return false;
     }
-
-    time_ += delta;
-
-    FrameInfo frameInfo {};
-    {
-        std::unique_lock<std::mutex> lck(decodedImagesMutex_);
-        if (!decodedImages_.empty()) {
-            auto frameTime = decodedImages_.front().frameTime;
-            if (time_ > frameTime) {
-                frameInfo = decodedImages_.front();
-                decodedImages_.pop_front();
-
-                lck.unlock();
-                hasDecodedImageCv_.notify_one();
-
-                // if the decoding thread cannot catch up time, then we slow down the clock
-                auto tmp = frameTime + 500.0;
-                if (time_ > tmp) {
-                    time_     = tmp;
-                    frameTime = tmp;
-                }
-                lastFrameTime_ = frameTime;
-            }
-        }
+    if (prerolled_ || videoCodecContext_ == nullptr) {
+        return true;
     }
-
-    if (frameInfo.format != PixelFormat::kPixelFormatNone) {
-        auto textureCount = get_textures_count_by_pixel_format(frameInfo.format);
-
-        if (frameInfo.format != currentPixelFormat_) {
-            currentPixelFormat_ = frameInfo.format;
-            textures_.clear();
-            textures_.resize((int)textureCount);
-            for (auto& t : textures_) {
-                t = Ref<ImageTexture>(memnew(ImageTexture));
-            }
-            // force recreate texture
-            textureWidth_  = 0;
-            textureHeight_ = 0;
-
-            emit_signal(kPixelFormatChangedSignalName, frameInfo.format);
-        }
-
-        auto& img0 = frameInfo.images[0];
-        auto* tw   = textures_.ptrw();
-        if (textureWidth_ != img0->get_width() || textureHeight_ != img0->get_height()) {
-            textureWidth_  = img0->get_width();
-            textureHeight_ = img0->get_height();
-            for (uint32_t i = 0; i < textureCount; ++i) {
-                tw[i]->set_image(frameInfo.images[i]);
-            }
-        } else {
-            for (uint32_t i = 0; i < textureCount; ++i) {
-                tw[i]->update(frameInfo.images[i]);
-            }
-        }
+    if (present_uploaded_frame()) {
+        prerolled_ = true;
+        stats_.presentedFrames.fetch_add(1, std::memory_order_relaxed);
         return true;
-    } else if (frameInfo.frameTime < 0) {
-        stop();
     }
-    return false;
-}
-
-double FfmpegMediaStream::get_length() const
-{
-    if (totalTime_ == 0) {
-        totalTime_ = get_context_duration(avFormatContext_.get());
+    if (nextUpload_.format == PixelFormat::kPixelFormatNone && !prerollTaken_ && latestFrameWins_) {
+        FrameInfo latest {};
+        if (!take_latest_frame(latest, false)) {
+            return false;
+        }
+        if (latest.serial != serial_) {
+            release_frame(latest);
+            return false;
+        }
+        lastFrameTime_ = latest.frameTime;
+        nextUpload_    = std::move(latest);
+        prerollTaken_  = true;
+    } else if (nextUpload_.format == PixelFormat::kPixelFormatNone && !prerollTaken_) {
+        auto* front = decodedFrames_.front();
+        if (front == nullptr || front->frameTime < 0 || front->serial != serial_) {
+            return false;
+        }
+        lastFrameTime_ = front->frameTime;
+        nextUpload_    = std::move(*front);
+        decodedFrames_.popFront();
+        notify_after_lock(frameSpaceMutex_, frameSpaceCv_);
+        prerollTaken_ = true;
     }
-    return totalTime_;
-}
-
-double FfmpegMediaStream::get_position() const
-{
-    return lastFrameTime_;
-}
-
-double FfmpegMediaStream::seek(double position)
-{
-    decltype(decodedImages_) frames; // To ensure frame are not freed in critical area
-    {
-        std::unique_lock<std::mutex> lck(decodedImagesMutex_);
-        seekTo_ = position;
-        time_   = position;
-        frames  = std::move(decodedImages_);
-        audioResampler_.flush();
+    if (nextUpload_.format != PixelFormat::kPixelFormatNone && uploadFrames_.tryPush(std::move(nextUpload_))) {
+        nextUpload_ = FrameInfo {};
+        uploadsPending_.fetch_add(1, std::memory_order_relaxed);
+        notify_after_lock(uploadMutex_, uploadCv_);
     }
-    // Tell the decoding thread that we want to seek
-    hasDecodedImageCv_.notify_one();
-
-    return 0.0;
+    return false;
 }
 
 #define CHECK_AV_ERROR(errcode)                                    \
@@ -499,7 +948,7 @@ inline void copy_video_frame(
 {
     auto dstStride = width * kElementSize;
     assert(dstStride <= srcStride);
-    if (width == srcStride) {
+    if (dstStride == srcStride) {
         memcpy(dst, src, dstStride * height);
     } else {
         for (int i = 0; i < height; ++i) {
@@ -510,133 +959,1265 @@ inline void copy_video_frame(
     }
 }
 
-static void FillYuv420P(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame)
+static void FillYuv420P(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool)
 {
     auto width      = frame->width;
     auto height     = frame->height;
     auto halfWidth  = frame->width / 2;
     auto halfHeight = frame->height / 2;
-    auto ySize      = width * height;
-    auto uvSize     = halfWidth * halfHeight;
 
-    Vector<uint8_t> yBuffer, uBuffer, vBuffer;
-    yBuffer.resize(ySize);
-    uBuffer.resize(uvSize);
-    vBuffer.resize(uvSize);
-    auto* yw = yBuffer.ptrw();
-    auto* uw = uBuffer.ptrw();
-    auto* vw = vBuffer.ptrw();
+    frameInfo.images[0] = pool.acquire(width, height, Image::FORMAT_R8);
+    frameInfo.images[1] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_R8);
+    frameInfo.images[2] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_R8);
 
-    copy_video_frame<1>(width, height, yw, frame->data[0], frame->linesize[0]);
-    copy_video_frame<1>(halfWidth, halfHeight, uw, frame->data[1], frame->linesize[1]);
-    copy_video_frame<1>(halfWidth, halfHeight, vw, frame->data[2], frame->linesize[2]);
-
-    frameInfo.images[0] = Ref<Image> { memnew(Image(width, height, false, Image::FORMAT_R8, yBuffer)) };
-    frameInfo.images[1] = Ref<Image> { memnew(Image(halfWidth, halfHeight, false, Image::FORMAT_R8, uBuffer)) };
-    frameInfo.images[2] = Ref<Image> { memnew(Image(halfWidth, halfHeight, false, Image::FORMAT_R8, vBuffer)) };
+    copy_video_frame<1>(width, height, frameInfo.images[0]->ptrw(), frame->data[0], frame->linesize[0]);
+    copy_video_frame<1>(halfWidth, halfHeight, frameInfo.images[1]->ptrw(), frame->data[1], frame->linesize[1]);
+    copy_video_frame<1>(halfWidth, halfHeight, frameInfo.images[2]->ptrw(), frame->data[2], frame->linesize[2]);
 }
 
-static void FillNv12(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame)
+static void FillNv12(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool)
 {
     auto width      = frame->width;
     auto height     = frame->height;
     auto halfWidth  = frame->width / 2;
     auto halfHeight = frame->height / 2;
-    auto ySize      = width * height;
-    auto uvSize     = halfWidth * halfHeight * 2;
 
-    Vector<uint8_t> yBuffer, uvBuffer;
-    yBuffer.resize(ySize);
-    uvBuffer.resize(uvSize);
-    auto* yw  = yBuffer.ptrw();
-    auto* uvw = uvBuffer.ptrw();
+    frameInfo.images[0] = pool.acquire(width, height, Image::FORMAT_R8);
+    frameInfo.images[1] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_RG8);
 
-    copy_video_frame<1>(width, height, yw, frame->data[0], frame->linesize[0]);
-    copy_video_frame<2>(halfWidth, halfHeight, uvw, frame->data[1], frame->linesize[1]);
+    copy_video_frame<1>(width, height, frameInfo.images[0]->ptrw(), frame->data[0], frame->linesize[0]);
+    copy_video_frame<2>(halfWidth, halfHeight, frameInfo.images[1]->ptrw(), frame->data[1], frame->linesize[1]);
+}
 
-    frameInfo.images[0] = Ref<Image> { memnew(Image(width, height, false, Image::FORMAT_R8, yBuffer)) };
-    frameInfo.images[1] = Ref<Image> { memnew(Image(halfWidth, halfHeight, false, Image::FORMAT_RG8, uvBuffer)) };
+// 10 bits samples are uploaded as half floats in [0, 1]: Godot images have no 16 bits unorm format, and half
+// floats are filtered by the sampler like 8 bits textures, see YuvHighBitDepth.gdshaderinc.
+// Copies width x height samples, shifted right by shift (6 for P010, 0 for yuv420p10). dst may be src.
+static void copy_samples_to_half(int width, int height, uint8_t* dst, const uint8_t* src, int srcStride, int shift)
+{
+    static const auto kHalves = []() {
+        std::array<uint16_t, 1024> halves {};
+        for (int i = 0; i < 1024; ++i) {
+            halves[i] = Math::make_half_float(i / 1023.0f);
+        }
+        return halves;
+    }();
+
+    auto* out = reinterpret_cast<uint16_t*>(dst);
+    for (int y = 0; y < height; ++y) {
+        auto* in = reinterpret_cast<const uint16_t*>(src + (ptrdiff_t)y * srcStride);
+        for (int x = 0; x < width; ++x) {
+            out[x] = kHalves[(in[x] >> shift) & 1023];
+        }
+        out += width;
+    }
 }
 
-static FfmpegMediaStream::FrameInfo AVFrame2Image(AVFrame* frame, AVFrame* tmpFrame)
+static void FillYuv420P10(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool)
 {
-    // TODO: other format
+    auto width      = frame->width;
+    auto height     = frame->height;
+    auto halfWidth  = frame->width / 2;
+    auto halfHeight = frame->height / 2;
 
-    FfmpegMediaStream::FrameInfo frameInfo {};
+    frameInfo.images[0] = pool.acquire(width, height, Image::FORMAT_RH);
+    frameInfo.images[1] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_RH);
+    frameInfo.images[2] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_RH);
 
-    // TODO: handle odd frame size?
-    assert(frame->width % 2 == 0);
-    assert(frame->height % 2 == 0);
+    copy_samples_to_half(width, height, frameInfo.images[0]->ptrw(), frame->data[0], frame->linesize[0], 0);
+    copy_samples_to_half(halfWidth, halfHeight, frameInfo.images[1]->ptrw(), frame->data[1], frame->linesize[1], 0);
+    copy_samples_to_half(halfWidth, halfHeight, frameInfo.images[2]->ptrw(), frame->data[2], frame->linesize[2], 0);
+}
 
-    {
-        // TODO: convert with gpu or render these formats directly using material and shader
-        if (frame->format == AV_PIX_FMT_YUV420P) {
-            frameInfo.format = FfmpegMediaStream::kPixelFormatYuv420P;
-            FillYuv420P(frameInfo, frame);
-        } else if (frame->format == AV_PIX_FMT_NV12) {
-            frameInfo.format = FfmpegMediaStream::kPixelFormatNv12;
-            FillNv12(frameInfo, frame);
-        } else if (frame->format == AV_PIX_FMT_DXVA2_VLD || frame->format == AV_PIX_FMT_VIDEOTOOLBOX || frame->format == AV_PIX_FMT_D3D11) {
-            AVFrame myFrame {};
-            auto width      = frame->width;
-            auto height     = frame->height;
-            auto halfWidth  = frame->width / 2;
-            auto halfHeight = frame->height / 2;
-            auto ySize      = width * height;
-            auto uvSize     = halfWidth * halfHeight * 2;
+static void FillP010(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool)
+{
+    auto width      = frame->width;
+    auto height     = frame->height;
+    auto halfWidth  = frame->width / 2;
+    auto halfHeight = frame->height / 2;
 
-            Vector<uint8_t> yBuffer, uvBuffer;
-            yBuffer.resize(ySize);
-            uvBuffer.resize(uvSize);
-            auto* yw  = yBuffer.ptrw();
-            auto* uvw = uvBuffer.ptrw();
+    frameInfo.images[0] = pool.acquire(width, height, Image::FORMAT_RH);
+    frameInfo.images[1] = pool.acquire(halfWidth, halfHeight, Image::FORMAT_RGH);
 
-            myFrame.format  = AV_PIX_FMT_NV12;
-            myFrame.data[0] = yw;
-            myFrame.data[1] = uvw;
-            myFrame.buf[0]  = av_buffer_create(
-                 yw, ySize, [](void*, uint8_t*) {}, nullptr, 0);
-            myFrame.buf[1] = av_buffer_create(
-                uvw, uvSize, [](void*, uint8_t*) {}, nullptr, 0);
-            myFrame.linesize[0] = width;
-            myFrame.linesize[1] = halfWidth * 2;
-            auto ret            = av_hwframe_transfer_data(&myFrame, frame, 0);
-            if (ret < 0) {
-                ERR_PRINT("Failed to transfer hw frame");
-                return frameInfo;
-            }
+    copy_samples_to_half(width, height, frameInfo.images[0]->ptrw(), frame->data[0], frame->linesize[0], 6);
+    copy_samples_to_half(halfWidth * 2, halfHeight, frameInfo.images[1]->ptrw(), frame->data[1], frame->linesize[1], 6);
+}
 
-            frameInfo.format    = FfmpegMediaStream::kPixelFormatNv12;
-            frameInfo.images[0] = Ref<Image> { memnew(Image(width, height, false, Image::FORMAT_R8, yBuffer)) };
-            frameInfo.images[1] = Ref<Image> { memnew(Image(halfWidth, halfHeight, false, Image::FORMAT_RG8, uvBuffer)) };
+// All planes in one R8 image of width x (height * 3 / 2): Y on top, then U and V side by side,
+// so a frame is a single upload and a single texture binding
+static void FillPackedI420(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool)
+{
+    auto width      = frame->width;
+    auto height     = frame->height;
+    auto halfWidth  = frame->width / 2;
+    auto halfHeight = frame->height / 2;
 
-            //       FillNv12(frameInfo, tmpFrame);
-        } else {
-            ERR_PRINT("Unsupported frame format");
-            abort(); // TODO:
+    frameInfo.format    = FfmpegMediaStream::kPixelFormatPackedI420;
+    frameInfo.images[0] = pool.acquire(width, height + halfHeight, Image::FORMAT_R8);
+
+    auto* dst = frameInfo.images[0]->ptrw();
+    copy_video_frame<1>(width, height, dst, frame->data[0], frame->linesize[0]);
+    auto* chroma = dst + (ptrdiff_t)width * height;
+    if (frame->format == AV_PIX_FMT_YUV420P) {
+        for (int y = 0; y < halfHeight; ++y) {
+            auto* row = chroma + (ptrdiff_t)y * width;
+            memcpy(row, frame->data[1] + (ptrdiff_t)y * frame->linesize[1], halfWidth);
+            memcpy(row + halfWidth, frame->data[2] + (ptrdiff_t)y * frame->linesize[2], halfWidth);
+        }
+    } else {
+        // NV12, deinterleave
+        for (int y = 0; y < halfHeight; ++y) {
+            auto* u  = chroma + (ptrdiff_t)y * width;
+            auto* v  = u + halfWidth;
+            auto* uv = frame->data[1] + (ptrdiff_t)y * frame->linesize[1];
+            for (int x = 0; x < halfWidth; ++x) {
+                u[x] = uv[2 * x];
+                v[x] = uv[2 * x + 1];
+            }
+        }
+    }
+}
+
+// The formats and sizes the Fill functions above copy without any conversion
+static bool is_uploaded_as_is(const AVFrame* frame)
+{
+    if (frame->width % 2 != 0 || frame->height % 2 != 0) {
+        return false;
+    }
+    return frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_NV12
+        || frame->format == AV_PIX_FMT_YUV420P10LE || frame->format == AV_PIX_FMT_P010LE;
+}
+
+static bool is_high_bit_depth(const AVFrame* frame)
+{
+    auto* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    return desc != nullptr && desc->comp[0].depth > 8;
+}
+
+// Any other software frame is converted by libswscale into yuv420p planes, or yuv420p10 planes when it has
+// more than 8 bits per sample. An odd width or height loses its last column or row.
+static bool FillConverted(FfmpegMediaStream::FrameInfo& frameInfo, AVFrame* frame, FramePool& pool, SwsConverter& converter)
+{
+    auto width        = frame->width & ~1;
+    auto height       = frame->height & ~1;
+    auto halfWidth    = width / 2;
+    auto halfHeight   = height / 2;
+    auto highBitDepth = is_high_bit_depth(frame);
+    auto sampleSize   = highBitDepth ? 2 : 1;
+    auto imageFormat  = highBitDepth ? Image::FORMAT_RH : Image::FORMAT_R8;
+    if (width == 0 || height == 0) {
+        ERR_PRINT("Frame too small");
+        return false;
+    }
+
+    frameInfo.images[0] = pool.acquire(width, height, imageFormat);
+    frameInfo.images[1] = pool.acquire(halfWidth, halfHeight, imageFormat);
+    frameInfo.images[2] = pool.acquire(halfWidth, halfHeight, imageFormat);
+
+    uint8_t* dst[4]    = { frameInfo.images[0]->ptrw(), frameInfo.images[1]->ptrw(), frameInfo.images[2]->ptrw(), nullptr };
+    int dstLinesize[4] = { width * sampleSize, halfWidth * sampleSize, halfWidth * sampleSize, 0 };
+    if (!converter.convert(frame, width, height, highBitDepth ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P, dst, dstLinesize)) {
+        ERR_PRINT(String("Unsupported pixel format {0}").format(varray(av_get_pix_fmt_name((AVPixelFormat)frame->format))));
+        for (auto& image : frameInfo.images) {
+            pool.release(image);
+        }
+        return false;
+    }
+    if (highBitDepth) {
+        // in place, the samples take as many bytes as their halves
+        copy_samples_to_half(width, height, dst[0], dst[0], dstLinesize[0], 0);
+        copy_samples_to_half(halfWidth, halfHeight, dst[1], dst[1], dstLinesize[1], 0);
+        copy_samples_to_half(halfWidth, halfHeight, dst[2], dst[2], dstLinesize[2], 0);
+    }
+    frameInfo.format = highBitDepth ? FfmpegMediaStream::kPixelFormatYuv420P10 : FfmpegMediaStream::kPixelFormatYuv420P;
+    return true;
+}
+
+// hw surfaces are downloaded as P010 when they hold 10 bits samples, as NV12 otherwise
+static AVPixelFormat get_hw_download_format(const AVFrame* frame)
+{
+    if (frame->hw_frames_ctx != nullptr) {
+        auto* framesContext = reinterpret_cast<const AVHWFramesContext*>(frame->hw_frames_ctx->data);
+        if (framesContext->sw_format == AV_PIX_FMT_P010LE) {
+            return AV_PIX_FMT_P010LE;
+        }
+    }
+    return AV_PIX_FMT_NV12;
+}
+
+static FfmpegMediaStream::FrameInfo AVFrame2Image(AVFrame* frame, AVFrame* tmpFrame, FramePool& pool, SwsConverter& converter, bool packedPlanes)
+{
+    FfmpegMediaStream::FrameInfo frameInfo {};
+
+    {
+        // TODO: convert with gpu or render these formats directly using material and shader
+        bool isHwFrame = frame->format == AV_PIX_FMT_DXVA2_VLD || frame->format == AV_PIX_FMT_VIDEOTOOLBOX || frame->format == AV_PIX_FMT_D3D11;
+        if (isHwFrame && (frame->width % 2 != 0 || frame->height % 2 != 0)) {
+            tmpFrame->format = get_hw_download_format(frame);
+            if (av_hwframe_transfer_data(tmpFrame, frame, 0) < 0) {
+                ERR_PRINT("Failed to transfer hw frame");
+                av_frame_unref(tmpFrame);
+                return frameInfo;
+            }
+            FillConverted(frameInfo, tmpFrame, pool, converter);
+            av_frame_unref(tmpFrame);
+        } else if (!isHwFrame && !is_uploaded_as_is(frame)) {
+            FillConverted(frameInfo, frame, pool, converter);
+        } else if (packedPlanes && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_NV12)) {
+            FillPackedI420(frameInfo, frame, pool);
+        } else if (packedPlanes && isHwFrame && get_hw_download_format(frame) == AV_PIX_FMT_NV12) {
+            tmpFrame->format = AV_PIX_FMT_NV12;
+            if (av_hwframe_transfer_data(tmpFrame, frame, 0) < 0) {
+                ERR_PRINT("Failed to transfer hw frame");
+                av_frame_unref(tmpFrame);
+                return frameInfo;
+            }
+            FillPackedI420(frameInfo, tmpFrame, pool);
+            av_frame_unref(tmpFrame);
+        } else if (frame->format == AV_PIX_FMT_YUV420P) {
+            frameInfo.format = FfmpegMediaStream::kPixelFormatYuv420P;
+            FillYuv420P(frameInfo, frame, pool);
+        } else if (frame->format == AV_PIX_FMT_NV12) {
+            frameInfo.format = FfmpegMediaStream::kPixelFormatNv12;
+            FillNv12(frameInfo, frame, pool);
+        } else if (frame->format == AV_PIX_FMT_YUV420P10LE) {
+            frameInfo.format = FfmpegMediaStream::kPixelFormatYuv420P10;
+            FillYuv420P10(frameInfo, frame, pool);
+        } else if (frame->format == AV_PIX_FMT_P010LE) {
+            frameInfo.format = FfmpegMediaStream::kPixelFormatP010;
+            FillP010(frameInfo, frame, pool);
+        } else if (isHwFrame) {
+            // Transfer straight into the pooled images, 10 bits surfaces stay 10 bits
+            AVFrame myFrame {};
+            auto format     = get_hw_download_format(frame);
+            auto sampleSize = format == AV_PIX_FMT_P010LE ? 2 : 1;
+            auto width      = frame->width;
+            auto height     = frame->height;
+            auto halfWidth  = frame->width / 2;
+            auto halfHeight = frame->height / 2;
+            auto ySize      = width * height * sampleSize;
+            auto uvSize     = halfWidth * halfHeight * 2 * sampleSize;
+
+            Ref<Image> yImage  = pool.acquire(width, height, sampleSize == 2 ? Image::FORMAT_RH : Image::FORMAT_R8);
+            Ref<Image> uvImage = pool.acquire(halfWidth, halfHeight, sampleSize == 2 ? Image::FORMAT_RGH : Image::FORMAT_RG8);
+            auto* yw           = yImage->ptrw();
+            auto* uvw          = uvImage->ptrw();
+
+            myFrame.format  = format;
+            myFrame.data[0] = yw;
+            myFrame.data[1] = uvw;
+            myFrame.buf[0]  = av_buffer_create(
+                 yw, ySize, [](void*, uint8_t*) {}, nullptr, 0);
+            myFrame.buf[1] = av_buffer_create(
+                uvw, uvSize, [](void*, uint8_t*) {}, nullptr, 0);
+            myFrame.linesize[0] = width * sampleSize;
+            myFrame.linesize[1] = halfWidth * 2 * sampleSize;
+            auto ret            = av_hwframe_transfer_data(&myFrame, frame, 0);
+            av_buffer_unref(&myFrame.buf[0]);
+            av_buffer_unref(&myFrame.buf[1]);
+            if (ret < 0) {
+                ERR_PRINT("Failed to transfer hw frame");
+                pool.release(yImage);
+                pool.release(uvImage);
+                return frameInfo;
+            }
+            if (sampleSize == 2) {
+                copy_samples_to_half(width, height, yw, yw, myFrame.linesize[0], 6);
+                copy_samples_to_half(halfWidth * 2, halfHeight, uvw, uvw, myFrame.linesize[1], 6);
+            }
+
+            frameInfo.format    = format == AV_PIX_FMT_P010LE ? FfmpegMediaStream::kPixelFormatP010 : FfmpegMediaStream::kPixelFormatNv12;
+            frameInfo.images[0] = yImage;
+            frameInfo.images[1] = uvImage;
         }
     }
 
     return frameInfo;
 }
 
+// Keep a reference of the decoded frame instead of copying its planes on the decode thread. The planes are still
+// copied twice: into pooled images by the upload thread, then into the textures by the rendering server.
+// The other software formats are held as well, the upload thread converts them.
+// Holding frames cannot starve the decoder: the default get_buffer2() allocates from an AVBufferPool that grows past
+// the frames held, and hw surfaces, taken from a fixed size pool, are downloaded here and never held.
+static FfmpegMediaStream::FrameInfo HoldAVFrame(AVFrame* frame, bool rgba)
+{
+    FfmpegMediaStream::FrameInfo frameInfo {};
+
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> heldFrame { av_frame_alloc() };
+    bool isHwFrame = frame->format == AV_PIX_FMT_DXVA2_VLD || frame->format == AV_PIX_FMT_VIDEOTOOLBOX || frame->format == AV_PIX_FMT_D3D11;
+    if (!isHwFrame && !sws_isSupportedInput((AVPixelFormat)frame->format)) {
+        ERR_PRINT(String("Unsupported pixel format {0}").format(varray(av_get_pix_fmt_name((AVPixelFormat)frame->format))));
+        return frameInfo;
+    }
+    if (!isHwFrame) {
+        if (av_frame_ref(heldFrame.get(), frame) < 0) {
+            ERR_PRINT("Failed to reference decoded frame");
+            return frameInfo;
+        }
+    } else {
+        // hw surfaces are a scarce resource, download them now and hold the system memory copy
+        heldFrame->format = get_hw_download_format(frame);
+        if (av_hwframe_transfer_data(heldFrame.get(), frame, 0) < 0) {
+            ERR_PRINT("Failed to transfer hw frame");
+            return frameInfo;
+        }
+    }
+
+    if (rgba) {
+        frameInfo.format = FfmpegMediaStream::kPixelFormatRgba8;
+    } else if (!is_uploaded_as_is(heldFrame.get())) {
+        frameInfo.format = is_high_bit_depth(heldFrame.get()) ? FfmpegMediaStream::kPixelFormatYuv420P10 : FfmpegMediaStream::kPixelFormatYuv420P;
+    } else {
+        switch (heldFrame->format) {
+        case AV_PIX_FMT_YUV420P:     frameInfo.format = FfmpegMediaStream::kPixelFormatYuv420P; break;
+        case AV_PIX_FMT_YUV420P10LE: frameInfo.format = FfmpegMediaStream::kPixelFormatYuv420P10; break;
+        case AV_PIX_FMT_P010LE:      frameInfo.format = FfmpegMediaStream::kPixelFormatP010; break;
+        default:                     frameInfo.format = FfmpegMediaStream::kPixelFormatNv12; break;
+        }
+    }
+    frameInfo.frame = std::move(heldFrame);
+    return frameInfo;
+}
+
+// Describes the planes of frames yuv_to_rgba8() can convert, returns false for other formats
+static bool describe_yuv_frame(const AVFrame* frame, YuvImage& image)
+{
+    bool fullRange = frame->color_range == AVCOL_RANGE_JPEG;
+    switch (frame->format) {
+    case AV_PIX_FMT_YUVJ420P:
+        fullRange = true;
+        [[fallthrough]];
+    case AV_PIX_FMT_YUV420P:
+        image.layout = kYuvLayout420P;
+        break;
+    case AV_PIX_FMT_YUVJ422P:
+        fullRange = true;
+        [[fallthrough]];
+    case AV_PIX_FMT_YUV422P:
+        image.layout = kYuvLayout422P;
+        break;
+    case AV_PIX_FMT_YUVJ444P:
+        fullRange = true;
+        [[fallthrough]];
+    case AV_PIX_FMT_YUV444P:
+        image.layout = kYuvLayout444P;
+        break;
+    case AV_PIX_FMT_NV12:
+        image.layout = kYuvLayoutNv12;
+        break;
+    default:
+        return false;
+    }
+
+    switch (frame->colorspace) {
+    case AVCOL_SPC_BT709:
+        image.matrix = kYuvMatrixBt709;
+        break;
+    case AVCOL_SPC_UNSPECIFIED:
+        // Untagged files, HD is almost always BT.709 and SD BT.601
+        image.matrix = frame->height > 576 ? kYuvMatrixBt709 : kYuvMatrixBt601;
+        break;
+    default:
+        image.matrix = kYuvMatrixBt601;
+        break;
+    }
+
+    image.fullRange = fullRange;
+    image.width     = frame->width;
+    image.height    = frame->height;
+    for (int i = 0; i < 3; ++i) {
+        image.planes[i]  = frame->data[i];
+        image.strides[i] = frame->linesize[i];
+    }
+    return true;
+}
+
+double FfmpegMediaStream::get_master_clock(double delta)
+{
+    if (externalClock_) {
+        audioClockMaster_ = false;
+        systemClockBase_ += delta * speedScale_;
+        return systemClockBase_;
+    }
+    auto nowUsec = OS::get_singleton()->get_ticks_usec();
+
+    // The audio clock is the position of the samples handed to the mixer, it is only trusted while
+    // the mixer keeps consuming, otherwise (paused, audio ended, underrun) the system clock takes over
+    auto audioClock = audioClock_.load();
+    if (audioCodecContext_ != nullptr && speedScale_ == 1.0 && audioClock.serial == serial_) {
+        auto sinceMix = ((double)nowUsec - (double)audioClock.usec) / 1000000.0;
+        if (sinceMix >= 0 && sinceMix < kMaxAudioClockExtrapolation_) {
+            auto clock = audioClock.pts + sinceMix - AudioServer::get_singleton()->get_output_latency();
+
+            // keep the system clock in step, so that falling back to it does not jump
+            systemClockBase_  = clock;
+            systemClockUsec_  = nowUsec;
+            audioClockMaster_ = true;
+            return clock;
+        }
+    }
+
+    audioClockMaster_ = false;
+    return systemClockBase_ + (double)(nowUsec - systemClockUsec_) / 1000000.0 * speedScale_;
+}
+
+bool FfmpegMediaStream::update(double delta)
+{
+    if (state_ == State::kStatePaused && tiledUpload_) {
+        return present_uploaded_frame(); // tiles coming into view
+    }
+    if (state_ != State::kStatePlaying) {
+        return false;
+    }
+    auto clock = get_master_clock(delta);
+
+    // Take the newest frame that is due, older due frames are late and skipped
+    FrameInfo frameInfo {};
+    bool gotFrame = latestFrameWins_ && take_latest_frame(frameInfo, true);
+    if (gotFrame && frameInfo.serial != serial_) {
+        release_frame(frameInfo); // decoded before a seek
+        frameInfo = FrameInfo {};
+        gotFrame  = false;
+    }
+    while (auto* front = decodedFrames_.front()) {
+        if (front->serial != serial_) {
+            // decoded before a seek
+            release_frame(*front);
+            decodedFrames_.popFront();
+            notify_after_lock(frameSpaceMutex_, frameSpaceCv_);
+            continue;
+        }
+        auto frameTime = front->frameTime;
+        bool isEnd     = frameTime < 0;
+        if (!isEnd && front->serial == pendingSeekSerial_ && pendingSeekKeyframeOnly_) {
+            // A keyframe only seek lands before the target, restart the clock at the landed position
+            clock            = frameTime;
+            systemClockBase_ = frameTime;
+            systemClockUsec_ = OS::get_singleton()->get_ticks_usec();
+            pendingSeekKeyframeOnly_ = false;
+        }
+        if (isEnd && gotFrame) {
+            break; // present the last frame first
+        }
+        if (!latestFrameWins_ && !isEnd && frameTime > clock) {
+            break;
+        }
+        if (gotFrame) {
+            release_frame(frameInfo); // superseded by a newer due frame
+            stats_.droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+        frameInfo = std::move(*front);
+        decodedFrames_.popFront();
+        notify_after_lock(frameSpaceMutex_, frameSpaceCv_);
+        gotFrame = true;
+        if (isEnd) {
+            break;
+        }
+    }
+    if (gotFrame && frameInfo.frameTime >= 0) {
+        lastFrameTime_ = frameInfo.frameTime;
+        avOffset_      = frameInfo.frameTime - clock;
+        stats_.presentedFrames.fetch_add(1, std::memory_order_relaxed);
+        if (avOffset_ < -kLateFrameThreshold_) {
+            stats_.lateFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (frameInfo.serial == pendingSeekSerial_) {
+            pendingSeekSerial_ = -1;
+            stats_.seek.record(OS::get_singleton()->get_ticks_usec() - seekBeginUsec_);
+            emit_signal(kSeekCompletedSignalName, frameInfo.frameTime);
+        }
+    } else if (pendingSeekSerial_ == serial_ && videoCodecContext_ == nullptr && audioClock_.load().serial == serial_) {
+        pendingSeekSerial_ = -1;
+        stats_.seek.record(OS::get_singleton()->get_ticks_usec() - seekBeginUsec_);
+        emit_signal(kSeekCompletedSignalName, clock);
+    }
+
+    if (frameInfo.format != PixelFormat::kPixelFormatNone) {
+        if (nextUpload_.format != PixelFormat::kPixelFormatNone) {
+            // the upload thread is still busy with an older frame
+            release_frame(nextUpload_);
+            stats_.droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+        nextUpload_ = std::move(frameInfo);
+    } else if (frameInfo.frameTime < 0) {
+        endOfStream_ = true;
+    }
+    if (nextUpload_.format != PixelFormat::kPixelFormatNone && uploadFrames_.tryPush(std::move(nextUpload_))) {
+        nextUpload_ = FrameInfo {}; // Ref has no move, drop the references without releasing the images
+        uploadsPending_.fetch_add(1, std::memory_order_relaxed);
+        notify_after_lock(uploadMutex_, uploadCv_);
+    }
+
+    auto presented = present_uploaded_frame();
+    if (endOfStream_ && !presented && nextUpload_.format == PixelFormat::kPixelFormatNone && uploadsPending_.load(std::memory_order_acquire) == 0
+        && !(middleTextureSet_.load(std::memory_order_acquire) & kTextureSetNewBit_)) {
+        stop(); // the last frame has been presented
+    }
+    return presented;
+}
+
+bool FfmpegMediaStream::present_uploaded_frame()
+{
+    if (!(middleTextureSet_.load(std::memory_order_acquire) & kTextureSetNewBit_)) {
+        return false;
+    }
+    frontTextureSet_ = middleTextureSet_.exchange(frontTextureSet_, std::memory_order_acq_rel) & ~kTextureSetNewBit_;
+    auto& set        = textureSets_[frontTextureSet_];
+    if (set.serial != serial_) {
+        return false; // uploaded from a frame decoded before a seek, the upload thread drops it
+    }
+
+    auto presentBegin = OS::get_singleton()->get_ticks_usec();
+    auto textureCount = get_textures_count_by_pixel_format(set.format);
+
+    bool formatChanged = set.format != currentPixelFormat_;
+    bool tiled         = set.format == PixelFormat::kPixelFormatYuv420PTiles || set.format == PixelFormat::kPixelFormatNv12Tiles;
+    if (formatChanged) {
+        currentPixelFormat_ = set.format;
+        textures_.clear();
+        tiledTextures_.clear();
+        if (tiled) {
+            tiledTextures_.resize((int)textureCount);
+            for (auto& t : tiledTextures_) {
+                t = Ref<FfmpegTiledVideoTexture>(memnew(FfmpegTiledVideoTexture));
+            }
+        } else {
+            textures_.resize((int)textureCount);
+            for (auto& t : textures_) {
+                t = Ref<FfmpegVideoTexture>(memnew(FfmpegVideoTexture));
+            }
+        }
+    }
+    if (tiled) {
+        auto* tw = tiledTextures_.ptrw();
+        for (uint32_t i = 0; i < textureCount; ++i) {
+            tw[i]->set_base(set.planes[i], set.widths[i], set.heights[i], set.columns, set.rows, set.formats[i]);
+        }
+        tileGrid_ = Vector2i(set.columns, set.rows);
+    } else {
+        auto* tw = textures_.ptrw();
+        for (uint32_t i = 0; i < textureCount; ++i) {
+            tw[i]->set_base(set.planes[i], set.widths[i], set.heights[i]);
+        }
+    }
+    for (auto& rid : set.retired) {
+        RenderingServer::get_singleton()->free(rid); // nothing points to them anymore
+    }
+    set.retired.clear();
+    stats_.present.record(OS::get_singleton()->get_ticks_usec() - presentBegin);
+
+    if (formatChanged) {
+        emit_signal(kPixelFormatChangedSignalName, set.format);
+    }
+    return true;
+}
+
+void FfmpegMediaStream::upload_thread_routine()
+{
+    while (state_ != State::kStateStopped) {
+        FrameInfo frameInfo {};
+        if (!uploadFrames_.tryPop(frameInfo)) {
+            if (lastUpload_.format != PixelFormat::kPixelFormatNone && visibleSerial_ != viewSerial_.load(std::memory_order_acquire)) {
+                upload_tiles(lastUpload_, lastUploadId_); // the view moved, fill in the tiles coming into view
+                continue;
+            }
+            std::unique_lock<std::mutex> lck(uploadMutex_);
+            uploadCv_.wait(lck, [this]() {
+                return !uploadFrames_.isEmpty() || state_ == State::kStateStopped
+                    || (lastUpload_.format != PixelFormat::kPixelFormatNone && visibleSerial_ != viewSerial_.load(std::memory_order_acquire));
+            });
+            continue;
+        }
+        if (frameInfo.serial != serial_) {
+            release_frame(frameInfo); // decoded before a seek
+        } else {
+            upload_frame(frameInfo);
+        }
+        uploadsPending_.fetch_sub(1, std::memory_order_release);
+    }
+    release_frame(lastUpload_);
+    lastUpload_ = FrameInfo {};
+}
+
+void FfmpegMediaStream::upload_frame(FrameInfo& frameInfo)
+{
+    if (frameInfo.frame != nullptr) {
+        auto convertBegin = OS::get_singleton()->get_ticks_usec();
+        if (rgbaOutput_) {
+            fill_rgba8(frameInfo);
+        } else if (!is_uploaded_as_is(frameInfo.frame.get())) {
+            if (!FillConverted(frameInfo, frameInfo.frame.get(), framePool_, swsConverter_)) {
+                release_frame(frameInfo);
+                return;
+            }
+        } else if (packedPlanes_ && (frameInfo.format == PixelFormat::kPixelFormatYuv420P || frameInfo.format == PixelFormat::kPixelFormatNv12)) {
+            FillPackedI420(frameInfo, frameInfo.frame.get(), framePool_);
+        } else if (frameInfo.format == PixelFormat::kPixelFormatYuv420P) {
+            FillYuv420P(frameInfo, frameInfo.frame.get(), framePool_);
+        } else if (frameInfo.format == PixelFormat::kPixelFormatYuv420P10) {
+            FillYuv420P10(frameInfo, frameInfo.frame.get(), framePool_);
+        } else if (frameInfo.format == PixelFormat::kPixelFormatP010) {
+            FillP010(frameInfo, frameInfo.frame.get(), framePool_);
+        } else {
+            FillNv12(frameInfo, frameInfo.frame.get(), framePool_);
+        }
+        frameInfo.frame.reset(); // give the buffers back to the decoder
+        stats_.convert.record(OS::get_singleton()->get_ticks_usec() - convertBegin);
+    }
+
+    if (tiledUpload_ && (frameInfo.format == PixelFormat::kPixelFormatYuv420P || frameInfo.format == PixelFormat::kPixelFormatNv12)) {
+        // The planes never reach the rendering server, they are kept to fill in tiles later
+        upload_tiles(frameInfo, ++lastUploadId_);
+        release_frame(lastUpload_);
+        lastUpload_ = std::move(frameInfo);
+        return;
+    }
+
+    // The back set is neither shown nor waiting to be shown, it can be written freely. The images are pushed
+    // as they are into the textures of the set.
+    auto& set         = textureSets_[backTextureSet_];
+    auto textureCount = get_textures_count_by_pixel_format(frameInfo.format);
+    if (set.columns != 0) {
+        set.recreate = true; // tile arrays
+        set.columns  = 0;
+        set.rows     = 0;
+    }
+    for (uint32_t i = 0; i < kMaxPlanes_; ++i) {
+        auto& image = frameInfo.images[i];
+        if (i >= textureCount) {
+            set.recreate   = set.recreate || set.widths[i] != 0;
+            set.widths[i]  = 0;
+            set.heights[i] = 0;
+            continue;
+        }
+        if (set.widths[i] != image->get_width() || set.heights[i] != image->get_height() || set.formats[i] != image->get_format()) {
+            set.recreate   = true;
+            set.widths[i]  = image->get_width();
+            set.heights[i] = image->get_height();
+            set.formats[i] = image->get_format();
+        }
+        set.images[i] = image;
+        image.unref();
+    }
+    set.format = frameInfo.format;
+    set.serial = frameInfo.serial;
+    release_frame(frameInfo); // planes beyond the texture count
+    apply_texture_set(backTextureSet_);
+
+    backTextureSet_ = middleTextureSet_.exchange(backTextureSet_ | kTextureSetNewBit_, std::memory_order_acq_rel) & ~kTextureSetNewBit_;
+}
+
+void FfmpegMediaStream::fill_rgba8(FrameInfo& frameInfo)
+{
+    auto* frame         = frameInfo.frame.get();
+    auto pitch          = frame->width * 4;
+    frameInfo.format    = kPixelFormatRgba8;
+    frameInfo.images[0] = framePool_.acquire(frame->width, frame->height, Image::FORMAT_RGBA8);
+    auto* dst           = frameInfo.images[0]->ptrw();
+
+    YuvImage yuv;
+    if (describe_yuv_frame(frame, yuv)) {
+        yuv_to_rgba8(yuv, dst, pitch);
+        return;
+    }
+    // Formats without a kernel (10 bits, ...), slower but better than nothing
+    uint8_t* dstData[4] = { dst, nullptr, nullptr, nullptr };
+    int dstLinesize[4]  = { pitch, 0, 0, 0 };
+    if (!swsConverter_.convert(frame, frame->width, frame->height, AV_PIX_FMT_RGBA, dstData, dstLinesize)) {
+        ERR_PRINT(String("Unsupported pixel format {0}").format(varray(av_get_pix_fmt_name((AVPixelFormat)frame->format))));
+    }
+}
+
+void FfmpegMediaStream::set_tile_grid(int columns, int rows)
+{
+    tileColumns_ = CLAMP(columns, 1, kMaxTiles_);
+    tileRows_    = CLAMP(rows, 1, kMaxTiles_ / tileColumns_);
+}
+
+void FfmpegMediaStream::set_view(const Basis& orientation, float fovDegrees, float aspect, float marginDegrees)
+{
+    {
+        std::unique_lock<std::mutex> lck(viewMutex_);
+        view_ = View { orientation, fovDegrees, aspect, marginDegrees };
+    }
+    viewSerial_.fetch_add(1, std::memory_order_release);
+    notify_after_lock(uploadMutex_, uploadCv_);
+}
+
+// The largest count not above requested that splits size evenly
+static int fit_tile_count(int size, int requested)
+{
+    for (int n = MIN(requested, size); n > 1; --n) {
+        if (size % n == 0) {
+            return n;
+        }
+    }
+    return 1;
+}
+
+// Tiles of an equirectangular frame split into columns x rows that the view sees. The view frustum, widened
+// by the margin, is sampled on a grid of directions mapped to the frame like the panorama shaders do.
+static uint64_t compute_visible_tiles(const Basis& orientation, float fovDegrees, float aspect, float marginDegrees, int columns, int rows)
+{
+    static constexpr int kSamples = 32;
+    static const float kMaxHalfAngle = Math::deg_to_rad(89.0f);
+
+    auto right   = orientation.get_column(0).normalized();
+    auto up      = orientation.get_column(1).normalized();
+    auto forward = -orientation.get_column(2).normalized();
+    auto halfY   = Math::deg_to_rad(fovDegrees * 0.5f);
+    auto halfX   = Math::atan(Math::tan(halfY) * aspect);
+    auto tanX    = Math::tan(MIN(halfX + Math::deg_to_rad(marginDegrees), kMaxHalfAngle));
+    auto tanY    = Math::tan(MIN(halfY + Math::deg_to_rad(marginDegrees), kMaxHalfAngle));
+
+    uint64_t tiles = 0;
+    for (int j = 0; j <= kSamples; ++j) {
+        for (int i = 0; i <= kSamples; ++i) {
+            auto dir = (forward + right * (tanX * (2.0f * i / kSamples - 1.0f)) + up * (tanY * (2.0f * j / kSamples - 1.0f))).normalized();
+            auto u   = Math::atan2(dir.z, dir.x) / (float)Math_TAU;
+            auto v   = Math::acos(CLAMP(dir.y, -1.0f, 1.0f)) / (float)Math_PI;
+            if (u < 0.0f) {
+                u += 1.0f;
+            }
+            auto column = MIN((int)(u * columns), columns - 1);
+            auto row    = MIN((int)(v * rows), rows - 1);
+            tiles |= (uint64_t)1 << (row * columns + column);
+        }
+    }
+    // A pole in view sees all the columns of its row
+    auto rowTiles = columns == 64 ? ~(uint64_t)0 : ((uint64_t)1 << columns) - 1;
+    for (int pole = 0; pole < 2; ++pole) {
+        auto dir   = Vector3(0.0f, pole == 0 ? 1.0f : -1.0f, 0.0f);
+        auto depth = dir.dot(forward);
+        if (depth > 0.0f && Math::abs(dir.dot(right)) <= tanX * depth && Math::abs(dir.dot(up)) <= tanY * depth) {
+            tiles |= rowTiles << ((pole == 0 ? 0 : rows - 1) * columns);
+        }
+    }
+    return tiles;
+}
+
+uint64_t FfmpegMediaStream::get_visible_tiles(int columns, int rows)
+{
+    auto serial = viewSerial_.load(std::memory_order_acquire);
+    if (serial == visibleSerial_ && columns == visibleColumns_ && rows == visibleRows_) {
+        return visibleTiles_;
+    }
+    visibleSerial_  = serial;
+    visibleColumns_ = columns;
+    visibleRows_    = rows;
+    if (serial == 0) {
+        visibleTiles_ = columns * rows == 64 ? ~(uint64_t)0 : ((uint64_t)1 << (columns * rows)) - 1;
+        return visibleTiles_;
+    }
+    View view;
+    {
+        std::unique_lock<std::mutex> lck(viewMutex_);
+        view = view_;
+    }
+    visibleTiles_ = compute_visible_tiles(view.orientation, view.fovDegrees, view.aspect, view.marginDegrees, columns, rows);
+    return visibleTiles_;
+}
+
+// Copies the tile (column, row) of a plane with its borders. Panoramas wrap around horizontally,
+// so the borders of the first and last columns are taken from the other side of the plane.
+static void copy_tile(const uint8_t* plane, int planeWidth, int planeHeight, int elementSize,
+    int column, int row, int tileWidth, int tileHeight, uint8_t* dst)
+{
+    constexpr int kBorder = FfmpegTiledVideoTexture::kBorder;
+
+    auto contentWidth  = tileWidth - 2 * kBorder;
+    auto contentHeight = tileHeight - 2 * kBorder;
+    auto x0            = column * contentWidth;
+    auto y0            = row * contentHeight;
+    for (int y = -kBorder; y < contentHeight + kBorder; ++y) {
+        auto* src = plane + (ptrdiff_t)CLAMP(y0 + y, 0, planeHeight - 1) * planeWidth * elementSize;
+        for (int x = -kBorder; x < 0; ++x) {
+            memcpy(dst, src + (ptrdiff_t)((x0 + x + planeWidth) % planeWidth) * elementSize, elementSize);
+            dst += elementSize;
+        }
+        memcpy(dst, src + (ptrdiff_t)x0 * elementSize, (size_t)contentWidth * elementSize);
+        dst += (ptrdiff_t)contentWidth * elementSize;
+        for (int x = 0; x < kBorder; ++x) {
+            memcpy(dst, src + (ptrdiff_t)((x0 + contentWidth + x) % planeWidth) * elementSize, elementSize);
+            dst += elementSize;
+        }
+    }
+}
+
+bool FfmpegMediaStream::upload_tiles(const FrameInfo& frameInfo, uint64_t uploadId)
+{
+    constexpr int kBorder = FfmpegTiledVideoTexture::kBorder;
+
+    auto& set        = textureSets_[backTextureSet_];
+    auto format      = frameInfo.format == PixelFormat::kPixelFormatYuv420P ? PixelFormat::kPixelFormatYuv420PTiles : PixelFormat::kPixelFormatNv12Tiles;
+    auto planeCount  = get_textures_count_by_pixel_format(format);
+    auto& chroma     = frameInfo.images[1];
+    auto columns     = fit_tile_count(chroma->get_width(), tileColumns_);
+    auto rows        = fit_tile_count(chroma->get_height(), tileRows_);
+    auto tileCount   = columns * rows;
+
+    // The texture arrays are created again when the layout changes, their tiles are stale until uploaded
+    bool layoutChanged = set.format != format || set.columns != columns || set.rows != rows;
+    for (uint32_t i = 0; i < planeCount; ++i) {
+        auto& image     = frameInfo.images[i];
+        auto tileWidth  = image->get_width() / columns + 2 * kBorder;
+        auto tileHeight = image->get_height() / rows + 2 * kBorder;
+        layoutChanged   = layoutChanged || set.widths[i] != tileWidth || set.heights[i] != tileHeight || set.formats[i] != image->get_format();
+    }
+    if (layoutChanged) {
+        for (uint32_t i = 0; i < kMaxPlanes_; ++i) {
+            auto& image    = frameInfo.images[i];
+            set.widths[i]  = i < planeCount ? image->get_width() / columns + 2 * kBorder : 0;
+            set.heights[i] = i < planeCount ? image->get_height() / rows + 2 * kBorder : 0;
+            set.formats[i] = i < planeCount ? image->get_format() : Image::Format {};
+        }
+        set.format   = format;
+        set.columns  = columns;
+        set.rows     = rows;
+        set.recreate = true;
+        std::fill(std::begin(set.tileUploads), std::end(set.tileUploads), 0);
+    }
+
+    auto visible  = get_visible_tiles(columns, rows);
+    bool uploaded = false;
+    for (int tile = 0; tile < tileCount; ++tile) {
+        if (((visible >> tile) & 1) == 0 || set.tileUploads[tile] == uploadId) {
+            continue;
+        }
+        for (uint32_t i = 0; i < planeCount; ++i) {
+            auto& image    = frameInfo.images[i];
+            auto tileImage = tilePool_.acquire(set.widths[i], set.heights[i], set.formats[i]);
+            copy_tile(image->ptr(), image->get_width(), image->get_height(), Image::get_format_pixel_size(set.formats[i]),
+                tile % columns, tile / columns, set.widths[i], set.heights[i], tileImage->ptrw());
+            set.tiles.push_back(TileImage { i, tile, tileImage });
+        }
+        set.tileUploads[tile] = uploadId;
+        uploaded              = true;
+    }
+    if (!uploaded && !layoutChanged) {
+        return false;
+    }
+    set.serial = frameInfo.serial;
+    apply_texture_set(backTextureSet_);
+
+    backTextureSet_ = middleTextureSet_.exchange(backTextureSet_ | kTextureSetNewBit_, std::memory_order_acq_rel) & ~kTextureSetNewBit_;
+    return true;
+}
+
+void FfmpegMediaStream::free_texture_sets()
+{
+    auto* rs = RenderingServer::get_singleton();
+    for (auto& set : textureSets_) {
+        for (auto& plane : set.planes) {
+            if (plane.is_valid()) {
+                rs->free(plane);
+                plane = RID();
+            }
+        }
+        for (auto& rid : set.retired) {
+            rs->free(rid);
+        }
+        for (auto& image : set.images) {
+            framePool_.release(image);
+        }
+        for (auto& tile : set.tiles) {
+            tilePool_.release(tile.image);
+        }
+        set = TextureSet {};
+    }
+}
+
+void FfmpegMediaStream::apply_texture_set(int index)
+{
+    auto uploadBegin = OS::get_singleton()->get_ticks_usec();
+    auto* rs         = RenderingServer::get_singleton();
+    auto& set        = textureSets_[index];
+    auto planeCount  = get_textures_count_by_pixel_format(set.format);
+    bool tiled       = set.format == PixelFormat::kPixelFormatYuv420PTiles || set.format == PixelFormat::kPixelFormatNv12Tiles;
+    if (set.recreate) {
+        for (uint32_t i = 0; i < kMaxPlanes_; ++i) {
+            if (set.planes[i].is_valid()) {
+                set.retired.push_back(set.planes[i]); // the textures may still point to it
+                set.planes[i] = RID();
+            }
+            if (i >= planeCount) {
+                continue;
+            }
+            if (!tiled) {
+                set.planes[i] = rs->texture_2d_create(set.images[i]);
+                continue;
+            }
+            // Black until the tiles are uploaded
+            Vector<uint8_t> blank;
+            blank.resize(Image::get_image_data_size(set.widths[i], set.heights[i], set.formats[i], false));
+            memset(blank.ptrw(), i == 0 ? 0 : 128, blank.size());
+            Ref<Image> blankImage { memnew(Image(set.widths[i], set.heights[i], false, set.formats[i], blank)) };
+            Vector<Ref<Image>> layers;
+            layers.resize(set.columns * set.rows);
+            layers.fill(blankImage);
+            set.planes[i] = rs->texture_2d_layered_create(layers, RenderingServer::TEXTURE_LAYERED_2D_ARRAY);
+        }
+        set.recreate = false;
+    } else if (!tiled) {
+        for (uint32_t i = 0; i < planeCount; ++i) {
+            rs->texture_2d_update(set.planes[i], set.images[i], 0);
+        }
+    }
+    for (auto& tile : set.tiles) {
+        rs->texture_2d_update(set.planes[tile.plane], tile.image, tile.tile);
+        tilePool_.release(tile.image); // reused once the rendering server drops it
+    }
+    set.tiles.clear();
+    for (auto& image : set.images) {
+        framePool_.release(image);
+    }
+    stats_.upload.record(OS::get_singleton()->get_ticks_usec() - uploadBegin);
+}
+
+double FfmpegMediaStream::get_length() const
+{
+    if (totalTime_ == 0) {
+        totalTime_ = get_context_duration(avFormatContext_.get());
+    }
+    return totalTime_;
+}
+
+double FfmpegMediaStream::get_position() const
+{
+    return lastFrameTime_;
+}
+
+int64_t FfmpegMediaStream::get_frame_size() const
+{
+    if (videoCodecContext_ == nullptr) {
+        return 0;
+    }
+    // Hw frames are downloaded to Nv12, as large as Yuv420P
+    auto* par   = avFormatContext_->streams[videoStreamIndex_]->codecpar;
+    auto format = par->format == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P : (AVPixelFormat)par->format;
+    auto size   = av_image_get_buffer_size(format, par->width, par->height, 1);
+    return size < 0 ? (int64_t)par->width * par->height * 3 / 2 : (int64_t)size;
+}
+
+int64_t FfmpegMediaStream::get_audio_buffer_size() const
+{
+    return audioCodecContext_ == nullptr ? 0 : (int64_t)(audioRing_.capacity() * sizeof(AudioFrame));
+}
+
+String FfmpegMediaStream::get_decode_error() const
+{
+    auto error = decodeError_.load(std::memory_order_relaxed);
+    if (error == 0) {
+        return String();
+    }
+    char errBuf[AV_ERROR_MAX_STRING_SIZE] {};
+    av_strerror(error, errBuf, sizeof(errBuf));
+    return errBuf;
+}
+
+int64_t FfmpegMediaStream::get_primed_buffer_size() const
+{
+    int64_t size = 0;
+    if (avioContext_ != nullptr && avioContext_->readAhead != nullptr) {
+        size += readAheadSize_;
+    }
+    if (avFormatContext_ != nullptr) {
+        size += avFormatContext_->bit_rate / 8 * kPrimedQueuedUsec_ / 1000000;
+    }
+    if (videoCodecContext_ != nullptr) {
+        auto* codecContext = videoCodecContext_.get();
+        int64_t frames     = codecContext->refs > 0 ? codecContext->refs : kAssumedReferenceFrames_;
+        frames += codecContext->has_b_frames;
+        if (codecContext->active_thread_type & FF_THREAD_FRAME) {
+            frames += codecContext->thread_count; // one frame in flight per thread
+        }
+        size += frames * get_frame_size();
+    }
+    return size;
+}
+
+Dictionary FfmpegMediaStream::get_stats() const
+{
+    Dictionary result;
+    result["decoded_frames"]           = stats_.decodedFrames.load(std::memory_order_relaxed);
+    result["presented_frames"]         = stats_.presentedFrames.load(std::memory_order_relaxed);
+    result["dropped_frames"]           = stats_.droppedFrames.load(std::memory_order_relaxed);
+    result["late_frames"]              = stats_.lateFrames.load(std::memory_order_relaxed);
+    result["demux_ms"]                 = stats_.demux.mean_ms();
+    result["demux_p99_ms"]             = stats_.demux.percentile_ms(0.99);
+    result["decode_ms"]                = stats_.decode.mean_ms();
+    result["decode_p99_ms"]            = stats_.decode.percentile_ms(0.99);
+    result["convert_ms"]               = stats_.convert.mean_ms();
+    result["convert_p99_ms"]           = stats_.convert.percentile_ms(0.99);
+    result["queue_wait_ms"]            = stats_.queueWait.mean_ms();
+    result["queue_wait_p99_ms"]        = stats_.queueWait.percentile_ms(0.99);
+    result["upload_ms"]                = stats_.upload.mean_ms();
+    result["upload_p99_ms"]            = stats_.upload.percentile_ms(0.99);
+    result["present_ms"]               = stats_.present.mean_ms();
+    result["present_p99_ms"]           = stats_.present.percentile_ms(0.99);
+    result["seeks"]                    = stats_.seek.count();
+    result["seek_latency_ms"]          = stats_.seek.mean_ms();
+    result["seek_latency_p99_ms"]      = stats_.seek.percentile_ms(0.99);
+    result["frame_queue_depth"]        = (uint64_t)decodedFrames_.size();
+    result["video_packet_queue_depth"] = (uint64_t)videoPackets_.approximateSize();
+    result["audio_packet_queue_depth"] = (uint64_t)audioPackets_.approximateSize();
+    result["audio_ring_fill"]          = audioRing_.capacity() == 0 ? 0.0 : (double)audioRing_.read_available() / (double)audioRing_.capacity();
+    result["audio_underruns"]          = stats_.audioUnderruns.load(std::memory_order_relaxed);
+    result["bytes_read"]               = avioContext_ == nullptr ? (uint64_t)0 : avioContext_->bytesRead.load(std::memory_order_relaxed);
+    result["hw_decoder"]               = hwDecoderName_;
+    result["io_backend"]               = avioContext_ == nullptr ? "ffmpeg" : avioContext_->get_backend_name();
+    result["open_ms"]                  = openUsec_ / 1000.0;
+    result["probe_cache_hit"]          = probeCacheHit_;
+    result["decoder_reused"]           = decoderReused_;
+
+    auto devices                  = HwDeviceCache::get_singleton().get_stats();
+    auto decoders                 = CodecContextPool::get_singleton().get_stats();
+    result["hw_devices"]          = devices.devices;
+    result["hw_devices_created"]  = devices.created;
+    result["hw_devices_reused"]   = devices.reused;
+    result["decoder_pool_idle"]   = decoders.idle;
+    result["decoder_pool_opened"] = decoders.opened;
+    result["decoder_pool_reused"] = decoders.reused;
+
+    ReadAheadBuffer::Stats readAhead {};
+    const ReadAheadBuffer* readAheadBuffer = avioContext_ == nullptr ? nullptr : avioContext_->readAhead.get();
+    if (readAheadBuffer != nullptr) {
+        readAhead = readAheadBuffer->get_stats();
+    }
+    result["read_ahead_buffered_bytes"] = readAhead.bufferedBytes;
+    result["read_ahead_fetched_bytes"]  = readAhead.fetchedBytes;
+    result["read_ahead_mb_per_s"]       = readAhead.fetchMbPerSecond;
+    result["read_ahead_window_seeks"]   = readAhead.windowSeeks;
+    result["read_ahead_refill_seeks"]   = readAhead.refillSeeks;
+
+    HttpRangeSource::Stats http {};
+    if (avioContext_ != nullptr && avioContext_->http != nullptr) {
+        http = avioContext_->http->get_stats();
+    }
+    auto httpChunks                 = http.cacheHits + http.cacheMisses;
+    result["http_downloaded_bytes"] = http.downloadedBytes;
+    result["http_mb_per_s"]         = http.downloadMbPerSecond;
+    result["http_cache_hit_rate"]   = httpChunks == 0 ? 0.0 : (double)http.cacheHits / (double)httpChunks;
+    result["http_cache_size"]       = HttpChunkCache::get_singleton().get_size();
+
+    const DurationStats* stalls = avioContext_ == nullptr ? nullptr : avioContext_->get_stalls();
+    result["io_stalls"]         = stalls == nullptr ? (uint64_t)0 : stalls->count();
+    result["io_stall_ms"]       = stalls == nullptr ? 0.0 : stalls->mean_ms();
+    result["io_stall_p99_ms"]   = stalls == nullptr ? 0.0 : stalls->percentile_ms(0.99);
+    return result;
+}
+
+void FfmpegMediaStream::reset_stats()
+{
+    stats_.decodedFrames.store(0, std::memory_order_relaxed);
+    stats_.presentedFrames.store(0, std::memory_order_relaxed);
+    stats_.droppedFrames.store(0, std::memory_order_relaxed);
+    stats_.lateFrames.store(0, std::memory_order_relaxed);
+    stats_.audioUnderruns.store(0, std::memory_order_relaxed);
+    stats_.demux.reset();
+    stats_.decode.reset();
+    stats_.convert.reset();
+    stats_.queueWait.reset();
+    stats_.upload.reset();
+    stats_.present.reset();
+    stats_.seek.reset();
+    if (avioContext_ != nullptr && avioContext_->readAhead != nullptr) {
+        avioContext_->readAhead->reset_stats();
+    }
+    if (avioContext_ != nullptr && avioContext_->http != nullptr) {
+        avioContext_->http->reset_stats();
+    }
+}
+
+static const char* const kMonitoredStats[] = {
+    "decoded_frames",
+    "presented_frames",
+    "dropped_frames",
+    "late_frames",
+    "demux_ms",
+    "demux_p99_ms",
+    "decode_ms",
+    "decode_p99_ms",
+    "convert_ms",
+    "convert_p99_ms",
+    "queue_wait_ms",
+    "upload_ms",
+    "upload_p99_ms",
+    "present_ms",
+    "seek_latency_ms",
+    "frame_queue_depth",
+    "video_packet_queue_depth",
+    "audio_packet_queue_depth",
+    "audio_ring_fill",
+    "audio_underruns",
+    "bytes_read",
+    "read_ahead_buffered_bytes",
+    "read_ahead_mb_per_s",
+    "http_mb_per_s",
+    "http_cache_hit_rate",
+    "io_stalls",
+    "io_stall_ms",
+};
+
+ObjectID FfmpegMediaStream::monitoredStream_ {};
+Dictionary* FfmpegMediaStream::monitorSnapshot_ { nullptr };
+uint64_t FfmpegMediaStream::monitorSnapshotFrame_ { 0 };
+
+Variant FfmpegMediaStream::get_monitor_value(const String& name)
+{
+    auto* stream = Object::cast_to<FfmpegMediaStream>(ObjectDB::get_instance(monitoredStream_));
+    if (stream == nullptr) {
+        return 0;
+    }
+    // Performance reads every monitor in the same frame, gather the stats once for all of them
+    auto frame = Engine::get_singleton()->get_process_frames();
+    if (monitorSnapshot_ == nullptr) {
+        monitorSnapshot_ = memnew(Dictionary);
+    }
+    if (monitorSnapshot_->is_empty() || monitorSnapshotFrame_ != frame) {
+        *monitorSnapshot_     = stream->get_stats();
+        monitorSnapshotFrame_ = frame;
+    }
+    return (*monitorSnapshot_)[name];
+}
+
+void FfmpegMediaStream::register_performance_monitors()
+{
+    auto* performance = Performance::get_singleton();
+    if (performance == nullptr) {
+        return;
+    }
+    // The monitors show the stream that started playing last
+    for (const char* name : kMonitoredStats) {
+        StringName id = String("FfmpegMediaStream/") + name;
+        if (!performance->has_custom_monitor(id)) {
+            performance->add_custom_monitor(id, callable_mp_static(&FfmpegMediaStream::get_monitor_value), varray(String(name)));
+        }
+    }
+}
+
+void FfmpegMediaStream::unregister_performance_monitors()
+{
+    auto* performance = Performance::get_singleton();
+    for (const char* name : kMonitoredStats) {
+        StringName id = String("FfmpegMediaStream/") + name;
+        if (performance != nullptr && performance->has_custom_monitor(id)) {
+            performance->remove_custom_monitor(id);
+        }
+    }
+    if (monitorSnapshot_ != nullptr) {
+        memdelete(monitorSnapshot_);
+        monitorSnapshot_ = nullptr;
+    }
+    monitoredStream_ = ObjectID();
+}
+
+Dictionary FfmpegMediaStream::get_frame_pool_stats() const
+{
+    auto stats = framePool_.get_stats();
+
+    Dictionary result;
+    result["allocations"]     = stats.allocations;
+    result["allocated_bytes"] = stats.allocatedBytes;
+    result["reuses"]          = stats.reuses;
+    result["pooled_images"]   = stats.pooledImages;
+    return result;
+}
+
+double FfmpegMediaStream::seek(double position, bool keyframeOnly)
+{
+    {
+        std::unique_lock<std::mutex> lck(controlMutex_);
+        // A seek that has not been started yet is simply replaced, so only the newest target is processed
+        seekTo_         = position;
+        seekDropBefore_ = keyframeOnly ? -1.0 : position;
+        ++serial_; // packets and frames of the previous serial will be discarded
+        pendingSeekSerial_ = serial_;
+    }
+    pendingSeekKeyframeOnly_ = keyframeOnly;
+    audioRing_.discard_written();
+    systemClockBase_ = position;
+    systemClockUsec_ = OS::get_singleton()->get_ticks_usec();
+    seekBeginUsec_   = systemClockUsec_;
+    videoPackets_.clear();
+    audioPackets_.clear();
+    // Tell the demuxing thread that we want to seek
+    controlCv_.notify_all();
+    notify_after_lock(audioSpaceMutex_, audioSpaceCv_); // the samples of the previous serial are not written anymore
+
+    // We are the consumer of the mailbox, frames pushed after this are dropped by update() because of their serial
+    FrameInfo frameInfo {};
+    while (decodedFrames_.tryPop(frameInfo)) {
+        release_frame(frameInfo);
+    }
+    clear_latest_frame();
+    notify_after_lock(frameSpaceMutex_, frameSpaceCv_);
+
+    // The upload thread skips frames of older serials, an upload already done is not presented
+    release_frame(nextUpload_);
+    nextUpload_ = FrameInfo {};
+    middleTextureSet_.fetch_and(~kTextureSetNewBit_, std::memory_order_acq_rel);
+    endOfStream_ = false;
+
+    return position;
+}
+
+Ref<Image> FfmpegMediaStream::get_thumbnail(double position)
+{
+    if (filePath_.is_empty() || videoStreamIndex_ < 0) {
+        return {};
+    }
+    if (!thumbnails_.is_started()) {
+        thumbnails_.start(filePath_, thumbnailWidth_);
+    }
+    return thumbnails_.get(position);
+}
+
+void FfmpegMediaStream::set_frame_queue_depth(int depth)
+{
+    if (state_ != State::kStateStopped) {
+        ERR_PRINT("The frame queue depth can only be changed while the stream is stopped");
+        return;
+    }
+    if (depth < 1) {
+        ERR_PRINT("The frame queue depth must be at least 1");
+        return;
+    }
+    decodedFrames_.reset(depth);
+    framePool_.set_max_images_per_key(depth + kFramesInUpload_);
+}
+
+void FfmpegMediaStream::release_frame(FrameInfo& frameInfo)
+{
+    for (auto& image : frameInfo.images) {
+        framePool_.release(image);
+    }
+    frameInfo.frame.reset();
+}
+
 bool FfmpegMediaStream::mix(AudioFrame* p_buffer, int p_frames)
 {
-    // Check the amount resampler can really handle.
-    // If it cannot, wait "wait_resampler_phase_limit" times.
-    // This mechanism contributes to smoother pause/unpause operation.
-    // if (p_frames <= audioResampler_.get_num_of_ready_frames() || wait_resampler_limit <= wait_resampler) {
-    //     wait_resampler = 0;
-    //     return resampler.mix(p_buffer, p_frames);
-    // }
-    // wait_resampler++;
+    auto n = (int)audioRing_.read(p_buffer, p_frames);
+    if (n > 0) {
+        notify_after_lock(audioSpaceMutex_, audioSpaceCv_);
+    }
+    if (n < p_frames && audioEndSerial_.load(std::memory_order_relaxed) != serial_.load(std::memory_order_relaxed)) {
+        stats_.audioUnderruns.fetch_add(1, std::memory_order_relaxed); // running dry after the end is no underrun
+    }
+    if (n == 0) {
+        return false;
+    }
 
-    if (p_frames <= audioResampler_.get_num_of_ready_frames() || waitResamplerLimit_ <= waitResampler_) {
-        waitResampler_ = 0;
-        return audioResampler_.mix(p_buffer, p_frames);
+    // Map the first sample of this chunk to the stream time through the latest anchor
+    auto anchor     = audioAnchor_.load();
+    auto chunkStart = audioRing_.total_read() - (uint64_t)n;
+    audioClock_.store(AudioClock { anchor.pts + ((double)chunkStart - (double)anchor.frame) / mixRate_, OS::get_singleton()->get_ticks_usec(), anchor.serial });
+
+    // Underrun, pad with silence
+    for (int i = n; i < p_frames; ++i) {
+        p_buffer[i] = AudioFrame(0.0F, 0.0F);
     }
-    waitResampler_++;
-    return false;
+    return true;
 }
 
 // Called from audio thread
@@ -691,162 +2272,443 @@ void FfmpegMediaStream::_mix_audio()
     }
 }
 
-void FfmpegMediaStream::decode_thread_routine()
+void FfmpegMediaStream::demux_thread_routine()
 {
-    auto* formatContext     = avFormatContext_.get();
-    auto* videoCodecContext = videoCodecContext_.get();
-    auto* audioCodecContext = audioCodecContext_.get();
-    auto* avPacket          = avPacket_.get();
-    auto* avFrame           = avFrame_.get();
-    auto* tmpFrame          = av_frame_alloc(); // TODO: Only alloc when decoder is hw decoder
-    tmpFrame->format        = AV_PIX_FMT_NV12;
-    std::unique_ptr<AVFrame, AvFrameDeleter> tmpFrame_(tmpFrame);
+    auto* formatContext = avFormatContext_.get();
+    bool hasVideo       = videoCodecContext_ != nullptr;
+    bool hasAudio       = audioCodecContext_ != nullptr;
 
     while (state_ != State::kStateStopped) {
         // handle seek
         double seekTo = -1.0;
+        int serial    = 0;
         {
-            std::unique_lock<std::mutex> lck(decodedImagesMutex_);
+            std::unique_lock<std::mutex> lck(controlMutex_);
             if (seekTo_ >= 0) {
                 seekTo  = seekTo_;
                 seekTo_ = -1.0;
             }
+            serial = serial_;
         }
         if (seekTo >= 0) {
             int seekFlags    = AVSEEK_FLAG_BACKWARD;
             bool seekSucceed = false;
-            if (audioStreamIndex_ != AVERROR_DECODER_NOT_FOUND) {
-                auto pts    = get_stream_time_pts(avFormatContext_->streams[audioStreamIndex_], seekTo);
-                auto ret    = av_seek_frame(avFormatContext_.get(), audioStreamIndex_, pts, seekFlags);
+            if (hasVideo) {
+                // Land exactly on the closest keyframe before the target, so nothing before it is read or decoded
+                auto* stream = formatContext->streams[videoStreamIndex_];
+                keyframeIndex_.import_stream_index(stream);
+                auto keyframePts = keyframeIndex_.find_at_or_before(get_stream_time_pts(stream, seekTo));
+                if (keyframePts != AV_NOPTS_VALUE) {
+                    // The demuxer may index decoding timestamps, which are earlier than the pts of a reordered
+                    // keyframe, so only the upper bound is exact
+                    seekSucceed = avformat_seek_file(formatContext, videoStreamIndex_, INT64_MIN, keyframePts, keyframePts, 0) >= 0;
+                }
+            }
+            if (!seekSucceed && audioStreamIndex_ != AVERROR_DECODER_NOT_FOUND) {
+                auto pts    = get_stream_time_pts(formatContext->streams[audioStreamIndex_], seekTo);
+                auto ret    = av_seek_frame(formatContext, audioStreamIndex_, pts, seekFlags);
                 seekSucceed = ret == 0;
             }
             if (!seekSucceed && videoStreamIndex_ != AVERROR_DECODER_NOT_FOUND) {
-                auto pts    = get_stream_time_pts(avFormatContext_->streams[videoStreamIndex_], seekTo);
-                auto ret    = av_seek_frame(avFormatContext_.get(), videoStreamIndex_, pts, seekFlags);
+                auto pts    = get_stream_time_pts(formatContext->streams[videoStreamIndex_], seekTo);
+                auto ret    = av_seek_frame(formatContext, videoStreamIndex_, pts, seekFlags);
                 seekSucceed = ret == 0;
             }
-            if (videoCodecContext != nullptr) {
-                avcodec_flush_buffers(videoCodecContext);
+            // The decoders flush themselves when they see packets of the new serial
+            (void)seekSucceed;
+        }
+
+        if (packet_queues_full(hasVideo, hasAudio)) {
+            // The decoders notify after every packet they pop
+            std::unique_lock<std::mutex> lck(controlMutex_);
+            controlCv_.wait(lck, [this, hasVideo, hasAudio]() { return state_ == State::kStateStopped || seekTo_ >= 0.0 || !packet_queues_full(hasVideo, hasAudio); });
+            continue;
+        }
+
+        std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet { av_packet_alloc() };
+        auto readBegin = OS::get_singleton()->get_ticks_usec();
+        int ret        = av_read_frame(formatContext, packet.get());
+        stats_.demux.record(OS::get_singleton()->get_ticks_usec() - readBegin);
+        if (ret == AVERROR(EAGAIN)) {
+            continue;
+        }
+        if (ret < 0) {
+            if (ret != AVERROR_EOF) {
+                CHECK_AV_ERROR(ret);
             }
-            if (audioCodecContext != nullptr) {
-                avcodec_flush_buffers(audioCodecContext);
+            WARN_PRINT("Video stream ended!");
+            // A null packet tells the decoders to drain
+            if (hasVideo) {
+                videoPackets_.push(MediaPacket { nullptr, serial });
+            }
+            if (hasAudio) {
+                audioPackets_.push(MediaPacket { nullptr, serial });
             }
-            // TODO: Audios sounds strange, bug?
 
-            (void)seekSucceed;
+            // Nothing more to read until someone seeks
+            std::unique_lock<std::mutex> lck(controlMutex_);
+            controlCv_.wait(lck, [this]() { return state_ == State::kStateStopped || seekTo_ >= 0.0; });
+            continue;
         }
 
-        int ret = 0;
+        // Every stream has its own queue so that audio decoding never waits for the video frames to be consumed.
+        // push() only blocks at the packet count bound, packet_queues_full() normally stops the reading before.
+        if (hasVideo && packet->stream_index == videoStreamIndex_) {
+            if (packet->flags & AV_PKT_FLAG_KEY) {
+                keyframeIndex_.add(packet->pts);
+            }
+            auto duration = get_packet_duration_usec(formatContext->streams[videoStreamIndex_], packet.get());
+            videoPackets_.push(MediaPacket { std::move(packet), serial }, duration);
+        } else if (hasAudio && packet->stream_index == audioStreamIndex_) {
+            auto duration = get_packet_duration_usec(formatContext->streams[audioStreamIndex_], packet.get());
+            audioPackets_.push(MediaPacket { std::move(packet), serial }, duration);
+        }
+    }
+}
+
+bool FfmpegMediaStream::packet_queues_full(bool hasVideo, bool hasAudio) const
+{
+    // A queue of packets without known durations counts as full at its packet count bound only
+    auto queuedUsec = primed_ ? kPrimedQueuedUsec_ : kQueuedUsec_;
+    auto maxVideo   = kMaxVideoPackets_ * queuedUsec / kQueuedUsec_;
+    auto maxAudio   = kMaxAudioPackets_ * queuedUsec / kQueuedUsec_;
+    auto videoFull  = !hasVideo || videoPackets_.approximateWeight() >= queuedUsec || videoPackets_.approximateSize() >= maxVideo;
+    auto audioFull  = !hasAudio || audioPackets_.approximateWeight() >= queuedUsec || audioPackets_.approximateSize() >= maxAudio;
+    return videoFull && audioFull;
+}
+
+void FfmpegMediaStream::push_decoded_frame(FrameInfo&& frameInfo, int serial)
+{
+    auto waitBegin   = OS::get_singleton()->get_ticks_usec();
+    frameInfo.serial = serial;
+    if (latestFrameWins_) {
+        push_latest_frame(std::move(frameInfo)); // never stall a live source
+        return;
+    }
+    while (!decodedFrames_.tryPush(std::move(frameInfo))) {
+        std::unique_lock<std::mutex> lck(frameSpaceMutex_);
+        frameSpaceCv_.wait(lck, [this, serial]() { return !decodedFrames_.isFull() || state_ == State::kStateStopped || serial != serial_; });
+        if (state_ == State::kStateStopped || serial != serial_) {
+            release_frame(frameInfo);
+            return;
+        }
+    }
+    stats_.queueWait.record(OS::get_singleton()->get_ticks_usec() - waitBegin);
+}
+
+double FfmpegMediaStream::get_seek_drop_before(int serial)
+{
+    std::unique_lock<std::mutex> lck(controlMutex_);
+    return serial == serial_ ? seekDropBefore_ : -1.0;
+}
+
+void FfmpegMediaStream::push_latest_frame(FrameInfo&& frameInfo)
+{
+    FrameInfo replaced {};
+    bool dropped = false;
+    {
+        std::unique_lock<std::mutex> lck(latestFrameMutex_);
+        if (frameInfo.frameTime < 0) {
+            latestEnd_    = std::move(frameInfo);
+            hasLatestEnd_ = true;
+        } else {
+            if (hasLatestFrame_) {
+                replaced = std::move(latestFrame_);
+                dropped  = true;
+            }
+            latestFrame_    = std::move(frameInfo);
+            hasLatestFrame_ = true;
+        }
+    }
+    frameInfo = FrameInfo {}; // Ref has no move, drop the references without releasing the images
+    if (dropped) {
+        release_frame(replaced);
+        stats_.droppedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool FfmpegMediaStream::take_latest_frame(FrameInfo& frameInfo, bool withEnd)
+{
+    std::unique_lock<std::mutex> lck(latestFrameMutex_);
+    if (hasLatestFrame_) {
+        frameInfo       = std::move(latestFrame_);
+        latestFrame_    = FrameInfo {};
+        hasLatestFrame_ = false;
+        return true;
+    }
+    if (withEnd && hasLatestEnd_) {
+        frameInfo     = std::move(latestEnd_);
+        latestEnd_    = FrameInfo {};
+        hasLatestEnd_ = false;
+        return true;
+    }
+    return false;
+}
+
+void FfmpegMediaStream::clear_latest_frame()
+{
+    FrameInfo frameInfo {};
+    take_latest_frame(frameInfo, false);
+    release_frame(frameInfo);
+    std::unique_lock<std::mutex> lck(latestFrameMutex_);
+    latestEnd_    = FrameInfo {};
+    hasLatestEnd_ = false;
+}
+
+void FfmpegMediaStream::video_decode_thread_routine()
+{
+    auto* videoCodecContext = videoCodecContext_.get();
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> avFrame_(av_frame_alloc());
+    auto* avFrame    = avFrame_.get();
+    auto* tmpFrame   = av_frame_alloc(); // TODO: Only alloc when decoder is hw decoder
+    tmpFrame->format = AV_PIX_FMT_NV12;
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> tmpFrame_(tmpFrame);
+
+    auto* stream      = avFormatContext_->streams[videoStreamIndex_];
+    int decoderSerial = -1;
+    double dropBefore = -1.0;
+    bool failed       = false;
+    MediaPacket mediaPacket {};
+    while (videoPackets_.pop(mediaPacket)) {
+        notify_after_lock(controlMutex_, controlCv_); // room for the demuxer
+        if (mediaPacket.serial != serial_ || failed) {
+            continue; // read before a seek, or after the decoder failed: popped so that the demuxer never blocks
+        }
+        if (mediaPacket.serial != decoderSerial) {
+            avcodec_flush_buffers(videoCodecContext);
+            decoderSerial = mediaPacket.serial;
+            dropBefore    = get_seek_drop_before(decoderSerial);
+        }
+        auto* avPacket = mediaPacket.packet.get(); // null means end of stream
+
+        int ret     = 0;
+        int sendRet = 0;
         do {
             if (state_ == State::kStateStopped) {
                 return;
             }
-            ret = av_read_frame(formatContext, avPacket);
-        } while (ret == AVERROR(EAGAIN));
-        std::unique_ptr<AVPacket, AvPacketDeleter> unrefOnExitScope(avPacket); // we need to unref the packet
-
-        if (ret == AVERROR_EOF) {
-            // TODO: flush decoder's internal frames
-            WARN_PRINT("Video stream ended!");
-            {
-                std::unique_lock<std::mutex> lck(decodedImagesMutex_);
-                decodedImages_.push_back(FrameInfo { PixelFormat::kPixelFormatNone, -1, { nullptr } });
+            auto decodeBegin = OS::get_singleton()->get_ticks_usec();
+            sendRet          = avcodec_send_packet(videoCodecContext, avPacket);
+            if (sendRet < 0 && sendRet != AVERROR(EAGAIN)) {
+                CHECK_AV_ERROR(sendRet);
+                break;
             }
-            return;
-        }
 
-        if (avPacket->stream_index == videoStreamIndex_) {
-            int sendRet = 0;
             do {
-                if (state_ == State::kStateStopped) {
-                    return;
-                }
-                sendRet = avcodec_send_packet(videoCodecContext, avPacket);
-                if (sendRet < 0 && sendRet != AVERROR(EAGAIN)) {
-                    CHECK_AV_ERROR(sendRet);
+                ret = avcodec_receive_frame(videoCodecContext, avFrame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                     break;
+                } else if (ret < 0) {
+                    CHECK_AV_ERROR(ret);
+                    failed = is_fatal_decode_error(ret);
+                    if (failed) {
+                        decodeError_.store(ret, std::memory_order_relaxed);
+                    }
+                    break; // a corrupt frame is skipped
                 }
-
-                do {
-                    ret = avcodec_receive_frame(videoCodecContext, avFrame);
-                    if (ret == AVERROR(EAGAIN)) {
-                        break;
-                    } else if (ret < 0) {
-                        CHECK_AV_ERROR(ret);
-                        abort();
-                        return;
+                auto decodeEnd = OS::get_singleton()->get_ticks_usec();
+                stats_.decodedFrames.fetch_add(1, std::memory_order_relaxed);
+                stats_.decode.record(decodeEnd - decodeBegin);
+                auto frameTime = get_stream_time_seconds(stream, avFrame->pts);
+                if (avFrame->pts != AV_NOPTS_VALUE && frameTime + get_stream_time_seconds(stream, avFrame->duration) <= dropBefore) {
+                    continue; // before the seek target, decoded as a reference only, never converted
+                }
+                ++currentFrameNumber_;
+                if (dropEveryNFrame_ > 1 && currentFrameNumber_ % dropEveryNFrame_ == 0) {
+                    stats_.droppedFrames.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    auto frameInfo = zeroCopy_ || rgbaOutput_ ? HoldAVFrame(avFrame, rgbaOutput_) : AVFrame2Image(avFrame, tmpFrame, framePool_, swsConverter_, packedPlanes_);
+                    if (frameInfo.format == PixelFormat::kPixelFormatNone) {
+                        // Convert failed
+                        ERR_PRINT("Failed to convert frame, discard");
+                        continue;
                     }
-                    ++currentFrameNumber_;
-                    if (dropEveryNFrame_ > 1 && currentFrameNumber_ % dropEveryNFrame_ == 0) {
-                        // drop
-                    } else {
-                        auto frameInfo = AVFrame2Image(avFrame, tmpFrame);
-                        if (frameInfo.format == PixelFormat::kPixelFormatNone) {
-                            // Convert failed
-                            ERR_PRINT("Failed to convert frame, discard");
-                            continue;
-                        }
-                        frameInfo.frameTime = get_stream_time_seconds(avFormatContext_->streams[videoStreamIndex_], avFrame->pts);
-                        {
-                            std::unique_lock<std::mutex> lck(decodedImagesMutex_);
-                            hasDecodedImageCv_.wait(lck, [this]() { return decodedImages_.size() < kMaxDecodedFrames_ || state_ == State::kStateStopped || seekTo_ >= 0.0; });
-                            if (seekTo_ < 0.0) {
-                                decodedImages_.push_back(std::move(frameInfo));
-                            }
-                        }
+                    if (frameInfo.frame == nullptr) {
+                        stats_.convert.record(OS::get_singleton()->get_ticks_usec() - decodeEnd);
                     }
-                } while (true);
-            } while (sendRet == AVERROR(EAGAIN));
-        } else if (avPacket->stream_index == audioStreamIndex_) {
-            ret = avcodec_send_packet(audioCodecContext, avPacket);
-            if (ret < 0) {
-                CHECK_AV_ERROR(ret);
-                continue;
-            }
+                    frameInfo.frameTime = frameTime;
+                    push_decoded_frame(std::move(frameInfo), mediaPacket.serial);
+                }
+                decodeBegin = OS::get_singleton()->get_ticks_usec();
+            } while (true);
+        } while (sendRet == AVERROR(EAGAIN) && !failed);
+
+        if (avPacket == nullptr || failed) {
+            push_decoded_frame(FrameInfo { PixelFormat::kPixelFormatNone, -1, { nullptr } }, mediaPacket.serial);
+        }
+    }
+}
+
+void FfmpegMediaStream::audio_decode_thread_routine()
+{
+    auto* audioCodecContext = audioCodecContext_.get();
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> avFrame_(av_frame_alloc());
+    auto* avFrame = avFrame_.get();
+
+    auto* stream      = avFormatContext_->streams[audioStreamIndex_];
+    int decoderSerial = -1;
+    double dropBefore = -1.0;
+    bool failed       = false;
+    MediaPacket mediaPacket {};
+    while (audioPackets_.pop(mediaPacket)) {
+        notify_after_lock(controlMutex_, controlCv_); // room for the demuxer
+        if (mediaPacket.serial != serial_ || failed) {
+            continue; // read before a seek, or after the decoder failed: popped so that the demuxer never blocks
+        }
+        if (mediaPacket.serial != decoderSerial) {
+            avcodec_flush_buffers(audioCodecContext);
+            swrContext_.reset(); // drop the samples buffered in the resampler
+            audioRing_.discard_written();
+            decoderSerial = mediaPacket.serial;
+            dropBefore    = get_seek_drop_before(decoderSerial);
+        }
+        auto* avPacket = mediaPacket.packet.get(); // null means end of stream
 
+        int ret = avcodec_send_packet(audioCodecContext, avPacket);
+        if (ret < 0) {
+            CHECK_AV_ERROR(ret);
+            continue;
+        }
+
+        do {
             ret = avcodec_receive_frame(audioCodecContext, avFrame);
-            if (ret == AVERROR(EAGAIN)) {
-                continue;
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
             } else if (ret < 0) {
                 CHECK_AV_ERROR(ret);
-                abort();
-                return;
+                failed = is_fatal_decode_error(ret);
+                if (failed) {
+                    decodeError_.store(ret, std::memory_order_relaxed);
+                }
+                break; // a corrupt frame is skipped
             }
 
-            if (avFrame->format == AV_SAMPLE_FMT_FLTP) {
-                int todo = MIN(audioResampler_.get_writer_space(), avFrame->nb_samples);
-                if (todo < avFrame->nb_samples) {
-                    ERR_PRINT("Discarding audio sample");
+            if (avFrame->best_effort_timestamp != AV_NOPTS_VALUE && avFrame->sample_rate > 0) {
+                auto frameEnd = get_stream_time_seconds(stream, avFrame->best_effort_timestamp) + avFrame->nb_samples / (double)avFrame->sample_rate;
+                if (frameEnd <= dropBefore) {
+                    continue; // before the seek target
                 }
+            }
+            if (!convert_audio_frame(avFrame, mediaPacket.serial)) {
+                break; // seeking or stopping
+            }
+        } while (true);
 
-                float* wb = audioResampler_.get_write_buffer();
-                int c     = audioResampler_.get_channel_count();
+        if (avPacket == nullptr || failed) {
+            audioEndSerial_.store(mediaPacket.serial, std::memory_order_relaxed);
+        }
+        if ((avPacket == nullptr || failed) && videoCodecContext_ == nullptr) {
+            // audio only, nobody else tells update() the stream has ended
+            push_decoded_frame(FrameInfo { PixelFormat::kPixelFormatNone, -1, { nullptr } }, mediaPacket.serial);
+        }
+    }
+}
 
-                for (int i = 0, j = 0; i < todo; ++i) {
-                    for (int k = 0; k < c; ++k) {
-                        wb[j++] = reinterpret_cast<const float*>(avFrame->data[k])[i];
-                    }
-                }
-                audioResampler_.write(todo);
-            } else {
-                ERR_PRINT("Unhandled audio sample format");
-            }
+bool FfmpegMediaStream::convert_audio_frame(const AVFrame* frame, int serial)
+{
+    // (Re)create the converter when the input layout changes, any sample format, channel layout
+    // and sample rate is converted to interleaved stereo float at the mix rate
+    if (swrContext_ == nullptr
+        || swrInputFormat_ != frame->format
+        || swrInputSampleRate_ != frame->sample_rate
+        || av_channel_layout_compare(&swrInputLayout_, &frame->ch_layout) != 0) {
+        AVChannelLayout outLayout = AV_CHANNEL_LAYOUT_STEREO;
+        SwrContext* swr           = nullptr;
+        int ret                   = swr_alloc_set_opts2(&swr,
+                              &outLayout, AV_SAMPLE_FMT_FLT, mixRate_,
+                              &frame->ch_layout, (AVSampleFormat)frame->format, frame->sample_rate,
+                              0, nullptr);
+        if (ret < 0 || swr_init(swr) < 0) {
+            swr_free(&swr);
+            ERR_PRINT(String("Cannot convert audio sample format {0}").format(varray(av_get_sample_fmt_name((AVSampleFormat)frame->format))));
+            return true; // skip this frame
+        }
+        swrContext_.reset(swr);
+        swrInputFormat_     = frame->format;
+        swrInputSampleRate_ = frame->sample_rate;
+        av_channel_layout_uninit(&swrInputLayout_);
+        av_channel_layout_copy(&swrInputLayout_, &frame->ch_layout);
+    }
+
+    // The converted samples start at the current write position of the ring, minus what swresample still holds
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        auto delay = (double)swr_get_delay(swrContext_.get(), mixRate_) / mixRate_;
+        auto pts   = get_stream_time_seconds(avFormatContext_->streams[audioStreamIndex_], frame->best_effort_timestamp) - delay;
+        audioAnchor_.store(AudioAnchor { pts, audioRing_.total_written(), serial });
+    }
+
+    static_assert(sizeof(AudioFrame) == 2 * sizeof(float), "AudioFrame must be interleaved stereo float");
+    auto maxOutput = swr_get_out_samples(swrContext_.get(), frame->nb_samples);
+    if (maxOutput <= 0) {
+        return true;
+    }
+    if ((int)audioConvertBuffer_.size() < maxOutput) {
+        audioConvertBuffer_.resize(maxOutput);
+    }
+    uint8_t* output[] = { reinterpret_cast<uint8_t*>(audioConvertBuffer_.data()) };
+    auto count        = swr_convert(swrContext_.get(), output, maxOutput, (const uint8_t**)frame->extended_data, frame->nb_samples);
+    if (count < 0) {
+        ERR_PRINT("Failed to convert audio samples");
+        return true;
+    }
+
+    // Apply backpressure instead of dropping samples: wait for the mixer to make room
+    for (int written = 0; written < count;) {
+        if (state_ == State::kStateStopped || serial != serial_) {
+            return false;
+        }
+        auto n = (int)audioRing_.write(audioConvertBuffer_.data() + written, count - written);
+        written += n;
+        if (n == 0) {
+            std::unique_lock<std::mutex> lck(audioSpaceMutex_);
+            audioSpaceCv_.wait(lck, [this, serial]() { return audioRing_.write_space() > 0 || state_ == State::kStateStopped || serial != serial_; });
         }
     }
+    return true;
 }
 
-int FfmpegMediaStream::hw_decoder_init(AVCodecContext* ctx, const enum AVHWDeviceType type)
+int FfmpegMediaStream::hw_decoder_init(const enum AVHWDeviceType type)
 {
-    AVBufferRef* hwDeviceCtx { nullptr };
-    int err = av_hwdevice_ctx_create(&hwDeviceCtx, type, nullptr, nullptr, 0);
-    if (err < 0) {
+    int err                  = 0;
+    AVBufferRef* hwDeviceCtx = HwDeviceCache::get_singleton().acquire(type, &err);
+    if (hwDeviceCtx == nullptr) {
         ERR_PRINT("Failed to create specified HW device.");
         return err;
     }
-    ctx->hw_device_ctx = av_buffer_ref(hwDeviceCtx);
     hwBuffer_.reset(hwDeviceCtx);
 
-    return err;
+    return 0;
+}
+
+AVCodecContext* FfmpegMediaStream::open_decoder(const AVCodec* codec, const AVCodecParameters* par, AVHWDeviceType hwType, int threadCount, bool* reused)
+{
+    *reused = false;
+    if (codec == nullptr) {
+        return nullptr;
+    }
+    auto& pool = CodecContextPool::get_singleton();
+    auto key   = CodecContextPool::make_key(codec, par, hwType, threadCount);
+    if (auto* pooled = pool.acquire(key)) {
+        *reused = true;
+        return pooled;
+    }
+
+    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> codecContext { avcodec_alloc_context3(codec) };
+    if (codecContext == nullptr) {
+        return nullptr;
+    }
+    avcodec_parameters_to_context(codecContext.get(), par);
+    if (hwType != AV_HWDEVICE_TYPE_NONE) {
+        codecContext->hw_device_ctx = av_buffer_ref(hwBuffer_.get());
+    }
+    if (threadCount > 0) {
+        codecContext->thread_count = threadCount;
+    }
+    if (0 != avcodec_open2(codecContext.get(), codec, nullptr)) {
+        return nullptr;
+    }
+    pool.track(codecContext.get(), key);
+    return codecContext.release();
 }
 
 bool FfmpegMediaStream::try_apply_hw_accelerator(AVCodecContext* codecContext, const AVCodec* codec, const String& hw)
@@ -860,9 +2722,19 @@ bool FfmpegMediaStream::try_apply_hw_accelerator(AVCodecContext* codecContext, c
         if (deviceTypeName != hw) {
             continue;
         }
-        if (hw_decoder_init(codecContext, config->device_type) == 0) {
+        if (hw_decoder_init(config->device_type) == 0) {
+            codecContext->hw_device_ctx = av_buffer_ref(hwBuffer_.get());
             return true;
         }
     }
     return false;
-}
\ No newline at end of file
+}
+
+int FfmpegMediaStream::read_audio(AudioFrame* dst, int frames)
+{
+    auto n = (int)audioRing_.read(dst, (size_t)MAX(frames, 0));
+    if (n > 0) {
+        notify_after_lock(audioSpaceMutex_, audioSpaceCv_);
+    }
+    return n;
+}
@@ -1,15 +1,28 @@
 #pragma once
 
+#include "audio_frame_ring.h"
+#include "codec_context_pool.h"
+#include "ffmpeg_tiled_video_texture.h"
+#include "ffmpeg_video_texture.h"
+#include "frame_pool.h"
+#include "hw_device_cache.h"
+#include "keyframe_index.h"
+#include "perf_counters.h"
+#include "seq_lock.h"
+#include "spsc_ring.h"
+#include "sws_converter.h"
 #include "structs.h"
+#include "threadsafe_blocking_queue.h"
+#include "thumbnail_generator.h"
 #include <atomic>
 #include <condition_variable>
 #include <core/object/ref_counted.h>
 #include <core/os/semaphore.h>
-#include <list>
 #include <memory>
 #include <mutex>
 #include <scene/resources/texture.h>
-#include <servers/audio/audio_rb_resampler.h>
+#include <thread>
+#include <vector>
 
 class FfmpegCodecHwConfig : public RefCounted {
     GDCLASS(FfmpegCodecHwConfig, RefCounted);
@@ -60,6 +73,12 @@ public:
         kPixelFormatNone = -1,
         kPixelFormatYuv420P,
         kPixelFormatNv12,
+        kPixelFormatPackedI420,   // one R8 texture, see set_packed_planes()
+        kPixelFormatRgba8,        // one RGBA8 texture, see set_rgba_output()
+        kPixelFormatYuv420P10,    // 10 bits Y, U and V planes, each sample a half float in [0, 1] (RH)
+        kPixelFormatP010,         // 10 bits Y plane (RH) then interleaved UV plane (RGH), half floats as well
+        kPixelFormatYuv420PTiles, // Yuv420P planes as tiled texture arrays, see set_tiled_upload()
+        kPixelFormatNv12Tiles,    // Nv12 planes as tiled texture arrays
     };
     enum State : int {
         kStateStopped,
@@ -71,6 +90,9 @@ public:
         PixelFormat format { PixelFormat::kPixelFormatNone };
         double frameTime { 0.0 };
         Ref<Image> images[4] { nullptr };
+        // Set in zero copy mode, the planes are copied into images by update()
+        std::unique_ptr<AVFrame, AvFrameFreeDeleter> frame { nullptr };
+        int serial { 0 };
     };
 
     static void _bind_methods();
@@ -86,34 +108,228 @@ public:
 
     bool set_file(const String& filePath);
 
+    // Opens the file on a worker thread: set_file(), create_decoders() with the video decoder named decoderName and
+    // its hw config named hwName, then decodes the first video frame into the poster texture. An empty decoderName
+    // picks the first decoder with a hw config, an empty hwName its first hw config and "none" decodes in software.
+    // open_progress is emitted as the stages complete, then opened or open_failed, all on the main thread.
+    // Nothing else may be called on the stream meanwhile.
+    void open_async(const String& filePath, const String& decoderName = "", const String& hwName = "");
+    bool is_opening() const { return openThread_.joinable(); }
+
+    // Main thread, makes the open started by open_async() stop as soon as possible, interrupting libavformat.
+    // open_failed is emitted once it has stopped.
+    void cancel_open();
+
+    // Main thread, the first video frame at most kMaxPosterWidth_ wide, to show before play(). Set by open_async().
+    Ref<ImageTexture> get_poster_texture() const { return posterTexture_; }
+
+    String get_hw_decoder_name() const { return hwDecoderName_; }
+
+    // Why open_async() failed, empty if it succeeded
+    String get_open_error() const { return openError_; }
+
+    // The ffmpeg error that stopped a decoder, empty if none did. The stream then ends as at the end of the file.
+    // Corrupt frames are only logged and skipped.
+    String get_decode_error() const;
+
+    // Size of the buffer the file is read ahead into by an I/O thread, 0 reads it synchronously on the demuxing
+    // thread. Must be set before set_file(). Memory mapped files and files opened by ffmpeg itself (Android paths
+    // outside of res:// and user:// that cannot be mapped) are never read ahead.
+    void set_read_ahead_size(int bytes) { readAheadSize_ = bytes; }
+    int get_read_ahead_size() const { return readAheadSize_; }
+
+    // When enabled and the read ahead size is 0, local files (not res://) are memory mapped instead of read with
+    // FileAccess: no read ahead thread and one copy less, the kernel reads ahead of the position. Off by default:
+    // page faults stall the demuxing thread on slow storage, and an I/O error or a file truncated while mapped
+    // raises SIGBUS instead of a read error. Must be set before set_file().
+    void set_memory_mapped(bool enabled) { memoryMapped_ = enabled; }
+    bool is_memory_mapped() const { return memoryMapped_; }
+
+    // When enabled, set_file() keeps what probing finds out about a file under user://probe_cache: opening it again,
+    // until it is modified, skips probing the input format and analyzing the streams. Must be set before set_file().
+    void set_probe_cache_enabled(bool enabled) { probeCacheEnabled_ = enabled; }
+    bool is_probe_cache_enabled() const { return probeCacheEnabled_; }
+    bool is_probe_cache_hit() const { return probeCacheHit_; }
+
+    // Bounds of probing and analyzing files missing from the probe cache, 0 keeps the ffmpeg defaults (5 MB and
+    // 5 seconds). Smaller values open faster, but may miss the parameters of streams starting late in the file.
+    // Must be set before set_file().
+    void set_probe_size(int64_t bytes) { probeSize_ = bytes; }
+    int64_t get_probe_size() const { return probeSize_; }
+    void set_analyze_duration(double seconds) { analyzeDuration_ = seconds; }
+    double get_analyze_duration() const { return analyzeDuration_; }
+
+    // http:// and https:// files are streamed with range requests, the downloaded chunks are kept in a cache under
+    // user://http_cache shared by every stream. Its size is capped to bytes (2 GB by default), least recently used
+    // chunks first out.
+    static void set_http_cache_size(int64_t bytes);
+    static int64_t get_http_cache_size();
+    static void clear_http_cache();
+
+    // Decoders of closed streams are kept opened, up to contexts (4 by default), and handed to the next stream
+    // decoding the same codec with the same parameters, which skips opening one. Hardware devices are shared by every
+    // stream whatever the pool size. A stream holds its decoders until it is freed.
+    static void set_decoder_pool_size(int contexts);
+    static int get_decoder_pool_size();
+    static void clear_decoder_pool();
+
+    // Whether create_decoders() reused a pooled video decoder, or the audio one without video
+    bool is_decoder_reused() const { return decoderReused_; }
+
     TypedArray<FfmpegCodec> available_video_decoders() const;
 
     bool create_decoders(const FfmpegCodec* videoCodec, const FfmpegCodecHwConfig* videoHwCfg);
 
     void play();
 
+    // Main thread, from stopped: starts decoding paused, so that preroll() presents the first frame before play().
+    // Unlike play() followed by pause(), it leaves the performance monitors and the audio mixer to the stream playing,
+    // play() takes them over. Until play() the demuxer only reads kPrimedQueuedUsec_ ahead.
+    void prime();
+
     void stop();
 
     void pause();
 
+    // Main thread, while paused before the first update(): uploads the first decoded frame and presents it, so that
+    // the textures already show it when play() resumes. Call it every frame until it returns true.
+    bool preroll();
+
     State get_state() const { return state_; }
 
+    // delta is the time since the previous update(), it advances the external clock. The other clocks are measured.
     bool update(double delta);
 
     double get_length() const;
 
     double get_position() const;
 
-    double seek(double position);
+    // Bytes of one decoded video frame, 0 without video
+    int64_t get_frame_size() const;
+
+    // Bytes of the decoded audio buffered ahead of the mixer, 0 without audio
+    int64_t get_audio_buffer_size() const;
+
+    // Bytes a primed stream holds besides its decoded frames and its audio buffer: the read ahead buffer, the packets
+    // queued ahead at the average bit rate and the frames the video decoder keeps for reference and reordering.
+    // A mapped file only adds the pages of the queued packets.
+    int64_t get_primed_buffer_size() const;
+
+    // Seeks to position. Frames between the keyframe and position are decoded but never presented,
+    // unless keyframeOnly is set: then playback resumes from the keyframe, which is much faster for scrubbing.
+    // Seeks requested before the previous one is done replace it. seek_completed reports the landed position.
+    double seek(double position, bool keyframeOnly = false);
+
+    // Allocation counters of the plane image pool, steady state playback should not allocate
+    Dictionary get_frame_pool_stats() const;
+
+    // Frame counters, mean and p99 time per frame of every pipeline stage in milliseconds, queue depths,
+    // audio ring fill and underruns, bytes read, the read ahead buffer, the I/O backend and the active hw decoder.
+    // The same values, except the I/O backend and the hw decoder, are registered as Performance custom monitors
+    // for the stream that started playing last.
+    Dictionary get_stats() const;
+    void reset_stats();
+
+    // Removes the Performance monitors, at module uninitialization
+    static void unregister_performance_monitors();
+
+    // When enabled, the clock only advances by the delta passed to update(), for benchmarks and offline rendering
+    void set_external_clock(bool enabled) { externalClock_ = enabled; }
+    bool is_external_clock() const { return externalClock_; }
+
+    // True from seek() until the first frame after it is presented
+    bool is_seeking() const { return pendingSeekSerial_ != -1; }
+
+    // Scrub preview of the keyframe at or before position. While it is being generated the preview of the nearest
+    // earlier keyframe is returned, null if there is none: poll it again later.
+    // The previews are decoded from a second instance of the file, the playback is not disturbed.
+    Ref<Image> get_thumbnail(double position);
+
+    // Width of the previews, must be set before the first get_thumbnail()
+    void set_thumbnail_width(int width) { thumbnailWidth_ = width; }
+    int get_thumbnail_width() const { return thumbnailWidth_; }
 
     void set_drop_every_n_frame(uint32_t n) { dropEveryNFrame_ = n; }
 
+    // When enabled, every frame is presented as a single R8 texture of width x (height * 3 / 2) whatever the
+    // decoder outputs: the Y plane on top, then the U and V planes side by side. Must be set before play().
+    void set_packed_planes(bool enabled) { packedPlanes_ = enabled; }
+    bool is_packed_planes() const { return packedPlanes_; }
+
+    // When enabled, every frame is converted to RGBA8 on the upload thread and presented as a single texture,
+    // for the consumers that cannot use the YUV shaders. Must be set before play().
+    void set_rgba_output(bool enabled) { rgbaOutput_ = enabled; }
+    bool is_rgba_output() const { return rgbaOutput_; }
+
+    // When enabled, the audio is not mixed into the Master bus, the owner pulls it with read_audio()
+    // and drives the clock with an external clock. Must be set before play().
+    void set_external_audio(bool enabled) { externalAudio_ = enabled; }
+    bool is_external_audio() const { return externalAudio_; }
+
+    // Any thread but only one, returns the count of stereo frames at get_mix_rate() written to dst
+    int read_audio(AudioFrame* dst, int frames);
+
+    bool has_audio() const { return audioCodecContext_ != nullptr; }
+    int get_mix_rate() const { return mixRate_; }
+
+    // When enabled, 8 bits Yuv420P and Nv12 planes are split into tiles (see FfmpegTiledVideoTexture) and only the
+    // tiles the view given to set_view() sees are uploaded, the others are filled in when they come into view.
+    // For panoramas, the tiles are laid out on the equirectangular projection. Must be set before play().
+    void set_tiled_upload(bool enabled) { tiledUpload_ = enabled; }
+    bool is_tiled_upload() const { return tiledUpload_; }
+
+    // Requested tile columns and rows, lowered to split the planes evenly. At most 64 tiles. Must be set before play().
+    void set_tile_grid(int columns, int rows);
+
+    // Main thread, columns and rows of the presented tiled frame
+    Vector2i get_tile_grid() const { return tileGrid_; }
+
+    // Main thread, the camera looking at the panorama: its orientation (-Z forward), vertical field of view
+    // and aspect ratio. Tiles within margin degrees around the view are uploaded as well.
+    // Until it is called every tile is uploaded.
+    void set_view(const Basis& orientation, float fovDegrees, float aspect, float marginDegrees = 10.0f);
+
+    // Tiled upload mode, same as get_texture()
+    Ref<FfmpegTiledVideoTexture> get_tiled_texture(uint32_t index) const { return tiledTextures_[index]; }
+    uint32_t get_tiled_textures_count() const { return tiledTextures_.size(); }
+
+    // When enabled, the decode thread hands references of the decoded frames to update() instead of copying their
+    // planes, the copy into the texture images then happens on the upload thread. Off by default. Must be set before
+    // play().
+    void set_zero_copy(bool enabled) { zeroCopy_ = enabled; }
+    bool is_zero_copy() const { return zeroCopy_; }
+
+    // How many decoded frames may wait for update(). Must be set while stopped.
+    void set_frame_queue_depth(int depth);
+    int get_frame_queue_depth() const { return (int)decodedFrames_.capacity(); }
+
+    // For live sources: update() always presents the newest decoded frame and the decoder never waits for update(),
+    // a decoded frame replaces the one update() has not taken yet. Must be set while stopped.
+    void set_latest_frame_wins(bool enabled) { latestFrameWins_ = enabled; }
+    bool is_latest_frame_wins() const { return latestFrameWins_; }
+
+    // Playback speed of the system clock. The audio clock is only the master at normal speed.
+    void set_speed_scale(double scale) { speedScale_ = scale; }
+    double get_speed_scale() const { return speedScale_; }
+
+    // Presentation time of the last presented frame minus the master clock at that moment,
+    // negative when the video is late
+    double get_av_offset() const { return avOffset_; }
+
+    // True if the last update() was driven by the audio clock, false if by the system clock
+    bool is_audio_clock_master() const { return audioClockMaster_; }
+
     bool is_stopped() const { return state_ == State::kStateStopped; }
     bool is_playing() const { return state_ == State::kStatePlaying; }
     bool is_paused() const { return state_ == State::kStatePaused; }
 
     int get_video_stream_count() const { return videoStreamIndices_.size(); }
     int get_audio_stream_count() const { return audioStreamIndices_.size(); }
+
+    // Plays the audio stream `track`, 0 to get_audio_stream_count() - 1 in file order, instead of the one ffmpeg finds
+    // best. Must be called while stopped after set_file(), the audio decoder is opened again if it exists already.
+    bool set_audio_track(int track);
+    int get_audio_track() const { return audioStreamIndices_.find(audioStreamIndex_); }
     int get_subtitle_stream_count() const { return subtitleStreamIndices_.size(); }
     String get_encapsulation_format() const { return inputFormat_ == nullptr ? "[Unknown]" : inputFormat_->name; }
     String get_video_encoding_format() const { return videoCodecContext_ == nullptr ? "[Unknown]" : avcodec_get_name(videoCodecContext_->codec->id); }
@@ -121,17 +337,93 @@ public:
     String get_video_codec_name() const { return videoCodecContext_ == nullptr || videoCodecContext_->codec == nullptr ? "[Unknown]" : videoCodecContext_->codec->name; }
     String get_audio_codec_name() const { return audioCodecContext_ == nullptr || audioCodecContext_->codec == nullptr ? "[Unknown]" : audioCodecContext_->codec->name; }
 
-    Ref<ImageTexture> get_texture(uint32_t index) const { return textures_[index]; }
+    // The textures stay the same while playing, presenting a frame re-points them to freshly uploaded textures.
+    // They are recreated when the pixel format changes.
+    Ref<FfmpegVideoTexture> get_texture(uint32_t index) const { return textures_[index]; }
     uint32_t get_textures_count() const { return textures_.size(); }
+    PixelFormat get_pixel_format() const { return currentPixelFormat_; }
 
 private:
     bool mix(AudioFrame* p_buffer, int p_frames);
 
+    // Main thread only
+    // Advances the external clock by delta
+    double get_master_clock(double delta);
+
     void _mix_audio();
 
-    void decode_thread_routine();
+    // Starts the demuxer, the decoders and the uploader, from stopped
+    void start_threads();
+
+    void demux_thread_routine();
+    // Whether every queue holds enough packets, the demuxer then waits for the decoders
+    bool packet_queues_full(bool hasVideo, bool hasAudio) const;
+
+    void video_decode_thread_routine();
+
+    void audio_decode_thread_routine();
 
-    int hw_decoder_init(AVCodecContext* ctx, const enum AVHWDeviceType type);
+    void push_decoded_frame(FrameInfo&& frameInfo, int serial);
+
+    // seekDropBefore_ if serial is still the current serial, -1 otherwise. Read together with controlMutex_ locked,
+    // so that a seek in between never pairs the threshold of the new serial with the packets of the previous one.
+    double get_seek_drop_before(int serial);
+
+    // The mailbox of latestFrameWins_. push_latest_frame() replaces the frame not taken yet, take_latest_frame() takes
+    // the frame, or the end marker once there is no frame left when withEnd is set.
+    void push_latest_frame(FrameInfo&& frameInfo);
+    bool take_latest_frame(FrameInfo& frameInfo, bool withEnd);
+    void clear_latest_frame();
+
+    // Returns false when interrupted by a seek or stop
+    bool convert_audio_frame(const AVFrame* frame, int serial);
+
+    void release_frame(FrameInfo& frameInfo);
+
+    // Main thread, points the textures to the last uploaded set, returns false if there is none
+    bool present_uploaded_frame();
+
+    void upload_thread_routine();
+
+    void upload_frame(FrameInfo& frameInfo);
+
+    // Upload thread, copies the tiles in view that the back set does not hold yet from the frame uploadId
+    // and publishes the back set. Returns false if there was nothing to upload.
+    bool upload_tiles(const FrameInfo& frameInfo, uint64_t uploadId);
+
+    // Upload thread, the tiles of a columns x rows grid to upload
+    uint64_t get_visible_tiles(int columns, int rows);
+
+    // Upload thread, replaces the held frame with an RGBA8 image
+    void fill_rgba8(FrameInfo& frameInfo);
+
+    void free_texture_sets();
+
+    // Upload thread, pushes the images of the back texture set into its textures before it is published
+    void apply_texture_set(int index);
+
+    // Open thread, returns the error to report, empty on success
+    String open_thread_routine(const String& filePath, const String& decoderName, const String& hwName);
+
+    // Main thread, joins the open thread and emits the result. keepAlive is the reference of the open thread,
+    // held until the signals are emitted.
+    void finish_open(const Ref<FfmpegMediaStream>& keepAlive);
+
+    // Open thread, decodes the first video frame into posterImage_ then seeks back to the beginning
+    void decode_poster();
+
+    Ref<Image> scale_poster(const AVFrame* frame);
+
+    static Variant get_monitor_value(const String& name);
+
+    static void register_performance_monitors();
+
+    // Acquires the shared device of type into hwBuffer_, open_decoder() attaches it
+    int hw_decoder_init(const enum AVHWDeviceType type);
+
+    // A pooled or newly opened decoder, with the device in hwBuffer_ if hwType is not AV_HWDEVICE_TYPE_NONE.
+    // threadCount 0 keeps the ffmpeg default. Null if it cannot be opened.
+    AVCodecContext* open_decoder(const AVCodec* codec, const AVCodecParameters* par, AVHWDeviceType hwType, int threadCount, bool* reused);
 
     bool try_apply_hw_accelerator(AVCodecContext* codecContext, const AVCodec* codec, const String& hw);
 
@@ -140,13 +432,29 @@ private:
 
     // ffmpeg objects
     std::unique_ptr<AvIoContextWrapper> avioContext_;
+    int readAheadSize_ { 16 * 1024 * 1024 };
+    bool memoryMapped_ { false };
+    bool probeCacheEnabled_ { true };
+    bool probeCacheHit_ { false };
+    int64_t probeSize_ { 0 };
+    double analyzeDuration_ { 0 };
+    uint64_t openUsec_ { 0 };
+
+    // open_async()
+    static const constexpr int kMaxPosterWidth_   = 2048;
+    static const constexpr int kMaxPosterPackets_ = 1024;
+    std::thread openThread_ {};
+    std::atomic<bool> openCancelled_ { false }; // also interrupts the blocking libavformat calls
+    String openError_ {};
+    Ref<Image> posterImage_ {}; // open thread, until finish_open()
+    Ref<ImageTexture> posterTexture_ {};
     std::unique_ptr<AVFormatContext, AVFormatContextDeleter> avFormatContext_;
-    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> videoCodecContext_;
-    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> audioCodecContext_;
-    std::unique_ptr<AVPacket, AvPacketDeleter> avPacket_;
-    std::unique_ptr<AVFrame, AvFrameDeleter> avFrame_ { nullptr };
-    std::unique_ptr<AVBufferRef, AvBufferRefDeleter> hwBuffer_ { nullptr };
+    std::unique_ptr<AVCodecContext, PooledCodecContextDeleter> videoCodecContext_;
+    std::unique_ptr<AVCodecContext, PooledCodecContextDeleter> audioCodecContext_;
+    std::unique_ptr<AVBufferRef, HwDeviceReleaser> hwBuffer_ { nullptr };
+    bool decoderReused_ { false };
     const AVInputFormat* inputFormat_ { nullptr };
+    String hwDecoderName_ {};
 
     Vector<int> videoStreamIndices_ {};
     Vector<int> audioStreamIndices_ {};
@@ -155,35 +463,209 @@ private:
     int audioStreamIndex_ { AVERROR_DECODER_NOT_FOUND };
 
     Vector<AudioFrame> mixBuffer_ {};
-    AudioRBResampler audioResampler_ {};
+    bool mixCallbackAdded_ { false };
+    AudioFrameRing audioRing_ {};
+    // The audio decoding thread waits on audioSpaceCv_ while the ring is full, the readers notify it
+    std::mutex audioSpaceMutex_;
+    std::condition_variable audioSpaceCv_;
     int audioBufferingMs_ { 1000 };
-    int waitResamplerLimit_ { 2 };
-    int waitResampler_ { 0 };
+    int mixRate_ { 44100 };
+
+    // audio decoding thread only
+    std::unique_ptr<SwrContext, SwrContextDeleter> swrContext_ { nullptr };
+    int swrInputFormat_ { AV_SAMPLE_FMT_NONE };
+    int swrInputSampleRate_ { 0 };
+    AVChannelLayout swrInputLayout_ {};
+    std::vector<AudioFrame> audioConvertBuffer_ {};
 
     uint32_t dropEveryNFrame_ { 0 };
+    bool zeroCopy_ { false };
+    bool packedPlanes_ { false };
+    bool rgbaOutput_ { false };
+    bool externalAudio_ { false };
+    SwsConverter swsConverter_ {}; // the thread converting the frames: decoding thread, or upload thread with zero copy or rgba output
     uint32_t currentFrameNumber_ { 0 };
 
     // state
     std::atomic<State> state_ { State::kStateStopped };
-    double time_ { 0 };
+    std::atomic<int> decodeError_ { 0 }; // set by a decoding thread, reset by play() from stopped
     double lastFrameTime_ { 0 };
-    mutable double totalTime_ { 0 };
 
-    //
-    static const constexpr size_t kMaxDecodedFrames_ = 2;
-    static_assert(kMaxDecodedFrames_ > 0);
+    // clocks, the audio clock is written by the audio threads, the rest belongs to the main thread
+    static constexpr double kMaxAudioClockExtrapolation_ = 0.1;
+    // Each one is published as a whole, so that a seek never shows a reader the serial of one and the time of another
+    struct AudioAnchor {
+        double pts { 0.0 };   // stream time of the sample at frame
+        uint64_t frame { 0 }; // index of a sample in audioRing_
+        int serial { -1 };
+    };
+    struct AudioClock {
+        double pts { 0.0 };  // stream time of the last chunk handed to the mixer
+        uint64_t usec { 0 }; // when that chunk was handed to the mixer
+        int serial { -1 };
+    };
+    SeqLock<AudioAnchor> audioAnchor_ {}; // written by the audio decoding thread
+    SeqLock<AudioClock> audioClock_ {};   // written by the mixer
+    double systemClockBase_ { 0.0 };
+    uint64_t systemClockUsec_ { 0 };
+    double speedScale_ { 1.0 };
+    double avOffset_ { 0.0 };
+    bool audioClockMaster_ { false };
+    bool externalClock_ { false };
+
+    static ObjectID monitoredStream_;
+    static Dictionary* monitorSnapshot_; // get_stats() of monitoredStream_, taken once per frame for every monitor
+    static uint64_t monitorSnapshotFrame_;
+    mutable double totalTime_ { 0 };
 
-    std::mutex decodedImagesMutex_;
-    std::condition_variable hasDecodedImageCv_;
-    std::list<FrameInfo> decodedImages_;
-    std::thread decodingThread_ {};
+    // seek requests and stop notifications for the demuxing thread
+    std::mutex controlMutex_;
+    std::condition_variable controlCv_;
     double seekTo_ { -1.0 };
+    std::atomic<int> serial_ { 0 };          // increased by every seek, modified with controlMutex_ locked
+    std::atomic<int> audioEndSerial_ { -1 }; // serial the audio decoder reached the end of the stream with
+    double seekDropBefore_ { -1.0 };         // frames of serial_ ending before this are not queued, with controlMutex_
+    int pendingSeekSerial_ { -1 };
+    uint64_t seekBeginUsec_ { 0 };
+    bool pendingSeekKeyframeOnly_ { false };
+    KeyframeIndex keyframeIndex_ {}; // demuxing thread only
+
+    // Decoded frames, the video decoding thread is the producer and update() the consumer.
+    // update() never takes a lock, the producer sleeps on frameSpaceCv_ while the mailbox is full.
+    static const constexpr size_t kDefaultDecodedFrames_ = 2;
+    SpscRing<FrameInfo> decodedFrames_ { kDefaultDecodedFrames_ };
+    std::mutex frameSpaceMutex_;
+    std::condition_variable frameSpaceCv_;
+    bool latestFrameWins_ { false };
+
+    // Used instead of decodedFrames_ with latestFrameWins_: a single frame and the end marker pushed after it
+    std::mutex latestFrameMutex_;
+    FrameInfo latestFrame_ {};
+    FrameInfo latestEnd_ {};
+    bool hasLatestFrame_ { false };
+    bool hasLatestEnd_ { false };
+
+    // A null packet marks the end of the stream
+    struct MediaPacket {
+        std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet { nullptr };
+        int serial { 0 };
+    };
+    // The queues are weighted by the packet durations in microseconds. The demuxer reads ahead until every queue holds
+    // kQueuedUsec_, so a video queue that is full never keeps the audio one from being fed. The packet counts only
+    // bound the memory of a stream whose audio is missing from the interleaving.
+    // While primed, the queues hold kPrimedQueuedUsec_ and the same fraction of the packet counts.
+    static const constexpr int64_t kQueuedUsec_       = 1000000;
+    static const constexpr int64_t kPrimedQueuedUsec_ = 250000;
+    static const constexpr size_t kMaxVideoPackets_   = 600;
+    static const constexpr size_t kMaxAudioPackets_   = 2048;
+    std::atomic<bool> primed_ { false }; // prime() until play()
+    static const constexpr int kAssumedReferenceFrames_ = 4; // of a decoder that does not report its refs
+    ThreadSafeBlockingQueue<MediaPacket> videoPackets_ { kMaxVideoPackets_ };
+    ThreadSafeBlockingQueue<MediaPacket> audioPackets_ { kMaxAudioPackets_ };
+    std::thread demuxThread_ {};
+    std::thread videoDecodeThread_ {};
+    std::thread audioDecodeThread_ {};
+
+    // Frames between the mailbox and the pool: one waiting in nextUpload_, one in uploadFrames_, one being
+    // copied into the back texture set and one whose texture update the rendering server has not run yet
+    static const constexpr size_t kFramesInUpload_ = 4;
+    FramePool framePool_ { kDefaultDecodedFrames_ + kFramesInUpload_ };
+
+    // Upload stage. update() hands the frame to present to the upload thread, which converts it, copies it into
+    // the images of the back texture set and updates the rendering server textures of the set, then swaps it with
+    // the middle one. The rendering server queues the texture updates of other threads to its own, in order.
+    // update() swaps the middle set with the front one when it is new and only re-points the textures, a lock-free
+    // triple buffer.
+    static const constexpr uint32_t kMaxPlanes_   = 3;
+    static const constexpr int kTextureSetNewBit_ = 4;
+    static const constexpr int kMaxTiles_ = 64;
+    struct TileImage {
+        uint32_t plane { 0 };
+        int tile { 0 };
+        Ref<Image> image {};
+    };
+    struct TextureSet {
+        // upload thread while the set is the back one
+        PixelFormat format { PixelFormat::kPixelFormatNone };
+        int serial { -1 }; // of the frame the set holds
+        int widths[kMaxPlanes_] {};  // of a tile with its borders in tiled formats
+        int heights[kMaxPlanes_] {};
+        Image::Format formats[kMaxPlanes_] {};
+        int columns { 0 }; // tiled formats only
+        int rows { 0 };
+        uint64_t tileUploads[kMaxTiles_] {}; // the upload each tile comes from, 0 for none: the stale tiles map
+
+        // staged by the upload thread, pushed into the textures then dropped by apply_texture_set()
+        Ref<Image> images[kMaxPlanes_] {}; // whole planes
+        std::vector<TileImage> tiles {};   // tiled formats
+        bool recreate { false };           // the textures must be created again with the layout above
+        RID planes[kMaxPlanes_] {};
+
+        // replaced by a recreation, the textures may still point to them until the main thread re-points
+        // the textures to this set and frees them
+        std::vector<RID> retired {};
+    };
+    TextureSet textureSets_[3] {};
+    int frontTextureSet_ { 0 };              // main thread only
+    int backTextureSet_ { 1 };               // upload thread only
+    std::atomic<int> middleTextureSet_ { 2 }; // or'ed with kTextureSetNewBit_ until update() takes it
+    SpscRing<FrameInfo> uploadFrames_ { 1 };
+    FrameInfo nextUpload_ {}; // main thread, waits for room in uploadFrames_
+    std::atomic<int> uploadsPending_ { 0 }; // pushed to uploadFrames_ and not processed yet
+    bool endOfStream_ { false };            // the end marker has been taken from the mailbox
+    bool prerollTaken_ { false };           // preroll() took the first frame from the mailbox
+    bool prerolled_ { false };              // and presented it
+    std::mutex uploadMutex_;
+    std::condition_variable uploadCv_;
+    std::thread uploadThread_ {};
+
+    // Tiled upload. The upload thread keeps the last frame to fill in the tiles coming into view while paused
+    // or between two frames.
+    struct View {
+        Basis orientation {};
+        float fovDegrees { 0.0f };
+        float aspect { 1.0f };
+        float marginDegrees { 0.0f };
+    };
+    bool tiledUpload_ { false };
+    int tileColumns_ { 8 };
+    int tileRows_ { 4 };
+    Vector2i tileGrid_ {}; // main thread
+    std::mutex viewMutex_ {};
+    View view_ {};
+    std::atomic<uint64_t> viewSerial_ { 0 }; // 0 until set_view() is called
+    FramePool tilePool_ { kMaxTiles_ * 2 };
+    FrameInfo lastUpload_ {};      // upload thread only
+    uint64_t lastUploadId_ { 0 };  // upload thread only
+    uint64_t visibleSerial_ { 0 }; // upload thread only, the view visibleTiles_ was computed for
+    int visibleColumns_ { 0 };
+    int visibleRows_ { 0 };
+    uint64_t visibleTiles_ { 0 };
+
+    // Updated without locks by the threads doing the work, read by get_stats()
+    static constexpr double kLateFrameThreshold_ = 0.04; // presented this far behind the clock
+    struct PipelineStats {
+        std::atomic<uint64_t> decodedFrames { 0 };
+        std::atomic<uint64_t> presentedFrames { 0 };
+        std::atomic<uint64_t> droppedFrames { 0 }; // decoded but never presented
+        std::atomic<uint64_t> lateFrames { 0 };
+        std::atomic<uint64_t> audioUnderruns { 0 };
+        DurationStats demux {}; // per packet
+        DurationStats decode {};
+        DurationStats convert {};
+        DurationStats queueWait {};
+        DurationStats upload {};
+        DurationStats present {};
+        DurationStats seek {};
+    };
+    PipelineStats stats_ {};
 
-    Vector<Ref<ImageTexture>> textures_ {};
-    PixelFormat currentPixelFormat_ { PixelFormat::kPixelFormatNone };
+    ThumbnailGenerator thumbnails_ {}; // started by the first get_thumbnail()
+    int thumbnailWidth_ { 256 };
 
-    uint32_t textureWidth_ { 0 };
-    uint32_t textureHeight_ { 0 };
+    Vector<Ref<FfmpegVideoTexture>> textures_ {};
+    Vector<Ref<FfmpegTiledVideoTexture>> tiledTextures_ {};
+    PixelFormat currentPixelFormat_ { PixelFormat::kPixelFormatNone };
 };
 
 VARIANT_ENUM_CAST(FfmpegMediaStream::PixelFormat);
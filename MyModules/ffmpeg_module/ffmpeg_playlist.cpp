@@ -0,0 +1,238 @@
+#include "ffmpeg_playlist.h"
+
+static const String kItemCreatedSignalName { "item_created" };
+static const String kItemStartedSignalName { "item_started" };
+static const String kItemFailedSignalName { "item_failed" };
+static const String kPixelFormatChangedSignalName { "pixel_format_changed" };
+static const String kFinishedSignalName { "finished" };
+
+void FfmpegPlaylist::_bind_methods()
+{
+    ClassDB::bind_method(D_METHOD("set_items", "paths"), &FfmpegPlaylist::set_items);
+    ClassDB::bind_method(D_METHOD("get_items"), &FfmpegPlaylist::get_items);
+    ClassDB::bind_method(D_METHOD("set_loop", "enabled"), &FfmpegPlaylist::set_loop);
+    ClassDB::bind_method(D_METHOD("is_loop"), &FfmpegPlaylist::is_loop);
+    ClassDB::bind_method(D_METHOD("set_decoder", "name"), &FfmpegPlaylist::set_decoder);
+    ClassDB::bind_method(D_METHOD("get_decoder"), &FfmpegPlaylist::get_decoder);
+    ClassDB::bind_method(D_METHOD("set_hw", "name"), &FfmpegPlaylist::set_hw);
+    ClassDB::bind_method(D_METHOD("get_hw"), &FfmpegPlaylist::get_hw);
+    ClassDB::bind_method(D_METHOD("set_prime_frames", "frames"), &FfmpegPlaylist::set_prime_frames);
+    ClassDB::bind_method(D_METHOD("get_prime_frames"), &FfmpegPlaylist::get_prime_frames);
+    ClassDB::bind_method(D_METHOD("set_preload_budget", "bytes"), &FfmpegPlaylist::set_preload_budget);
+    ClassDB::bind_method(D_METHOD("get_preload_budget"), &FfmpegPlaylist::get_preload_budget);
+    ClassDB::bind_method(D_METHOD("play", "index"), &FfmpegPlaylist::play, DEFVAL(0));
+    ClassDB::bind_method(D_METHOD("stop"), &FfmpegPlaylist::stop);
+    ClassDB::bind_method(D_METHOD("update", "delta"), &FfmpegPlaylist::update);
+    ClassDB::bind_method(D_METHOD("get_current_index"), &FfmpegPlaylist::get_current_index);
+    ClassDB::bind_method(D_METHOD("get_current_stream"), &FfmpegPlaylist::get_current_stream);
+    ClassDB::bind_method(D_METHOD("get_texture", "index"), &FfmpegPlaylist::get_texture);
+    ClassDB::bind_method(D_METHOD("get_textures_count"), &FfmpegPlaylist::get_textures_count);
+    ClassDB::bind_method(D_METHOD("get_pixel_format"), &FfmpegPlaylist::get_pixel_format);
+
+    // item_created comes before the stream is opened, for the options that must be set before set_file()
+    ADD_SIGNAL(MethodInfo(kItemCreatedSignalName, PropertyInfo(Variant::INT, "index"), PropertyInfo(Variant::OBJECT, "stream", PROPERTY_HINT_RESOURCE_TYPE, "FfmpegMediaStream")));
+    ADD_SIGNAL(MethodInfo(kItemStartedSignalName, PropertyInfo(Variant::INT, "index")));
+    ADD_SIGNAL(MethodInfo(kItemFailedSignalName, PropertyInfo(Variant::INT, "index"), PropertyInfo(Variant::STRING, "message")));
+    ADD_SIGNAL(MethodInfo(kPixelFormatChangedSignalName, PropertyInfo(Variant::INT, "format")));
+    ADD_SIGNAL(MethodInfo(kFinishedSignalName));
+}
+
+void FfmpegPlaylist::play(int index)
+{
+    stop();
+    if (index < 0 || index >= items_.size()) {
+        ERR_PRINT(String("No item {0} in the playlist").format(varray(index)));
+        return;
+    }
+    current_ = open_item(index);
+}
+
+void FfmpegPlaylist::stop()
+{
+    for (auto* item : { &current_, &next_ }) {
+        if (item->stream.is_valid()) {
+            item->stream->stop();
+        }
+        *item = Item {};
+    }
+    previous_.unref();
+    failures_       = 0;
+    finished_       = false;
+    lastPosition_   = 0.0;
+    sinceLastFrame_ = 0.0;
+}
+
+bool FfmpegPlaylist::update(double delta)
+{
+    if (current_.stream.is_null() || finished_) {
+        return false;
+    }
+    if (!current_.started) {
+        // The first item
+        if (!poll_opened(current_)) {
+            if (current_.stream.is_null()) {
+                finish();
+            }
+            return false;
+        }
+        current_.stream->play();
+        current_.started = true;
+        emit_signal(kItemStartedSignalName, current_.index);
+    }
+
+    auto stream    = current_.stream;
+    bool presented = !stream->is_stopped() && stream->update(delta);
+    if (presented) {
+        sync_textures();
+        lastPosition_   = stream->get_position();
+        sinceLastFrame_ = 0.0;
+    } else {
+        sinceLastFrame_ += delta * stream->get_speed_scale();
+    }
+
+    prepare_next();
+
+    // The last frame stays until it ends, then the next item takes over
+    if (stream->is_stopped() && sinceLastFrame_ >= CLAMP(stream->get_length() - lastPosition_, 0.0, kMaxEndHold)) {
+        presented = take_over() || presented;
+    }
+    return presented;
+}
+
+FfmpegPlaylist::Item FfmpegPlaylist::open_item(int index)
+{
+    Item item;
+    if (index < 0) {
+        return item;
+    }
+    item.index = index;
+    item.stream.instantiate();
+    emit_signal(kItemCreatedSignalName, index, item.stream);
+    item.stream->open_async(items_[index], decoderName_, hwName_);
+    return item;
+}
+
+int FfmpegPlaylist::get_next_index(int index) const
+{
+    if (index + 1 < items_.size()) {
+        return index + 1;
+    }
+    return loop_ && !items_.is_empty() ? 0 : -1;
+}
+
+bool FfmpegPlaylist::poll_opened(Item& item)
+{
+    if (item.opened) {
+        return true;
+    }
+    if (item.stream.is_null() || item.stream->is_opening()) {
+        return false;
+    }
+    auto error = item.stream->get_open_error();
+    if (error.is_empty()) {
+        item.opened = true;
+        failures_   = 0;
+        return true;
+    }
+    emit_signal(kItemFailedSignalName, item.index, error);
+    // Every item failing in a row ends the playlist instead of looping forever
+    bool givingUp = ++failures_ >= items_.size();
+    item          = open_item(givingUp ? -1 : get_next_index(item.index));
+    return false;
+}
+
+void FfmpegPlaylist::prime(Item& item)
+{
+    auto& stream   = item.stream;
+    auto frameSize = stream->get_frame_size();
+    // Less the uploaded first frame and what decoding ahead holds besides the frames
+    auto available = preloadBudget_ - stream->get_audio_buffer_size() - stream->get_primed_buffer_size() - frameSize;
+    auto frames    = frameSize == 0 ? (int64_t)primeFrames_ : MIN(available / frameSize, (int64_t)primeFrames_);
+    if (available < 0 || frames < 1) {
+        return; // only opened, it decodes when it takes over
+    }
+    stream->set_frame_queue_depth((int)frames);
+    stream->prime();
+    item.primed = true;
+}
+
+void FfmpegPlaylist::prepare_next()
+{
+    if (next_.stream.is_null()) {
+        if (failures_ < items_.size()) {
+            next_ = open_item(get_next_index(current_.index));
+        }
+        return;
+    }
+    if (!next_.opened && poll_opened(next_)) {
+        prime(next_);
+    }
+    if (next_.primed) {
+        next_.stream->preroll();
+    }
+}
+
+bool FfmpegPlaylist::take_over()
+{
+    if (next_.stream.is_null()) {
+        if (get_next_index(current_.index) < 0 || failures_ >= items_.size()) {
+            finish();
+        }
+        return false;
+    }
+    // Until the next item is ready the last frame stays on screen
+    if (!poll_opened(next_) || (next_.primed && !next_.stream->preroll())) {
+        return false;
+    }
+
+    previous_ = current_.stream;
+    current_  = next_;
+    next_     = Item {};
+    current_.stream->play();
+    current_.started = true;
+    lastPosition_    = current_.stream->get_position();
+    sinceLastFrame_  = 0.0;
+    emit_signal(kItemStartedSignalName, current_.index);
+    if (!current_.primed) {
+        return false; // its first frame comes with a later update()
+    }
+    sync_textures();
+    return true;
+}
+
+void FfmpegPlaylist::sync_textures()
+{
+    const auto& stream = current_.stream;
+    auto count         = (int)stream->get_textures_count();
+    bool reused        = stream->get_pixel_format() == pixelFormat_ && count == textures_.size();
+    for (int i = 0; i < count && reused; ++i) {
+        auto source = stream->get_texture(i);
+        reused      = textures_[i]->get_width() == source->get_width() && textures_[i]->get_height() == source->get_height();
+    }
+    if (!reused) {
+        pixelFormat_ = stream->get_pixel_format();
+        textures_.resize(count);
+        for (auto& t : textures_) {
+            t = Ref<FfmpegVideoTexture>(memnew(FfmpegVideoTexture));
+        }
+    }
+
+    auto* tw = textures_.ptrw();
+    for (int i = 0; i < count; ++i) {
+        auto source = stream->get_texture(i);
+        tw[i]->set_base(source->get_base(), source->get_width(), source->get_height());
+    }
+    previous_.unref();
+
+    if (!reused) {
+        emit_signal(kPixelFormatChangedSignalName, pixelFormat_);
+    }
+}
+
+void FfmpegPlaylist::finish()
+{
+    if (!finished_) {
+        finished_ = true;
+        emit_signal(kFinishedSignalName);
+    }
+}
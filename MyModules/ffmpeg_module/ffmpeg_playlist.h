@@ -0,0 +1,115 @@
+#pragma once
+
+#include "ffmpeg_media_stream.h"
+
+// Plays a list of files back to back without a gap. While an item plays, the next one is opened with
+// FfmpegMediaStream::open_async() then primed with FfmpegMediaStream::prime(): started paused so that its first frames
+// are decoded and the first one is uploaded. The next item takes over on the display frame the last frame of the current one ends.
+// The textures of the playlist follow the item playing. They are only recreated, and pixel_format_changed emitted,
+// when the pixel format, the plane count or the resolution changes. Tiled upload is not supported.
+class FfmpegPlaylist : public RefCounted {
+    GDCLASS(FfmpegPlaylist, RefCounted);
+
+public:
+    static void _bind_methods();
+
+    FfmpegPlaylist() = default;
+
+    void set_items(const PackedStringArray& paths) { items_ = paths; }
+    PackedStringArray get_items() const { return items_; }
+
+    // When enabled, the first item follows the last one
+    void set_loop(bool enabled) { loop_ = enabled; }
+    bool is_loop() const { return loop_; }
+
+    // Passed to open_async() for every item
+    void set_decoder(const String& name) { decoderName_ = name; }
+    String get_decoder() const { return decoderName_; }
+    void set_hw(const String& name) { hwName_ = name; }
+    String get_hw() const { return hwName_; }
+
+    // Decoded frames the next item holds ready at most
+    void set_prime_frames(int frames) { primeFrames_ = MAX(frames, 1); }
+    int get_prime_frames() const { return primeFrames_; }
+
+    // Memory the primed item may hold: its decoded frames, the uploaded first frame, its audio buffer and
+    // FfmpegMediaStream::get_primed_buffer_size(): the read ahead buffer, the queued packets and the reference frames.
+    // Fewer frames are primed to stay within it, if not even one fits the next item is only opened and decodes when it
+    // takes over.
+    void set_preload_budget(int64_t bytes) { preloadBudget_ = bytes; }
+    int64_t get_preload_budget() const { return preloadBudget_; }
+
+    // Starts over from the item at index, item_created is emitted before it is opened
+    void play(int index = 0);
+
+    void stop();
+
+    // Main thread, every frame: drives the current item, prepares the next one and switches to it.
+    // Returns true if a new frame is presented.
+    bool update(double delta);
+
+    int get_current_index() const { return current_.index; }
+
+    // The item playing, null until the first one is opened
+    Ref<FfmpegMediaStream> get_current_stream() const { return current_.started ? current_.stream : Ref<FfmpegMediaStream>(); }
+
+    Ref<FfmpegVideoTexture> get_texture(uint32_t index) const
+    {
+        ERR_FAIL_INDEX_V((int)index, textures_.size(), Ref<FfmpegVideoTexture>());
+        return textures_[index];
+    }
+    uint32_t get_textures_count() const { return textures_.size(); }
+    FfmpegMediaStream::PixelFormat get_pixel_format() const { return pixelFormat_; }
+
+private:
+    struct Item {
+        Ref<FfmpegMediaStream> stream {};
+        int index { -1 };
+        bool opened { false };
+        bool primed { false };  // started paused to decode ahead
+        bool started { false }; // playing
+    };
+
+    // Creates the stream of the item at index and starts opening it, an empty item if index is -1
+    Item open_item(int index);
+
+    // -1 after the last item
+    int get_next_index(int index) const;
+
+    // Whether the item is opened. When it failed, it is replaced with the following one.
+    bool poll_opened(Item& item);
+
+    // Starts the opened next item paused, with as many frames ahead as the budget allows
+    void prime(Item& item);
+
+    void prepare_next();
+
+    // Switches to the next item if it is ready, returns true if its first frame is presented
+    bool take_over();
+
+    // Points the textures to the ones of the current stream
+    void sync_textures();
+
+    void finish();
+
+private:
+    static constexpr double kMaxEndHold = 0.5; // seconds the last frame may be held, for bogus durations
+
+    PackedStringArray items_ {};
+    bool loop_ { false };
+    String decoderName_ {};
+    String hwName_ {};
+    int primeFrames_ { 4 };
+    int64_t preloadBudget_ { 256 * 1024 * 1024 };
+
+    Item current_ {};
+    Item next_ {};
+    Ref<FfmpegMediaStream> previous_ {}; // until the textures no longer show its frames
+    int failures_ { 0 };                  // items that failed to open in a row
+    bool finished_ { false };
+    double lastPosition_ { 0.0 };
+    double sinceLastFrame_ { 0.0 };
+
+    Vector<Ref<FfmpegVideoTexture>> textures_ {};
+    FfmpegMediaStream::PixelFormat pixelFormat_ { FfmpegMediaStream::kPixelFormatNone };
+};
@@ -0,0 +1,40 @@
+#include "ffmpeg_tiled_video_texture.h"
+#include <servers/rendering_server.h>
+
+void FfmpegTiledVideoTexture::_bind_methods()
+{
+    ClassDB::bind_method(D_METHOD("get_grid"), &FfmpegTiledVideoTexture::get_grid);
+    ClassDB::bind_method(D_METHOD("get_plane_size"), &FfmpegTiledVideoTexture::get_plane_size);
+}
+
+FfmpegTiledVideoTexture::FfmpegTiledVideoTexture()
+{
+    // Same as FfmpegVideoTexture, materials keep the rid they got so it never changes
+    auto* rs     = RenderingServer::get_singleton();
+    placeholder_ = rs->texture_2d_layered_placeholder_create(RenderingServer::TEXTURE_LAYERED_2D_ARRAY);
+    proxy_       = rs->texture_proxy_create(placeholder_);
+}
+
+FfmpegTiledVideoTexture::~FfmpegTiledVideoTexture()
+{
+    auto* rs = RenderingServer::get_singleton();
+    if (proxy_.is_valid()) {
+        rs->free(proxy_);
+    }
+    if (placeholder_.is_valid()) {
+        rs->free(placeholder_);
+    }
+}
+
+void FfmpegTiledVideoTexture::set_base(RID base, int width, int height, int columns, int rows, Image::Format format)
+{
+    RenderingServer::get_singleton()->texture_proxy_update(proxy_, base);
+    if (width_ != width || height_ != height || columns_ != columns || rows_ != rows || format_ != format) {
+        width_   = width;
+        height_  = height;
+        columns_ = columns;
+        rows_    = rows;
+        format_  = format;
+        emit_changed();
+    }
+}
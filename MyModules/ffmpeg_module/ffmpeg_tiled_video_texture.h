@@ -0,0 +1,47 @@
+#pragma once
+
+#include <scene/resources/texture.h>
+
+// The tiled counterpart of FfmpegVideoTexture: a plane split into columns x rows tiles, one per layer of
+// a 2D texture array, so that only the tiles in view need to be uploaded. Every tile has a border of
+// kBorder texels copied from its neighbours for the linear filtering.
+// Layer row * columns + column holds the tile (column, row), see Shaders/Tiles.gdshaderinc.
+class FfmpegTiledVideoTexture : public TextureLayered {
+    GDCLASS(FfmpegTiledVideoTexture, TextureLayered);
+
+public:
+    static constexpr int kBorder = 1;
+
+    FfmpegTiledVideoTexture();
+    ~FfmpegTiledVideoTexture() override;
+
+    Image::Format get_format() const override { return format_; }
+    LayeredType get_layered_type() const override { return LAYERED_TYPE_2D_ARRAY; }
+    int get_width() const override { return width_; }
+    int get_height() const override { return height_; }
+    int get_layers() const override { return columns_ * rows_; }
+    bool has_mipmaps() const override { return false; }
+    Ref<Image> get_layer_data(int /* layer */) const override { return Ref<Image>(); }
+    RID get_rid() const override { return proxy_; }
+
+    // Columns and rows of tiles
+    Vector2i get_grid() const { return Vector2i(columns_, rows_); }
+
+    // Size of the whole plane, without the tile borders
+    Vector2i get_plane_size() const { return Vector2i((width_ - 2 * kBorder) * columns_, (height_ - 2 * kBorder) * rows_); }
+
+    // Main thread, shows the content of base from now on. width and height are the size of a tile with its borders.
+    void set_base(RID base, int width, int height, int columns, int rows, Image::Format format);
+
+protected:
+    static void _bind_methods();
+
+private:
+    RID proxy_ {};
+    RID placeholder_ {};
+    int width_ { 0 };
+    int height_ { 0 };
+    int columns_ { 0 };
+    int rows_ { 0 };
+    Image::Format format_ { Image::FORMAT_R8 };
+};
@@ -0,0 +1,33 @@
+#include "ffmpeg_video_texture.h"
+#include <servers/rendering_server.h>
+
+FfmpegVideoTexture::FfmpegVideoTexture()
+{
+    // Materials keep the rid they got when the texture was assigned, so it never changes.
+    // Until the first frame is presented the proxy points to a placeholder.
+    auto* rs     = RenderingServer::get_singleton();
+    placeholder_ = rs->texture_2d_placeholder_create();
+    proxy_       = rs->texture_proxy_create(placeholder_);
+}
+
+FfmpegVideoTexture::~FfmpegVideoTexture()
+{
+    auto* rs = RenderingServer::get_singleton();
+    if (proxy_.is_valid()) {
+        rs->free(proxy_);
+    }
+    if (placeholder_.is_valid()) {
+        rs->free(placeholder_);
+    }
+}
+
+void FfmpegVideoTexture::set_base(RID base, int width, int height)
+{
+    RenderingServer::get_singleton()->texture_proxy_update(proxy_, base);
+    base_ = base;
+    if (width_ != width || height_ != height) {
+        width_  = width;
+        height_ = height;
+        emit_changed();
+    }
+}
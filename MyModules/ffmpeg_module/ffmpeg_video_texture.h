@@ -0,0 +1,33 @@
+#pragma once
+
+#include <scene/resources/texture.h>
+
+// A texture that stays the same resource while the frames it shows are uploaded to other textures.
+// It wraps a rendering server texture proxy, presenting a frame only re-points the proxy.
+class FfmpegVideoTexture : public Texture2D {
+    GDCLASS(FfmpegVideoTexture, Texture2D);
+
+public:
+    FfmpegVideoTexture();
+    ~FfmpegVideoTexture() override;
+
+    int get_width() const override { return width_; }
+    int get_height() const override { return height_; }
+    RID get_rid() const override { return proxy_; }
+    bool has_alpha() const override { return false; }
+
+    // Main thread, shows the content of base from now on
+    void set_base(RID base, int width, int height);
+
+    RID get_base() const { return base_; }
+
+protected:
+    static void _bind_methods() { }
+
+private:
+    RID proxy_ {};
+    RID placeholder_ {};
+    RID base_ {};
+    int width_ { 0 };
+    int height_ { 0 };
+};
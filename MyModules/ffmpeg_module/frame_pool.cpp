@@ -0,0 +1,98 @@
+#include "frame_pool.h"
+
+FramePool::FramePool(uint32_t maxImagesPerKey)
+    : maxImagesPerKey_ { maxImagesPerKey }
+{
+}
+
+FramePool::Entry* FramePool::find_entry(int width, int height, Image::Format format)
+{
+    for (auto& e : entries_) {
+        if (e.width == width && e.height == height && e.format == format) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+Ref<Image> FramePool::acquire(int width, int height, Image::Format format)
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        if (auto* entry = find_entry(width, height, format)) {
+            auto& images = entry->images;
+            for (size_t i = 0; i < images.size(); ++i) {
+                // The rendering server may still hold a reference if the upload is queued, skip these
+                if (images[i]->get_reference_count() != 1) {
+                    continue;
+                }
+                Ref<Image> image = images[i];
+                images.erase(images.begin() + (ptrdiff_t)i);
+                reuses_.fetch_add(1, std::memory_order_relaxed);
+                return image;
+            }
+        }
+    }
+
+    auto size = Image::get_image_data_size(width, height, format, false);
+    Vector<uint8_t> buffer;
+    buffer.resize(size);
+
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes_.fetch_add((uint64_t)size, std::memory_order_relaxed);
+    return Ref<Image> { memnew(Image(width, height, false, format, buffer)) };
+}
+
+void FramePool::release(Ref<Image>& image)
+{
+    if (image.is_null()) {
+        return;
+    }
+    Ref<Image> img = image;
+    image.unref();
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    auto* entry = find_entry(img->get_width(), img->get_height(), img->get_format());
+    if (entry == nullptr) {
+        // A frame has at most 3 plane kinds, entries beyond that belong to an older resolution
+        if (entries_.size() >= kMaxEntries) {
+            entries_.erase(entries_.begin());
+        }
+        entries_.push_back(Entry { img->get_width(), img->get_height(), img->get_format(), {} });
+        entry = &entries_.back();
+    }
+    if (entry->images.size() < maxImagesPerKey_) {
+        entry->images.push_back(img);
+    }
+}
+
+void FramePool::clear()
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    entries_.clear();
+}
+
+void FramePool::set_max_images_per_key(uint32_t n)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    maxImagesPerKey_ = n;
+    for (auto& e : entries_) {
+        if (e.images.size() > n) {
+            e.images.resize(n);
+        }
+    }
+}
+
+FramePool::Stats FramePool::get_stats() const
+{
+    Stats stats;
+    stats.allocations    = allocations_.load(std::memory_order_relaxed);
+    stats.allocatedBytes = allocatedBytes_.load(std::memory_order_relaxed);
+    stats.reuses         = reuses_.load(std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    for (auto& e : entries_) {
+        stats.pooledImages += (uint32_t)e.images.size();
+    }
+    return stats;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <core/io/image.h>
+#include <mutex>
+#include <vector>
+
+// A bounded pool of plane images, keyed by resolution and image format.
+// The decode thread borrows images from it and the main thread gives them back
+// once their content has been pushed into the textures.
+class FramePool {
+public:
+    struct Stats {
+        uint64_t allocations { 0 };
+        uint64_t allocatedBytes { 0 };
+        uint64_t reuses { 0 };
+        uint32_t pooledImages { 0 };
+    };
+
+    explicit FramePool(uint32_t maxImagesPerKey = 8);
+
+    FramePool(const FramePool&)            = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Returns an image with the given size and format. The content is undefined.
+    Ref<Image> acquire(int width, int height, Image::Format format);
+
+    // Gives the image back to the pool, the caller must not touch its pixels afterwards.
+    void release(Ref<Image>& image);
+
+    void clear();
+
+    void set_max_images_per_key(uint32_t n);
+
+    Stats get_stats() const;
+
+private:
+    struct Entry {
+        int width { 0 };
+        int height { 0 };
+        Image::Format format { Image::FORMAT_MAX };
+        std::vector<Ref<Image>> images {};
+    };
+
+    Entry* find_entry(int width, int height, Image::Format format);
+
+private:
+    static constexpr size_t kMaxEntries = 3;
+
+    mutable std::mutex mutex_ {};
+    std::vector<Entry> entries_ {};
+    uint32_t maxImagesPerKey_ { 8 };
+
+    std::atomic<uint64_t> allocations_ { 0 };
+    std::atomic<uint64_t> allocatedBytes_ { 0 };
+    std::atomic<uint64_t> reuses_ { 0 };
+};
@@ -0,0 +1,168 @@
+#include "http_chunk_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <core/io/dir_access.h>
+#include <core/io/file_access.h>
+
+HttpChunkCache& HttpChunkCache::get_singleton()
+{
+    static HttpChunkCache cache;
+    return cache;
+}
+
+void HttpChunkCache::set_capacity(uint64_t bytes)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    capacity_ = bytes;
+    if (scanned_) {
+        evict();
+    }
+}
+
+uint64_t HttpChunkCache::get_capacity() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return capacity_;
+}
+
+uint64_t HttpChunkCache::get_size() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return size_;
+}
+
+bool HttpChunkCache::load(const String& key, int64_t index, std::vector<uint8_t>& data)
+{
+    auto name = std::string(key.utf8().get_data()) + "/" + std::to_string(index) + ".chunk";
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        scan();
+        auto it = lookup_.find(name);
+        if (it == lookup_.end()) {
+            return false;
+        }
+        entries_.splice(entries_.end(), entries_, it->second);
+    }
+
+    // Read without the lock, an eviction meanwhile only makes it a miss
+    auto file = FileAccess::open(get_path(name), FileAccess::READ);
+    if (file.is_null()) {
+        return false;
+    }
+    data.resize((size_t)file->get_length());
+    return file->get_buffer(data.data(), data.size()) == data.size();
+}
+
+void HttpChunkCache::store(const String& key, int64_t index, const uint8_t* data, size_t size)
+{
+    auto name = std::string(key.utf8().get_data()) + "/" + std::to_string(index) + ".chunk";
+    auto path = get_path(name);
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        scan();
+        if (lookup_.count(name) != 0 || size > capacity_) {
+            return;
+        }
+    }
+
+    // Written aside then renamed, so that a crash never leaves a truncated chunk
+    DirAccess::make_dir_recursive_absolute(path.get_base_dir());
+    static std::atomic<uint64_t> tmpSerial { 0 };
+    auto tmpPath = path + "." + itos((int64_t)tmpSerial.fetch_add(1)) + ".tmp"; // several streams may play the file
+    {
+        auto file = FileAccess::open(tmpPath, FileAccess::WRITE);
+        if (file.is_null()) {
+            ERR_PRINT("Cannot write the http cache file '" + tmpPath + "'");
+            return;
+        }
+        file->store_buffer(data, size);
+    }
+    if (DirAccess::rename_absolute(tmpPath, path) != OK) {
+        DirAccess::remove_absolute(tmpPath);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    if (lookup_.count(name) != 0) {
+        return; // stored by another stream meanwhile
+    }
+    entries_.push_back({ name, (uint64_t)size });
+    lookup_[name] = std::prev(entries_.end());
+    size_ += size;
+    evict();
+}
+
+void HttpChunkCache::clear()
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    scan();
+    while (!entries_.empty()) {
+        remove(entries_.begin());
+    }
+}
+
+String HttpChunkCache::get_path(const std::string& name)
+{
+    return String(kCacheDir) + "/" + String::utf8(name.c_str());
+}
+
+void HttpChunkCache::scan()
+{
+    if (scanned_) {
+        return;
+    }
+    scanned_ = true;
+    if (!DirAccess::dir_exists_absolute(kCacheDir)) {
+        return;
+    }
+
+    struct Found {
+        uint64_t modifiedTime { 0 };
+        Entry entry {};
+    };
+    std::vector<Found> found;
+    for (const auto& key : DirAccess::get_directories_at(kCacheDir)) {
+        auto dir = String(kCacheDir) + "/" + key;
+        for (const auto& fileName : DirAccess::get_files_at(dir)) {
+            auto path = dir + "/" + fileName;
+            if (fileName.ends_with(".tmp")) {
+                DirAccess::remove_absolute(path); // left by a crash
+                continue;
+            }
+            if (!fileName.ends_with(".chunk")) {
+                continue;
+            }
+            auto file = FileAccess::open(path, FileAccess::READ);
+            if (file.is_null()) {
+                continue;
+            }
+            Found f;
+            f.modifiedTime = FileAccess::get_modified_time(path);
+            f.entry.name   = std::string((key + "/" + fileName).utf8().get_data());
+            f.entry.size   = file->get_length();
+            found.push_back(std::move(f));
+        }
+    }
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.modifiedTime < b.modifiedTime; });
+    for (auto& f : found) {
+        size_ += f.entry.size;
+        entries_.push_back(std::move(f.entry));
+        lookup_[entries_.back().name] = std::prev(entries_.end());
+    }
+    evict();
+}
+
+void HttpChunkCache::evict()
+{
+    while (size_ > capacity_ && !entries_.empty()) {
+        remove(entries_.begin());
+    }
+}
+
+void HttpChunkCache::remove(std::list<Entry>::iterator it)
+{
+    DirAccess::remove_absolute(get_path(it->name));
+    size_ -= it->size;
+    lookup_.erase(it->name);
+    entries_.erase(it);
+}
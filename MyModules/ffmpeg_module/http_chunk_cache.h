@@ -0,0 +1,58 @@
+#pragma once
+
+#include <core/string/ustring.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Size-capped on-disk cache of the chunks HttpRangeSource downloads, shared by every stream.
+// A chunk is a file user://http_cache/<key>/<index>.chunk, the least recently used ones are deleted when the
+// cache grows over its capacity. The files left by the previous runs are found on first use, oldest first.
+// Any thread may use it.
+class HttpChunkCache {
+public:
+    static HttpChunkCache& get_singleton();
+
+    HttpChunkCache(const HttpChunkCache&)            = delete;
+    HttpChunkCache& operator=(const HttpChunkCache&) = delete;
+
+    void set_capacity(uint64_t bytes);
+    uint64_t get_capacity() const;
+
+    uint64_t get_size() const;
+
+    // Returns false if the chunk is not cached
+    bool load(const String& key, int64_t index, std::vector<uint8_t>& data);
+
+    void store(const String& key, int64_t index, const uint8_t* data, size_t size);
+
+    // Deletes every chunk
+    void clear();
+
+private:
+    HttpChunkCache() = default;
+
+    struct Entry {
+        std::string name; // <key>/<index>.chunk
+        uint64_t size { 0 };
+    };
+
+    static String get_path(const std::string& name);
+
+    // with mutex_ locked
+    void scan();
+    void evict();
+    void remove(std::list<Entry>::iterator it);
+
+private:
+    static constexpr const char* kCacheDir = "user://http_cache";
+
+    mutable std::mutex mutex_ {};
+    std::list<Entry> entries_ {}; // least recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> lookup_ {};
+    uint64_t size_ { 0 };
+    uint64_t capacity_ { 2ull * 1024 * 1024 * 1024 };
+    bool scanned_ { false };
+};
@@ -0,0 +1,322 @@
+#include "http_range_source.h"
+#include "http_chunk_cache.h"
+#include <algorithm>
+#include <core/os/os.h>
+#include <core/version.h>
+#include <cstring>
+
+HttpRangeSource::HttpRangeSource(int workerCount, int chunksAhead)
+    : workerCount_ { std::max(workerCount, 1) }
+    , chunksAhead_ { std::max(chunksAhead, 1) }
+{
+}
+
+HttpRangeSource::~HttpRangeSource()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        stopRequested_ = true;
+    }
+    workCv_.notify_all();
+    dataCv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+bool HttpRangeSource::open(const String& url)
+{
+    String scheme;
+    if (url.parse_url(scheme, host_, port_, path_) != OK) {
+        ERR_PRINT("Invalid url '" + url + "'");
+        return false;
+    }
+    tls_ = scheme == "https://";
+    if (port_ <= 0) {
+        port_ = tls_ ? 443 : 80;
+    }
+    if (path_.is_empty()) {
+        path_ = "/";
+    }
+
+    // The first byte, the length of the file comes with it
+    Connection connection;
+    int responseCode = 0;
+    List<String> headers;
+    if (!connect(connection) || !request(connection, 0, 1, responseCode, headers)) {
+        ERR_PRINT("Cannot connect to '" + url + "'");
+        return false;
+    }
+    if (responseCode != HTTPClient::RESPONSE_PARTIAL_CONTENT) {
+        ERR_PRINT(String("'{0}' answered {1} to a range request, it cannot be streamed").format(varray(url, responseCode)));
+        return false;
+    }
+    length_ = parse_content_range_length(headers);
+    if (length_ <= 0) {
+        ERR_PRINT("'" + url + "' did not tell the length of the file");
+        return false;
+    }
+
+    // A file replaced at the same url keeps its length more often than not, the validator tells them apart
+    auto validator = find_header(headers, "etag");
+    if (validator.is_empty()) {
+        validator = find_header(headers, "last-modified");
+    }
+    cacheKey_ = (url + ":" + itos(length_) + ":" + validator).md5_text();
+    for (int i = 0; i < workerCount_; ++i) {
+        workers_.emplace_back(&HttpRangeSource::worker_routine, this);
+    }
+    return true;
+}
+
+int HttpRangeSource::read(uint8_t* buf, int size)
+{
+    if (position_ >= length_) {
+        return 0;
+    }
+    auto index = position_ / kChunkSize;
+    if (index != currentIndex_) {
+        std::unique_lock<std::mutex> lck(mutex_);
+        if (readChunk_ != index) {
+            readChunk_ = index;
+            trim_chunks();
+            workCv_.notify_all();
+        }
+        auto isReady = [this, index]() { return chunks_.count(index) != 0 || failed_.count(index) != 0 || stopRequested_; };
+        if (!isReady()) {
+            auto stallBegin = OS::get_singleton()->get_ticks_usec();
+            dataCv_.wait(lck, isReady);
+            stalls_.record(OS::get_singleton()->get_ticks_usec() - stallBegin);
+        }
+        auto it = chunks_.find(index);
+        if (it == chunks_.end()) {
+            return 0;
+        }
+        current_      = it->second;
+        currentIndex_ = index;
+    }
+
+    auto offset = (size_t)(position_ - index * kChunkSize);
+    auto n      = (int)std::min<size_t>(size, current_->size() - offset);
+    memcpy(buf, current_->data() + offset, n);
+    position_ += n;
+    return n;
+}
+
+int64_t HttpRangeSource::seek(int64_t position)
+{
+    position_ = std::clamp<int64_t>(position, 0, length_);
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        failed_.clear(); // tried again
+        readChunk_ = position_ / kChunkSize;
+        trim_chunks();
+    }
+    workCv_.notify_all();
+    return position_;
+}
+
+HttpRangeSource::Stats HttpRangeSource::get_stats() const
+{
+    auto downloadUsec = downloadUsec_.load(std::memory_order_relaxed);
+    Stats stats;
+    stats.downloadedBytes     = downloadedBytes_.load(std::memory_order_relaxed);
+    stats.downloadMbPerSecond = downloadUsec == 0 ? 0.0 : (double)stats.downloadedBytes / (double)downloadUsec * workerCount_;
+    stats.cacheHits           = cacheHits_.load(std::memory_order_relaxed);
+    stats.cacheMisses         = cacheMisses_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void HttpRangeSource::reset_stats()
+{
+    downloadedBytes_.store(0, std::memory_order_relaxed);
+    downloadUsec_.store(0, std::memory_order_relaxed);
+    cacheHits_.store(0, std::memory_order_relaxed);
+    cacheMisses_.store(0, std::memory_order_relaxed);
+    stalls_.reset();
+}
+
+void HttpRangeSource::worker_routine()
+{
+    auto& cache = HttpChunkCache::get_singleton();
+    Connection connection;
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    while (true) {
+        workCv_.wait(lck, [this]() { return stopRequested_ || next_chunk_to_fetch() >= 0; });
+        if (stopRequested_) {
+            break;
+        }
+        auto index = next_chunk_to_fetch();
+        fetching_.insert(index);
+        lck.unlock();
+
+        auto expectedSize = (size_t)std::min(kChunkSize, length_ - index * kChunkSize);
+        auto data         = std::make_shared<std::vector<uint8_t>>();
+        bool ok           = cache.load(cacheKey_, index, *data) && data->size() == expectedSize;
+        if (ok) {
+            cacheHits_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            for (int attempt = 0; attempt < kMaxAttempts && !ok && !stopRequested_; ++attempt) {
+                ok = connect(connection) && download(connection, index, *data);
+                if (!ok && connection.client.is_valid()) {
+                    connection.client->close(); // reconnects for the next attempt
+                }
+            }
+            if (ok) {
+                cacheMisses_.fetch_add(1, std::memory_order_relaxed);
+                cache.store(cacheKey_, index, data->data(), data->size());
+            }
+        }
+
+        lck.lock();
+        fetching_.erase(index);
+        if (ok) {
+            chunks_[index] = std::move(data);
+            trim_chunks();
+        } else {
+            ERR_PRINT(String("Failed to download {0} at offset {1}").format(varray(host_ + path_, index * kChunkSize)));
+            failed_.insert(index);
+        }
+        dataCv_.notify_all();
+    }
+}
+
+int64_t HttpRangeSource::next_chunk_to_fetch() const
+{
+    auto end = std::min(readChunk_ + chunksAhead_, (length_ + kChunkSize - 1) / kChunkSize);
+    for (auto i = readChunk_; i < end; ++i) {
+        if (chunks_.count(i) == 0 && fetching_.count(i) == 0 && failed_.count(i) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void HttpRangeSource::trim_chunks()
+{
+    chunks_.erase(chunks_.begin(), chunks_.lower_bound(readChunk_ - kChunksKeptBehind));
+    chunks_.erase(chunks_.lower_bound(readChunk_ + chunksAhead_), chunks_.end());
+}
+
+bool HttpRangeSource::connect(Connection& connection)
+{
+    if (connection.client.is_null()) {
+        connection.client = Ref<HTTPClient>(HTTPClient::create());
+        connection.client->set_read_chunk_size(256 * 1024);
+    }
+    auto& client = connection.client;
+    if (client->get_status() == HTTPClient::STATUS_CONNECTED) {
+        return true; // kept alive
+    }
+    client->close();
+#if VERSION_MAJOR == 4 && VERSION_MINOR == 0
+    auto error = client->connect_to_host(host_, port_, tls_);
+#else
+    auto error = client->connect_to_host(host_, port_, tls_ ? TLSOptions::client() : Ref<TLSOptions>());
+#endif
+    if (error != OK) {
+        return false;
+    }
+
+    auto begin = OS::get_singleton()->get_ticks_usec();
+    while (client->get_status() == HTTPClient::STATUS_RESOLVING || client->get_status() == HTTPClient::STATUS_CONNECTING) {
+        if (stopRequested_ || OS::get_singleton()->get_ticks_usec() - begin > kTimeoutUsec) {
+            return false;
+        }
+        client->poll();
+        OS::get_singleton()->delay_usec(1000);
+    }
+    return client->get_status() == HTTPClient::STATUS_CONNECTED;
+}
+
+bool HttpRangeSource::request(Connection& connection, int64_t from, int64_t size, int& responseCode, List<String>& headers)
+{
+    auto& client = connection.client;
+    Vector<String> requestHeaders;
+    requestHeaders.push_back(String("Range: bytes={0}-{1}").format(varray(from, from + size - 1)));
+    client->set_blocking_mode(false);
+    if (client->request(HTTPClient::METHOD_GET, path_, requestHeaders, nullptr, 0) != OK) {
+        return false;
+    }
+
+    auto begin = OS::get_singleton()->get_ticks_usec();
+    while (client->get_status() == HTTPClient::STATUS_REQUESTING) {
+        if (stopRequested_ || OS::get_singleton()->get_ticks_usec() - begin > kTimeoutUsec) {
+            return false;
+        }
+        client->poll();
+        OS::get_singleton()->delay_usec(500);
+    }
+    if (client->get_status() != HTTPClient::STATUS_BODY && client->get_status() != HTTPClient::STATUS_CONNECTED) {
+        return false;
+    }
+    responseCode = client->get_response_code();
+    headers.clear();
+    client->get_response_headers(&headers);
+    return true;
+}
+
+bool HttpRangeSource::download(Connection& connection, int64_t index, std::vector<uint8_t>& data)
+{
+    auto from = index * kChunkSize;
+    auto size = std::min(kChunkSize, length_ - from);
+    int responseCode = 0;
+    List<String> headers;
+    auto begin = OS::get_singleton()->get_ticks_usec();
+    if (!request(connection, from, size, responseCode, headers)) {
+        return false;
+    }
+    if (responseCode != HTTPClient::RESPONSE_PARTIAL_CONTENT) {
+        ERR_PRINT(String("Range request answered with {0}").format(varray(responseCode)));
+        return false;
+    }
+
+    // Read without blocking, so that a server stalling in the middle of the body cannot hold the worker (and the
+    // destructor joining it) forever. The connection stays open for the next chunk.
+    auto& client = connection.client;
+    data.resize((size_t)size);
+    int64_t received = 0;
+    auto lastData    = OS::get_singleton()->get_ticks_usec();
+    while (client->get_status() == HTTPClient::STATUS_BODY && !stopRequested_) {
+        client->poll();
+        auto part = client->read_response_body_chunk();
+        auto n    = std::min<int64_t>(part.size(), size - received);
+        if (n > 0) {
+            memcpy(data.data() + received, part.ptr(), n);
+            received += n;
+            lastData = OS::get_singleton()->get_ticks_usec();
+        } else if (OS::get_singleton()->get_ticks_usec() - lastData > kTimeoutUsec) {
+            ERR_PRINT(String("{0} stalled for {1} s in a body").format(varray(host_, kTimeoutUsec / 1000000)));
+            break;
+        } else if (part.is_empty()) {
+            OS::get_singleton()->delay_usec(500);
+        }
+    }
+    downloadedBytes_.fetch_add((uint64_t)received, std::memory_order_relaxed);
+    downloadUsec_.fetch_add(OS::get_singleton()->get_ticks_usec() - begin, std::memory_order_relaxed);
+    return received == size;
+}
+
+String HttpRangeSource::find_header(const List<String>& headers, const String& name)
+{
+    auto prefix = name + ":";
+    for (const auto& header : headers) {
+        if (header.to_lower().begins_with(prefix)) {
+            return header.substr(prefix.length()).strip_edges();
+        }
+    }
+    return String();
+}
+
+int64_t HttpRangeSource::parse_content_range_length(const List<String>& headers)
+{
+    // Content-Range: bytes 0-0/123456
+    for (const auto& header : headers) {
+        if (header.to_lower().begins_with("content-range:")) {
+            auto total = header.get_slice("/", 1).strip_edges();
+            return total.is_valid_int() ? total.to_int() : -1;
+        }
+    }
+    return -1;
+}
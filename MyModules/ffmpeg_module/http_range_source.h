@@ -0,0 +1,122 @@
+#pragma once
+
+#include "perf_counters.h"
+#include <atomic>
+#include <condition_variable>
+#include <core/io/http_client.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Streams a file from an HTTP/1.1 server for AvIoContextWrapper, with Range requests of kChunkSize bytes.
+// Worker threads, each with its own keep-alive connection, download the chunks after the read position in
+// parallel. Downloaded chunks go to the shared HttpChunkCache, so seeking back and playing the file again do not
+// download them twice. The cached chunks are keyed by the url, the length and the ETag or Last-Modified of the
+// file. The server must answer range requests with 206 Partial Content.
+// One thread at a time may read and seek.
+class HttpRangeSource {
+public:
+    struct Stats {
+        uint64_t downloadedBytes { 0 };
+        double downloadMbPerSecond { 0 }; // while the workers were downloading, estimated for all of them together
+        uint64_t cacheHits { 0 };         // chunks loaded from the disk cache
+        uint64_t cacheMisses { 0 };       // chunks downloaded
+    };
+
+    // workerCount connections download up to chunksAhead chunks after the read position
+    explicit HttpRangeSource(int workerCount = 3, int chunksAhead = 8);
+    ~HttpRangeSource();
+
+    HttpRangeSource(const HttpRangeSource&)            = delete;
+    HttpRangeSource& operator=(const HttpRangeSource&) = delete;
+
+    static bool is_http_url(const String& path) { return path.begins_with("http://") || path.begins_with("https://"); }
+
+    // Asks the server for the length of the file and starts the workers, returns false on failure
+    bool open(const String& url);
+
+    bool is_open() const { return !workers_.empty(); }
+
+    // Waits for the chunk at the read position, returns 0 at the end of the file or when it cannot be downloaded
+    int read(uint8_t* buf, int size);
+
+    // position is clamped to the file, returns the new position
+    int64_t seek(int64_t position);
+
+    int64_t get_position() const { return position_; }
+    int64_t get_length() const { return length_; }
+
+    Stats get_stats() const;
+
+    // The reads that waited for a chunk, per read
+    const DurationStats& get_stalls() const { return stalls_; }
+
+    void reset_stats();
+
+private:
+    using Chunk = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Connection {
+        Ref<HTTPClient> client {};
+    };
+
+    void worker_routine();
+
+    // with mutex_ locked, the first wanted chunk nobody has or downloads, -1 if there is none
+    int64_t next_chunk_to_fetch() const;
+
+    // with mutex_ locked, drops the chunks far from the read position
+    void trim_chunks();
+
+    // Worker threads, connects unless the connection is kept alive
+    bool connect(Connection& connection);
+
+    // Sends a request for size bytes at from and waits for the response headers
+    bool request(Connection& connection, int64_t from, int64_t size, int& responseCode, List<String>& headers);
+
+    bool download(Connection& connection, int64_t index, std::vector<uint8_t>& data);
+
+    static int64_t parse_content_range_length(const List<String>& headers);
+
+    // The value of the header name (lower case), empty if there is none
+    static String find_header(const List<String>& headers, const String& name);
+
+private:
+    static constexpr int64_t kChunkSize    = 1024 * 1024;
+    static constexpr int kMaxAttempts      = 3;
+    static constexpr int kChunksKeptBehind = 2;
+    static constexpr uint64_t kTimeoutUsec = 10 * 1000 * 1000;
+
+    int workerCount_ { 3 };
+    int chunksAhead_ { 8 };
+
+    String host_ {};
+    int port_ { 80 };
+    bool tls_ { false };
+    String path_ {};
+    String cacheKey_ {};
+    int64_t length_ { 0 };
+    int64_t position_ { 0 }; // reader only
+
+    mutable std::mutex mutex_ {};
+    std::condition_variable workCv_ {};
+    std::condition_variable dataCv_ {};
+    int64_t readChunk_ { 0 }; // the chunk at the read position
+    std::map<int64_t, Chunk> chunks_ {};
+    std::set<int64_t> fetching_ {};
+    std::set<int64_t> failed_ {}; // cleared by seek()
+    std::atomic<bool> stopRequested_ { false };
+    std::vector<std::thread> workers_ {};
+
+    Chunk current_ {}; // reader only, the chunk at readChunk_
+    int64_t currentIndex_ { -1 };
+
+    std::atomic<uint64_t> downloadedBytes_ { 0 };
+    std::atomic<uint64_t> downloadUsec_ { 0 };
+    std::atomic<uint64_t> cacheHits_ { 0 };
+    std::atomic<uint64_t> cacheMisses_ { 0 };
+    DurationStats stalls_ {};
+};
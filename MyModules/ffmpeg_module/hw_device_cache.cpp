@@ -0,0 +1,67 @@
+#include "hw_device_cache.h"
+
+HwDeviceCache& HwDeviceCache::get_singleton()
+{
+    static HwDeviceCache cache;
+    return cache;
+}
+
+AVBufferRef* HwDeviceCache::acquire(AVHWDeviceType type, int* err)
+{
+    // Created with the lock held, so that streams opening at the same time share the device instead of racing
+    std::unique_lock<std::mutex> lck(mutex_);
+    auto it = devices_.find(type);
+    if (it != devices_.end()) {
+        ++reused_;
+        return av_buffer_ref(it->second);
+    }
+
+    AVBufferRef* device { nullptr };
+    int ret = factory_ != nullptr ? factory_(&device, type) : av_hwdevice_ctx_create(&device, type, nullptr, nullptr, 0);
+    if (err != nullptr) {
+        *err = ret;
+    }
+    if (ret < 0) {
+        return nullptr;
+    }
+    ++created_;
+    devices_[type] = device;
+    return av_buffer_ref(device);
+}
+
+void HwDeviceCache::release(AVBufferRef* device)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    av_buffer_unref(&device);
+    trim_locked();
+}
+
+void HwDeviceCache::trim()
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    trim_locked();
+}
+
+void HwDeviceCache::trim_locked()
+{
+    for (auto it = devices_.begin(); it != devices_.end();) {
+        if (av_buffer_get_ref_count(it->second) == 1) {
+            av_buffer_unref(&it->second);
+            it = devices_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+HwDeviceCache::Stats HwDeviceCache::get_stats() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return Stats { created_, reused_, (uint32_t)devices_.size() };
+}
+
+void HwDeviceCache::set_factory(Factory factory)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    factory_ = factory;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/hwcontext.h>
+}
+
+// Hardware device contexts shared by every stream, one per AVHWDeviceType. Creating a device is one of the slowest
+// parts of opening a file, with the cache only the first stream using a type pays for it.
+// Devices are reference counted by ffmpeg: the cache keeps one reference and drops it once nothing else references the
+// device, neither a stream nor a codec context, idle ones in CodecContextPool included. Any thread may use it.
+class HwDeviceCache {
+public:
+    // Creates a device of type into *device, returns 0 or an ffmpeg error like av_hwdevice_ctx_create()
+    using Factory = int (*)(AVBufferRef** device, AVHWDeviceType type);
+
+    struct Stats {
+        uint64_t created { 0 }; // devices created
+        uint64_t reused { 0 };  // acquire() calls served from the cache
+        uint32_t devices { 0 }; // cached now
+    };
+
+    static HwDeviceCache& get_singleton();
+
+    HwDeviceCache(const HwDeviceCache&)            = delete;
+    HwDeviceCache& operator=(const HwDeviceCache&) = delete;
+
+    // A new reference to the device of type, created if none is cached.
+    // Returns null on failure, with the ffmpeg error in err.
+    AVBufferRef* acquire(AVHWDeviceType type, int* err = nullptr);
+
+    // Unreferences a device returned by acquire(), then trims
+    void release(AVBufferRef* device);
+
+    // Drops the devices only the cache references
+    void trim();
+
+    Stats get_stats() const;
+
+    // Replaces av_hwdevice_ctx_create(), null restores it. For the self tests, which count references without hardware.
+    void set_factory(Factory factory);
+
+private:
+    HwDeviceCache() = default;
+
+    // with mutex_ locked
+    void trim_locked();
+
+private:
+    mutable std::mutex mutex_ {};
+    std::map<AVHWDeviceType, AVBufferRef*> devices_ {}; // the references of the cache
+    uint64_t created_ { 0 };
+    uint64_t reused_ { 0 };
+    Factory factory_ { nullptr };
+};
+
+struct HwDeviceReleaser {
+    void operator()(AVBufferRef* device)
+    {
+        if (device) {
+            HwDeviceCache::get_singleton().release(device);
+        }
+    }
+};
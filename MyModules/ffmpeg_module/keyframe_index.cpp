@@ -0,0 +1,57 @@
+#include "keyframe_index.h"
+#include <algorithm>
+
+void KeyframeIndex::clear()
+{
+    keyframes_.clear();
+    imported_ = false;
+    complete_ = false;
+}
+
+void KeyframeIndex::import_stream_index(AVStream* stream)
+{
+    if (imported_) {
+        return;
+    }
+    imported_ = true;
+    if (stream->codecpar->video_delay > 0) {
+        return; // B-frames, a decoding timestamp would be off by the reordering delay
+    }
+
+    int count = avformat_index_get_entries_count(stream);
+    keyframes_.reserve(keyframes_.size() + count);
+    for (int i = 0; i < count; ++i) {
+        const AVIndexEntry* entry = avformat_index_get_entry(stream, i);
+        if (entry != nullptr && (entry->flags & AVINDEX_KEYFRAME) && entry->timestamp != AV_NOPTS_VALUE) {
+            keyframes_.push_back(entry->timestamp);
+        }
+    }
+    std::sort(keyframes_.begin(), keyframes_.end());
+    keyframes_.erase(std::unique(keyframes_.begin(), keyframes_.end()), keyframes_.end());
+    complete_ = count > 0;
+}
+
+void KeyframeIndex::add(int64_t pts)
+{
+    if (pts == AV_NOPTS_VALUE) {
+        return;
+    }
+    // Packets are mostly read in order, so this is usually an append
+    if (keyframes_.empty() || keyframes_.back() < pts) {
+        keyframes_.push_back(pts);
+        return;
+    }
+    auto it = std::lower_bound(keyframes_.begin(), keyframes_.end(), pts);
+    if (it == keyframes_.end() || *it != pts) {
+        keyframes_.insert(it, pts);
+    }
+}
+
+int64_t KeyframeIndex::find_at_or_before(int64_t pts) const
+{
+    auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), pts);
+    if (it == keyframes_.begin()) {
+        return AV_NOPTS_VALUE;
+    }
+    return *(it - 1);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "structs.h"
+#include <vector>
+
+// Sorted presentation timestamps of the keyframes of one stream, in the stream time base.
+// It is filled lazily: from the demuxer's own index the first time it is needed, and from
+// every keyframe the demuxer reads. Only presentation timestamps are stored, never decoding ones.
+class KeyframeIndex {
+public:
+    void clear();
+
+    // Merge the entries libavformat has already collected for the stream, only done once. Some demuxers index
+    // decoding timestamps, so the entries are only taken when frames are not reordered and both are the same.
+    void import_stream_index(AVStream* stream);
+
+    // pts of a keyframe, AV_NOPTS_VALUE is ignored
+    void add(int64_t pts);
+
+    // Returns the last keyframe at or before pts, or AV_NOPTS_VALUE if there is none
+    int64_t find_at_or_before(int64_t pts) const;
+
+    size_t size() const { return keyframes_.size(); }
+
+    // Whether every keyframe of the stream is known, only when the demuxer's index could be imported. Otherwise a
+    // keyframe not read yet may lie between the one find_at_or_before() returns and the pts looked for.
+    bool is_complete() const { return complete_; }
+
+private:
+    std::vector<int64_t> keyframes_ {};
+    bool imported_ { false };
+    bool complete_ { false };
+};
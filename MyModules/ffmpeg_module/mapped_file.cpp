@@ -0,0 +1,133 @@
+#include "mapped_file.h"
+#include <algorithm>
+#include <core/config/project_settings.h>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const String& filePath)
+{
+    close();
+    if (filePath.begins_with("res://")) {
+        return false; // may be inside a pck
+    }
+    auto path = ProjectSettings::get_singleton()->globalize_path(filePath);
+
+#ifdef _WIN32
+    HANDLE file = CreateFileW((LPCWSTR)path.utf16().get_data(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size {};
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file); // the mapping keeps the file open
+    if (mapping == nullptr) {
+        return false;
+    }
+    auto* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr) {
+        CloseHandle(mapping);
+        return false;
+    }
+    mapping_ = mapping;
+    length_  = size.QuadPart;
+#else
+    int fd = ::open(path.utf8().get_data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    auto* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    length_ = st.st_size;
+#endif
+    data_            = (const uint8_t*)data;
+    position_        = 0;
+    advisedPosition_ = -1;
+    advise();
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (data_ == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    mapping_ = nullptr;
+#else
+    munmap((void*)data_, (size_t)length_);
+#endif
+    data_     = nullptr;
+    length_   = 0;
+    position_ = 0;
+}
+
+int MappedFile::read(uint8_t* buf, int size)
+{
+    auto n = (int)std::min<int64_t>(size, length_ - position_);
+    if (n <= 0) {
+        return 0;
+    }
+    memcpy(buf, data_ + position_, n);
+    position_ += n;
+    advise();
+    return n;
+}
+
+int64_t MappedFile::seek(int64_t position)
+{
+    position_ = std::clamp<int64_t>(position, 0, length_);
+    advise();
+    return position_;
+}
+
+void MappedFile::advise()
+{
+    if (advisedPosition_ >= 0 && position_ >= advisedPosition_ && position_ - advisedPosition_ < kAdviseStep) {
+        return;
+    }
+#ifndef _WIN32
+    static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+    auto pageFloor                = [](int64_t offset) { return offset / pageSize * pageSize; };
+
+    auto aheadBegin = pageFloor(position_);
+    auto aheadEnd   = std::min(position_ + kAdviseWindow, length_);
+    if (aheadEnd > aheadBegin) {
+        madvise((void*)(data_ + aheadBegin), (size_t)(aheadEnd - aheadBegin), MADV_WILLNEED);
+    }
+    // Only drops the pages from the mapping, they stay in the page cache for the seeks going back
+    auto behindEnd   = pageFloor(std::max<int64_t>(position_ - kAdviseWindow, 0));
+    auto behindBegin = advisedPosition_ < 0 ? 0 : pageFloor(std::max<int64_t>(advisedPosition_ - kAdviseWindow, 0));
+    if (behindEnd > behindBegin) {
+        madvise((void*)(data_ + behindBegin), (size_t)(behindEnd - behindBegin), MADV_DONTNEED);
+    }
+#endif
+    advisedPosition_ = position_;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <core/string/ustring.h>
+#include <cstdint>
+
+// Read-only memory mapping of a local file for AvIoContextWrapper: reads are copied straight from the page cache
+// into the AVIO buffer, without the FileAccess calls and their intermediate copy, and probing only touches the
+// pages libavformat looks at. The kernel is told the file is read sequentially, and the window after the read
+// position is requested ahead of time as the position moves; the pages far behind it are released (hints are
+// POSIX only).
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // user:// and native paths, returns false if the file cannot be mapped
+    bool open(const String& filePath);
+
+    void close();
+
+    bool is_open() const { return data_ != nullptr; }
+
+    // Returns 0 at the end of the file
+    int read(uint8_t* buf, int size);
+
+    // position is clamped to the file, returns the new position
+    int64_t seek(int64_t position);
+
+    int64_t get_position() const { return position_; }
+    int64_t get_length() const { return length_; }
+
+private:
+    // Hints the kernel about the pages around position_
+    void advise();
+
+private:
+    static constexpr int64_t kAdviseWindow = 8 * 1024 * 1024; // requested ahead, kept behind
+    static constexpr int64_t kAdviseStep   = 1024 * 1024;     // the position moves this much between two hints
+
+    const uint8_t* data_ { nullptr };
+    int64_t length_ { 0 };
+    int64_t position_ { 0 };
+    int64_t advisedPosition_ { -1 }; // the position of the last hint
+#ifdef _WIN32
+    void* mapping_ { nullptr };
+#endif
+};
@@ -0,0 +1,194 @@
+#include "panorama_mesh.h"
+
+void PanoramaMesh::_bind_methods()
+{
+    ClassDB::bind_method(D_METHOD("set_layout", "layout"), &PanoramaMesh::set_layout);
+    ClassDB::bind_method(D_METHOD("get_layout"), &PanoramaMesh::get_layout);
+    ClassDB::bind_method(D_METHOD("set_radius", "radius"), &PanoramaMesh::set_radius);
+    ClassDB::bind_method(D_METHOD("get_radius"), &PanoramaMesh::get_radius);
+    ClassDB::bind_method(D_METHOD("set_radial_segments", "segments"), &PanoramaMesh::set_radial_segments);
+    ClassDB::bind_method(D_METHOD("get_radial_segments"), &PanoramaMesh::get_radial_segments);
+    ClassDB::bind_method(D_METHOD("set_rings", "rings"), &PanoramaMesh::set_rings);
+    ClassDB::bind_method(D_METHOD("get_rings"), &PanoramaMesh::get_rings);
+    ClassDB::bind_method(D_METHOD("set_band_densities", "densities"), &PanoramaMesh::set_band_densities);
+    ClassDB::bind_method(D_METHOD("get_band_densities"), &PanoramaMesh::get_band_densities);
+
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "layout", PROPERTY_HINT_ENUM, "Equirect,Equirect 180,EAC"), "set_layout", "get_layout");
+    ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "radius", PROPERTY_HINT_RANGE, "0.001,1000,0.001,or_greater"), "set_radius", "get_radius");
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "radial_segments", PROPERTY_HINT_RANGE, "4,256,1"), "set_radial_segments", "get_radial_segments");
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "rings", PROPERTY_HINT_RANGE, "2,256,1"), "set_rings", "get_rings");
+    ADD_PROPERTY(PropertyInfo(Variant::PACKED_FLOAT32_ARRAY, "band_densities"), "set_band_densities", "get_band_densities");
+
+    BIND_ENUM_CONSTANT(kLayoutEquirect);
+    BIND_ENUM_CONSTANT(kLayoutEquirect180);
+    BIND_ENUM_CONSTANT(kLayoutEac);
+}
+
+void PanoramaMesh::set_layout(Layout layout)
+{
+    layout_ = layout;
+    request_update();
+}
+
+void PanoramaMesh::set_radius(float radius)
+{
+    radius_ = radius;
+    request_update();
+}
+
+void PanoramaMesh::set_radial_segments(int segments)
+{
+    radialSegments_ = MAX(segments, 4);
+    request_update();
+}
+
+void PanoramaMesh::set_rings(int rings)
+{
+    rings_ = MAX(rings, 2);
+    request_update();
+}
+
+void PanoramaMesh::set_band_densities(const PackedFloat32Array& densities)
+{
+    bandDensities_ = densities;
+    request_update();
+}
+
+void PanoramaMesh::_create_mesh_array(Array& arr) const
+{
+    PackedVector3Array vertices;
+    PackedVector3Array normals;
+    PackedVector2Array uvs;
+    PackedInt32Array indices;
+    if (layout_ == kLayoutEac) {
+        create_eac(vertices, normals, uvs, indices);
+    } else {
+        create_equirect(vertices, normals, uvs, indices);
+    }
+    arr[RS::ARRAY_VERTEX] = vertices;
+    arr[RS::ARRAY_NORMAL] = normals;
+    arr[RS::ARRAY_TEX_UV] = uvs;
+    arr[RS::ARRAY_INDEX]  = indices;
+}
+
+Vector<float> PanoramaMesh::get_ring_latitudes() const
+{
+    Vector<float> latitudes;
+    float total = 0.0f;
+    for (int i = 0; i < bandDensities_.size(); ++i) {
+        total += MAX(bandDensities_[i], 0.0f);
+    }
+    if (total <= 0.0f) {
+        for (int i = 0; i <= rings_; ++i) {
+            latitudes.push_back((float)i / rings_);
+        }
+        return latitudes;
+    }
+
+    auto bandCount = bandDensities_.size();
+    latitudes.push_back(0.0f);
+    for (int band = 0; band < bandCount; ++band) {
+        auto rings = MAX((int)Math::round(rings_ * MAX(bandDensities_[band], 0.0f) / total), 1);
+        auto top   = (float)band / bandCount;
+        for (int i = 1; i <= rings; ++i) {
+            latitudes.push_back(top + (float)i / rings / bandCount);
+        }
+    }
+    return latitudes;
+}
+
+void PanoramaMesh::create_equirect(PackedVector3Array& vertices, PackedVector3Array& normals, PackedVector2Array& uvs, PackedInt32Array& indices) const
+{
+    // u covers 360 degrees of longitude, or the 180 degrees in front of the viewer
+    bool half        = layout_ == kLayoutEquirect180;
+    auto latitudes   = get_ring_latitudes();
+    auto segments    = half ? MAX(radialSegments_ / 2, 2) : radialSegments_;
+    auto columnCount = segments + 1; // the seam column is duplicated
+    auto lastRing    = latitudes.size() - 1;
+    for (int ring = 0; ring < latitudes.size(); ++ring) {
+        auto v     = latitudes[ring];
+        auto theta = v * Math_PI;
+        for (int i = 0; i < columnCount; ++i) {
+            auto u = (float)i / segments;
+            // At the poles every vertex of the ring is at the same place, its u is the center of the only
+            // triangle using it: column i + 1 closes segment i at the north pole, column i opens it at the south one
+            if (ring == 0) {
+                u = MAX(u - 0.5f / segments, 0.0f);
+            } else if (ring == lastRing) {
+                u = MIN(u + 0.5f / segments, 1.0f);
+            }
+            auto phi = half ? Math_PI * (1.0f + u) : Math_TAU * u; // from the left to the right for 180 degrees
+            // Same mapping as the panorama shaders: u = atan(z, x) / 2pi, v = acos(y) / pi
+            Vector3 dir(Math::sin(theta) * Math::cos(phi), Math::cos(theta), Math::sin(theta) * Math::sin(phi));
+            vertices.push_back(dir * radius_);
+            normals.push_back(-dir); // seen from the inside
+            uvs.push_back(Vector2(u, v));
+        }
+    }
+    for (int ring = 0; ring + 1 < latitudes.size(); ++ring) {
+        for (int i = 0; i < segments; ++i) {
+            auto a = ring * columnCount + i;
+            auto b = a + columnCount;
+            // clockwise seen from the inside, without the triangles collapsed on a pole
+            if (ring != 0) {
+                indices.push_back(a);
+                indices.push_back(a + 1);
+                indices.push_back(b);
+            }
+            if (ring + 1 != lastRing) {
+                indices.push_back(a + 1);
+                indices.push_back(b + 1);
+                indices.push_back(b);
+            }
+        }
+    }
+}
+
+void PanoramaMesh::create_eac(PackedVector3Array& vertices, PackedVector3Array& normals, PackedVector2Array& uvs, PackedInt32Array& indices) const
+{
+    struct Face {
+        Vector3 center;
+        Vector3 right; // texture x
+        Vector3 up;    // texture -y
+        int column;
+        int row;
+    };
+    // clang-format off
+    static const Face kFaces[] = {
+        { Vector3(-1, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0),  0, 0 }, // left
+        { Vector3(0, 0, -1), Vector3(1, 0, 0),  Vector3(0, 1, 0),  1, 0 }, // front
+        { Vector3(1, 0, 0),  Vector3(0, 0, 1),  Vector3(0, 1, 0),  2, 0 }, // right
+        { Vector3(0, -1, 0), Vector3(0, 0, -1), Vector3(-1, 0, 0), 0, 1 }, // down
+        { Vector3(0, 0, 1),  Vector3(0, 1, 0),  Vector3(1, 0, 0),  1, 1 }, // back
+        { Vector3(0, 1, 0),  Vector3(0, 0, 1),  Vector3(-1, 0, 0), 2, 1 }, // up
+    };
+    // clang-format on
+
+    // Equi-angular: the texture is uniform in angle, a face texel at s in [-1, 1] is at tan(s * pi / 4) on the cube
+    auto segments = MAX(radialSegments_ / 4, 2);
+    for (const auto& face : kFaces) {
+        auto base = (int)vertices.size();
+        for (int j = 0; j <= segments; ++j) {
+            auto sy = 1.0f - 2.0f * j / segments;
+            for (int i = 0; i <= segments; ++i) {
+                auto sx  = 2.0f * i / segments - 1.0f;
+                auto dir = (face.center + face.right * Math::tan(sx * (float)Math_PI / 4.0f) + face.up * Math::tan(sy * (float)Math_PI / 4.0f)).normalized();
+                vertices.push_back(dir * radius_);
+                normals.push_back(-dir);
+                uvs.push_back(Vector2((face.column + (float)i / segments) / 3.0f, (face.row + (float)j / segments) / 2.0f));
+            }
+        }
+        for (int j = 0; j < segments; ++j) {
+            for (int i = 0; i < segments; ++i) {
+                auto a = base + j * (segments + 1) + i;
+                auto b = a + segments + 1;
+                indices.push_back(a);
+                indices.push_back(a + 1);
+                indices.push_back(b);
+                indices.push_back(a + 1);
+                indices.push_back(b + 1);
+                indices.push_back(b);
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <scene/resources/primitive_meshes.h>
+
+// A sphere around the viewer whose texture coordinates map a panoramic video frame, so that the materials
+// only sample the planes (the *_3D shaders) instead of computing the direction and calling atan/acos for
+// every fragment like the *_Panorama shaders do. The mapping matches the *_Panorama shaders, u = atan(z, x) / 2pi:
+// the center of an equirectangular frame is at -X, its left edge at +X. The 180 degrees layout centers its frame
+// at -Z and the cubemap layout its front face. Vertices are duplicated along the texture seams.
+class PanoramaMesh : public PrimitiveMesh {
+    GDCLASS(PanoramaMesh, PrimitiveMesh);
+
+public:
+    enum Layout : int {
+        kLayoutEquirect,    // 360 x 180 degrees equirectangular
+        kLayoutEquirect180, // front half only, 180 x 180 degrees (VR180)
+        kLayoutEac,         // equi-angular cubemap in 3 x 2 faces: left, front, right, then down, back
+                            // and up rotated 90 degrees clockwise
+    };
+
+    PanoramaMesh() = default;
+
+    void set_layout(Layout layout);
+    Layout get_layout() const { return layout_; }
+
+    void set_radius(float radius);
+    float get_radius() const { return radius_; }
+
+    // Equirectangular layouts: segments around the full circle. Cubemap layout: a quarter of them along a face edge.
+    void set_radial_segments(int segments);
+    int get_radial_segments() const { return radialSegments_; }
+
+    // Equirectangular layouts only, rings from pole to pole
+    void set_rings(int rings);
+    int get_rings() const { return rings_; }
+
+    // Equirectangular layouts only. The latitudes are split into as many bands of equal height as there are
+    // densities, band i gets a share of the rings proportional to densities[i], from the north pole down.
+    // Empty spreads the rings evenly.
+    void set_band_densities(const PackedFloat32Array& densities);
+    PackedFloat32Array get_band_densities() const { return bandDensities_; }
+
+protected:
+    static void _bind_methods();
+
+    void _create_mesh_array(Array& arr) const override;
+
+private:
+    // Latitudes of the rings in [0, 1] from the north pole, both poles included
+    Vector<float> get_ring_latitudes() const;
+
+    void create_equirect(PackedVector3Array& vertices, PackedVector3Array& normals, PackedVector2Array& uvs, PackedInt32Array& indices) const;
+
+    void create_eac(PackedVector3Array& vertices, PackedVector3Array& normals, PackedVector2Array& uvs, PackedInt32Array& indices) const;
+
+private:
+    Layout layout_ { kLayoutEquirect };
+    float radius_ { 1.0f };
+    int radialSegments_ { 64 };
+    int rings_ { 32 };
+    PackedFloat32Array bandDensities_ {};
+};
+
+VARIANT_ENUM_CAST(PanoramaMesh::Layout);
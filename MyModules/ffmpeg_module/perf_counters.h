@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// Lock-free distribution of durations in microseconds: any thread may record, any thread may read.
+// Values are kept in logarithmic buckets with 4 sub-buckets per power of two, so percentiles are
+// accurate to about 12%.
+class DurationStats {
+public:
+    void record(uint64_t usec)
+    {
+        buckets_[bucket_of(usec)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sumUsec_.fetch_add(usec, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    double mean_ms() const
+    {
+        auto n = count();
+        return n == 0 ? 0.0 : sumUsec_.load(std::memory_order_relaxed) / 1000.0 / (double)n;
+    }
+
+    // p in [0, 1], returns the middle of the bucket holding the percentile
+    double percentile_ms(double p) const
+    {
+        auto n = count();
+        if (n == 0) {
+            return 0.0;
+        }
+        auto target    = std::min((uint64_t)(p * (double)n), n - 1);
+        uint64_t total = 0;
+        for (int i = 0; i < kBucketCount; ++i) {
+            total += buckets_[i].load(std::memory_order_relaxed);
+            if (total > target) {
+                return (bucket_lower(i) + bucket_lower(i + 1)) / 2.0 / 1000.0;
+            }
+        }
+        return bucket_lower(kBucketCount) / 1000.0;
+    }
+
+    // Not atomic as a whole, concurrent records may be partially kept
+    void reset()
+    {
+        for (auto& b : buckets_) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sumUsec_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int kMaxExponent = 40; // about 12 days
+    static constexpr int kBucketCount = 4 + (kMaxExponent - 1) * 4;
+
+    static int bucket_of(uint64_t v)
+    {
+        if (v < 4) {
+            return (int)v;
+        }
+        int msb = 0;
+        while ((v >> msb) > 1) {
+            ++msb;
+        }
+        if (msb > kMaxExponent) {
+            return kBucketCount - 1;
+        }
+        auto sub = (int)((v >> (msb - 2)) & 3);
+        return 4 + (msb - 2) * 4 + sub;
+    }
+
+    static double bucket_lower(int i)
+    {
+        if (i < 4) {
+            return i;
+        }
+        int msb = (i - 4) / 4 + 2;
+        int sub = (i - 4) % 4;
+        return (double)((uint64_t)(4 + sub) << (msb - 2));
+    }
+
+    std::atomic<uint64_t> buckets_[kBucketCount] {};
+    std::atomic<uint64_t> count_ { 0 };
+    std::atomic<uint64_t> sumUsec_ { 0 };
+};
@@ -0,0 +1,289 @@
+#include "probe_cache.h"
+#include "http_range_source.h"
+#include <core/io/dir_access.h>
+#include <core/io/file_access.h>
+#include <algorithm>
+#include <core/variant/array.h>
+#include <cstring>
+#include <vector>
+
+static Array rational_to_array(AVRational r)
+{
+    Array a;
+    a.push_back(r.num);
+    a.push_back(r.den);
+    return a;
+}
+
+static AVRational array_to_rational(const Array& a)
+{
+    return a.size() == 2 ? AVRational { (int)a[0], (int)a[1] } : AVRational { 0, 1 };
+}
+
+static String get_entry_path(const String& key)
+{
+    return String("user://probe_cache/") + key.md5_text() + ".probe";
+}
+
+bool ProbeCache::is_cacheable(const AVInputFormat* format)
+{
+    return format != nullptr && strcmp(format->name, "mov,mp4,m4a,3gp,3g2,mj2") == 0;
+}
+
+String ProbeCache::make_key(const String& filePath, int64_t fileSize)
+{
+    if (fileSize <= 0) {
+        return String();
+    }
+    // The urls have no modification time, HttpRangeSource keys its chunks the same way
+    uint64_t modifiedTime = 0;
+    if (!HttpRangeSource::is_http_url(filePath)) {
+        modifiedTime = FileAccess::get_modified_time(filePath);
+        if (modifiedTime == 0) {
+            return String(); // inside a pck
+        }
+    }
+    return String("{0}|{1}|{2}").format(varray(filePath, fileSize, (int64_t)modifiedTime));
+}
+
+Dictionary ProbeCache::load(const String& key)
+{
+    auto path = get_entry_path(key);
+    if (!FileAccess::exists(path)) {
+        return Dictionary();
+    }
+    auto file = FileAccess::open(path, FileAccess::READ);
+    if (file.is_null()) {
+        return Dictionary();
+    }
+    Variant value = file->get_var();
+    if (value.get_type() != Variant::DICTIONARY) {
+        return Dictionary();
+    }
+    Dictionary entry = value;
+    if ((int)entry.get("version", 0) != kVersion || (int64_t)entry.get("libavformat", 0) != LIBAVFORMAT_VERSION_INT || String(entry.get("key", "")) != key) {
+        return Dictionary();
+    }
+    return entry;
+}
+
+void ProbeCache::store(const String& key, const Dictionary& entry)
+{
+    Dictionary stored     = entry.duplicate();
+    stored["version"]     = kVersion;
+    stored["libavformat"] = LIBAVFORMAT_VERSION_INT;
+    stored["key"]         = key;
+
+    // Written aside then renamed, so that a crash never leaves a truncated entry
+    DirAccess::make_dir_recursive_absolute(kCacheDir);
+    auto path    = get_entry_path(key);
+    auto tmpPath = path + ".tmp";
+    {
+        auto file = FileAccess::open(tmpPath, FileAccess::WRITE);
+        if (file.is_null()) {
+            ERR_PRINT("Cannot write the probe cache file '" + tmpPath + "'");
+            return;
+        }
+        file->store_var(stored);
+    }
+    if (FileAccess::exists(path)) {
+        DirAccess::remove_absolute(path);
+    }
+    if (DirAccess::rename_absolute(tmpPath, path) != OK) {
+        DirAccess::remove_absolute(tmpPath);
+    }
+    evict();
+}
+
+void ProbeCache::remove(const String& key)
+{
+    auto path = get_entry_path(key);
+    if (FileAccess::exists(path)) {
+        DirAccess::remove_absolute(path);
+    }
+}
+
+void ProbeCache::evict()
+{
+    struct Found {
+        uint64_t modifiedTime { 0 };
+        uint64_t size { 0 };
+        String path {};
+    };
+    std::vector<Found> found;
+    uint64_t size = 0;
+    for (const auto& fileName : DirAccess::get_files_at(kCacheDir)) {
+        auto path = String(kCacheDir) + "/" + fileName;
+        auto file = FileAccess::open(path, FileAccess::READ);
+        if (file.is_null()) {
+            continue;
+        }
+        found.push_back(Found { FileAccess::get_modified_time(path), file->get_length(), path });
+        size += found.back().size;
+    }
+    if (size <= kCapacity) {
+        return;
+    }
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.modifiedTime < b.modifiedTime; });
+    for (const auto& f : found) {
+        if (size <= kCapacity) {
+            break;
+        }
+        DirAccess::remove_absolute(f.path);
+        size -= f.size;
+    }
+}
+
+Dictionary ProbeCache::capture(const AVFormatContext* formatContext, int videoStreamIndex, int audioStreamIndex)
+{
+    if (!is_cacheable(formatContext->iformat)) {
+        return Dictionary();
+    }
+    Array streams;
+    for (unsigned i = 0; i < formatContext->nb_streams; ++i) {
+        const AVStream* stream       = formatContext->streams[i];
+        const AVCodecParameters* par = stream->codecpar;
+        if (par->codec_id == AV_CODEC_ID_MP1 || par->codec_id == AV_CODEC_ID_MP2 || par->codec_id == AV_CODEC_ID_MP3) {
+            return Dictionary(); // the mov demuxer parses MPEG audio, its parser would start from the header only
+        }
+        if (par->ch_layout.order != AV_CHANNEL_ORDER_NATIVE && par->ch_layout.order != AV_CHANNEL_ORDER_UNSPEC) {
+            return Dictionary(); // custom and ambisonic layouts are not worth describing
+        }
+
+        PackedByteArray extradata;
+        if (par->extradata_size > 0) {
+            extradata.resize(par->extradata_size);
+            memcpy(extradata.ptrw(), par->extradata, par->extradata_size);
+        }
+
+        Dictionary s;
+        s["codec_type"]            = (int)par->codec_type;
+        s["codec_id"]              = (int)par->codec_id;
+        s["codec_tag"]             = (int64_t)par->codec_tag;
+        s["extradata"]             = extradata;
+        s["format"]                = par->format;
+        s["bit_rate"]              = par->bit_rate;
+        s["bits_per_coded_sample"] = par->bits_per_coded_sample;
+        s["bits_per_raw_sample"]   = par->bits_per_raw_sample;
+        s["profile"]               = par->profile;
+        s["level"]                 = par->level;
+        s["width"]                 = par->width;
+        s["height"]                = par->height;
+        s["sample_aspect_ratio"]   = rational_to_array(par->sample_aspect_ratio);
+        s["field_order"]           = (int)par->field_order;
+        s["color_range"]           = (int)par->color_range;
+        s["color_primaries"]       = (int)par->color_primaries;
+        s["color_trc"]             = (int)par->color_trc;
+        s["color_space"]           = (int)par->color_space;
+        s["chroma_location"]       = (int)par->chroma_location;
+        s["video_delay"]           = par->video_delay;
+        s["channel_order"]         = (int)par->ch_layout.order;
+        s["channels"]              = par->ch_layout.nb_channels;
+        s["channel_mask"]          = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? (int64_t)par->ch_layout.u.mask : (int64_t)0;
+        s["sample_rate"]           = par->sample_rate;
+        s["block_align"]           = par->block_align;
+        s["frame_size"]            = par->frame_size;
+        s["initial_padding"]       = par->initial_padding;
+        s["trailing_padding"]      = par->trailing_padding;
+        s["seek_preroll"]          = par->seek_preroll;
+        s["avg_frame_rate"]        = rational_to_array(stream->avg_frame_rate);
+        s["r_frame_rate"]          = rational_to_array(stream->r_frame_rate);
+        s["start_time"]            = stream->start_time;
+        s["duration"]              = stream->duration;
+        s["nb_frames"]             = stream->nb_frames;
+        streams.push_back(s);
+    }
+
+    Dictionary entry;
+    entry["format"]       = formatContext->iformat->name;
+    entry["duration"]     = formatContext->duration;
+    entry["start_time"]   = formatContext->start_time;
+    entry["bit_rate"]     = formatContext->bit_rate;
+    entry["video_stream"] = videoStreamIndex;
+    entry["audio_stream"] = audioStreamIndex;
+    entry["streams"]      = streams;
+    return entry;
+}
+
+bool ProbeCache::apply(const Dictionary& entry, AVFormatContext* formatContext)
+{
+    Array streams = entry.get("streams", Array());
+    if (!is_cacheable(formatContext->iformat) || streams.size() != (int)formatContext->nb_streams) {
+        return false;
+    }
+    for (unsigned i = 0; i < formatContext->nb_streams; ++i) {
+        Dictionary s                 = streams[i];
+        const AVCodecParameters* par = formatContext->streams[i]->codecpar;
+        if ((int)s.get("codec_type", -1) != (int)par->codec_type || (int)s.get("codec_id", -1) != (int)par->codec_id) {
+            return false;
+        }
+    }
+
+    for (unsigned i = 0; i < formatContext->nb_streams; ++i) {
+        Dictionary s           = streams[i];
+        AVStream* stream       = formatContext->streams[i];
+        AVCodecParameters* par = stream->codecpar;
+
+        PackedByteArray extradata = s["extradata"];
+        if (!extradata.is_empty()) {
+            av_freep(&par->extradata);
+            par->extradata = (uint8_t*)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+            memcpy(par->extradata, extradata.ptr(), extradata.size());
+            par->extradata_size = extradata.size();
+        }
+        par->codec_tag             = (uint32_t)(int64_t)s["codec_tag"];
+        par->format                = s["format"];
+        par->bit_rate              = s["bit_rate"];
+        par->bits_per_coded_sample = s["bits_per_coded_sample"];
+        par->bits_per_raw_sample   = s["bits_per_raw_sample"];
+        par->profile               = s["profile"];
+        par->level                 = s["level"];
+        par->width                 = s["width"];
+        par->height                = s["height"];
+        par->sample_aspect_ratio   = array_to_rational(s["sample_aspect_ratio"]);
+        par->field_order           = (AVFieldOrder)(int)s["field_order"];
+        par->color_range           = (AVColorRange)(int)s["color_range"];
+        par->color_primaries       = (AVColorPrimaries)(int)s["color_primaries"];
+        par->color_trc             = (AVColorTransferCharacteristic)(int)s["color_trc"];
+        par->color_space           = (AVColorSpace)(int)s["color_space"];
+        par->chroma_location       = (AVChromaLocation)(int)s["chroma_location"];
+        par->video_delay           = s["video_delay"];
+        par->sample_rate           = s["sample_rate"];
+        par->block_align           = s["block_align"];
+        par->frame_size            = s["frame_size"];
+        par->initial_padding       = s["initial_padding"];
+        par->trailing_padding      = s["trailing_padding"];
+        par->seek_preroll          = s["seek_preroll"];
+
+        av_channel_layout_uninit(&par->ch_layout);
+        if ((int)s["channel_order"] == AV_CHANNEL_ORDER_NATIVE) {
+            av_channel_layout_from_mask(&par->ch_layout, (uint64_t)(int64_t)s["channel_mask"]);
+        } else {
+            par->ch_layout.order       = AV_CHANNEL_ORDER_UNSPEC;
+            par->ch_layout.nb_channels = s["channels"];
+        }
+
+        stream->avg_frame_rate = array_to_rational(s["avg_frame_rate"]);
+        stream->r_frame_rate   = array_to_rational(s["r_frame_rate"]);
+        if (stream->start_time == AV_NOPTS_VALUE) {
+            stream->start_time = s["start_time"];
+        }
+        if (stream->duration == AV_NOPTS_VALUE) {
+            stream->duration = s["duration"];
+        }
+        if (stream->nb_frames == 0) {
+            stream->nb_frames = s["nb_frames"];
+        }
+    }
+
+    if (formatContext->duration == AV_NOPTS_VALUE) {
+        formatContext->duration = entry["duration"];
+    }
+    if (formatContext->start_time == AV_NOPTS_VALUE) {
+        formatContext->start_time = entry["start_time"];
+    }
+    if (formatContext->bit_rate == 0) {
+        formatContext->bit_rate = entry["bit_rate"];
+    }
+    return true;
+}
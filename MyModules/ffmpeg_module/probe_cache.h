@@ -0,0 +1,45 @@
+#pragma once
+
+#include "structs.h"
+#include <core/variant/dictionary.h>
+
+// What probing a media file finds out, kept under user://probe_cache so that opening the file again skips
+// av_probe_input_buffer() and avformat_find_stream_info(): the input format, the codec parameters, timings and
+// frame rates of every stream, the duration and the streams picked for playback. An entry is keyed by the path,
+// the size and the modification time of the file, and only used when the streams the demuxer finds in the header
+// match it. The entries beyond kCapacity bytes are deleted, least recently written first.
+// Only MP4/MOV files are cached: without avformat_find_stream_info() the decoder contexts and parsers libavformat
+// keeps for itself stay as avformat_open_input() left them, which only the mov demuxer does not depend on: its
+// header holds every codec parameter, and both timestamps and the duration of every sample.
+class ProbeCache {
+public:
+    // Whether files opened by format may be cached
+    static bool is_cacheable(const AVInputFormat* format);
+
+    // Empty if the file cannot be cached
+    static String make_key(const String& filePath, int64_t fileSize);
+
+    // Returns an empty dictionary if there is no entry or it was written by another version
+    static Dictionary load(const String& key);
+
+    static void store(const String& key, const Dictionary& entry);
+
+    // Deletes the entry, for one the file no longer opens with
+    static void remove(const String& key);
+
+    // Describes an analyzed context, returns an empty dictionary if it is not cacheable or some stream cannot be described
+    static Dictionary capture(const AVFormatContext* formatContext, int videoStreamIndex, int audioStreamIndex);
+
+    // Completes the codec parameters of a context just opened with avformat_open_input(). Returns false, leaving
+    // the context untouched, if its streams do not match the entry.
+    static bool apply(const Dictionary& entry, AVFormatContext* formatContext);
+
+private:
+    // Deletes the oldest entries while the cache is larger than kCapacity
+    static void evict();
+
+private:
+    static constexpr int kVersion          = 1;
+    static constexpr uint64_t kCapacity    = 16 * 1024 * 1024;
+    static constexpr const char* kCacheDir = "user://probe_cache";
+};
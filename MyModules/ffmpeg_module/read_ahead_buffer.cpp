@@ -0,0 +1,155 @@
+#include "read_ahead_buffer.h"
+#include <algorithm>
+#include <core/os/os.h>
+#include <cstring>
+
+ReadAheadBuffer::ReadAheadBuffer(const Ref<FileAccess>& file, size_t capacity)
+    : file_ { file }
+{
+    capacity = std::max<size_t>((capacity + kChunkSize - 1) / kChunkSize, 4) * kChunkSize;
+    ring_.resize(capacity);
+    keepBehind_ = (int64_t)capacity / 4;
+    length_     = (int64_t)file_->get_length();
+    position_   = (int64_t)file_->get_position();
+    begin_      = position_;
+    end_        = position_;
+    ioThread_   = std::thread(&ReadAheadBuffer::io_thread_routine, this);
+}
+
+ReadAheadBuffer::~ReadAheadBuffer()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        stopRequested_ = true;
+    }
+    spaceCv_.notify_one();
+    dataCv_.notify_all();
+    ioThread_.join();
+}
+
+int ReadAheadBuffer::read(uint8_t* buf, int size)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    if (position_ == end_ && end_ < length_ && !failed_) {
+        auto stallBegin = OS::get_singleton()->get_ticks_usec();
+        dataCv_.wait(lck, [this]() { return position_ < end_ || failed_ || stopRequested_; });
+        stalls_.record(OS::get_singleton()->get_ticks_usec() - stallBegin);
+    }
+    auto n = (int)std::min<int64_t>(size, end_ - position_);
+    if (n <= 0) {
+        return 0;
+    }
+
+    // The I/O thread only writes outside of [begin_, end_), copying needs no more care
+    auto capacity = (int64_t)ring_.size();
+    auto offset   = (size_t)(position_ % capacity);
+    auto first    = std::min<size_t>(n, ring_.size() - offset);
+    memcpy(buf, ring_.data() + offset, first);
+    memcpy(buf + first, ring_.data(), n - first);
+    position_ += n;
+    bool wakeUp = has_space();
+    lck.unlock();
+
+    if (wakeUp) {
+        spaceCv_.notify_one();
+    }
+    return n;
+}
+
+int64_t ReadAheadBuffer::seek(int64_t position)
+{
+    position = std::clamp<int64_t>(position, 0, length_);
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        if (position >= begin_ && position <= end_) {
+            windowSeeks_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            refillSeeks_.fetch_add(1, std::memory_order_relaxed);
+            begin_  = position;
+            end_    = position;
+            failed_ = false;
+            ++generation_;
+        }
+        position_ = position;
+    }
+    spaceCv_.notify_one();
+    return position;
+}
+
+int64_t ReadAheadBuffer::get_position() const
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    return position_;
+}
+
+ReadAheadBuffer::Stats ReadAheadBuffer::get_stats() const
+{
+    auto fetchUsec = fetchUsec_.load(std::memory_order_relaxed);
+    Stats stats;
+    stats.fetchedBytes     = fetchedBytes_.load(std::memory_order_relaxed);
+    stats.fetchMbPerSecond = fetchUsec == 0 ? 0.0 : (double)stats.fetchedBytes / (double)fetchUsec; // bytes per usec
+    stats.windowSeeks      = windowSeeks_.load(std::memory_order_relaxed);
+    stats.refillSeeks      = refillSeeks_.load(std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    stats.bufferedBytes = (uint64_t)(end_ - position_);
+    return stats;
+}
+
+void ReadAheadBuffer::reset_stats()
+{
+    fetchedBytes_.store(0, std::memory_order_relaxed);
+    fetchUsec_.store(0, std::memory_order_relaxed);
+    windowSeeks_.store(0, std::memory_order_relaxed);
+    refillSeeks_.store(0, std::memory_order_relaxed);
+    stalls_.reset();
+}
+
+bool ReadAheadBuffer::has_space() const
+{
+    return !failed_ && end_ < length_ && end_ - position_ + (int64_t)kChunkSize <= (int64_t)ring_.size() - keepBehind_;
+}
+
+void ReadAheadBuffer::io_thread_routine()
+{
+    auto capacity = (int64_t)ring_.size();
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    while (true) {
+        spaceCv_.wait(lck, [this]() { return stopRequested_ || has_space(); });
+        if (stopRequested_) {
+            break;
+        }
+
+        // The chunk leaves the window before it is overwritten, the reader never sees it half written
+        auto from       = end_;
+        auto size       = std::min<int64_t>(kChunkSize, length_ - from);
+        begin_          = std::max(begin_, from + size - capacity);
+        auto generation = generation_;
+        lck.unlock();
+
+        auto fetchBegin = OS::get_singleton()->get_ticks_usec();
+        if ((int64_t)file_->get_position() != from) {
+            file_->seek(from);
+        }
+        auto offset = from % capacity;
+        auto first  = std::min(size, capacity - offset);
+        auto n      = (int64_t)file_->get_buffer(ring_.data() + offset, first);
+        if (n == first && size > first) {
+            n += (int64_t)file_->get_buffer(ring_.data(), size - first);
+        }
+        fetchUsec_.fetch_add(OS::get_singleton()->get_ticks_usec() - fetchBegin, std::memory_order_relaxed);
+        fetchedBytes_.fetch_add((uint64_t)std::max<int64_t>(n, 0), std::memory_order_relaxed);
+
+        lck.lock();
+        if (generation != generation_) {
+            continue; // a seek restarted the reading somewhere else
+        }
+        end_ = from + std::max<int64_t>(n, 0);
+        if (n < size) {
+            ERR_PRINT(String("Failed to read ahead at offset {0}").format(varray(end_)));
+            failed_ = true;
+        }
+        dataCv_.notify_all();
+    }
+}
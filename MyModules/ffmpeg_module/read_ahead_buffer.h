@@ -0,0 +1,80 @@
+#pragma once
+
+#include "perf_counters.h"
+#include <atomic>
+#include <condition_variable>
+#include <core/io/file_access.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Reads a file ahead of the demuxer on its own thread, into a ring of a few megabytes, so that the reads of
+// libavformat are served from memory instead of waiting on slow storage (SD cards, network mounts).
+// A quarter of the ring keeps the data behind the read position: seeks landing inside the buffered window
+// do not touch the file, the others restart the reading at the new position.
+// One thread at a time may read and seek.
+class ReadAheadBuffer {
+public:
+    struct Stats {
+        uint64_t fetchedBytes { 0 };  // read from the file
+        double fetchMbPerSecond { 0 }; // while the I/O thread was reading
+        uint64_t windowSeeks { 0 };   // served from the ring
+        uint64_t refillSeeks { 0 };   // outside of the ring, the reading restarted
+        uint64_t bufferedBytes { 0 }; // ahead of the read position
+    };
+
+    // Takes over file, nobody else may use it afterwards. capacity is rounded up to a multiple of kChunkSize.
+    ReadAheadBuffer(const Ref<FileAccess>& file, size_t capacity);
+    ~ReadAheadBuffer();
+
+    ReadAheadBuffer(const ReadAheadBuffer&)            = delete;
+    ReadAheadBuffer& operator=(const ReadAheadBuffer&) = delete;
+
+    // Waits until some data is buffered, returns 0 at the end of the file or after a read error
+    int read(uint8_t* buf, int size);
+
+    // position is clamped to the file, returns the new position
+    int64_t seek(int64_t position);
+
+    int64_t get_position() const;
+    int64_t get_length() const { return length_; }
+    size_t get_capacity() const { return ring_.size(); }
+
+    Stats get_stats() const;
+
+    // The reads that waited for the file, per read
+    const DurationStats& get_stalls() const { return stalls_; }
+
+    void reset_stats();
+
+private:
+    void io_thread_routine();
+
+    // with mutex_ locked, the I/O thread may read the next chunk
+    bool has_space() const;
+
+private:
+    static constexpr size_t kChunkSize = 256 * 1024;
+
+    Ref<FileAccess> file_ {}; // I/O thread only
+    int64_t length_ { 0 };
+    std::vector<uint8_t> ring_ {}; // file offset o is at ring_[o % capacity]
+    int64_t keepBehind_ { 0 };
+
+    mutable std::mutex mutex_ {};
+    std::condition_variable dataCv_ {};  // the reader waits for data
+    std::condition_variable spaceCv_ {}; // the I/O thread waits for room
+    int64_t position_ { 0 };
+    int64_t begin_ { 0 }; // [begin_, end_) is buffered, the chunk being read is already excluded
+    int64_t end_ { 0 };
+    uint64_t generation_ { 0 }; // increased by the seeks restarting the reading, older chunks are dropped
+    bool failed_ { false };     // a read error at end_, cleared by the next refill
+    bool stopRequested_ { false };
+    std::thread ioThread_ {};
+
+    std::atomic<uint64_t> fetchedBytes_ { 0 };
+    std::atomic<uint64_t> fetchUsec_ { 0 };
+    std::atomic<uint64_t> windowSeeks_ { 0 };
+    std::atomic<uint64_t> refillSeeks_ { 0 };
+    DurationStats stalls_ {};
+};
@@ -1,7 +1,18 @@
 #include "register_types.h"
+#include "codec_context_pool.h"
 #include "ffmpeg_media_stream.h"
+#include "ffmpeg_playlist.h"
+#include "ffmpeg_tiled_video_texture.h"
+#include "ffmpeg_video_texture.h"
+#include "hw_device_cache.h"
+#include "panorama_mesh.h"
 #include "video_stream_ffmpeg.h"
 
+#ifdef TOOLS_ENABLED
+#include "benchmarks.h"
+#include "self_tests.h"
+#endif
+
 static Ref<ResourceFormatLoaderFfmpeg> resource_loader_ffmpeg;
 
 void initialize_ffmpeg_module_module(ModuleInitializationLevel p_level)
@@ -18,6 +29,15 @@ void initialize_ffmpeg_module_module(ModuleInitializationLevel p_level)
     GDREGISTER_CLASS(FfmpegCodecHwConfig);
     GDREGISTER_CLASS(VideoStreamPlaybackFfmpeg);
     GDREGISTER_CLASS(FfmpegMediaStream);
+    GDREGISTER_CLASS(FfmpegPlaylist);
+    GDREGISTER_CLASS(FfmpegVideoTexture);
+    GDREGISTER_CLASS(FfmpegTiledVideoTexture);
+    GDREGISTER_CLASS(PanoramaMesh);
+#ifdef TOOLS_ENABLED
+    // The benchmark and self test scenes run with editor builds only, export templates leave them out
+    GDREGISTER_CLASS(FfmpegBenchmark);
+    GDREGISTER_CLASS(FfmpegSelfTest);
+#endif
 }
 
 void uninitialize_ffmpeg_module_module(ModuleInitializationLevel p_level)
@@ -28,4 +48,8 @@ void uninitialize_ffmpeg_module_module(ModuleInitializationLevel p_level)
 
     ResourceLoader::remove_resource_format_loader(resource_loader_ffmpeg);
     resource_loader_ffmpeg.unref();
+    FfmpegMediaStream::unregister_performance_monitors();
+    // The pool and the device cache are never destroyed, free the idle decoders, then the devices nothing uses anymore
+    CodecContextPool::get_singleton().clear();
+    HwDeviceCache::get_singleton().trim();
 }
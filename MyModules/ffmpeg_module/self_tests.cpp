@@ -0,0 +1,881 @@
+#ifdef TOOLS_ENABLED
+
+#include "self_tests.h"
+#include "benchmarks.h"
+#include "codec_context_pool.h"
+#include "ffmpeg_media_stream.h"
+#include "http_range_source.h"
+#include "hw_device_cache.h"
+#include "panorama_mesh.h"
+#include "probe_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <core/io/dir_access.h>
+#include <core/io/file_access.h>
+#include <core/io/stream_peer_tcp.h>
+#include <core/io/tcp_server.h>
+#include <core/config/project_settings.h>
+#include <core/os/os.h>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/md5.h>
+}
+
+using SelfTestClock = std::chrono::steady_clock;
+
+static const char* kClipDir = "user://self_test";
+
+static double elapsed_seconds(SelfTestClock::time_point since)
+{
+    return std::chrono::duration<double>(SelfTestClock::now() - since).count();
+}
+
+// Collects the failed expectations of one check next to its measurements
+class CheckReport {
+public:
+    void expect(bool condition, const String& failure)
+    {
+        if (!condition) {
+            failures_.push_back(failure);
+        }
+    }
+
+    void set(const String& key, const Variant& value) { values_[key] = value; }
+
+    Dictionary finish()
+    {
+        values_["passed"]   = failures_.is_empty();
+        values_["failures"] = failures_;
+        return values_;
+    }
+
+private:
+    Dictionary values_ {};
+    PackedStringArray failures_ {};
+};
+
+// The path of the clip, generated on the first use. Empty if it cannot be generated.
+static String generate_clip(const String& name, int width, int height, double seconds, int fps, const Dictionary& options)
+{
+    auto path = String(kClipDir).path_join(name + ".mp4");
+    if (FileAccess::exists(path)) {
+        return path;
+    }
+    DirAccess::make_dir_recursive_absolute(kClipDir);
+    return FfmpegBenchmark::generate_clip(path, width, height, seconds, fps, options) ? path : String();
+}
+
+// Opens the file with its first video decoder in software. Returns false with the reason in error.
+static bool open_stream(const Ref<FfmpegMediaStream>& stream, const String& path, String& error)
+{
+    if (!stream->set_file(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+    TypedArray<FfmpegCodec> decoders = stream->available_video_decoders();
+    Ref<FfmpegCodec> codec           = decoders.is_empty() ? Ref<FfmpegCodec>() : Ref<FfmpegCodec>(decoders[0]);
+    if (codec.is_null() || !stream->create_decoders(codec.ptr(), nullptr)) {
+        error = "cannot create the decoders of " + path;
+        return false;
+    }
+    return true;
+}
+
+// A minimal HTTP/1.1 server on the loopback for the HttpRangeSource checks. It serves one in-memory file to Range
+// requests over keep-alive connections from a thread, and answers 500 to everything while failing.
+class LocalHttpServer {
+public:
+    ~LocalHttpServer() { stop(); }
+
+    bool start()
+    {
+        server_.instantiate();
+        for (int port = 47100; port < 47200; ++port) {
+            if (server_->listen(port, IPAddress("127.0.0.1")) == OK) {
+                port_   = port;
+                thread_ = std::thread(&LocalHttpServer::thread_routine, this);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void stop()
+    {
+        stopRequested_ = true;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (server_.is_valid()) {
+            server_->stop();
+        }
+    }
+
+    String get_url() const { return "http://127.0.0.1:" + itos(port_) + "/clip.bin"; }
+
+    // Replaces the file, etag is sent as its ETag header
+    void set_file(const std::vector<uint8_t>& body, const String& etag)
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        body_ = body;
+        etag_ = etag.utf8().get_data();
+    }
+
+    void set_failing(bool failing) { failing_ = failing; }
+
+private:
+    struct Client {
+        Ref<StreamPeerTCP> peer {};
+        std::string pending {}; // received, not answered yet
+    };
+
+    void thread_routine()
+    {
+        std::vector<Client> clients;
+        std::vector<uint8_t> buffer(64 * 1024);
+        while (!stopRequested_) {
+            while (server_->is_connection_available()) {
+                clients.push_back(Client { server_->take_connection(), {} });
+            }
+            bool idle = true;
+            for (auto it = clients.begin(); it != clients.end();) {
+                it->peer->poll();
+                if (it->peer->get_status() != StreamPeerTCP::STATUS_CONNECTED) {
+                    it = clients.erase(it);
+                    continue;
+                }
+                auto available = MIN(it->peer->get_available_bytes(), (int)buffer.size());
+                int received   = 0;
+                if (available > 0 && it->peer->get_partial_data(buffer.data(), available, received) == OK && received > 0) {
+                    it->pending.append(reinterpret_cast<const char*>(buffer.data()), received);
+                    idle = false;
+                }
+                size_t end;
+                while ((end = it->pending.find("\r\n\r\n")) != std::string::npos) {
+                    respond(it->peer, it->pending.substr(0, end));
+                    it->pending.erase(0, end + 4);
+                }
+                ++it;
+            }
+            if (idle) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    void respond(const Ref<StreamPeerTCP>& peer, std::string head)
+    {
+        for (auto& c : head) {
+            c = (char)tolower((unsigned char)c);
+        }
+        // Range: bytes=<first>-<last>
+        int64_t first = -1;
+        int64_t last  = -1;
+        auto range    = head.find("range: bytes=");
+        if (range != std::string::npos) {
+            char* end = nullptr;
+            first     = strtoll(head.c_str() + range + 13, &end, 10);
+            last      = *end == '-' ? strtoll(end + 1, nullptr, 10) : -1;
+        }
+
+        std::unique_lock<std::mutex> lck(mutex_);
+        auto size = (int64_t)body_.size();
+        if (failing_ || first < 0 || last < first || first >= size) {
+            std::string response = failing_ ? "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"
+                                            : "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n";
+            peer->put_data(reinterpret_cast<const uint8_t*>(response.data()), (int)response.size());
+            return;
+        }
+        last                 = MIN(last, size - 1);
+        std::string response = "HTTP/1.1 206 Partial Content\r\n"
+                               "Content-Range: bytes "
+            + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size) + "\r\n"
+            + "Content-Length: " + std::to_string(last - first + 1) + "\r\n"
+            + "ETag: " + etag_ + "\r\n\r\n";
+        peer->put_data(reinterpret_cast<const uint8_t*>(response.data()), (int)response.size());
+        peer->put_data(body_.data() + first, (int)(last - first + 1));
+    }
+
+private:
+    Ref<TCPServer> server_ {};
+    int port_ { 0 };
+    std::thread thread_ {};
+    std::atomic<bool> stopRequested_ { false };
+    std::atomic<bool> failing_ { false };
+    std::mutex mutex_ {};
+    std::vector<uint8_t> body_ {};
+    std::string etag_ {};
+};
+
+// Reads size bytes at position, fewer at the end of the file or on failure
+static std::vector<uint8_t> read_range(HttpRangeSource& source, int64_t position, int size)
+{
+    std::vector<uint8_t> data((size_t)size);
+    source.seek(position);
+    int received = 0;
+    while (received < size) {
+        auto n = source.read(data.data() + received, size - received);
+        if (n <= 0) {
+            break;
+        }
+        received += n;
+    }
+    data.resize((size_t)received);
+    return data;
+}
+
+struct AVFormatContextCloser {
+    void operator()(AVFormatContext* c)
+    {
+        avformat_close_input(&c);
+    }
+};
+using OpenedFormatContext = std::unique_ptr<AVFormatContext, AVFormatContextCloser>;
+
+// Decodes at most maxFrames video frames of path in software with a decoder of CodecContextPool, opened if none is idle,
+// and hashes the pixels and the timestamp of every frame. Stopping at maxFrames gives the decoder back undrained.
+// Returns false with the reason in error.
+static bool decode_pooled(const String& path, int maxFrames, PackedStringArray& hashes, bool& reused, String& error)
+{
+    static const constexpr int kThreads = 2; // frame threads hold frames of their own when the decoder is given back
+
+    auto nativePath          = ProjectSettings::get_singleton()->globalize_path(path).utf8();
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, nativePath.get_data(), nullptr, nullptr) != 0) {
+        error = "cannot open " + path;
+        return false;
+    }
+    OpenedFormatContext formatContext { context };
+    const AVCodec* codec = nullptr;
+    int streamIndex      = avformat_find_stream_info(formatContext.get(), nullptr) < 0 ? -1 : av_find_best_stream(formatContext.get(), AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (streamIndex < 0) {
+        error = "no video stream in " + path;
+        return false;
+    }
+    auto* par = formatContext->streams[streamIndex]->codecpar;
+
+    auto& pool = CodecContextPool::get_singleton();
+    auto key   = CodecContextPool::make_key(codec, par, AV_HWDEVICE_TYPE_NONE, kThreads);
+    std::unique_ptr<AVCodecContext, PooledCodecContextDeleter> codecContext { pool.acquire(key) };
+    reused = codecContext != nullptr;
+    if (!reused) {
+        codecContext.reset(avcodec_alloc_context3(codec));
+        if (codecContext == nullptr || avcodec_parameters_to_context(codecContext.get(), par) < 0) {
+            error = "cannot create a decoder for " + path;
+            return false;
+        }
+        codecContext->thread_count = kThreads;
+        if (avcodec_open2(codecContext.get(), codec, nullptr) != 0) {
+            error = "cannot open the decoder of " + path;
+            return false;
+        }
+        pool.track(codecContext.get(), key);
+    }
+
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet { av_packet_alloc() };
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> frame { av_frame_alloc() };
+    std::vector<uint8_t> pixels;
+    bool draining = false;
+    while (hashes.size() < maxFrames) {
+        int ret = avcodec_receive_frame(codecContext.get(), frame.get());
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret == 0) {
+            auto size = av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1);
+            pixels.resize((size_t)MAX(size, 0));
+            av_image_copy_to_buffer(pixels.data(), size, frame->data, frame->linesize, (AVPixelFormat)frame->format, frame->width, frame->height, 1);
+            uint8_t md5[16] {};
+            av_md5_sum(md5, pixels.data(), size);
+            hashes.push_back(itos(frame->pts) + ":" + String::hex_encode_buffer(md5, sizeof(md5)));
+            av_frame_unref(frame.get());
+            continue;
+        }
+        if (ret != AVERROR(EAGAIN) || draining) {
+            error = String("decoding {0} failed after {1} frames").format(varray(path, hashes.size()));
+            return false;
+        }
+        ret = av_read_frame(formatContext.get(), packet.get());
+        if (ret < 0) {
+            draining = true;
+            avcodec_send_packet(codecContext.get(), nullptr);
+            continue;
+        }
+        if (packet->stream_index == streamIndex) {
+            avcodec_send_packet(codecContext.get(), packet.get());
+        }
+        av_packet_unref(packet.get());
+    }
+    return true;
+}
+
+// Counts the buffers hw_device_cache_refcount() creates instead of devices, and the ones ffmpeg freed
+static std::atomic<int> fakeDevicesCreated { 0 };
+static std::atomic<int> fakeDevicesFreed { 0 };
+
+static void free_fake_device(void*, uint8_t* data)
+{
+    av_free(data);
+    ++fakeDevicesFreed;
+}
+
+static int create_fake_device(AVBufferRef** device, AVHWDeviceType)
+{
+    auto* data = (uint8_t*)av_mallocz(1);
+    *device    = data == nullptr ? nullptr : av_buffer_create(data, 1, &free_fake_device, nullptr, 0);
+    if (*device == nullptr) {
+        av_free(data);
+        return AVERROR(ENOMEM);
+    }
+    ++fakeDevicesCreated;
+    return 0;
+}
+
+static int fail_device(AVBufferRef**, AVHWDeviceType)
+{
+    return AVERROR(ENOSYS);
+}
+
+void FfmpegSelfTest::_bind_methods()
+{
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("audio_under_video_backlog"), &FfmpegSelfTest::audio_under_video_backlog);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("latest_frame_wins"), &FfmpegSelfTest::latest_frame_wins);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("thumbnails_with_b_frames"), &FfmpegSelfTest::thumbnails_with_b_frames);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("panorama_pole_uvs"), &FfmpegSelfTest::panorama_pole_uvs);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("http_range_source"), &FfmpegSelfTest::http_range_source);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("probe_cache_matches_probe"), &FfmpegSelfTest::probe_cache_matches_probe);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("decoder_pool_reuse"), &FfmpegSelfTest::decoder_pool_reuse);
+    ClassDB::bind_static_method("FfmpegSelfTest", D_METHOD("hw_device_cache_refcount"), &FfmpegSelfTest::hw_device_cache_refcount);
+}
+
+Dictionary FfmpegSelfTest::audio_under_video_backlog()
+{
+    CheckReport report;
+    Dictionary options;
+    options["bit_rate"] = 40 * 1000 * 1000;
+    options["audio"]    = true;
+    auto path           = generate_clip("high_bitrate_audio", 1920, 1080, 8.0, 60, options);
+    if (path.is_empty()) {
+        report.expect(false, "cannot generate the clip");
+        return report.finish();
+    }
+
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    stream->set_external_audio(true);
+    stream->set_external_clock(true);
+    String error;
+    if (!open_stream(stream, path, error)) {
+        report.expect(false, error);
+        return report.finish();
+    }
+
+    // update() is never called: the decoded frames stay queued, the video decoder waits and its packets pile up.
+    // 6 s is far more than the 2 s of video packets the demuxer used to stop at.
+    stream->play();
+    const int64_t wanted = (int64_t)stream->get_mix_rate() * 6;
+    std::vector<AudioFrame> buffer(1024);
+    int64_t read = 0;
+    auto begin   = SelfTestClock::now();
+    while (read < wanted && elapsed_seconds(begin) < 10.0) {
+        auto n = stream->read_audio(buffer.data(), (int)buffer.size());
+        read += n;
+        if (n == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+    Dictionary stats = stream->get_stats();
+    stream->stop();
+
+    report.set("audio_seconds", read / (double)MAX(stream->get_mix_rate(), 1));
+    report.set("video_packets_queued", stats["video_packet_queue_depth"]);
+    report.expect(read >= wanted, String("the audio stopped after {0} s while the video was not consumed").format(varray(read / (double)MAX(stream->get_mix_rate(), 1))));
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::latest_frame_wins()
+{
+    static const constexpr int kFps = 30;
+    CheckReport report;
+    auto path = generate_clip("latest_frame", 320, 180, 2.0, kFps, Dictionary());
+    if (path.is_empty()) {
+        report.expect(false, "cannot generate the clip");
+        return report.finish();
+    }
+
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    stream->set_external_clock(true);
+    stream->set_latest_frame_wins(true);
+    String error;
+    if (!open_stream(stream, path, error)) {
+        report.expect(false, error);
+        return report.finish();
+    }
+
+    // The decoder must never wait for update(), so every frame gets decoded while none is taken
+    stream->play();
+    const int64_t frames = (int64_t)(stream->get_length() * kFps + 0.5);
+    auto begin           = SelfTestClock::now();
+    while ((int64_t)stream->get_stats()["decoded_frames"] < frames && elapsed_seconds(begin) < 10.0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200)); // the last frame is counted before it is converted
+    int64_t decoded = stream->get_stats()["decoded_frames"];
+    stream->update(1.0 / kFps);
+    auto position = stream->get_position();
+    stream->stop();
+
+    report.set("decoded_frames", decoded);
+    report.set("mailbox_depth", stream->get_frame_queue_depth());
+    report.set("position", position);
+    report.expect(decoded >= frames, String("{0} of {1} frames decoded, the decoder waited for update()").format(varray(decoded, frames)));
+    report.expect(decoded > stream->get_frame_queue_depth(), "no more frames decoded than the mailbox holds");
+    report.expect(position >= stream->get_length() - 1.5 / kFps, String("the frame at {0} s was presented instead of the newest one").format(varray(position)));
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::thumbnails_with_b_frames()
+{
+    CheckReport report;
+    Dictionary options;
+    options["b_frames"] = 2;
+    auto path           = generate_clip("b_frames", 320, 180, 4.0, 30, options); // a keyframe every second
+    if (path.is_empty()) {
+        report.expect(false, "cannot generate the clip");
+        return report.finish();
+    }
+
+    // The case the index import skips
+    auto nativePath          = ProjectSettings::get_singleton()->globalize_path(path).utf8();
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, nativePath.get_data(), nullptr, nullptr) != 0) {
+        report.expect(false, "cannot open " + path);
+        return report.finish();
+    }
+    OpenedFormatContext probed { context };
+    auto video = avformat_find_stream_info(probed.get(), nullptr) < 0 ? -1 : av_find_best_stream(probed.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video < 0) {
+        report.expect(false, "no video stream in " + path);
+        return report.finish();
+    }
+    report.set("video_delay", probed->streams[video]->codecpar->video_delay);
+    report.expect(probed->streams[video]->codecpar->video_delay > 0, "the clip has no B-frames");
+
+    ThumbnailGenerator thumbnails;
+    thumbnails.start(path, 64);
+    const double positions[] = { 0.5, 1.5, 2.5, 1.2 };
+    Vector<Ref<Image>> previews;
+    for (auto position : positions) {
+        Ref<Image> preview;
+        bool exact = false;
+        auto begin = SelfTestClock::now();
+        while (elapsed_seconds(begin) < 5.0) {
+            preview = thumbnails.get(position, &exact);
+            if (exact) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        report.expect(exact && preview.is_valid(), String("no exact preview at {0} s").format(varray(position)));
+        previews.push_back(preview);
+    }
+    thumbnails.stop();
+
+    auto same = [](const Ref<Image>& a, const Ref<Image>& b) {
+        if (a.is_null() || b.is_null()) {
+            return false;
+        }
+        auto dataA = a->get_data();
+        auto dataB = b->get_data();
+        return dataA.size() == dataB.size() && memcmp(dataA.ptr(), dataB.ptr(), dataA.size()) == 0;
+    };
+    report.expect(!same(previews[0], previews[1]) && !same(previews[1], previews[2]) && !same(previews[0], previews[2]),
+            "two GOPs got the same preview");
+    report.expect(same(previews[3], previews[1]), "two positions of the same GOP got different previews");
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::panorama_pole_uvs()
+{
+    struct Case {
+        const char* name;
+        PanoramaMesh::Layout layout;
+        PackedFloat32Array densities;
+    };
+    PackedFloat32Array bands;
+    bands.push_back(1.0f);
+    bands.push_back(3.0f);
+    bands.push_back(1.0f);
+    const Case cases[] = {
+        { "equirect", PanoramaMesh::kLayoutEquirect, {} },
+        { "equirect_180", PanoramaMesh::kLayoutEquirect180, {} },
+        { "equirect_bands", PanoramaMesh::kLayoutEquirect, bands },
+    };
+
+    CheckReport report;
+    for (const auto& c : cases) {
+        Ref<PanoramaMesh> mesh;
+        mesh.instantiate();
+        mesh->set_layout(c.layout);
+        mesh->set_radial_segments(16);
+        mesh->set_rings(8);
+        mesh->set_band_densities(c.densities);
+        Array arrays             = mesh->get_mesh_arrays();
+        PackedVector2Array uvs   = arrays[Mesh::ARRAY_TEX_UV];
+        PackedInt32Array indices = arrays[Mesh::ARRAY_INDEX];
+        auto segments            = c.layout == PanoramaMesh::kLayoutEquirect180 ? 8 : 16;
+
+        int poleTriangles[2] = { 0, 0 }; // north, south
+        float worstError     = 0.0f;
+        for (int t = 0; t + 2 < indices.size(); t += 3) {
+            int pole         = -1;
+            int poleVertices = 0;
+            float poleU      = 0.0f;
+            float otherU     = 0.0f; // sum of the other two
+            for (int k = 0; k < 3; ++k) {
+                auto uv = uvs[indices[t + k]];
+                if (uv.y == 0.0f || uv.y == 1.0f) {
+                    pole  = uv.y == 0.0f ? 0 : 1;
+                    poleU = uv.x;
+                    ++poleVertices;
+                } else {
+                    otherU += uv.x;
+                }
+            }
+            if (poleVertices == 0) {
+                continue;
+            }
+            if (poleVertices != 1) {
+                report.expect(false, String("{0}: triangle {1} collapses on a pole").format(varray(c.name, t / 3)));
+                continue;
+            }
+            auto center = otherU * 0.5f;
+            auto error  = Math::abs(poleU - center);
+            worstError  = MAX(worstError, error);
+            report.expect(error < 1e-5f, String("{0}: the {1} pole vertex of triangle {2} is at u = {3} instead of {4}").format(varray(c.name, pole == 0 ? "north" : "south", t / 3, poleU, center)));
+            ++poleTriangles[pole];
+        }
+        report.expect(poleTriangles[0] == segments, String("{0}: {1} triangles at the north pole instead of {2}").format(varray(c.name, poleTriangles[0], segments)));
+        report.expect(poleTriangles[1] == segments, String("{0}: {1} triangles at the south pole instead of {2}").format(varray(c.name, poleTriangles[1], segments)));
+        report.set(String(c.name) + "_worst_pole_u_error", worstError);
+    }
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::http_range_source()
+{
+    static constexpr int64_t kChunkSize = 1024 * 1024; // HttpRangeSource's
+    static constexpr int64_t kFileSize  = 3 * kChunkSize + kChunkSize / 2;
+    CheckReport report;
+
+    // Two files of the same size, with ETags unique to this run so that the chunk cache starts cold
+    std::vector<uint8_t> files[2];
+    uint32_t seed = 12345;
+    for (auto& file : files) {
+        file.resize((size_t)kFileSize);
+        for (auto& byte : file) {
+            seed = seed * 1664525u + 1013904223u;
+            byte = (uint8_t)(seed >> 24);
+        }
+    }
+    auto run        = String::num_uint64(OS::get_singleton()->get_unix_time()) + "-" + String::num_uint64(OS::get_singleton()->get_ticks_usec());
+    String etags[2] = { "\"a-" + run + "\"", "\"b-" + run + "\"" };
+
+    LocalHttpServer server;
+    if (!server.start()) {
+        report.expect(false, "cannot listen on the loopback");
+        return report.finish();
+    }
+    server.set_file(files[0], etags[0]);
+    auto url = server.get_url();
+
+    auto chunkCount = (kFileSize + kChunkSize - 1) / kChunkSize;
+    {
+        // Sequential reads, then seeks across chunk boundaries
+        HttpRangeSource source;
+        if (!source.open(url)) {
+            report.expect(false, "cannot open " + url);
+            return report.finish();
+        }
+        report.expect(source.get_length() == kFileSize, String("length {0} instead of {1}").format(varray(source.get_length(), kFileSize)));
+        auto whole = read_range(source, 0, (int)kFileSize);
+        report.expect(whole == files[0], String("sequential reads returned {0} bytes that differ from the file").format(varray((int64_t)whole.size())));
+
+        const int64_t seeks[] = { 2 * kChunkSize + 12345, kChunkSize - 1000, 3 * kChunkSize - 5, 100, kFileSize - 10 };
+        for (auto position : seeks) {
+            auto data = read_range(source, position, 4096);
+            auto size = (int64_t)MIN(4096, kFileSize - position);
+            report.expect((int64_t)data.size() == size && std::equal(data.begin(), data.end(), files[0].begin() + position),
+                String("4096 bytes at {0} differ from the file").format(varray(position)));
+        }
+        auto stats = source.get_stats();
+        report.set("first_open_cache_misses", stats.cacheMisses);
+        report.expect(stats.cacheMisses == (uint64_t)chunkCount, String("{0} chunks downloaded instead of {1}").format(varray(stats.cacheMisses, chunkCount)));
+    }
+    {
+        // Opened again, every chunk comes from the cache
+        HttpRangeSource source;
+        report.expect(source.open(url), "cannot open " + url + " again");
+        auto whole = read_range(source, 0, (int)kFileSize);
+        auto stats = source.get_stats();
+        report.set("second_open_cache_hits", stats.cacheHits);
+        report.expect(whole == files[0], "the cached chunks differ from the file");
+        report.expect(stats.cacheMisses == 0 && stats.cacheHits >= (uint64_t)chunkCount,
+            String("second open: {0} chunks from the cache, {1} downloaded").format(varray(stats.cacheHits, stats.cacheMisses)));
+    }
+    {
+        // Replaced by a file of the same size, the chunks of the old one must not be served
+        server.set_file(files[1], etags[1]);
+        HttpRangeSource source;
+        report.expect(source.open(url), "cannot open the replaced " + url);
+        auto data = read_range(source, 0, 4096);
+        report.expect(data.size() == 4096 && std::equal(data.begin(), data.end(), files[1].begin()), "the replaced file was served from the cache of the old one");
+    }
+    {
+        // The server fails after the open: a read of a chunk not downloaded yet returns 0 instead of waiting forever
+        server.set_file(files[0], "\"c-" + run + "\"");
+        HttpRangeSource source(1, 1);
+        report.expect(source.open(url), "cannot open " + url + " before the failure");
+        auto data = read_range(source, 0, 4096);
+        report.expect(data.size() == 4096, "cannot read before the failure");
+        server.set_failing(true);
+        auto begin = SelfTestClock::now();
+        data       = read_range(source, 2 * kChunkSize, 4096);
+        report.set("failed_read_seconds", elapsed_seconds(begin));
+        report.expect(data.empty(), "a chunk was read from a failing server");
+
+        // and opening fails
+        HttpRangeSource failed;
+        report.expect(!failed.open(url), "opened from a failing server");
+    }
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::probe_cache_matches_probe()
+{
+    CheckReport report;
+    report.expect(!ProbeCache::is_cacheable(av_find_input_format("matroska")), "matroska files would be cached");
+
+    Dictionary options;
+    options["audio"] = true;
+    auto path        = generate_clip("probe_cache", 640, 360, 4.0, 30, options);
+    if (path.is_empty()) {
+        report.expect(false, "cannot generate the clip");
+        return report.finish();
+    }
+    auto nativePath = ProjectSettings::get_singleton()->globalize_path(path).utf8();
+
+    // A real probe, as set_file() does on a cache miss
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, nativePath.get_data(), nullptr, nullptr) != 0) {
+        report.expect(false, "cannot open " + path);
+        return report.finish();
+    }
+    OpenedFormatContext probed { context };
+    if (avformat_find_stream_info(probed.get(), nullptr) < 0) {
+        report.expect(false, "cannot find the stream info of " + path);
+        return report.finish();
+    }
+    auto video = av_find_best_stream(probed.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    auto audio = av_find_best_stream(probed.get(), AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    auto entry = ProbeCache::capture(probed.get(), video, audio);
+    if (entry.is_empty()) {
+        report.expect(false, "the probe of " + path + " was not captured");
+        return report.finish();
+    }
+
+    // Completed from the entry, as set_file() does on a cache hit
+    context = nullptr;
+    if (avformat_open_input(&context, nativePath.get_data(), av_find_input_format(String(entry["format"]).utf8().get_data()), nullptr) != 0) {
+        report.expect(false, "cannot open " + path + " again");
+        return report.finish();
+    }
+    OpenedFormatContext cached { context };
+    if (!ProbeCache::apply(entry, cached.get())) {
+        report.expect(false, "the entry does not apply to " + path);
+        return report.finish();
+    }
+
+    auto compare = [&report](const String& what, int64_t probedValue, int64_t cachedValue) {
+        report.expect(probedValue == cachedValue, String("{0}: {1} probed, {2} from the cache").format(varray(what, probedValue, cachedValue)));
+    };
+    compare("duration", probed->duration, cached->duration);
+    compare("start_time", probed->start_time, cached->start_time);
+    compare("streams", probed->nb_streams, cached->nb_streams);
+    for (unsigned i = 0; i < MIN(probed->nb_streams, cached->nb_streams); ++i) {
+        const AVStream* p = probed->streams[i];
+        const AVStream* c = cached->streams[i];
+        auto prefix       = String("stream {0} ").format(varray(i));
+        compare(prefix + "codec_id", p->codecpar->codec_id, c->codecpar->codec_id);
+        compare(prefix + "format", p->codecpar->format, c->codecpar->format);
+        compare(prefix + "width", p->codecpar->width, c->codecpar->width);
+        compare(prefix + "height", p->codecpar->height, c->codecpar->height);
+        compare(prefix + "video_delay", p->codecpar->video_delay, c->codecpar->video_delay);
+        compare(prefix + "sample_rate", p->codecpar->sample_rate, c->codecpar->sample_rate);
+        compare(prefix + "channels", p->codecpar->ch_layout.nb_channels, c->codecpar->ch_layout.nb_channels);
+        compare(prefix + "frame_size", p->codecpar->frame_size, c->codecpar->frame_size);
+        compare(prefix + "time_base", av_q2d(p->time_base) * 1e9, av_q2d(c->time_base) * 1e9);
+        compare(prefix + "avg_frame_rate", av_q2d(p->avg_frame_rate) * 1e6, av_q2d(c->avg_frame_rate) * 1e6);
+        compare(prefix + "start_time", p->start_time, c->start_time);
+        compare(prefix + "duration", p->duration, c->duration);
+    }
+
+    // The packets and their timestamps, B-frames included
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> probedPacket { av_packet_alloc() };
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> cachedPacket { av_packet_alloc() };
+    int packets = 0;
+    for (; packets < 300; ++packets) {
+        auto probedRet = av_read_frame(probed.get(), probedPacket.get());
+        auto cachedRet = av_read_frame(cached.get(), cachedPacket.get());
+        if (probedRet < 0 || cachedRet < 0) {
+            report.expect(probedRet == cachedRet, String("packet {0}: one of the contexts ended first").format(varray(packets)));
+            break;
+        }
+        auto prefix = String("packet {0} ").format(varray(packets));
+        compare(prefix + "stream", probedPacket->stream_index, cachedPacket->stream_index);
+        compare(prefix + "pts", probedPacket->pts, cachedPacket->pts);
+        compare(prefix + "dts", probedPacket->dts, cachedPacket->dts);
+        compare(prefix + "duration", probedPacket->duration, cachedPacket->duration);
+        compare(prefix + "size", probedPacket->size, cachedPacket->size);
+        compare(prefix + "flags", probedPacket->flags, cachedPacket->flags);
+        av_packet_unref(probedPacket.get());
+        av_packet_unref(cachedPacket.get());
+    }
+    report.set("packets_compared", packets);
+
+    // An entry whose format no longer opens the file: set_file() must probe it for real and replace the entry
+    int64_t fileSize = -1;
+    if (auto file = FileAccess::open(path, FileAccess::READ); file.is_valid()) {
+        fileSize = (int64_t)file->get_length();
+    }
+    auto key         = ProbeCache::make_key(path, fileSize);
+    Dictionary stale = entry.duplicate();
+    stale["format"]  = "matroska";
+    ProbeCache::store(key, stale);
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    stream->set_probe_cache_enabled(true);
+    bool opened = stream->set_file(path);
+    report.expect(opened, "set_file() failed with a stale cache entry instead of probing again");
+    report.expect(!stream->is_probe_cache_hit(), "the stale cache entry was reported as a hit");
+    report.expect(stream->get_video_stream_count() == 1 && stream->get_audio_stream_count() == 1, "the streams of the file were not found after probing again");
+    auto replaced = ProbeCache::load(key);
+    report.expect(String(replaced.get("format", "")) == String(entry["format"]), String("the cache entry holds the format '{0}' after probing again").format(varray(replaced.get("format", ""))));
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::decoder_pool_reuse()
+{
+    CheckReport report;
+    auto path = generate_clip("decoder_pool", 640, 360, 3.0, 30, Dictionary());
+    if (path.is_empty()) {
+        report.expect(false, "cannot generate the clip");
+        return report.finish();
+    }
+
+    static const constexpr int kAllFrames         = 1000;
+    static const constexpr int kInterruptedFrames = 20;
+    auto& pool                                    = CodecContextPool::get_singleton();
+    auto savedCapacity                            = pool.get_capacity();
+    pool.clear();
+    pool.set_capacity(1);
+
+    PackedStringArray fresh, interrupted, again;
+    bool freshReused = false, interruptedReused = false, againReused = false;
+    String error;
+    bool decoded = decode_pooled(path, kAllFrames, fresh, freshReused, error)
+            && decode_pooled(path, kInterruptedFrames, interrupted, interruptedReused, error)
+            && decode_pooled(path, kAllFrames, again, againReused, error);
+    pool.clear();
+    pool.set_capacity(savedCapacity);
+    if (!decoded) {
+        report.expect(false, error);
+        return report.finish();
+    }
+
+    report.set("frames", fresh.size());
+    report.expect(fresh.size() > kInterruptedFrames, String("only {0} frames decoded").format(varray(fresh.size())));
+    report.expect(!freshReused, "the first decoder came from the pool");
+    report.expect(interruptedReused && againReused, "the decoder was not reused");
+    report.expect(interrupted.size() == kInterruptedFrames, String("{0} frames decoded before giving the decoder back").format(varray(interrupted.size())));
+    for (int i = 0; i < interrupted.size() && i < fresh.size(); ++i) {
+        report.expect(interrupted[i] == fresh[i], String("frame {0} differs after the first reuse").format(varray(i)));
+    }
+    // The frames left inside the interrupted decoder must not come out of the next one
+    report.expect(again.size() == fresh.size(), String("{0} frames decoded after the reset, {1} fresh").format(varray(again.size(), fresh.size())));
+    for (int i = 0; i < again.size() && i < fresh.size(); ++i) {
+        report.expect(again[i] == fresh[i], String("frame {0} differs after the reset").format(varray(i)));
+    }
+    return report.finish();
+}
+
+Dictionary FfmpegSelfTest::hw_device_cache_refcount()
+{
+    CheckReport report;
+    auto& cache = HwDeviceCache::get_singleton();
+    // The idle decoders may hold the real devices, nothing else runs during the checks
+    CodecContextPool::get_singleton().clear();
+    if (cache.get_stats().devices != 0) {
+        report.expect(false, "devices are still in use");
+        return report.finish();
+    }
+    cache.set_factory(&create_fake_device);
+    fakeDevicesCreated = 0;
+    fakeDevicesFreed   = 0;
+    auto before        = cache.get_stats();
+    auto type          = AV_HWDEVICE_TYPE_VAAPI; // any type, the factory ignores it
+
+    auto* first  = cache.acquire(type);
+    auto* second = cache.acquire(type);
+    report.expect(first != nullptr && second != nullptr, "acquire() failed");
+    if (first == nullptr || second == nullptr) {
+        cache.release(first);
+        cache.release(second);
+        cache.set_factory(nullptr);
+        return report.finish();
+    }
+    report.expect(first->data == second->data, "the two streams got different devices");
+    report.expect(fakeDevicesCreated == 1, String("{0} devices created for one type").format(varray(fakeDevicesCreated.load())));
+    report.expect(cache.get_stats().reused - before.reused == 1, "the second acquire() was not counted as reused");
+
+    // As open_decoder() does, the codec context keeps its own reference
+    auto* codecReference = av_buffer_ref(first);
+    cache.release(first);
+    cache.release(second);
+    cache.trim();
+    report.expect(cache.get_stats().devices == 1 && fakeDevicesFreed == 0, "the device was dropped while a codec context used it");
+
+    av_buffer_unref(&codecReference);
+    report.expect(cache.get_stats().devices == 1, "the device was dropped before trim()");
+    cache.trim();
+    report.expect(cache.get_stats().devices == 0 && fakeDevicesFreed == 1, "trim() kept a device only the cache referenced");
+
+    // A device dropped is created again, and freed by release() alone
+    auto* third = cache.acquire(type);
+    report.expect(third != nullptr && fakeDevicesCreated == 2, "the dropped device was not created again");
+    cache.release(third);
+    report.expect(cache.get_stats().devices == 0 && fakeDevicesFreed == 2, "release() did not drop the unused device");
+
+    cache.set_factory(&fail_device);
+    int err      = 0;
+    auto* failed = cache.acquire(type, &err);
+    report.expect(failed == nullptr && err == AVERROR(ENOSYS), "a failed creation was not reported");
+    report.expect(cache.get_stats().devices == 0, "a failed creation was cached");
+    cache.release(failed);
+    cache.set_factory(nullptr);
+
+    report.set("created", fakeDevicesCreated.load());
+    report.set("freed", fakeDevicesFreed.load());
+    return report.finish();
+}
+
+#endif // TOOLS_ENABLED
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifdef TOOLS_ENABLED
+
+#include <core/object/ref_counted.h>
+#include <core/string/ustring.h>
+#include <core/variant/dictionary.h>
+
+// Automated checks of the playback pipeline that need the engine and ffmpeg, run headless by the SelfTest scene.
+// Every check returns a dictionary with "passed", the "failures" it found and what it measured. The clips they play
+// are generated into user://self_test.
+class FfmpegSelfTest : public RefCounted {
+    GDCLASS(FfmpegSelfTest, RefCounted);
+
+public:
+    static void _bind_methods();
+
+    // Plays a high bit rate 60 fps clip with audio while nothing consumes the decoded video frames, as when the
+    // renderer stalls, and reads the audio with read_audio(). The audio must keep being demuxed past the time the
+    // video packets the queue holds would last.
+    static Dictionary audio_under_video_backlog();
+
+    // Decodes a whole clip with set_latest_frame_wins() while nothing calls update(), far more frames than the mailbox
+    // holds, then calls update() once: the frame presented must be the last one decoded, not one of the first.
+    static Dictionary latest_frame_wins();
+
+    // Scrubs a generated clip with B-frames, whose keyframe index cannot be imported from the demuxer, across three
+    // GOPs with ThumbnailGenerator. Every position must end up with the exact preview of its own keyframe, each one
+    // different from the others.
+    static Dictionary thumbnails_with_b_frames();
+
+    // Builds PanoramaMesh equirectangular spheres and checks that the pole vertex of every triangle touching a pole
+    // has the u of the triangle center, at both poles, and that no triangle collapses on a pole.
+    static Dictionary panorama_pole_uvs();
+
+    // Streams a generated file from a local HTTP server through HttpRangeSource: sequential range reads, seeks across
+    // chunks, cache hits when the file is opened again, a file replaced with one of the same size, and a server failing
+    // before and after the open.
+    static Dictionary http_range_source();
+
+    // Opens a generated MP4 clip once with a real probe and once completed from the ProbeCache entry of that probe,
+    // and compares the codec parameters, the timings and the first packets the two contexts read. Then stores an entry
+    // with a format that cannot open the clip: set_file() must still open it, with a real probe, and replace the entry.
+    static Dictionary probe_cache_matches_probe();
+
+    // Decodes a generated clip in software with a fresh CodecContextPool decoder, gives back a reused one in the middle
+    // of the clip with frames still inside, then decodes the clip again with it. Every frame of the reused decoders must
+    // be identical to the fresh one's, timestamps included.
+    static Dictionary decoder_pool_reuse();
+
+    // Drives HwDeviceCache with a factory of plain ffmpeg buffers instead of hardware devices: one device per type
+    // shared by every acquire(), kept while a stream or a codec context references it, dropped by trim() after, and
+    // nothing cached when creating it fails.
+    static Dictionary hw_device_cache_refcount();
+};
+
+#endif // TOOLS_ENABLED
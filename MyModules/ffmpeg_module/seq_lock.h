@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A value written by one thread and read by any other without locks and without tearing: a reader that overlaps a
+// write retries. The value is stored as atomic words, so that copying it while it is written is well defined.
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock only copies trivially copyable values");
+
+public:
+    explicit SeqLock(const T& value = T {}) { store(value); }
+
+    SeqLock(const SeqLock&)            = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    // Only one thread may write
+    void store(const T& value)
+    {
+        uint64_t words[kWords] {};
+        memcpy(words, &value, sizeof(T));
+        auto sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed); // odd while writing
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; ++i) {
+            words_[i].store(words[i], std::memory_order_relaxed);
+        }
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    T load() const
+    {
+        uint64_t words[kWords];
+        uint32_t before = 0;
+        uint32_t after  = 0;
+        do {
+            before = sequence_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < kWords; ++i) {
+                words[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence_.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+
+        T value;
+        memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+private:
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint32_t> sequence_ { 0 };
+    std::atomic<uint64_t> words_[kWords] {};
+};
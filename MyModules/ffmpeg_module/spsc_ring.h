@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A fixed-slot, lock-free ring for exactly one producer thread and one consumer thread.
+// Slots are allocated once by reset(), push and pop never allocate.
+template <typename E>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) { reset(capacity); }
+
+    SpscRing(const SpscRing&)            = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Neither the producer nor the consumer may be running when calling this
+    void reset(size_t capacity)
+    {
+        assert(capacity > 0);
+        slots_.clear();
+        slots_.resize(capacity);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    // Producer side, returns false if the ring is full
+    bool tryPush(E&& e)
+    {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) >= slots_.size()) {
+            return false;
+        }
+        slots_[tail % slots_.size()] = std::move(e);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool isFull() const
+    {
+        return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) >= slots_.size();
+    }
+
+    // Consumer side, returns nullptr if the ring is empty
+    E* front()
+    {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots_[head % slots_.size()];
+    }
+
+    // Consumer side, the ring must not be empty
+    void popFront()
+    {
+        auto head = head_.load(std::memory_order_relaxed);
+        assert(head != tail_.load(std::memory_order_acquire));
+        slots_[head % slots_.size()] = E {}; // release what the element holds
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Consumer side, returns false if the ring is empty
+    bool tryPop(E& e)
+    {
+        auto* f = front();
+        if (f == nullptr) {
+            return false;
+        }
+        e = std::move(*f);
+        popFront();
+        return true;
+    }
+
+    size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+    bool isEmpty() const { return size() == 0; }
+    size_t capacity() const { return slots_.size(); }
+
+private:
+    std::vector<E> slots_ {};
+    alignas(64) std::atomic<uint64_t> head_ { 0 }; // written by the consumer
+    alignas(64) std::atomic<uint64_t> tail_ { 0 }; // written by the producer
+};
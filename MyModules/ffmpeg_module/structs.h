@@ -1,11 +1,18 @@
 #pragma once
+#include "http_range_source.h"
+#include "mapped_file.h"
+#include "read_ahead_buffer.h"
+#include <atomic>
 #include <cassert>
 #include <core/io/file_access.h>
 #include <core/string/ustring.h>
+#include <memory>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
 }
 
 struct AVFormatContextDeleter {
@@ -34,6 +41,13 @@ struct AvPacketDeleter {
     }
 };
 
+struct AvPacketFreeDeleter {
+    void operator()(AVPacket* p)
+    {
+        av_packet_free(&p);
+    }
+};
+
 struct AvFrameDeleter {
     void operator()(AVFrame* f)
     {
@@ -43,6 +57,27 @@ struct AvFrameDeleter {
     }
 };
 
+struct AvFrameFreeDeleter {
+    void operator()(AVFrame* f)
+    {
+        av_frame_free(&f);
+    }
+};
+
+struct SwrContextDeleter {
+    void operator()(SwrContext* s)
+    {
+        swr_free(&s);
+    }
+};
+
+struct SwsContextDeleter {
+    void operator()(SwsContext* s)
+    {
+        sws_freeContext(s);
+    }
+};
+
 struct AvBufferRefDeleter {
     void operator()(AVBufferRef* r)
     {
@@ -51,7 +86,10 @@ struct AvBufferRefDeleter {
 };
 
 struct AvIoContextWrapper {
-    explicit AvIoContextWrapper(const String& filePath)
+    // http:// and https:// urls are streamed with an HttpRangeSource. With memoryMapped and no read ahead, local
+    // files are read through a MappedFile. Otherwise they are read with FileAccess, ahead on a thread when
+    // readAheadBytes > 0, see ReadAheadBuffer.
+    explicit AvIoContextWrapper(const String& filePath, size_t readAheadBytes = 0, bool memoryMapped = false)
     {
         enum { kBufferSize = 16384 };
         auto* buffer = (unsigned char*)av_malloc(kBufferSize); // we don't need to free it
@@ -66,10 +104,22 @@ struct AvIoContextWrapper {
                  [](void* opaque, int64_t offset, int whence) -> int64_t {
                 return reinterpret_cast<AvIoContextWrapper*>(opaque)->seek_func(offset, whence);
             });
+        if (HttpRangeSource::is_http_url(filePath)) {
+            http = std::make_unique<HttpRangeSource>();
+            if (!http->open(filePath)) {
+                http.reset();
+            }
+            return;
+        }
+        if (memoryMapped && readAheadBytes == 0 && mapped.open(filePath)) {
+            return;
+        }
         Error error;
         file = FileAccess::open(filePath, FileAccess::READ, &error);
         if (error != 0) {
             ERR_PRINT(String("Failed to open file {0}: code {1}").format(varray(filePath, int(error))));
+        } else if (readAheadBytes > 0) {
+            readAhead = std::make_unique<ReadAheadBuffer>(file, readAheadBytes);
         }
     }
     ~AvIoContextWrapper()
@@ -82,9 +132,43 @@ struct AvIoContextWrapper {
         avio_context_free(&context);
     }
 
+    bool is_open() const { return http != nullptr || mapped.is_open() || file.is_valid(); }
+
+    // "http", "mmap", "read_ahead" or "file"
+    const char* get_backend_name() const
+    {
+        if (http != nullptr) {
+            return "http";
+        }
+        return mapped.is_open() ? "mmap" : readAhead != nullptr ? "read_ahead" : "file";
+    }
+
+    // The reads that had to wait for the storage or the network, null when reading synchronously
+    const DurationStats* get_stalls() const
+    {
+        if (http != nullptr) {
+            return &http->get_stalls();
+        }
+        return readAhead != nullptr ? &readAhead->get_stalls() : nullptr;
+    }
+
     int read_func(uint8_t* buf, int buf_size)
     {
-        return (int)file->get_buffer(buf, buf_size);
+        int n = 0;
+        if (http != nullptr) {
+            n = http->read(buf, buf_size);
+        } else if (mapped.is_open()) {
+            n = mapped.read(buf, buf_size);
+        } else if (readAhead != nullptr) {
+            n = readAhead->read(buf, buf_size);
+        } else {
+            n = (int)file->get_buffer(buf, buf_size);
+        }
+        if (n <= 0) {
+            return AVERROR_EOF;
+        }
+        bytesRead.fetch_add((uint64_t)n, std::memory_order_relaxed);
+        return n;
     }
 
     int write_func(uint8_t* buf, int buf_size)
@@ -96,30 +180,67 @@ struct AvIoContextWrapper {
     int64_t seek_func(int64_t offset, int whence)
     {
         if (whence & AVSEEK_SIZE) {
-            return (int64_t)file->get_length();
+            return get_length();
         }
 
         if (whence == AVSEEK_FORCE) {
             abort(); // seems ffmpeg will not pass this flag to me
         }
 
+        int64_t position = 0;
         switch (whence) {
         case SEEK_SET:
-            file->seek(offset);
+            position = offset;
             break;
         case SEEK_CUR:
-            file->seek(file->get_position() + offset);
+            position = get_position() + offset;
             break;
         case SEEK_END:
-            file->seek_end(offset);
+            position = get_length() + offset;
             break;
         default:
             abort();
         }
 
+        if (http != nullptr) {
+            return http->seek(position);
+        }
+        if (mapped.is_open()) {
+            return mapped.seek(position);
+        }
+        if (readAhead != nullptr) {
+            return readAhead->seek(position);
+        }
+        file->seek(position);
         return (int64_t)file->get_position();
     }
 
+    int64_t get_length() const
+    {
+        if (http != nullptr) {
+            return http->get_length();
+        }
+        if (mapped.is_open()) {
+            return mapped.get_length();
+        }
+        return readAhead != nullptr ? readAhead->get_length() : (int64_t)file->get_length();
+    }
+
+    int64_t get_position() const
+    {
+        if (http != nullptr) {
+            return http->get_position();
+        }
+        if (mapped.is_open()) {
+            return mapped.get_position();
+        }
+        return readAhead != nullptr ? readAhead->get_position() : (int64_t)file->get_position();
+    }
+
     AVIOContext* context { nullptr };
-    Ref<FileAccess> file { nullptr };
+    std::unique_ptr<HttpRangeSource> http { nullptr };
+    MappedFile mapped {};
+    Ref<FileAccess> file { nullptr }; // only used by readAhead's thread when there is one
+    std::unique_ptr<ReadAheadBuffer> readAhead { nullptr };
+    std::atomic<uint64_t> bytesRead { 0 };
 };
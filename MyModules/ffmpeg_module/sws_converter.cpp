@@ -0,0 +1,164 @@
+#include "sws_converter.h"
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+// Planes 1 and 2 of the yuv formats hold the chroma, the other planes are full height
+static void get_plane_shifts(const AVPixFmtDescriptor* desc, int shifts[4])
+{
+    for (int i = 0; i < 4; ++i) {
+        shifts[i] = (i == 1 || i == 2) && (desc->flags & AV_PIX_FMT_FLAG_RGB) == 0 ? desc->log2_chroma_h : 0;
+    }
+}
+
+SwsConverter::SwsConverter(int threadCount)
+{
+    if (threadCount <= 0) {
+        threadCount = (int)std::thread::hardware_concurrency() / 2;
+    }
+    threadCount_ = std::clamp(threadCount, 1, 4);
+}
+
+SwsConverter::~SwsConverter()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        stopRequested_ = true;
+    }
+    workCv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+bool SwsConverter::convert(const AVFrame* frame, int width, int height, AVPixelFormat dstFormat, uint8_t* const dst[4], const int dstLinesize[4])
+{
+    auto* entry = get_entry((AVPixelFormat)frame->format, width, height, dstFormat);
+    if (entry == nullptr) {
+        return false;
+    }
+
+    int pending = (int)entry->bands.size() - 1;
+    if (pending > 0 && workers_.empty()) {
+        for (int i = 1; i < threadCount_; ++i) {
+            workers_.emplace_back(&SwsConverter::worker_routine, this, i, generation_);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        frame_ = frame;
+        entry_ = entry;
+        std::copy(dst, dst + 4, dst_);
+        std::copy(dstLinesize, dstLinesize + 4, dstLinesize_);
+        pendingBands_ = pending;
+        ++generation_;
+    }
+    if (pending > 0) {
+        workCv_.notify_all();
+    }
+    convert_band(0);
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    doneCv_.wait(lck, [this]() { return pendingBands_ == 0; });
+    frame_ = nullptr;
+    return true;
+}
+
+void SwsConverter::clear()
+{
+    entries_.clear();
+}
+
+SwsConverter::Entry* SwsConverter::get_entry(AVPixelFormat srcFormat, int width, int height, AVPixelFormat dstFormat)
+{
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->srcFormat == srcFormat && it->width == width && it->height == height && it->dstFormat == dstFormat) {
+            if (it + 1 != entries_.end()) {
+                std::rotate(it, it + 1, entries_.end());
+            }
+            return &entries_.back();
+        }
+    }
+
+    if (width <= 0 || height <= 0 || !sws_isSupportedInput(srcFormat) || !sws_isSupportedOutput(dstFormat)) {
+        return nullptr;
+    }
+    Entry entry { srcFormat, width, height, dstFormat };
+    if (!create_bands(entry)) {
+        return nullptr;
+    }
+    if (entries_.size() >= kMaxEntries) {
+        entries_.erase(entries_.begin());
+    }
+    entries_.push_back(std::move(entry));
+    return &entries_.back();
+}
+
+bool SwsConverter::create_bands(Entry& entry)
+{
+    auto* srcDesc = av_pix_fmt_desc_get(entry.srcFormat);
+    auto* dstDesc = av_pix_fmt_desc_get(entry.dstFormat);
+    get_plane_shifts(srcDesc, entry.srcShifts);
+    get_plane_shifts(dstDesc, entry.dstShifts);
+
+    // The palette of paletted formats is a plane that must not be offset
+    int bandCount = std::clamp(entry.height / kMinBandHeight, 1, threadCount_);
+    if ((srcDesc->flags & AV_PIX_FMT_FLAG_PAL) != 0 || (dstDesc->flags & AV_PIX_FMT_FLAG_PAL) != 0) {
+        bandCount = 1;
+    }
+
+    // Every band is converted as a picture of its own, so the chroma of the rows next to a band border
+    // is upsampled from that band only. It is not visible in a moving picture.
+    entry.bands.resize(bandCount);
+    for (int i = 0; i < bandCount; ++i) {
+        auto& band  = entry.bands[i];
+        band.y      = i == 0 ? 0 : entry.height * i / bandCount / kBandAlignment * kBandAlignment;
+        auto end    = i + 1 == bandCount ? entry.height : entry.height * (i + 1) / bandCount / kBandAlignment * kBandAlignment;
+        band.height = end - band.y;
+        band.context.reset(sws_getContext(entry.width, band.height, entry.srcFormat,
+            entry.width, band.height, entry.dstFormat, SWS_BILINEAR, nullptr, nullptr, nullptr));
+        if (band.context == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SwsConverter::convert_band(int index)
+{
+    auto& band = entry_->bands[index];
+    const uint8_t* src[4] {};
+    uint8_t* dst[4] {};
+    for (int i = 0; i < 4; ++i) {
+        if (frame_->data[i] != nullptr) {
+            src[i] = frame_->data[i] + (ptrdiff_t)(band.y >> entry_->srcShifts[i]) * frame_->linesize[i];
+        }
+        if (dst_[i] != nullptr) {
+            dst[i] = dst_[i] + (ptrdiff_t)(band.y >> entry_->dstShifts[i]) * dstLinesize_[i];
+        }
+    }
+    sws_scale(band.context.get(), src, frame_->linesize, 0, band.height, dst, dstLinesize_);
+}
+
+void SwsConverter::worker_routine(int index, uint64_t generation)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    while (true) {
+        workCv_.wait(lck, [this, generation]() { return stopRequested_ || generation_ != generation; });
+        if (stopRequested_) {
+            return;
+        }
+        generation = generation_;
+        if (index >= (int)entry_->bands.size()) {
+            continue;
+        }
+        lck.unlock();
+        convert_band(index);
+        lck.lock();
+        if (--pendingBands_ == 0) {
+            doneCv_.notify_one();
+        }
+    }
+}
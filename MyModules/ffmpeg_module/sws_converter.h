@@ -0,0 +1,79 @@
+#pragma once
+
+#include "structs.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// libswscale conversion of the frames the upload paths cannot take as they are (yuv422p, yuv444p, rgb24,
+// odd sizes...). SwsContexts are kept per (source format, size, destination format), and the picture is
+// converted in horizontal bands on worker threads, each band with its own SwsContext.
+// Only one thread at a time may convert.
+class SwsConverter {
+public:
+    // threadCount includes the converting thread, 0 picks it from the cpu count
+    explicit SwsConverter(int threadCount = 0);
+    ~SwsConverter();
+
+    SwsConverter(const SwsConverter&)            = delete;
+    SwsConverter& operator=(const SwsConverter&) = delete;
+
+    // Converts the top left width x height pixels of frame to dstFormat without scaling, into the planes
+    // dst which must be large enough. Returns false if libswscale does not support the conversion.
+    bool convert(const AVFrame* frame, int width, int height, AVPixelFormat dstFormat, uint8_t* const dst[4], const int dstLinesize[4]);
+
+    // Frees the cached contexts
+    void clear();
+
+    int get_thread_count() const { return threadCount_; }
+
+private:
+    struct Band {
+        int y { 0 };
+        int height { 0 };
+        std::unique_ptr<SwsContext, SwsContextDeleter> context {};
+    };
+
+    struct Entry {
+        AVPixelFormat srcFormat { AV_PIX_FMT_NONE };
+        int width { 0 };
+        int height { 0 };
+        AVPixelFormat dstFormat { AV_PIX_FMT_NONE };
+        int srcShifts[4] {}; // vertical subsampling of each plane
+        int dstShifts[4] {};
+        std::vector<Band> bands {};
+    };
+
+    Entry* get_entry(AVPixelFormat srcFormat, int width, int height, AVPixelFormat dstFormat);
+
+    bool create_bands(Entry& entry);
+
+    void convert_band(int index);
+
+    // generation is the last conversion started before the worker
+    void worker_routine(int index, uint64_t generation);
+
+private:
+    static constexpr size_t kMaxEntries = 4;
+    static constexpr int kMinBandHeight = 64;
+    static constexpr int kBandAlignment = 16; // a multiple of every vertical chroma subsampling
+
+    int threadCount_ { 1 };
+    std::vector<Entry> entries_ {}; // most recently used last
+
+    // the conversion in progress, read by the workers
+    const AVFrame* frame_ { nullptr };
+    Entry* entry_ { nullptr };
+    uint8_t* dst_[4] {};
+    int dstLinesize_[4] {};
+
+    std::mutex mutex_ {};
+    std::condition_variable workCv_ {};
+    std::condition_variable doneCv_ {};
+    uint64_t generation_ { 0 };
+    int pendingBands_ { 0 };
+    bool stopRequested_ { false };
+    std::vector<std::thread> workers_ {}; // started by the first conversion split into bands
+};
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <condition_variable>
+#include <cstdint>
 #include <list>
 #include <mutex>
+#include <utility>
 
 template <typename E>
 class ThreadSafeBlockingQueue {
@@ -13,7 +17,8 @@ public:
     }
     ~ThreadSafeBlockingQueue() { close(); }
 
-    bool push(E e)
+    // weight is any amount the owner wants summed over the queued elements, e.g. their duration
+    bool push(E e, int64_t weight = 0)
     {
         {
             std::unique_lock<std::mutex> lck(mutex_);
@@ -21,7 +26,10 @@ public:
             if (isClosed_) {
                 return false;
             }
-            queue_.push_back(std::move(e));
+            queue_.push_back(std::make_pair(std::move(e), weight));
+            totalWeight_ += weight;
+            sizeHint_.store(queue_.size(), std::memory_order_relaxed);
+            weightHint_.store(totalWeight_, std::memory_order_relaxed);
         }
         hasElementCv_.notify_one();
         return true;
@@ -35,8 +43,11 @@ public:
             if (isClosed_) {
                 return false;
             }
-            e = std::move(queue_.front());
+            e = std::move(queue_.front().first);
+            totalWeight_ -= queue_.front().second;
             queue_.pop_front();
+            sizeHint_.store(queue_.size(), std::memory_order_relaxed);
+            weightHint_.store(totalWeight_, std::memory_order_relaxed);
         }
         hasSpaceCv_.notify_one();
         return true;
@@ -45,7 +56,7 @@ public:
     const E& peekFront() const
     {
         assert(queue_.size() > 0);
-        return queue_.front();
+        return queue_.front().first;
     }
 
     bool isEmpty() const { return size() == 0; }
@@ -56,6 +67,12 @@ public:
         return queue_.size();
     }
 
+    // Lock-free and possibly stale, for statistics
+    size_t approximateSize() const { return sizeHint_.load(std::memory_order_relaxed); }
+
+    // Sum of the weights of the queued elements, lock-free and possibly stale
+    int64_t approximateWeight() const { return weightHint_.load(std::memory_order_relaxed); }
+
     void close()
     {
         {
@@ -67,16 +84,36 @@ public:
     }
 
     void clear()
+    {
+        {
+            std::unique_lock<std::mutex> lck(mutex_);
+            queue_.clear();
+            totalWeight_ = 0;
+            sizeHint_.store(0, std::memory_order_relaxed);
+            weightHint_.store(0, std::memory_order_relaxed);
+        }
+        hasSpaceCv_.notify_all();
+    }
+
+    // Drop all elements and accept new ones again after close()
+    void reopen()
     {
         std::unique_lock<std::mutex> lck(mutex_);
         queue_.clear();
+        totalWeight_ = 0;
+        sizeHint_.store(0, std::memory_order_relaxed);
+        weightHint_.store(0, std::memory_order_relaxed);
+        isClosed_ = false;
     }
 
 private:
     mutable std::mutex mutex_ {};
     std::condition_variable hasElementCv_ {};
     std::condition_variable hasSpaceCv_ {};
-    std::list<E> queue_ {};
+    std::list<std::pair<E, int64_t>> queue_ {};
     size_t maxSize_ { 1 };
+    int64_t totalWeight_ { 0 };
     bool isClosed_ { false };
+    std::atomic<size_t> sizeHint_ { 0 };
+    std::atomic<int64_t> weightHint_ { 0 };
 };
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include "thumbnail_generator.h"
+
+ThumbnailGenerator::~ThumbnailGenerator()
+{
+    stop();
+}
+
+void ThumbnailGenerator::start(const String& filePath, int width)
+{
+    stop();
+    filePath_      = filePath;
+    width_         = MAX(width, 16);
+    stopRequested_ = false;
+    worker_        = std::thread([this]() { worker_routine(); });
+}
+
+void ThumbnailGenerator::stop()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        stopRequested_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    requestedPosition_     = -1.0;
+    lastRequestedPosition_ = -1.0;
+    timeBase_              = AVRational { 0, 1 };
+    keyframes_.clear();
+    cache_.clear();
+    cacheLookup_.clear();
+}
+
+Ref<Image> ThumbnailGenerator::get(double position, bool* exact)
+{
+    if (exact != nullptr) {
+        *exact = false;
+    }
+    Ref<Image> nearest;
+    std::unique_lock<std::mutex> lck(mutex_);
+    if (timeBase_.num != 0) {
+        auto pts    = int64_t(position * timeBase_.den / (double)timeBase_.num);
+        auto keyPts = keyframes_.find_at_or_before(pts);
+        auto it     = keyPts != AV_NOPTS_VALUE ? cacheLookup_.find(keyPts) : cacheLookup_.end();
+        if (it != cacheLookup_.end()) {
+            cache_.splice(cache_.end(), cache_, it->second);
+            const auto& preview = it->second->second;
+            if (keyframes_.is_complete() || pts <= preview.coveredUntil) {
+                if (exact != nullptr) {
+                    *exact = true;
+                }
+                return preview.image;
+            }
+            nearest = preview.image; // a later keyframe may not have been read yet
+        }
+    }
+    // Polled every frame while dragging, ask for each position only once
+    if (position != lastRequestedPosition_) {
+        lastRequestedPosition_ = position;
+        requestedPosition_     = position;
+        cv_.notify_one();
+    }
+    return nearest;
+}
+
+void ThumbnailGenerator::set_cache_capacity(uint32_t n)
+{
+    std::unique_lock<std::mutex> lck(mutex_);
+    cacheCapacity_ = MAX(n, 1u);
+    while (cache_.size() > cacheCapacity_) {
+        cacheLookup_.erase(cache_.front().first);
+        cache_.pop_front();
+    }
+}
+
+void ThumbnailGenerator::put(int64_t pts, const Ref<Image>& image, int64_t coveredUntil)
+{
+    auto it = cacheLookup_.find(pts);
+    if (it != cacheLookup_.end()) {
+        auto& preview        = it->second->second;
+        preview.image        = image;
+        preview.coveredUntil = MAX(preview.coveredUntil, coveredUntil);
+        cache_.splice(cache_.end(), cache_, it->second);
+        return;
+    }
+    if (cache_.size() >= cacheCapacity_) {
+        cacheLookup_.erase(cache_.front().first);
+        cache_.pop_front();
+    }
+    cache_.emplace_back(pts, Preview { image, MAX(pts, coveredUntil) });
+    cacheLookup_[pts] = std::prev(cache_.end());
+}
+
+bool ThumbnailGenerator::open()
+{
+    bool useAvio =
+#if defined(__ANDROID__)
+        filePath_.begins_with("res://") || filePath_.begins_with("user://") || HttpRangeSource::is_http_url(filePath_);
+#else
+        true;
+#endif
+    const AVInputFormat* inputFormat = nullptr;
+    if (useAvio) {
+        avioContext_ = std::make_unique<AvIoContextWrapper>(filePath_, 0, true);
+        if (!avioContext_->is_open()) {
+            return false;
+        }
+        if (av_probe_input_buffer(avioContext_->context, &inputFormat, "", nullptr, 0, 0) < 0) {
+            ERR_PRINT("Failed to probe input format for thumbnails!");
+            return false;
+        }
+    }
+
+    auto utf8FilePath              = filePath_.utf8();
+    const char* url                = utf8FilePath.get_data();
+    AVFormatContext* formatContext = avformat_alloc_context();
+    if (useAvio) {
+        formatContext->pb    = avioContext_->context;
+        formatContext->flags = AVFMT_FLAG_CUSTOM_IO;
+        url                  = "";
+    }
+    formatContext_.reset(formatContext);
+    if (avformat_open_input(&formatContext, url, inputFormat, nullptr) != 0) {
+        formatContext_.release(); // freed by avformat_open_input on failure
+        ERR_PRINT("Failed to open '" + filePath_ + "' for thumbnails");
+        return false;
+    }
+    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+        return false;
+    }
+
+    const AVCodec* codec = nullptr;
+    streamIndex_         = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (streamIndex_ < 0 || codec == nullptr) {
+        return false;
+    }
+    auto* stream = formatContext->streams[streamIndex_];
+
+    codecContext_.reset(avcodec_alloc_context3(codec));
+    if (avcodec_parameters_to_context(codecContext_.get(), stream->codecpar) < 0) {
+        return false;
+    }
+    // Only keyframes, slice threads do not add a frame of latency like frame threads do
+    codecContext_->skip_frame   = AVDISCARD_NONKEY;
+    codecContext_->thread_type  = FF_THREAD_SLICE;
+    codecContext_->thread_count = 0;
+    if (avcodec_open2(codecContext_.get(), codec, nullptr) < 0) {
+        ERR_PRINT("Failed to open the thumbnail decoder");
+        return false;
+    }
+
+    packet_.reset(av_packet_alloc());
+    frame_.reset(av_frame_alloc());
+
+    std::unique_lock<std::mutex> lck(mutex_);
+    keyframes_.import_stream_index(stream);
+    timeBase_ = stream->time_base;
+    return true;
+}
+
+void ThumbnailGenerator::worker_routine()
+{
+    if (open()) {
+        while (true) {
+            double position = -1.0;
+            {
+                std::unique_lock<std::mutex> lck(mutex_);
+                cv_.wait(lck, [this]() { return stopRequested_ || requestedPosition_ >= 0; });
+                if (stopRequested_) {
+                    break;
+                }
+                position           = requestedPosition_;
+                requestedPosition_ = -1.0;
+            }
+            generate(position);
+        }
+    }
+
+    sws_freeContext(swsContext_);
+    swsContext_ = nullptr;
+    frame_.reset();
+    packet_.reset();
+    codecContext_.reset();
+    formatContext_.reset();
+    avioContext_.reset();
+}
+
+void ThumbnailGenerator::generate(double position)
+{
+    auto* formatContext = formatContext_.get();
+    auto* codecContext  = codecContext_.get();
+    auto* stream        = formatContext->streams[streamIndex_];
+
+    // With a complete index the keyframe is sought exactly, so the preview is stored under the key get() looks for.
+    // Otherwise the demuxer finds it: a keyframe the index does not know yet may come after the last known one.
+    auto pts    = int64_t(position * stream->time_base.den / (double)stream->time_base.num);
+    auto keyPts = int64_t(AV_NOPTS_VALUE);
+    {
+        std::unique_lock<std::mutex> lck(mutex_);
+        if (keyframes_.is_complete()) {
+            keyPts = keyframes_.find_at_or_before(pts);
+        }
+    }
+    int seekRet = keyPts != AV_NOPTS_VALUE ? avformat_seek_file(formatContext, streamIndex_, INT64_MIN, keyPts, keyPts, 0)
+                                           : av_seek_frame(formatContext, streamIndex_, pts, AVSEEK_FLAG_BACKWARD);
+    if (seekRet < 0) {
+        return;
+    }
+    avcodec_flush_buffers(codecContext);
+
+    bool draining = false;
+    for (int i = 0; i < kMaxPacketsPerRequest; ++i) {
+        if (!draining) {
+            int ret = av_read_frame(formatContext, packet_.get());
+            if (ret < 0) {
+                draining = true;
+                avcodec_send_packet(codecContext, nullptr);
+            } else {
+                std::unique_ptr<AVPacket, AvPacketDeleter> packetGuard { packet_.get() };
+                if (packet_->stream_index != streamIndex_) {
+                    continue;
+                }
+                ret = avcodec_send_packet(codecContext, packet_.get());
+                if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                    return;
+                }
+            }
+        }
+
+        int ret = avcodec_receive_frame(codecContext, frame_.get());
+        if (ret == AVERROR(EAGAIN) && !draining) {
+            continue;
+        }
+        if (ret < 0) {
+            return;
+        }
+        std::unique_ptr<AVFrame, AvFrameDeleter> frameGuard { frame_.get() };
+        // The pts, like the index entries, the best effort timestamp may be guessed from the decoding timestamp
+        auto framePts = frame_->pts != AV_NOPTS_VALUE ? frame_->pts : frame_->best_effort_timestamp;
+        if (framePts == AV_NOPTS_VALUE) {
+            return;
+        }
+        auto image = scale(frame_.get());
+        if (image.is_null()) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lck(mutex_);
+        keyframes_.add(framePts);
+        put(framePts, image, pts);
+        return;
+    }
+}
+
+Ref<Image> ThumbnailGenerator::scale(const AVFrame* frame)
+{
+    if (frame->width <= 0 || frame->height <= 0) {
+        return {};
+    }
+    int width  = MIN(width_, frame->width);
+    int height = MAX(2, (int)((int64_t)frame->height * width / frame->width) & ~1);
+
+    swsContext_ = sws_getCachedContext(swsContext_, frame->width, frame->height, (AVPixelFormat)frame->format,
+        width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (swsContext_ == nullptr) {
+        ERR_PRINT("Failed to create the thumbnail scaler");
+        return {};
+    }
+
+    Vector<uint8_t> buffer;
+    buffer.resize(Image::get_image_data_size(width, height, Image::FORMAT_RGBA8, false));
+    uint8_t* dst[4]    = { buffer.ptrw(), nullptr, nullptr, nullptr };
+    int dstLinesize[4] = { width * 4, 0, 0, 0 };
+    sws_scale(swsContext_, frame->data, frame->linesize, 0, frame->height, dst, dstLinesize);
+
+    return Ref<Image> { memnew(Image(width, height, false, Image::FORMAT_RGBA8, buffer)) };
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "keyframe_index.h"
+#include "structs.h"
+#include <condition_variable>
+#include <core/io/image.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+// Low resolution previews of the keyframes, for scrubbing.
+// It opens the file a second time with its own software decoder that only decodes keyframes,
+// so generating previews never seeks or stalls the playback demuxer and decoders.
+class ThumbnailGenerator {
+public:
+    ThumbnailGenerator() = default;
+    ~ThumbnailGenerator();
+
+    ThumbnailGenerator(const ThumbnailGenerator&)            = delete;
+    ThumbnailGenerator& operator=(const ThumbnailGenerator&) = delete;
+
+    // Starts the worker thread, the file is opened on it
+    void start(const String& filePath, int width);
+
+    void stop();
+
+    bool is_started() const { return worker_.joinable(); }
+
+    // Main thread. Returns the cached preview of the keyframe at or before position, exact is then set. Otherwise
+    // asks the worker for it and returns the preview of the nearest keyframe before position meanwhile, null if none
+    // is cached. Only the newest request is kept.
+    // Without a complete keyframe index, as for most files with B-frames, a preview is only known to be the one of
+    // position up to the furthest position it was generated for.
+    Ref<Image> get(double position, bool* exact = nullptr);
+
+    void set_cache_capacity(uint32_t n);
+
+private:
+    void worker_routine();
+
+    bool open();
+
+    // Decodes the first keyframe at or before position and puts it into the cache
+    void generate(double position);
+
+    Ref<Image> scale(const AVFrame* frame);
+
+    // with mutex_ locked, image is the preview of the keyframe at pts, the keyframe at or before coveredUntil
+    void put(int64_t pts, const Ref<Image>& image, int64_t coveredUntil);
+
+private:
+    static constexpr int kMaxPacketsPerRequest = 1024;
+
+    String filePath_ {};
+    int width_ { 256 };
+
+    // worker thread only
+    std::unique_ptr<AvIoContextWrapper> avioContext_ {};
+    std::unique_ptr<AVFormatContext, AVFormatContextDeleter> formatContext_ {};
+    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> codecContext_ {};
+    std::unique_ptr<AVPacket, AvPacketFreeDeleter> packet_ {};
+    std::unique_ptr<AVFrame, AvFrameFreeDeleter> frame_ {};
+    SwsContext* swsContext_ { nullptr };
+    int streamIndex_ { -1 };
+
+    std::mutex mutex_ {};
+    std::condition_variable cv_ {};
+    std::thread worker_ {};
+    bool stopRequested_ { false };
+    double requestedPosition_ { -1.0 };
+    double lastRequestedPosition_ { -1.0 };
+    AVRational timeBase_ { 0, 1 }; // set once the file is opened
+    KeyframeIndex keyframes_ {};
+
+    struct Preview {
+        Ref<Image> image {};
+        int64_t coveredUntil { 0 }; // no other keyframe lies between this one and coveredUntil
+    };
+    // least recently used first
+    using CacheList = std::list<std::pair<int64_t, Preview>>;
+    CacheList cache_ {};
+    std::unordered_map<int64_t, CacheList::iterator> cacheLookup_ {};
+    uint32_t cacheCapacity_ { 64 };
+};
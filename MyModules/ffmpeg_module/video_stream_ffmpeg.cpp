@@ -1,91 +1,74 @@
 #include "video_stream_ffmpeg.h"
-#include <cassert>
-#include <core/config/project_settings.h>
-#include <thirdparty/misc/yuv2rgb.h>
+#include <core/io/file_access.h>
 
-void VideoStreamPlaybackFfmpeg::video_frame_write(AVFrame* frame)
+static constexpr int kAudioChunkFrames = 4096;
+
+void VideoStreamPlaybackFfmpeg::push_audio()
 {
-    // TODO: other format
-    int pitch = 4;
-    frame_data_.resize(frame->width * frame->height * pitch);
-
-    {
-        auto* dst = frame_data_.ptrw();
-        if (frame->format == AV_PIX_FMT_YUV420P) {
-            yuv420_2_rgb8888(dst,
-                frame->data[0],              // y
-                frame->data[1],              // u
-                frame->data[2],              // v
-                frame->width, frame->height, // w, h
-                frame->linesize[0],          // y stride
-                frame->linesize[1],          // uv stride
-                frame->width * 4             // dst stride
-            );
-
-        } else {
-            abort(); // TODO:
+    if (mix_callback_ == nullptr || !stream_->has_audio()) {
+        return;
+    }
+    // Everything decoded goes to the player, it buffers the samples and plays them at its own pace.
+    // What it refuses now is offered again on the next update().
+    while (true) {
+        if (audio_buffer_frames_ == 0) {
+            audio_buffer_offset_ = 0;
+            audio_buffer_frames_ = stream_->read_audio(audio_buffer_.ptrw(), audio_buffer_.size());
+            if (audio_buffer_frames_ == 0) {
+                return;
+            }
+        }
+        // AudioFrame is two floats, the chunk is already interleaved stereo
+        auto* pcm = reinterpret_cast<const float*>(audio_buffer_.ptr() + audio_buffer_offset_);
+        int taken = mix_callback_(mix_udata_, pcm, audio_buffer_frames_);
+        audio_buffer_offset_ += taken;
+        audio_buffer_frames_ -= taken;
+        if (audio_buffer_frames_ > 0) {
+            return; // the player is full
         }
     }
-
-    Ref<Image> img = memnew(Image(frame->width, frame->height, 0, Image::FORMAT_RGBA8, frame_data_)); // zero copy image creation
-
-    texture_->set_image(img); // zero copy send to rendering server
-
-    frames_pending_ = 1;
-}
-
-void VideoStreamPlaybackFfmpeg::clear()
-{
-    avioWrapper_   = nullptr;
-    formatContext_ = nullptr;
-    codecContext_  = nullptr;
-    packet_        = nullptr;
-    frame_         = nullptr;
-
-    frames_pending_ = 0;
-    videoStreamIndices_.clear();
-    audioStreamIndices_.clear();
-    subtitleStreamIndices_.clear();
-
-    playing_            = false;
-    paused_             = false;
-    time_               = 0.0;
-    delay_compensation_ = 0.0;
-    videobuf_time_      = 0.0;
 }
 
 void VideoStreamPlaybackFfmpeg::play()
 {
-    if (!playing_) {
-        time_ = 0;
-    } else {
-        stop();
+    if (stream_.is_null()) {
+        return;
+    }
+    if (stream_->is_stopped()) {
+        audio_buffer_frames_ = 0;
+    }
+    stream_->play();
+    if (paused_) {
+        stream_->pause(); // VideoStreamPlayer may be paused before it plays
     }
-
-    playing_ = true;
-
-    delay_compensation_ = ProjectSettings::get_singleton()->get("audio/video/video_delay_compensation_ms");
-    delay_compensation_ /= 1000.0;
 }
 
 void VideoStreamPlaybackFfmpeg::stop()
 {
-    if (playing_) {
-        clear();
-        set_file(file_name_); // reset
+    if (stream_.is_null()) {
+        return;
     }
-    playing_ = false;
-    time_    = 0; // TODO:
+    // The container stays open, the next play() seeks back to the start
+    stream_->stop();
+    audio_buffer_frames_ = 0;
 }
 
 bool VideoStreamPlaybackFfmpeg::is_playing() const
 {
-    return playing_;
+    return stream_.is_valid() && !stream_->is_stopped();
 }
 
 void VideoStreamPlaybackFfmpeg::set_paused(bool p_paused)
 {
     paused_ = p_paused;
+    if (stream_.is_null()) {
+        return;
+    }
+    if (paused_ && stream_->is_playing()) {
+        stream_->pause();
+    } else if (!paused_ && stream_->is_paused()) {
+        stream_->play();
+    }
 }
 
 bool VideoStreamPlaybackFfmpeg::is_paused() const
@@ -104,12 +87,12 @@ bool VideoStreamPlaybackFfmpeg::has_loop() const
 
 double VideoStreamPlaybackFfmpeg::get_length() const
 {
-    return 0;
+    return stream_.is_valid() ? stream_->get_length() : 0.0;
 }
 
 String VideoStreamPlaybackFfmpeg::get_stream_name() const
 {
-    return "";
+    return file_name_.get_file();
 }
 
 int VideoStreamPlaybackFfmpeg::get_loop_count() const
@@ -119,91 +102,59 @@ int VideoStreamPlaybackFfmpeg::get_loop_count() const
 
 double VideoStreamPlaybackFfmpeg::get_playback_position() const
 {
-    return get_time();
+    return stream_.is_valid() ? stream_->get_position() : 0.0;
 }
 
 void VideoStreamPlaybackFfmpeg::seek(double p_time)
 {
-    WARN_PRINT_ONCE("Seeking in not yet implemented");
+    if (stream_.is_null() || stream_->is_stopped()) {
+        return;
+    }
+    stream_->seek(p_time);
+    audio_buffer_frames_ = 0; // older than the seek
 }
 
 void VideoStreamPlaybackFfmpeg::set_file(const String& p_file)
 {
-    time_ = 0.0;
-
-    avioWrapper_ = std::make_unique<AvIoContextWrapper>(p_file);
-    auto* avio   = avioWrapper_.get();
+    file_name_ = p_file;
 
-    if (avio->file.is_null()) {
-        avioWrapper_ = nullptr;
+    Ref<FfmpegMediaStream> stream;
+    stream.instantiate();
+    if (!stream->set_file(p_file)) {
         ERR_PRINT("Cannot open file '" + p_file + "'.");
         return;
     }
-
-    file_name_ = p_file;
-    //
-    const AVInputFormat* inputFormat = nullptr;
-
-    auto ret = av_probe_input_buffer(avio->context, &inputFormat, "", nullptr, 0, 0);
-    if (ret < 0) {
-        // TODO:
-    } else {
-        // TODO:
+    if (audio_track_ > 0 && audio_track_ < stream->get_audio_stream_count()) {
+        stream->set_audio_track(audio_track_); // before the decoders are created, nothing to reopen
+    } else if (audio_track_ > 0) {
+        WARN_PRINT(String("No audio track {0} in '{1}', playing the default one.").format(varray(audio_track_, p_file)));
     }
 
-    AVFormatContext* formatContext = avformat_alloc_context();
-    formatContext->pb              = avio->context;
-    formatContext->flags           = AVFMT_FLAG_CUSTOM_IO;
-    formatContext_.reset(formatContext);
-    ret = avformat_open_input(&formatContext, "", inputFormat, nullptr);
-    if (ret != 0) {
-        char buf[AV_ERROR_MAX_STRING_SIZE];
-        av_make_error_string(buf, AV_ERROR_MAX_STRING_SIZE, ret);
-        ERR_PRINT(String("Failed to call avformat_open_input(): {0}, {1}").format(varray(buf, p_file)));
-
-        // TODO:
-        return;
-    }
-
-    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
-        ERR_PRINT("Failed to find stream info");
-        return;
-    }
-    for (int i = 0; i < formatContext->nb_streams; ++i) {
-        auto* stream = formatContext->streams[i];
-        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoStreamIndices_.push_back(i);
-        } else if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            audioStreamIndices_.push_back(i);
-        } else if (stream->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-            subtitleStreamIndices_.push_back(i);
+    // Prefer a decoder with hw acceleration, like the player scenes do
+    TypedArray<FfmpegCodec> decoders = stream->available_video_decoders();
+    Ref<FfmpegCodec> codec;
+    Ref<FfmpegCodecHwConfig> hwConfig;
+    for (int i = 0; i < decoders.size() && hwConfig.is_null(); ++i) {
+        Ref<FfmpegCodec> decoder = decoders[i];
+        TypedArray<FfmpegCodecHwConfig> configs = decoder->available_hw_configs();
+        if (!configs.is_empty()) {
+            codec    = decoder;
+            hwConfig = configs[0];
         }
     }
-
-    if (videoStreamIndices_.is_empty() && audioStreamIndices_.is_empty()) {
-        ERR_PRINT("Failed to find a video stream.");
-        return;
+    if (codec.is_null() && !decoders.is_empty()) {
+        codec = decoders[0];
     }
-
-    // decoder
-    packet_.reset(av_packet_alloc());
-    frame_.reset(av_frame_alloc());
-
-    if (!videoStreamIndices_.is_empty()) { // TODO: Multiple stream?
-        videoStreamIndex_ = videoStreamIndices_[0];
-        auto codecId      = formatContext_->streams[videoStreamIndex_]->codecpar->codec_id;
-        auto* codec       = avcodec_find_decoder(codecId);
-        auto codecContext = avcodec_alloc_context3(codec);
-        codecContext_.reset(codecContext);
-        avcodec_parameters_to_context(codecContext, formatContext->streams[videoStreamIndex_]->codecpar);
-        codecContext->thread_count = 8;
-        if (0 != avcodec_open2(codecContext, codec, nullptr)) {
-            ERR_PRINT(String("Open codec {0} failed").format(avcodec_get_name(codecId)));
-            codecContext_ = nullptr;
-        }
+    if (codec.is_null() || !stream->create_decoders(codec.ptr(), hwConfig.ptr())) {
+        ERR_PRINT("Failed to create the decoders for '" + p_file + "'.");
+        return;
     }
 
-    // TODO: Audio
+    // VideoStreamPlayer drives the clock through update() and mixes the audio we hand it
+    stream->set_rgba_output(true);
+    stream->set_external_clock(true);
+    stream->set_external_audio(true);
+    stream_ = stream;
 }
 
 Ref<Texture2D> VideoStreamPlaybackFfmpeg::get_texture() const
@@ -211,118 +162,58 @@ Ref<Texture2D> VideoStreamPlaybackFfmpeg::get_texture() const
     return texture_;
 }
 
-#define CHECK_AV_ERROR(errcode)                            \
-    do {                                                   \
-        if (errcode == 0)                                  \
-            break;                                         \
-        char errBuf[512];                                  \
-        av_strerror(ret, errBuf, sizeof(errBuf));          \
-        ERR_PRINT(String("av error: {0}").format(errBuf)); \
-    } while (false)
-
 void VideoStreamPlaybackFfmpeg::update(double p_delta)
 {
-    if (avioWrapper_ == nullptr || avioWrapper_->file.is_null()) {
+    if (stream_.is_null() || !stream_->is_playing()) {
         return;
     }
 
-    if (!playing_ || paused_) {
-        // printf("not playing\n");
-        return;
-    };
-
-    time_ += p_delta;
-
-    if (videobuf_time_ > get_time()) {
-        return; // no new frames need to be produced
-    }
-
-    auto* codecContext = codecContext_.get();
-    auto* avPacket     = packet_.get();
-    auto* avFrame      = frame_.get();
-    bool frame_done    = false;
-    while (!frame_done) {
-        auto ret = av_read_frame(formatContext_.get(), packet_.get());
-        std::unique_ptr<AVPacket, AvPacketDeleter> unrefOnExitScope(packet_.get());
-
-        if (ret == AVERROR_EOF) {
-            // L_INFO("EOF, replay from start");
-            // int kSeekFlags[] {
-            //     AVSEEK_FLAG_BACKWARD,
-            //     AVSEEK_FLAG_BYTE,
-            //     AVSEEK_FLAG_ANY,
-            //     AVSEEK_FLAG_FRAME,
-            // };
-            // // 不同文件支持的seek模式不一样，几种seek模式都试试
-            // for (auto flag : kSeekFlags) {
-            //     ret = av_seek_frame(formatContext_.get() - 1,videoStreamIndex_, 0, flag);
-            //     if (ret == 0) {
-            //         break;
-            //     }
-            // }
-            // if (ret != 0) {
-            //     L_ERROR("Cannot rewind video stream, stop capturing");
-            //     return;
-            // }
-            WARN_PRINT("Video stream ended!");
-            stop();
-            break;
-        }
-        if (avPacket->stream_index != videoStreamIndex_) {
-            continue;
-        }
-
-        {
-            ret = avcodec_send_packet(codecContext, avPacket);
-            if (ret < 0) {
-                CHECK_AV_ERROR(ret);
-                continue;
-            }
-
-            ret = avcodec_receive_frame(codecContext, avFrame);
-            if (ret == AVERROR(EAGAIN)) {
-                continue;
-            } else if (ret < 0) {
-                CHECK_AV_ERROR(ret);
-                return;
-            }
-
-            video_frame_write(avFrame);
-            frame_done     = true;
-            videobuf_time_ = avFrame->pts * avFrame->time_base.num / (double)avFrame->time_base.den;
+    stream_->update(p_delta);
+    if (stream_->get_textures_count() > 0) {
+        auto frame = stream_->get_texture(0);
+        if (frame->get_base() != texture_->get_base()) {
+            texture_->set_base(frame->get_base(), frame->get_width(), frame->get_height());
         }
     }
+    push_audio();
 }
 
 void VideoStreamPlaybackFfmpeg::set_mix_callback(AudioMixCallback p_callback, void* p_userdata)
 {
-    // TODO:
+    mix_callback_ = p_callback;
+    mix_udata_    = p_userdata;
 }
 
 int VideoStreamPlaybackFfmpeg::get_channels() const
 {
-    // TODO:
-    return 0;
+    return stream_.is_valid() && stream_->has_audio() ? 2 : 0;
 }
 
 int VideoStreamPlaybackFfmpeg::get_mix_rate() const
 {
-    // TODO:
-    return 0;
+    return stream_.is_valid() ? stream_->get_mix_rate() : 0;
 }
 
 void VideoStreamPlaybackFfmpeg::set_audio_track(int p_idx)
 {
-    // TODO:
+    // VideoStreamFfmpeg sets it before the file, set_file() applies it
+    audio_track_ = p_idx;
+    if (stream_.is_valid() && stream_->is_stopped() && p_idx > 0 && p_idx < stream_->get_audio_stream_count()) {
+        stream_->set_audio_track(p_idx);
+    }
 }
 
 VideoStreamPlaybackFfmpeg::VideoStreamPlaybackFfmpeg()
 {
-    texture_ = Ref<ImageTexture>(memnew(ImageTexture));
+    texture_ = Ref<FfmpegVideoTexture>(memnew(FfmpegVideoTexture));
+    audio_buffer_.resize(kAudioChunkFrames);
 }
 
 VideoStreamPlaybackFfmpeg::~VideoStreamPlaybackFfmpeg()
 {
+    if (stream_.is_valid()) {
+        stream_->stop();
+    }
 }
 
 void VideoStreamPlaybackFfmpeg::_bind_methods()
@@ -1,63 +1,32 @@
 #pragma once
 
-#include <cassert>
-#include <core/io/file_access.h>
 #include <core/io/resource_loader.h>
-#include <core/os/semaphore.h>
-#include <core/os/thread.h>
-#include <core/templates/ring_buffer.h>
-#include <core/templates/safe_refcount.h>
+#include <core/math/audio_frame.h>
 #include <core/templates/vector.h>
 #include <scene/resources/video_stream.h>
-#include <servers/audio_server.h>
-#include "structs.h"
+#include "ffmpeg_media_stream.h"
+#include "ffmpeg_video_texture.h"
 
+// Lets the stock VideoStreamPlayer play anything FfmpegMediaStream can. Demuxing, decoding, conversion to RGBA
+// and uploads run on the stream threads, update() only advances the clock, re-points the texture and hands
+// the decoded audio to the player.
 class VideoStreamPlaybackFfmpeg : public VideoStreamPlayback {
     GDCLASS(VideoStreamPlaybackFfmpeg, VideoStreamPlayback);
 
     String file_name_;
-    std::unique_ptr<AvIoContextWrapper> avioWrapper_ { nullptr };
-    std::unique_ptr<AVFormatContext, AVFormatContextDeleter> formatContext_ { nullptr };
-    std::unique_ptr<AVCodecContext, AvCodecContextDeleter> codecContext_ { nullptr };
-    std::unique_ptr<AVPacket, AvPacketDeleter> packet_ { nullptr };
-    std::unique_ptr<AVFrame, AvFrameDeleter> frame_ { nullptr };
+    Ref<FfmpegMediaStream> stream_ {};
+    Ref<FfmpegVideoTexture> texture_ {}; // the same resource for the whole playback, VideoStreamPlayer keeps it
 
-    Vector<uint8_t> frame_data_ {};
-    int frames_pending_ { 0 };
+    AudioMixCallback mix_callback_ { nullptr };
+    void* mix_udata_ { nullptr };
+    Vector<AudioFrame> audio_buffer_ {}; // read from the stream, not yet accepted by the mix callback
+    int audio_buffer_offset_ { 0 };
+    int audio_buffer_frames_ { 0 };
 
-    Vector<int> videoStreamIndices_ {};
-    Vector<int> audioStreamIndices_ {};
-    Vector<int> subtitleStreamIndices_ {};
-    Ref<ImageTexture> texture_ {};
-
-    int videoStreamIndex_ { -1 };
-    int audioStreamIndex_ { -1 };
-    int subtitleStreamIndex_ { -1 };
-
-    bool playing_ { false };
     bool paused_ { false };
-    double time_ { 0.0 };
-    double delay_compensation_ { 0.0 };
-    double videobuf_time_ { 0.0 };
-
-    //    enum {
-    //        MAX_FRAMES = 4,
-    //    };
-    //
-    //    // Image frames[MAX_FRAMES];
-    //    Image::Format format = Image::Format::FORMAT_L8;
-    //    Vector<uint8_t> frame_data;
-    //    int frames_pending = 0;
-    //    Ref<FileAccess> file;
-    //    String file_name;
-    //    int audio_frames_wrote = 0;
-    //    Point2i size;
-
-    double get_time() const { return time_ - delay_compensation_; }
-
-    void video_frame_write(AVFrame* frame);
-
-    void clear();
+    int audio_track_ { 0 }; // 0 keeps the audio stream ffmpeg finds best
+
+    void push_audio();
 
 public:
     static void _bind_methods();
@@ -0,0 +1,447 @@
+#include "yuv_to_rgba.h"
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define YUV_TO_RGBA_SSE2 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define YUV_TO_RGBA_TARGET_AVX2
+#else
+#define YUV_TO_RGBA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define YUV_TO_RGBA_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Fixed point with 6 fractional bits, so that every intermediate value fits in 16 bits:
+//   R = (Y - yOffset) * yScale + vToR * V
+//   G = (Y - yOffset) * yScale - uToG * U - vToG * V
+//   B = (Y - yOffset) * yScale + uToB * U
+// with U and V centered on 0. Sums that overflow 16 bits saturate, which the final clamp to
+// [0, 255] would have done anyway, so the SIMD kernels match the scalar one bit for bit.
+struct Coefficients {
+    int16_t yOffset;
+    int16_t yScale;
+    int16_t vToR;
+    int16_t uToG;
+    int16_t vToG;
+    int16_t uToB;
+};
+
+constexpr int kFractionBits = 6;
+constexpr int kRounding     = 1 << (kFractionBits - 1);
+
+// [matrix][fullRange]
+constexpr Coefficients kCoefficients[2][2] = {
+    {
+        { 16, 75, 102, 25, 52, 129 }, // BT.601 limited: 1.164, 1.596, 0.391, 0.813, 2.018
+        { 0, 64, 90, 22, 46, 113 },   // BT.601 full:    1.0,   1.402, 0.344, 0.714, 1.772
+    },
+    {
+        { 16, 75, 115, 14, 34, 135 }, // BT.709 limited: 1.164, 1.793, 0.213, 0.533, 2.112
+        { 0, 64, 101, 12, 30, 119 },  // BT.709 full:    1.0,   1.575, 0.187, 0.468, 1.856
+    },
+};
+
+// Converts the pixels [begin, width) of a row. u and v point to the start of the chroma rows,
+// for interleaved chroma u points to the UV row and v is unused.
+using RowFn = void (*)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c);
+
+inline uint8_t clamp_u8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+}
+
+inline void yuv_pixel(int y, int u, int v, const Coefficients& c, uint8_t* dst)
+{
+    int luma = (y - c.yOffset) * c.yScale + kRounding;
+    u -= 128;
+    v -= 128;
+    dst[0] = clamp_u8((luma + c.vToR * v) >> kFractionBits);
+    dst[1] = clamp_u8((luma - c.uToG * u - c.vToG * v) >> kFractionBits);
+    dst[2] = clamp_u8((luma + c.uToB * u) >> kFractionBits);
+    dst[3] = 255;
+}
+
+void row_half_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    for (int x = begin; x < width; ++x) {
+        yuv_pixel(y[x], u[x / 2], v[x / 2], c, dst + x * 4);
+    }
+}
+
+void row_full_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    for (int x = begin; x < width; ++x) {
+        yuv_pixel(y[x], u[x], v[x], c, dst + x * 4);
+    }
+}
+
+void row_interleaved_scalar(const uint8_t* y, const uint8_t* uv, const uint8_t*, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    for (int x = begin; x < width; ++x) {
+        yuv_pixel(y[x], uv[x / 2 * 2], uv[x / 2 * 2 + 1], c, dst + x * 4);
+    }
+}
+
+#if YUV_TO_RGBA_SSE2
+
+struct CoefficientsSse2 {
+    explicit CoefficientsSse2(const Coefficients& c)
+        : yOffset(_mm_set1_epi16(c.yOffset))
+        , yScale(_mm_set1_epi16(c.yScale))
+        , vToR(_mm_set1_epi16(c.vToR))
+        , uToG(_mm_set1_epi16(c.uToG))
+        , vToG(_mm_set1_epi16(c.vToG))
+        , uToB(_mm_set1_epi16(c.uToB))
+    {
+    }
+    __m128i yOffset, yScale, vToR, uToG, vToG, uToB;
+    __m128i rounding { _mm_set1_epi16(kRounding) };
+    __m128i chromaOffset { _mm_set1_epi16(128) };
+};
+
+// 8 pixels, 16 bits per component in and out
+inline void yuv8_sse2(__m128i y, __m128i u, __m128i v, const CoefficientsSse2& k, __m128i& r, __m128i& g, __m128i& b)
+{
+    u = _mm_sub_epi16(u, k.chromaOffset);
+    v = _mm_sub_epi16(v, k.chromaOffset);
+    y = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, k.yOffset), k.yScale), k.rounding);
+    r = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(v, k.vToR)), kFractionBits);
+    g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(y, _mm_mullo_epi16(u, k.uToG)), _mm_mullo_epi16(v, k.vToG)), kFractionBits);
+    b = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(u, k.uToB)), kFractionBits);
+}
+
+// 16 pixels, 8 bits per component
+inline void store_rgba_sse2(__m128i r, __m128i g, __m128i b, uint8_t* dst)
+{
+    auto a  = _mm_set1_epi8((char)0xFF);
+    auto rg = _mm_unpacklo_epi8(r, g);
+    auto ba = _mm_unpacklo_epi8(b, a);
+    _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+    rg = _mm_unpackhi_epi8(r, g);
+    ba = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128((__m128i*)(dst + 32), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i*)(dst + 48), _mm_unpackhi_epi16(rg, ba));
+}
+
+// 16 pixels, luma as bytes and chroma as two halves of 8 16 bits values
+inline void yuv16_sse2(__m128i y, __m128i u0, __m128i u1, __m128i v0, __m128i v1, const CoefficientsSse2& k, uint8_t* dst)
+{
+    auto zero = _mm_setzero_si128();
+    __m128i r0, g0, b0, r1, g1, b1;
+    yuv8_sse2(_mm_unpacklo_epi8(y, zero), u0, v0, k, r0, g0, b0);
+    yuv8_sse2(_mm_unpackhi_epi8(y, zero), u1, v1, k, r1, g1, b1);
+    store_rgba_sse2(_mm_packus_epi16(r0, r1), _mm_packus_epi16(g0, g1), _mm_packus_epi16(b0, b1), dst);
+}
+
+void row_half_sse2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsSse2 k { c };
+    auto zero = _mm_setzero_si128();
+    int x     = begin;
+    for (; x + 16 <= width; x += 16) {
+        auto u8 = _mm_loadl_epi64((const __m128i*)(u + x / 2));
+        auto v8 = _mm_loadl_epi64((const __m128i*)(v + x / 2));
+        u8      = _mm_unpacklo_epi8(u8, u8);
+        v8      = _mm_unpacklo_epi8(v8, v8);
+        yuv16_sse2(_mm_loadu_si128((const __m128i*)(y + x)),
+            _mm_unpacklo_epi8(u8, zero), _mm_unpackhi_epi8(u8, zero),
+            _mm_unpacklo_epi8(v8, zero), _mm_unpackhi_epi8(v8, zero), k, dst + x * 4);
+    }
+    row_half_scalar(y, u, v, dst, x, width, c);
+}
+
+void row_full_sse2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsSse2 k { c };
+    auto zero = _mm_setzero_si128();
+    int x     = begin;
+    for (; x + 16 <= width; x += 16) {
+        auto u16 = _mm_loadu_si128((const __m128i*)(u + x));
+        auto v16 = _mm_loadu_si128((const __m128i*)(v + x));
+        yuv16_sse2(_mm_loadu_si128((const __m128i*)(y + x)),
+            _mm_unpacklo_epi8(u16, zero), _mm_unpackhi_epi8(u16, zero),
+            _mm_unpacklo_epi8(v16, zero), _mm_unpackhi_epi8(v16, zero), k, dst + x * 4);
+    }
+    row_full_scalar(y, u, v, dst, x, width, c);
+}
+
+void row_interleaved_sse2(const uint8_t* y, const uint8_t* uv, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsSse2 k { c };
+    auto lowBytes = _mm_set1_epi16(0xFF);
+    int x         = begin;
+    for (; x + 16 <= width; x += 16) {
+        auto uv16 = _mm_loadu_si128((const __m128i*)(uv + x));
+        auto u8   = _mm_and_si128(uv16, lowBytes);
+        auto v8   = _mm_srli_epi16(uv16, 8);
+        yuv16_sse2(_mm_loadu_si128((const __m128i*)(y + x)),
+            _mm_unpacklo_epi16(u8, u8), _mm_unpackhi_epi16(u8, u8),
+            _mm_unpacklo_epi16(v8, v8), _mm_unpackhi_epi16(v8, v8), k, dst + x * 4);
+    }
+    row_interleaved_scalar(y, uv, v, dst, x, width, c);
+}
+
+struct CoefficientsAvx2 {
+    YUV_TO_RGBA_TARGET_AVX2 explicit CoefficientsAvx2(const Coefficients& c)
+        : yOffset(_mm256_set1_epi16(c.yOffset))
+        , yScale(_mm256_set1_epi16(c.yScale))
+        , vToR(_mm256_set1_epi16(c.vToR))
+        , uToG(_mm256_set1_epi16(c.uToG))
+        , vToG(_mm256_set1_epi16(c.vToG))
+        , uToB(_mm256_set1_epi16(c.uToB))
+        , rounding(_mm256_set1_epi16(kRounding))
+        , chromaOffset(_mm256_set1_epi16(128))
+    {
+    }
+    __m256i yOffset, yScale, vToR, uToG, vToG, uToB, rounding, chromaOffset;
+};
+
+YUV_TO_RGBA_TARGET_AVX2 inline __m128i pack_u8_avx2(__m256i v)
+{
+    return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+YUV_TO_RGBA_TARGET_AVX2 inline __m256i combine_avx2(__m128i low, __m128i high)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+// 16 pixels, luma as bytes and chroma as 16 bits values
+YUV_TO_RGBA_TARGET_AVX2 inline void yuv16_avx2(__m128i y8, __m256i u, __m256i v, const CoefficientsAvx2& k, uint8_t* dst)
+{
+    u      = _mm256_sub_epi16(u, k.chromaOffset);
+    v      = _mm256_sub_epi16(v, k.chromaOffset);
+    auto y = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(y8), k.yOffset), k.yScale), k.rounding);
+    auto r = _mm256_srai_epi16(_mm256_adds_epi16(y, _mm256_mullo_epi16(v, k.vToR)), kFractionBits);
+    auto g = _mm256_srai_epi16(_mm256_subs_epi16(_mm256_subs_epi16(y, _mm256_mullo_epi16(u, k.uToG)), _mm256_mullo_epi16(v, k.vToG)), kFractionBits);
+    auto b = _mm256_srai_epi16(_mm256_adds_epi16(y, _mm256_mullo_epi16(u, k.uToB)), kFractionBits);
+    store_rgba_sse2(pack_u8_avx2(r), pack_u8_avx2(g), pack_u8_avx2(b), dst);
+}
+
+YUV_TO_RGBA_TARGET_AVX2 void row_half_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsAvx2 k { c };
+    int x = begin;
+    for (; x + 32 <= width; x += 32) {
+        auto u16 = _mm_loadu_si128((const __m128i*)(u + x / 2));
+        auto v16 = _mm_loadu_si128((const __m128i*)(v + x / 2));
+        yuv16_avx2(_mm_loadu_si128((const __m128i*)(y + x)),
+            _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u16, u16)), _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v16, v16)), k, dst + x * 4);
+        yuv16_avx2(_mm_loadu_si128((const __m128i*)(y + x + 16)),
+            _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(u16, u16)), _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(v16, v16)), k, dst + x * 4 + 64);
+    }
+    row_half_sse2(y, u, v, dst, x, width, c);
+}
+
+YUV_TO_RGBA_TARGET_AVX2 void row_full_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsAvx2 k { c };
+    int x = begin;
+    for (; x + 16 <= width; x += 16) {
+        yuv16_avx2(_mm_loadu_si128((const __m128i*)(y + x)),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x))), k, dst + x * 4);
+    }
+    row_full_scalar(y, u, v, dst, x, width, c);
+}
+
+YUV_TO_RGBA_TARGET_AVX2 void row_interleaved_avx2(const uint8_t* y, const uint8_t* uv, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsAvx2 k { c };
+    auto lowBytes = _mm256_set1_epi16(0xFF);
+    int x         = begin;
+    for (; x + 32 <= width; x += 32) {
+        // 16 UV pairs, each one shared by 2 pixels
+        auto uv32 = _mm256_loadu_si256((const __m256i*)(uv + x));
+        auto u8   = _mm256_and_si256(uv32, lowBytes);
+        auto v8   = _mm256_srli_epi16(uv32, 8);
+        auto uLow = _mm256_castsi256_si128(u8);
+        auto vLow = _mm256_castsi256_si128(v8);
+        auto uHi  = _mm256_extracti128_si256(u8, 1);
+        auto vHi  = _mm256_extracti128_si256(v8, 1);
+        yuv16_avx2(_mm_loadu_si128((const __m128i*)(y + x)),
+            combine_avx2(_mm_unpacklo_epi16(uLow, uLow), _mm_unpackhi_epi16(uLow, uLow)),
+            combine_avx2(_mm_unpacklo_epi16(vLow, vLow), _mm_unpackhi_epi16(vLow, vLow)), k, dst + x * 4);
+        yuv16_avx2(_mm_loadu_si128((const __m128i*)(y + x + 16)),
+            combine_avx2(_mm_unpacklo_epi16(uHi, uHi), _mm_unpackhi_epi16(uHi, uHi)),
+            combine_avx2(_mm_unpacklo_epi16(vHi, vHi), _mm_unpackhi_epi16(vHi, vHi)), k, dst + x * 4 + 64);
+    }
+    row_interleaved_sse2(y, uv, v, dst, x, width, c);
+}
+
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx     = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // YUV_TO_RGBA_SSE2
+
+#if YUV_TO_RGBA_NEON
+
+struct CoefficientsNeon {
+    explicit CoefficientsNeon(const Coefficients& c)
+        : yOffset(vdupq_n_s16(c.yOffset))
+        , yScale(vdupq_n_s16(c.yScale))
+        , vToR(vdupq_n_s16(c.vToR))
+        , uToG(vdupq_n_s16(c.uToG))
+        , vToG(vdupq_n_s16(c.vToG))
+        , uToB(vdupq_n_s16(c.uToB))
+        , rounding(vdupq_n_s16(kRounding))
+        , chromaOffset(vdupq_n_s16(128))
+    {
+    }
+    int16x8_t yOffset, yScale, vToR, uToG, vToG, uToB, rounding, chromaOffset;
+};
+
+inline int16x8_t widen_neon(uint8x8_t v)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(v));
+}
+
+// 8 pixels, vqshrun does the shift and the clamp to [0, 255] like srai + packus do on x86
+inline void yuv8_neon(uint8x8_t y8, uint8x8_t u8, uint8x8_t v8, const CoefficientsNeon& k, uint8x8_t& r, uint8x8_t& g, uint8x8_t& b)
+{
+    auto u = vsubq_s16(widen_neon(u8), k.chromaOffset);
+    auto v = vsubq_s16(widen_neon(v8), k.chromaOffset);
+    auto y = vaddq_s16(vmulq_s16(vsubq_s16(widen_neon(y8), k.yOffset), k.yScale), k.rounding);
+    r      = vqshrun_n_s16(vqaddq_s16(y, vmulq_s16(v, k.vToR)), kFractionBits);
+    g      = vqshrun_n_s16(vqsubq_s16(vqsubq_s16(y, vmulq_s16(u, k.uToG)), vmulq_s16(v, k.vToG)), kFractionBits);
+    b      = vqshrun_n_s16(vqaddq_s16(y, vmulq_s16(u, k.uToB)), kFractionBits);
+}
+
+// 16 pixels, one chroma value per pixel
+inline void yuv16_neon(uint8x16_t y, uint8x16_t u, uint8x16_t v, const CoefficientsNeon& k, uint8_t* dst)
+{
+    uint8x8_t r0, g0, b0, r1, g1, b1;
+    yuv8_neon(vget_low_u8(y), vget_low_u8(u), vget_low_u8(v), k, r0, g0, b0);
+    yuv8_neon(vget_high_u8(y), vget_high_u8(u), vget_high_u8(v), k, r1, g1, b1);
+    uint8x16x4_t rgba;
+    rgba.val[0] = vcombine_u8(r0, r1);
+    rgba.val[1] = vcombine_u8(g0, g1);
+    rgba.val[2] = vcombine_u8(b0, b1);
+    rgba.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst, rgba);
+}
+
+inline uint8x16_t duplicate_neon(uint8x8_t v)
+{
+    auto zipped = vzip_u8(v, v);
+    return vcombine_u8(zipped.val[0], zipped.val[1]);
+}
+
+void row_half_neon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsNeon k { c };
+    int x = begin;
+    for (; x + 16 <= width; x += 16) {
+        yuv16_neon(vld1q_u8(y + x), duplicate_neon(vld1_u8(u + x / 2)), duplicate_neon(vld1_u8(v + x / 2)), k, dst + x * 4);
+    }
+    row_half_scalar(y, u, v, dst, x, width, c);
+}
+
+void row_full_neon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsNeon k { c };
+    int x = begin;
+    for (; x + 16 <= width; x += 16) {
+        yuv16_neon(vld1q_u8(y + x), vld1q_u8(u + x), vld1q_u8(v + x), k, dst + x * 4);
+    }
+    row_full_scalar(y, u, v, dst, x, width, c);
+}
+
+void row_interleaved_neon(const uint8_t* y, const uint8_t* uv, const uint8_t* v, uint8_t* dst, int begin, int width, const Coefficients& c)
+{
+    CoefficientsNeon k { c };
+    int x = begin;
+    for (; x + 16 <= width; x += 16) {
+        auto chroma = vld2_u8(uv + x);
+        yuv16_neon(vld1q_u8(y + x), duplicate_neon(chroma.val[0]), duplicate_neon(chroma.val[1]), k, dst + x * 4);
+    }
+    row_interleaved_scalar(y, uv, v, dst, x, width, c);
+}
+
+#endif // YUV_TO_RGBA_NEON
+
+struct RowKernels {
+    const char* name;
+    RowFn half;
+    RowFn full;
+    RowFn interleaved;
+};
+
+const RowKernels& row_kernels()
+{
+    static const RowKernels kernels = []() -> RowKernels {
+#if YUV_TO_RGBA_SSE2
+        if (cpu_has_avx2()) {
+            return { "avx2", row_half_avx2, row_full_avx2, row_interleaved_avx2 };
+        }
+        return { "sse2", row_half_sse2, row_full_sse2, row_interleaved_sse2 };
+#elif YUV_TO_RGBA_NEON
+        return { "neon", row_half_neon, row_full_neon, row_interleaved_neon };
+#else
+        return { "scalar", row_half_scalar, row_full_scalar, row_interleaved_scalar };
+#endif
+    }();
+    return kernels;
+}
+
+} // namespace
+
+void yuv_to_rgba8(const YuvImage& src, uint8_t* dst, int dstStride)
+{
+    const auto& kernels = row_kernels();
+    const auto& c       = kCoefficients[src.matrix == kYuvMatrixBt709 ? 1 : 0][src.fullRange ? 1 : 0];
+
+    RowFn row          = kernels.half;
+    int chromaRowShift = 0;
+    switch (src.layout) {
+    case kYuvLayout420P:
+        chromaRowShift = 1;
+        break;
+    case kYuvLayout422P:
+        break;
+    case kYuvLayout444P:
+        row = kernels.full;
+        break;
+    case kYuvLayoutNv12:
+        row            = kernels.interleaved;
+        chromaRowShift = 1;
+        break;
+    }
+
+    for (int y = 0; y < src.height; ++y) {
+        auto chromaRow = y >> chromaRowShift;
+        auto* u        = src.planes[1] + (ptrdiff_t)chromaRow * src.strides[1];
+        auto* v        = src.layout == kYuvLayoutNv12 ? nullptr : src.planes[2] + (ptrdiff_t)chromaRow * src.strides[2];
+        row(src.planes[0] + (ptrdiff_t)y * src.strides[0], u, v, dst + (ptrdiff_t)y * dstStride, 0, src.width, c);
+    }
+}
+
+const char* yuv_to_rgba8_backend()
+{
+    return row_kernels().name;
+}
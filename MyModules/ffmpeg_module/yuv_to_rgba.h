@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+// YUV to RGBA8 conversion on the CPU, for the consumers that need RGBA images (VideoStreamPlaybackFfmpeg).
+// Rows are converted by SSE2, AVX2 or NEON kernels picked once at runtime, the scalar kernel
+// only handles the pixels left over at the end of the rows. All kernels give the same result.
+
+enum YuvLayout : int {
+    kYuvLayout420P, // Y, U and V planes, chroma halved in both directions
+    kYuvLayout422P, // Y, U and V planes, chroma halved horizontally
+    kYuvLayout444P, // Y, U and V planes, full resolution chroma
+    kYuvLayoutNv12, // Y plane then interleaved UV plane, chroma halved in both directions
+};
+
+enum YuvMatrix : int {
+    kYuvMatrixBt601,
+    kYuvMatrixBt709,
+};
+
+struct YuvImage {
+    YuvLayout layout { kYuvLayout420P };
+    YuvMatrix matrix { kYuvMatrixBt601 };
+    bool fullRange { false }; // limited range is Y in [16, 235] and chroma in [16, 240]
+    int width { 0 };
+    int height { 0 };
+    const uint8_t* planes[3] {};
+    int strides[3] {};
+};
+
+// Writes width x height RGBA8 pixels with an opaque alpha, rows are dstStride bytes apart
+void yuv_to_rgba8(const YuvImage& src, uint8_t* dst, int dstStride);
+
+// The kernels yuv_to_rgba8() uses on this CPU: "avx2", "sse2", "neon" or "scalar"
+const char* yuv_to_rgba8_backend();
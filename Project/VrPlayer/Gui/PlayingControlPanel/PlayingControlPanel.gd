@@ -17,7 +17,26 @@ enum MaterialMode {
 @export var materialNv12_Panorama : ShaderMaterial
 @export var materialYuv420P_Panorama : ShaderMaterial
 
+@export var materialPackedI420 : ShaderMaterial
+@export var materialPackedI420_3D : ShaderMaterial
+@export var materialPackedI420_Panorama : ShaderMaterial
+
+@export var materialYuv420P10 : ShaderMaterial
+@export var materialYuv420P10_3D : ShaderMaterial
+@export var materialYuv420P10_Panorama : ShaderMaterial
+
+@export var materialP010 : ShaderMaterial
+@export var materialP010_3D : ShaderMaterial
+@export var materialP010_Panorama : ShaderMaterial
+
+# Tiled upload, on panorama meshes or spheres
+@export var materialYuv420PTiles_3D : ShaderMaterial
+@export var materialYuv420PTiles_Panorama : ShaderMaterial
+@export var materialNv12Tiles_3D : ShaderMaterial
+@export var materialNv12Tiles_Panorama : ShaderMaterial
+
 var _materialMode: MaterialMode = MaterialMode.k2d
+var _tiledUpload : bool = false
 
 signal on_play()
 signal on_paused()
@@ -30,6 +49,9 @@ signal on_pixel_format_change(material: Material, texture: Texture)
 @onready var _timeLabel : Label = find_child("TimeLabel", true)
 @onready var _infoLabel : Label = find_child("InfoLabel", true)
 @onready var _dropEvery2FramesCheck : CheckBox = find_child("DropEvery2FramesCheck")
+@onready var _packedPlanesCheck : CheckBox = find_child("PackedPlanesCheck")
+@onready var _scrubPreview : TextureRect = find_child("ScrubPreview")
+var _scrubPreviewTexture : ImageTexture = null
 var _mediaStream : FfmpegMediaStream
 var _currentPlayState : int = FfmpegMediaStream.kStateStopped
 
@@ -42,8 +64,8 @@ var _currentEncapsulationFormat : String
 var _currentVideoEncodingFormat : String
 var _currentPlaySpeedScale: float = 1.0
 
-var _currentVideoCodec : FfmpegCodec = null
-var _currentVideoCodecHw : FfmpegCodecHwConfig = null
+var _currentHwDecoder : String = ""
+var _openingStream : FfmpegMediaStream = null
 
 const _kPlaySpeedScales : Array[float] = [
 	0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 1.75, 2.0, 2.5, 3.0
@@ -55,7 +77,7 @@ func _updateInfoLabel():
 	str += "Current PixFmt: %s\n" % _currentPixelFormat
 	str += "Current Encapsulation: %s\n" % _currentEncapsulationFormat
 	str += "Current Video Codec Format: %s\n" % _currentVideoEncodingFormat
-	str += "Current Hw Accel: %s\n" % _currentVideoCodecHw.get_name()
+	str += "Current Hw Accel: %s\n" % _currentHwDecoder
 	str += "Available codecs:\n"
 	var availableCodecStrings : Array[String] = []
 	for codec in _availableDecoders:
@@ -68,12 +90,15 @@ func _updateInfoLabel():
 
 func _on_play_speed_selected(index: int):
 	_currentPlaySpeedScale = _kPlaySpeedScales[index]
+	if _mediaStream != null:
+		_mediaStream.set_speed_scale(_currentPlaySpeedScale)
 
 # Called when the node enters the scene tree for the first time.
 func _ready():
 	_playButton.pressed.connect(_on_play_pressed)
 	_progressBar.drag_started.connect(_on_progress_bar_drag_begin)
 	_progressBar.drag_ended.connect(_on_progress_bar_drag_end)
+	_progressBar.value_changed.connect(_on_progress_bar_value_changed)
 	var exitBtn : Button = find_child("ExitButton", true)
 	exitBtn.pressed.connect(func ():
 		get_tree().change_scene_to_file("res://Scenes/Main/main.tscn")
@@ -85,6 +110,7 @@ func _ready():
 	perSecondTimer.timeout.connect(_on_per_second_timer)
 	
 	_dropEvery2FramesCheck.toggled.connect(_on_drop_every2frames_check_toggle)
+	_packedPlanesCheck.toggled.connect(_on_packed_planes_check_toggle)
 	# progressDragArea.on_seek_offset.connect(_seek_offset)
 	
 	# TODO: Configurable scan directory
@@ -117,61 +143,94 @@ func _exit_tree():
 	# make sure _mediaStream will not callback
 	# after all it's children destroyed
 	_mediaStream = null
+	_openingStream = null
 
 func set_material_mode(mode: MaterialMode):
 	_materialMode = mode
-	
-static func _choose_video_decoder(decoders : Array[FfmpegCodec]) -> FfmpegCodec:
-	for dec in decoders:
-		var hwCfgs = dec.available_hw_configs()
-		if hwCfgs.size() > 0:
-			return dec;
-		
-	if decoders.is_empty():
-		return null
-	return decoders[0]
-	
-static func _choose_video_hw_config(configs: Array[FfmpegCodecHwConfig]) -> FfmpegCodecHwConfig:
-	if configs.is_empty():
-		return null
-	return configs[0]
+
+# Only upload the tiles of the panorama in view, see set_view(). Taken into account by the next set_file()
+func set_tiled_upload(enabled: bool):
+	_tiledUpload = enabled
+
+func set_view(orientation: Basis, fov: float, aspect: float):
+	if _mediaStream != null:
+		_mediaStream.set_view(orientation, fov, aspect)
 	
 func set_file(path: String):
+	# Opened on a worker thread, the current stream keeps playing until the new one is ready
 	_filePath = path
+	if _openingStream != null:
+		# Superseded, its open_failed is ignored like the rest of its signals
+		_openingStream.cancel_open()
+	# Bound by id, binding the stream itself would keep it alive through its own signals
 	var ms = FfmpegMediaStream.new()
-	if not ms.set_file(_filePath):
-		return
-	var decoders = ms.available_video_decoders()
-	var decoder = _choose_video_decoder(decoders)
-	if decoder == null:
-		print("No decoder found!")
-		return
-	var hwCfg = _choose_video_hw_config(decoder.available_hw_configs())
-	if hwCfg == null:
-		print("No hw decoder found!")
-	
-	if !ms.create_decoders(decoder, hwCfg):
+	ms.open_progress.connect(_on_stream_open_progress.bind(ms.get_instance_id()))
+	ms.opened.connect(_on_stream_opened.bind(ms.get_instance_id()))
+	ms.open_failed.connect(_on_stream_open_failed.bind(ms.get_instance_id()))
+	_openingStream = ms
+	ms.open_async(path)
+
+func _is_opening_stream(id: int) -> bool:
+	return _openingStream != null and _openingStream.get_instance_id() == id
+
+func _on_stream_open_progress(progress: float, id: int):
+	if _is_opening_stream(id):
+		_infoLabel.text = "Opening %s... %d%%" % [_filePath, int(progress * 100)]
+
+func _on_stream_open_failed(message: String, id: int):
+	if not _is_opening_stream(id):
 		return
+	_openingStream = null
+	_infoLabel.text = "Cannot play %s:\n%s" % [_filePath, message]
+
+func _on_stream_opened(id: int):
+	if not _is_opening_stream(id):
+		return # replaced by a later set_file()
+	var ms : FfmpegMediaStream = _openingStream
+	_openingStream = null
 	_progressBar.min_value = 0
 	_progressBar.max_value = ms.get_length()
 	_currentEncapsulationFormat = ms.get_encapsulation_format()
 	_currentVideoEncodingFormat = ms.get_video_encoding_format()
 	_availableDecoders = ms.available_video_decoders()
-	_currentVideoCodecHw = hwCfg
+	_currentHwDecoder = ms.get_hw_decoder_name()
 	_updateInfoLabel()
 	
 	if _mediaStream != null:
-		_mediaStream.disconnect("pixel_format_changed", _on_pixel_format_changed)
-		_mediaStream.pixel_format_changed.disconnect(_on_pixel_format_changed);
+		_mediaStream.pixel_format_changed.disconnect(_on_pixel_format_changed)
 	ms.pixel_format_changed.connect(_on_pixel_format_changed)
 	ms.play_state_changed.connect(_on_stream_play_state_change)
 	if _dropEvery2FramesCheck.button_pressed:
 		ms.set_drop_every_n_frame(2)
 	else:
 		ms.set_drop_every_n_frame(0)
+	ms.set_packed_planes(_packedPlanesCheck.button_pressed)
+	ms.set_tiled_upload(_tiledUpload)
+	ms.set_speed_scale(_currentPlaySpeedScale)
 	_mediaStream = ms
+	_lastPoolAllocations = 0
+	_lastPoolAllocatedBytes = 0
+	# The poster stays on screen until the first frame changes the pixel format
+	var poster : Texture2D = ms.get_poster_texture()
+	if poster != null:
+		_show_poster(poster)
 	ms.play()
 
+func _show_poster(poster: Texture2D):
+	var material: Material = null
+	if _materialMode != MaterialMode.k2d:
+		var posterMaterial := StandardMaterial3D.new()
+		posterMaterial.shading_mode = BaseMaterial3D.SHADING_MODE_UNSHADED
+		posterMaterial.cull_mode = BaseMaterial3D.CULL_DISABLED
+		posterMaterial.albedo_texture = poster
+		material = posterMaterial
+	emit_signal("on_pixel_format_change", material, poster)
+
+func _on_packed_planes_check_toggle(_pressed: bool):
+	# Only taken into account by play(), reopen the current file
+	if not _filePath.is_empty():
+		set_file(_filePath)
+
 func _on_drop_every2frames_check_toggle(pressed: bool):
 	if _mediaStream != null:
 		if pressed:
@@ -196,10 +255,12 @@ var _fpsCounter : int = 0
 
 func _process(delta):
 	if _mediaStream != null:
-		if _mediaStream.update(delta * _currentPlaySpeedScale):
+		if _mediaStream.update(delta):
 			_fpsCounter += 1
 		if not _isProgressBarDragging:
 			_progressBar.value = _mediaStream.get_position()
+		else:
+			_update_scrub_preview()
 		_timeLabel.text = "{0}/{1}".format([_to_hhmmss(_mediaStream.get_position()), _to_hhmmss(_mediaStream.get_length())])
 
 		# Auto hide the control ui
@@ -209,13 +270,34 @@ func _process(delta):
 				self.visible = false
 
 @onready var _fpsLabel : Label = find_child("FPSLabel")
+var _lastPoolAllocations : int = 0
+var _lastPoolAllocatedBytes : int = 0
 func _on_per_second_timer():
-	_fpsLabel.text = "FPS {0}".format([_fpsCounter])
+	var allocsPerSecond : int = 0
+	var bytesPerSecond : int = 0
+	if _mediaStream != null:
+		var poolStats : Dictionary = _mediaStream.get_frame_pool_stats()
+		allocsPerSecond = poolStats["allocations"] - _lastPoolAllocations
+		bytesPerSecond = poolStats["allocated_bytes"] - _lastPoolAllocatedBytes
+		_lastPoolAllocations = poolStats["allocations"]
+		_lastPoolAllocatedBytes = poolStats["allocated_bytes"]
+	var avOffsetMs : float = 0.0
+	var stats : Dictionary = {}
+	if _mediaStream != null:
+		avOffsetMs = _mediaStream.get_av_offset() * 1000.0
+		stats = _mediaStream.get_stats()
+	_fpsLabel.text = "FPS {0}, allocs {1}/s ({2} KB/s), A/V {3} ms".format([_fpsCounter, allocsPerSecond, bytesPerSecond / 1024, "%.1f" % avOffsetMs])
+	if not stats.is_empty():
+		_fpsLabel.text += "\ndropped {0}, late {1}, decode p99 {2} ms, upload p99 {3} ms".format([
+			stats["dropped_frames"], stats["late_frames"], "%.1f" % stats["decode_p99_ms"], "%.1f" % stats["upload_p99_ms"]])
 	_fpsCounter = 0
 	pass
 	
 func _on_pixel_format_changed(fmt: int):
 	var material: Material = null
+	var texture: Texture2D = null
+	if _mediaStream.get_textures_count() > 0:
+		texture = _mediaStream.get_texture(0)
 	if fmt == FfmpegMediaStream.kPixelFormatNv12:
 		if _materialMode == MaterialMode.k3d:
 			material = materialNv12_3D.duplicate()
@@ -237,10 +319,67 @@ func _on_pixel_format_changed(fmt: int):
 		material.set_shader_parameter("uTexture", _mediaStream.get_texture(1))
 		material.set_shader_parameter("vTexture", _mediaStream.get_texture(2))
 		_currentPixelFormat = "Yuv420P"
+	elif fmt == FfmpegMediaStream.kPixelFormatPackedI420:
+		if _materialMode == MaterialMode.k3d:
+			material = materialPackedI420_3D.duplicate()
+		elif _materialMode == MaterialMode.k2d:
+			material = materialPackedI420.duplicate()
+		else:
+			material = materialPackedI420_Panorama.duplicate()
+		material.set_shader_parameter("yuvTexture", _mediaStream.get_texture(0))
+		_currentPixelFormat = "PackedI420"
+		# The packed texture is 1.5 times as tall as the picture, give the picture size to the players
+		var picture := PlaceholderTexture2D.new()
+		picture.size = Vector2(texture.get_width(), texture.get_height() * 2.0 / 3.0)
+		texture = picture
+	elif fmt == FfmpegMediaStream.kPixelFormatYuv420P10:
+		if _materialMode == MaterialMode.k3d:
+			material = materialYuv420P10_3D.duplicate()
+		elif _materialMode == MaterialMode.k2d:
+			material = materialYuv420P10.duplicate()
+		else:
+			material = materialYuv420P10_Panorama.duplicate()
+		material.set_shader_parameter("yTexture", _mediaStream.get_texture(0))
+		material.set_shader_parameter("uTexture", _mediaStream.get_texture(1))
+		material.set_shader_parameter("vTexture", _mediaStream.get_texture(2))
+		_currentPixelFormat = "Yuv420P10"
+	elif fmt == FfmpegMediaStream.kPixelFormatP010:
+		if _materialMode == MaterialMode.k3d:
+			material = materialP010_3D.duplicate()
+		elif _materialMode == MaterialMode.k2d:
+			material = materialP010.duplicate()
+		else:
+			material = materialP010_Panorama.duplicate()
+		material.set_shader_parameter("yTexture", _mediaStream.get_texture(0))
+		material.set_shader_parameter("uvTexture", _mediaStream.get_texture(1))
+		_currentPixelFormat = "P010"
+	elif fmt == FfmpegMediaStream.kPixelFormatYuv420PTiles:
+		if _materialMode == MaterialMode.k3d:
+			material = materialYuv420PTiles_3D.duplicate()
+		else:
+			material = materialYuv420PTiles_Panorama.duplicate()
+		material.set_shader_parameter("yTexture", _mediaStream.get_tiled_texture(0))
+		material.set_shader_parameter("uTexture", _mediaStream.get_tiled_texture(1))
+		material.set_shader_parameter("vTexture", _mediaStream.get_tiled_texture(2))
+		material.set_shader_parameter("tileGrid", _mediaStream.get_tile_grid())
+		_currentPixelFormat = "Yuv420P Tiles"
+		texture = PlaceholderTexture2D.new()
+		texture.size = _mediaStream.get_tiled_texture(0).get_plane_size()
+	elif fmt == FfmpegMediaStream.kPixelFormatNv12Tiles:
+		if _materialMode == MaterialMode.k3d:
+			material = materialNv12Tiles_3D.duplicate()
+		else:
+			material = materialNv12Tiles_Panorama.duplicate()
+		material.set_shader_parameter("yTexture", _mediaStream.get_tiled_texture(0))
+		material.set_shader_parameter("uvTexture", _mediaStream.get_tiled_texture(1))
+		material.set_shader_parameter("tileGrid", _mediaStream.get_tile_grid())
+		_currentPixelFormat = "Nv12 Tiles"
+		texture = PlaceholderTexture2D.new()
+		texture.size = _mediaStream.get_tiled_texture(0).get_plane_size()
 	else:
 		print("Unsupported pixel format")
 		_currentPixelFormat = "Unknown"
-	emit_signal("on_pixel_format_change", material, _mediaStream.get_texture(0))
+	emit_signal("on_pixel_format_change", material, texture)
 	print("Pixel format changed!")
 	_updateInfoLabel()
 	
@@ -252,6 +391,25 @@ func _on_play_pressed():
 	elif _mediaStream.is_paused():
 		_mediaStream.play()
 	
+func _update_scrub_preview():
+	# The preview is generated asynchronously, keep polling until it is ready
+	var image : Image = _mediaStream.get_thumbnail(get_progress())
+	if image == null:
+		return
+	if _scrubPreviewTexture == null or _scrubPreviewTexture.get_size() != Vector2(image.get_size()):
+		_scrubPreviewTexture = ImageTexture.create_from_image(image)
+		_scrubPreview.texture = _scrubPreviewTexture
+	else:
+		_scrubPreviewTexture.update(image)
+	var ratio : float = 0.0
+	if _progressBar.max_value > _progressBar.min_value:
+		ratio = (get_progress() - _progressBar.min_value) / (_progressBar.max_value - _progressBar.min_value)
+	var barRect : Rect2 = _progressBar.get_global_rect()
+	_scrubPreview.global_position = Vector2(
+		barRect.position.x + barRect.size.x * ratio - _scrubPreview.size.x / 2,
+		barRect.position.y - _scrubPreview.size.y)
+	_scrubPreview.visible = true
+
 func _on_progress_bar_drag_begin():
 	if _mediaStream == null:
 		return
@@ -259,10 +417,17 @@ func _on_progress_bar_drag_begin():
 	emit_signal("on_progress_drag_begin")
 		
 func _on_progress_bar_drag_end(_valueChanged: bool):
+	_scrubPreview.visible = false
 	if _mediaStream == null:
 		return
 	_isProgressBarDragging = false
 	_mediaStream.seek(get_progress())
+
+func _on_progress_bar_value_changed(value: float):
+	# Scrub with keyframe only seeks while dragging, the precise seek is done on drag end
+	if _mediaStream == null or not _isProgressBarDragging:
+		return
+	_mediaStream.seek(value, true)
 	
 func _seek_offset(offsetMs: float):
 	if _mediaStream == null:
@@ -0,0 +1,96 @@
+extends Node
+
+# Headless end-to-end benchmark of the playback pipeline:
+#   godot --headless --path Project/VrPlayer res://Scenes/Benchmark/Benchmark.tscn -- --out=bench.json
+# Options after "--": --out=<file>, --seconds=<playback seconds per run>, --seeks=<count>,
+# --clip_seconds=<length of generated clips>, --file=<extra file or http:// url to benchmark, repeatable>,
+# --packed_planes=<true to present every frame as one packed texture>
+# Results are printed as json and written to --out if given.
+
+const _kClips : Array[Dictionary] = [
+	{ "name": "1080p", "width": 1920, "height": 1080 },
+	{ "name": "4k", "width": 3840, "height": 2160 },
+	{ "name": "8k_equirect", "width": 7680, "height": 3840 },
+	# Decoded to yuv420p10 in software and to p010 by the hw decoders
+	{ "name": "4k_10bit", "width": 3840, "height": 2160, "pix_fmt": "yuv420p10" },
+]
+const _kClipDir : String = "user://benchmark"
+
+static func _parse_args() -> Dictionary:
+	var args : Dictionary = { "seconds": 10.0, "seeks": 5, "clip_seconds": 4.0, "out": "", "files": [], "packed_planes": false }
+	for arg in OS.get_cmdline_user_args():
+		var kv : PackedStringArray = arg.trim_prefix("--").split("=", true, 1)
+		if kv.size() != 2:
+			continue
+		match kv[0]:
+			"out": args["out"] = kv[1]
+			"seconds": args["seconds"] = kv[1].to_float()
+			"seeks": args["seeks"] = kv[1].to_int()
+			"clip_seconds": args["clip_seconds"] = kv[1].to_float()
+			"file": args["files"].append(kv[1])
+			"packed_planes": args["packed_planes"] = kv[1] == "true"
+	return args
+
+static func _hw_config_names(path: String) -> Array[String]:
+	var names : Array[String] = []
+	var ms = FfmpegMediaStream.new()
+	if not ms.set_file(path):
+		return names
+	var decoders = ms.available_video_decoders()
+	if not decoders.is_empty():
+		for cfg in decoders[0].available_hw_configs():
+			names.append(cfg.get_name())
+	return names
+
+static func _run_file(path: String, args: Dictionary) -> Array:
+	var runs : Array = []
+	# Software decoding presents yuv420p or yuv420p10, hardware decoders present nv12 or p010
+	var hwNames : Array[String] = [""]
+	hwNames.append_array(_hw_config_names(path))
+	for hw in hwNames:
+		var result = FfmpegBenchmark.playback(path, {
+			"hw": hw,
+			"max_seconds": args["seconds"],
+			"seeks": args["seeks"],
+			"packed_planes": args["packed_planes"],
+		})
+		# Decoder pool and shared hw device, the software run covers them without a GPU
+		result["open_decoders"] = FfmpegBenchmark.open_decoders(path, { "hw": hw })
+		print("{0} [{1}]: {2}".format([path, hw if hw != "" else "sw", JSON.stringify(result)]))
+		runs.append(result)
+	return runs
+
+func _ready():
+	var args := _parse_args()
+	DirAccess.make_dir_recursive_absolute(_kClipDir)
+
+	var report : Dictionary = {}
+	report["engine"] = Engine.get_version_info()["string"]
+	report["platform"] = OS.get_name()
+	report["processor"] = OS.get_processor_name()
+	report["mailbox"] = FfmpegBenchmark.frame_mailbox_contention(2000, 2, 100)
+	report["yuv_to_rgba_4k"] = FfmpegBenchmark.yuv_to_rgba(3840, 2160, 10)
+
+	var runs : Array = []
+	for clip in _kClips:
+		var path : String = "{0}/{1}.mp4".format([_kClipDir, clip["name"]])
+		if not FileAccess.file_exists(path):
+			print("Generating ", path)
+			if not FfmpegBenchmark.generate_clip(path, clip["width"], clip["height"], args["clip_seconds"], 30, { "pix_fmt": clip.get("pix_fmt", "yuv420p") }):
+				continue
+		runs.append_array(_run_file(path, args))
+	for f in args["files"]:
+		runs.append_array(_run_file(f, args))
+	report["runs"] = runs
+
+	var json := JSON.stringify(report, "  ")
+	print(json)
+	if args["out"] != "":
+		var file := FileAccess.open(args["out"], FileAccess.WRITE)
+		if file != null:
+			file.store_string(json)
+
+	if DisplayServer.get_name() == "headless":
+		get_tree().quit()
+	else:
+		get_tree().change_scene_to_file.call_deferred("res://Scenes/Main/main.tscn")
@@ -0,0 +1,112 @@
+extends Node3D
+
+# Compares the fragment cost of mapping an equirectangular frame in the fragment shader (*_Panorama materials
+# on a SphereMesh) with precomputed texture coordinates (*_3D materials on a PanoramaMesh).
+# Needs a GPU, it does not run headless:
+#   godot --path Project/VrPlayer res://Scenes/PanoramaBenchmark/PanoramaBenchmark.tscn -- --out=panorama.json
+# Options after "--": --out=<file>, --frames=<measured frames per case>, --width=<frame width>
+# Results are printed as json and written to --out if given.
+
+const _kWarmupFrames : int = 30
+
+@onready var _sphere : MeshInstance3D = $Sphere
+@onready var _camera : Camera3D = $Camera3d
+
+static func _parse_args() -> Dictionary:
+	var args : Dictionary = { "frames": 300, "width": 3840, "out": "" }
+	for arg in OS.get_cmdline_user_args():
+		var kv : PackedStringArray = arg.trim_prefix("--").split("=", true, 1)
+		if kv.size() != 2:
+			continue
+		match kv[0]:
+			"out": args["out"] = kv[1]
+			"frames": args["frames"] = kv[1].to_int()
+			"width": args["width"] = kv[1].to_int()
+	return args
+
+# Planes of a yuv420p frame with some detail, so that the texture caches behave like with a video
+static func _make_planes(width: int) -> Array[ImageTexture]:
+	var height : int = width / 2
+	var planes : Array[ImageTexture] = []
+	for i in 3:
+		var w : int = width if i == 0 else width / 2
+		var h : int = height if i == 0 else height / 2
+		var data := PackedByteArray()
+		data.resize(w * h)
+		for y in h:
+			for x in w:
+				data[y * w + x] = ((x * (i + 1)) ^ (y * 3)) & 0xff
+		planes.append(ImageTexture.create_from_image(Image.create_from_data(w, h, false, Image.FORMAT_L8, data)))
+	return planes
+
+static func _make_mesh(density: String) -> PanoramaMesh:
+	var mesh := PanoramaMesh.new()
+	mesh.radial_segments = 128 if density == "dense" else 64
+	mesh.rings = 64 if density == "dense" else 32
+	if density == "banded":
+		# Most of the rings around the horizon, where people look
+		mesh.band_densities = PackedFloat32Array([0.5, 2.0, 2.0, 0.5])
+	return mesh
+
+func _ready():
+	var args := _parse_args()
+	if DisplayServer.get_name() == "headless":
+		printerr("The panorama benchmark needs a GPU")
+		get_tree().quit()
+		return
+	DisplayServer.window_set_vsync_mode(DisplayServer.VSYNC_DISABLED)
+	var viewport := get_viewport().get_viewport_rid()
+	RenderingServer.viewport_set_measure_render_time(viewport, true)
+
+	var planes := _make_planes(args["width"])
+	var cases : Array[Dictionary] = [
+		{ "name": "shader_mapping", "mesh": SphereMesh.new(), "material": load("res://Materials/Yuv420P_Panorama.material") },
+		{ "name": "panorama_mesh", "mesh": _make_mesh("default"), "material": load("res://Materials/Yuv420P_3D.material") },
+		{ "name": "panorama_mesh_banded", "mesh": _make_mesh("banded"), "material": load("res://Materials/Yuv420P_3D.material") },
+		{ "name": "panorama_mesh_dense", "mesh": _make_mesh("dense"), "material": load("res://Materials/Yuv420P_3D.material") },
+	]
+
+	var report : Dictionary = {}
+	report["engine"] = Engine.get_version_info()["string"]
+	report["platform"] = OS.get_name()
+	report["gpu"] = RenderingServer.get_video_adapter_name()
+	report["viewport"] = get_viewport().get_visible_rect().size
+	var results : Array = []
+	for c in cases:
+		var material : ShaderMaterial = c["material"].duplicate()
+		material.set_shader_parameter("yTexture", planes[0])
+		material.set_shader_parameter("uTexture", planes[1])
+		material.set_shader_parameter("vTexture", planes[2])
+		_sphere.mesh = c["mesh"]
+		_sphere.material_override = material
+
+		for i in _kWarmupFrames:
+			await get_tree().process_frame
+		var gpu : Array[float] = []
+		for i in args["frames"]:
+			# Turn around so that every part of the sphere is measured
+			_camera.rotation = Vector3(0.0, TAU * i / args["frames"], 0.0)
+			await get_tree().process_frame
+			gpu.append(RenderingServer.viewport_get_measured_render_time_gpu(viewport))
+		gpu.sort()
+		var total : float = 0.0
+		for t in gpu:
+			total += t
+		var result : Dictionary = {
+			"name": c["name"],
+			"frames": gpu.size(),
+			"gpu_mean_ms": total / max(gpu.size(), 1),
+			"gpu_p50_ms": gpu[gpu.size() / 2] if not gpu.is_empty() else 0.0,
+			"gpu_p95_ms": gpu[gpu.size() * 95 / 100] if not gpu.is_empty() else 0.0,
+		}
+		print(JSON.stringify(result))
+		results.append(result)
+	report["cases"] = results
+
+	var json := JSON.stringify(report, "  ")
+	print(json)
+	if args["out"] != "":
+		var file := FileAccess.open(args["out"], FileAccess.WRITE)
+		if file != null:
+			file.store_string(json)
+	get_tree().change_scene_to_file.call_deferred("res://Scenes/Main/main.tscn")
@@ -7,11 +7,21 @@ extends Node3D
 func _ready():
 	_controlPanel.on_play.connect(_on_play)
 	_controlPanel.on_pixel_format_change.connect(_on_pixel_format_changed)
-	_controlPanel.set_material_mode(PlayingControlPanel.MaterialMode.kPanorama)
+	# The sphere is a PanoramaMesh, its UVs already map the equirect frame
+	_controlPanel.set_material_mode(PlayingControlPanel.MaterialMode.k3d)
+	_controlPanel.set_tiled_upload(true)
 	var mesh = $MeshInstance3d as MeshInstance3D
 	pass # Replace with function body.
 
 
+func _process(_delta):
+	# Only the tiles of the panorama in view are uploaded
+	var camera := get_viewport().get_camera_3d()
+	if camera != null:
+		var size := get_viewport().get_visible_rect().size
+		_controlPanel.set_view(camera.global_transform.basis, camera.fov, size.x / max(size.y, 1.0))
+
+
 func _on_pixel_format_changed(material: Material, texture: Texture):
 	# var meshInstance : MeshInstance3D = $MeshInstance3d
 	var meshInstance : MeshInstance3D = $Sphere
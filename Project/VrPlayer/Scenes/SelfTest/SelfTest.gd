@@ -0,0 +1,40 @@
+extends Node
+
+# Headless automated checks of the ffmpeg module, see FfmpegSelfTest:
+#   godot --headless --path Project/VrPlayer res://Scenes/SelfTest/SelfTest.tscn -- --check=<name>
+# Options after "--": --check=<name of a check to run, repeatable, all by default>
+# Prints every result as json and exits with 1 if a check failed.
+
+const _kChecks : Array[String] = [
+	"audio_under_video_backlog",
+	"latest_frame_wins",
+	"thumbnails_with_b_frames",
+	"panorama_pole_uvs",
+	"http_range_source",
+	"probe_cache_matches_probe",
+	"decoder_pool_reuse",
+	"hw_device_cache_refcount",
+]
+
+static func _parse_checks() -> Array[String]:
+	var checks : Array[String] = []
+	for arg in OS.get_cmdline_user_args():
+		var kv : PackedStringArray = arg.trim_prefix("--").split("=", true, 1)
+		if kv.size() == 2 and kv[0] == "check":
+			checks.append(kv[1])
+	return checks if not checks.is_empty() else _kChecks
+
+func _ready():
+	var tests := FfmpegSelfTest.new()
+	var failed : int = 0
+	for check in _parse_checks():
+		var result : Dictionary = tests.call(check)
+		print("{0}: {1}".format([check, JSON.stringify(result)]))
+		if not result.get("passed", false):
+			failed += 1
+	print("{0} check(s) failed".format([failed]))
+
+	if DisplayServer.get_name() == "headless":
+		get_tree().quit(1 if failed > 0 else 0)
+	else:
+		get_tree().change_scene_to_file.call_deferred("res://Scenes/Main/main.tscn")